@@ -0,0 +1,399 @@
+// Standard headers
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+
+// Spitfire headers
+#include <spitfire/storage/filesystem.h>
+#include <spitfire/util/log.h>
+
+// Diesel headers
+#include "cacheevictionindex.h"
+#include "cachefile.h"
+
+namespace diesel
+{
+  // Entries are added and removed all the time so we only rewrite the file once it has more stale lines than live ones
+  const size_t nMinimumStaleLines = 1000;
+
+  // Scrolling through a folder accesses every thumbnail in it, so accesses are only written out once we have a few of them
+  const size_t nAccessesPerSave = 1000;
+
+  // The protected segment can use up to 80% of the cache
+  const uint64_t nProtectedPercentage = 80;
+
+  // Enough evicted entries to tell whether the cache is too small, each one is only a cache key
+  const size_t nMaximumGhosts = 100000;
+
+  // ** cCacheEvictionIndex
+
+  cCacheEvictionIndex::cStatistics::cStatistics() :
+    nHits(0),
+    nMisses(0),
+    nEvictedMisses(0)
+  {
+  }
+
+  cCacheEvictionIndex::cCacheEvictionIndex(const string_t& _sIndexFilePath) :
+    sIndexFilePath(_sIndexFilePath),
+    nLinesInFile(0),
+    sequence(0),
+    nTotalSizeBytes(0),
+    nProtectedSizeBytes(0)
+  {
+  }
+
+  cCacheEvictionIndex::~cCacheEvictionIndex()
+  {
+    SaveAccesses();
+  }
+
+  std::string cCacheEvictionIndex::GetEntryName(const string_t& sCacheKey, IMAGE_SIZE imageSize)
+  {
+    // NOTE: Cache keys are always ascii
+    return std::string(sCacheKey.begin(), sCacheKey.end()) + ((imageSize == IMAGE_SIZE::THUMBNAIL) ? "_thumbnail" : "_full");
+  }
+
+  bool cCacheEvictionIndex::ParseEntryName(const std::string& sName, string_t& sCacheKey, IMAGE_SIZE& imageSize)
+  {
+    const size_t separator = sName.rfind('_');
+    if ((separator == std::string::npos) || (separator == 0)) return false;
+
+    const std::string sSize = sName.substr(separator + 1);
+    if (sSize == "thumbnail") imageSize = IMAGE_SIZE::THUMBNAIL;
+    else if (sSize == "full") imageSize = IMAGE_SIZE::FULL;
+    else return false;
+
+    sCacheKey = string_t(sName.begin(), sName.begin() + separator);
+    return true;
+  }
+
+  void cCacheEvictionIndex::Insert(const std::string& sName, uint64_t nSizeBytes, int64_t createdSeconds)
+  {
+    Erase(sName);
+
+    // New entries start at the most recently used end of the probation segment
+    cEntry entry;
+    entry.nSizeBytes = nSizeBytes;
+    entry.createdSeconds = createdSeconds;
+    entry.segment = SEGMENT::PROBATION;
+    entry.sequence = ++sequence;
+
+    entries[sName] = entry;
+    probation[entry.sequence] = sName;
+    nTotalSizeBytes += nSizeBytes;
+  }
+
+  bool cCacheEvictionIndex::Access(const std::string& sName)
+  {
+    std::map<std::string, cEntry>::iterator iter = entries.find(sName);
+    if (iter == entries.end()) return false;
+
+    cEntry& entry = iter->second;
+
+    // Move the entry to the most recently used end of the protected segment
+    if (entry.segment == SEGMENT::PROBATION) {
+      probation.erase(entry.sequence);
+      entry.segment = SEGMENT::PROTECTED;
+      nProtectedSizeBytes += entry.nSizeBytes;
+    } else protectedEntries.erase(entry.sequence);
+
+    entry.sequence = ++sequence;
+    protectedEntries[entry.sequence] = sName;
+
+    // Move the least recently used protected entries back to the most recently used end of the probation segment
+    const uint64_t nMaximumProtectedSizeBytes = (nTotalSizeBytes * nProtectedPercentage) / 100;
+    while ((nProtectedSizeBytes > nMaximumProtectedSizeBytes) && (protectedEntries.size() > 1)) {
+      const std::string sDemotedName = protectedEntries.begin()->second;
+      protectedEntries.erase(protectedEntries.begin());
+
+      cEntry& demoted = entries[sDemotedName];
+      demoted.segment = SEGMENT::PROBATION;
+      demoted.sequence = ++sequence;
+      nProtectedSizeBytes -= demoted.nSizeBytes;
+      probation[demoted.sequence] = sDemotedName;
+    }
+
+    return true;
+  }
+
+  bool cCacheEvictionIndex::Erase(const std::string& sName)
+  {
+    std::map<std::string, cEntry>::iterator iter = entries.find(sName);
+    if (iter == entries.end()) return false;
+
+    if (iter->second.segment == SEGMENT::PROTECTED) {
+      protectedEntries.erase(iter->second.sequence);
+      nProtectedSizeBytes -= iter->second.nSizeBytes;
+    } else probation.erase(iter->second.sequence);
+
+    nTotalSizeBytes -= iter->second.nSizeBytes;
+    entries.erase(iter);
+
+    return true;
+  }
+
+  void cCacheEvictionIndex::AddGhost(const std::string& sName)
+  {
+    if (!ghosts.insert(sName).second) return;
+
+    ghostOrder.push_back(sName);
+
+    if (ghostOrder.size() > nMaximumGhosts) {
+      ghosts.erase(ghostOrder.front());
+      ghostOrder.pop_front();
+    }
+  }
+
+  bool cCacheEvictionIndex::Load()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    entries.clear();
+    probation.clear();
+    protectedEntries.clear();
+    sequence = 0;
+    nTotalSizeBytes = 0;
+    nProtectedSizeBytes = 0;
+    nLinesInFile = 0;
+    unsavedAccesses.clear();
+
+    bool bIsFound = false;
+
+    {
+      std::ifstream input(sIndexFilePath.c_str());
+      if (input.good()) {
+        bIsFound = true;
+
+        // "A <created seconds> <size bytes> <name>" adds an entry, "T <name>" accesses it and "R <name>" removes it
+        std::string sLine;
+        while (std::getline(input, sLine)) {
+          nLinesInFile++;
+
+          std::istringstream i(sLine);
+          std::string sCommand;
+          if (!(i>>sCommand)) continue;
+
+          if (sCommand == "A") {
+            int64_t createdSeconds = 0;
+            uint64_t nSizeBytes = 0;
+            std::string sName;
+            if (i>>createdSeconds>>nSizeBytes>>sName) Insert(sName, nSizeBytes, createdSeconds);
+          } else if (sCommand == "T") {
+            std::string sName;
+            if (i>>sName) Access(sName);
+          } else if (sCommand == "R") {
+            std::string sName;
+            if (i>>sName) Erase(sName);
+          }
+        }
+      }
+    }
+
+    if (bIsFound) LOG<<"cCacheEvictionIndex::Load Loaded "<<entries.size()<<" entries totalling "<<nTotalSizeBytes<<" bytes ("<<protectedEntries.size()<<" protected) from "<<nLinesInFile<<" lines"<<std::endl;
+
+    if (nLinesInFile > ((2 * entries.size()) + nMinimumStaleLines)) Rewrite();
+
+    return bIsFound;
+  }
+
+  void cCacheEvictionIndex::Clear()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (file.is_open()) file.close();
+    file.clear();
+
+    if (spitfire::filesystem::FileExists(sIndexFilePath)) spitfire::filesystem::DeleteFile(sIndexFilePath);
+
+    entries.clear();
+    probation.clear();
+    protectedEntries.clear();
+    sequence = 0;
+    nTotalSizeBytes = 0;
+    nProtectedSizeBytes = 0;
+    nLinesInFile = 0;
+    unsavedAccesses.clear();
+    ghosts.clear();
+    ghostOrder.clear();
+  }
+
+  void cCacheEvictionIndex::AppendLines(const std::string& sLines)
+  {
+    // The file is kept open because eviction can remove thousands of entries at a time
+    if (!file.is_open()) {
+      file.clear();
+      file.open(sIndexFilePath.c_str(), std::ios::out | std::ios::app);
+    }
+
+    file<<sLines;
+    file.flush();
+
+    if (!file.good()) {
+      // Try again next time, the cache folder may have been deleted
+      file.close();
+      return;
+    }
+
+    nLinesInFile += size_t(std::count(sLines.begin(), sLines.end(), '\n'));
+  }
+
+  void cCacheEvictionIndex::Rewrite()
+  {
+    LOG<<"cCacheEvictionIndex::Rewrite Rewriting \""<<sIndexFilePath<<"\" with "<<entries.size()<<" entries"<<std::endl;
+
+    if (file.is_open()) file.close();
+    file.clear();
+
+    const string_t sTemporaryFilePath = GetTemporaryFilePath(sIndexFilePath);
+
+    {
+      std::ofstream output(sTemporaryFilePath.c_str(), std::ios::out | std::ios::trunc);
+      if (!output.good()) return;
+
+      // Add the probation entries and then the protected entries, least recently used first, and then access the protected entries in the same order, so that
+      // loading the file again puts every entry back in the same place
+      const std::map<uint64_t, std::string>* segments[2] = { &probation, &protectedEntries };
+      for (size_t i = 0; i < 2; i++) {
+        std::map<uint64_t, std::string>::const_iterator iter = segments[i]->begin();
+        const std::map<uint64_t, std::string>::const_iterator iterEnd = segments[i]->end();
+        while (iter != iterEnd) {
+          const cEntry& entry = entries[iter->second];
+          output<<"A "<<entry.createdSeconds<<" "<<entry.nSizeBytes<<" "<<iter->second<<"\n";
+
+          iter++;
+        }
+      }
+
+      std::map<uint64_t, std::string>::const_iterator iter = protectedEntries.begin();
+      const std::map<uint64_t, std::string>::const_iterator iterEnd = protectedEntries.end();
+      while (iter != iterEnd) {
+        output<<"T "<<iter->second<<"\n";
+
+        iter++;
+      }
+
+      if (!output.good()) {
+        output.close();
+        spitfire::filesystem::DeleteFile(sTemporaryFilePath);
+        return;
+      }
+    }
+
+    if (!PublishFile(sTemporaryFilePath, sIndexFilePath)) return;
+
+    nLinesInFile = entries.size() + protectedEntries.size();
+  }
+
+  uint64_t cCacheEvictionIndex::GetTotalSizeBytes()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    return nTotalSizeBytes;
+  }
+
+  void cCacheEvictionIndex::AddEntry(const string_t& sCacheKey, IMAGE_SIZE imageSize, uint64_t nSizeBytes, int64_t createdSeconds)
+  {
+    ASSERT(!sCacheKey.empty());
+
+    const std::string sName = GetEntryName(sCacheKey, imageSize);
+
+    std::ostringstream o;
+    o<<"A "<<createdSeconds<<" "<<nSizeBytes<<" "<<sName<<"\n";
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    Insert(sName, nSizeBytes, createdSeconds);
+    AppendLines(o.str());
+  }
+
+  void cCacheEvictionIndex::RemoveEntry(const string_t& sCacheKey, IMAGE_SIZE imageSize)
+  {
+    const std::string sName = GetEntryName(sCacheKey, imageSize);
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (Erase(sName)) AppendLines("R " + sName + "\n");
+  }
+
+  bool cCacheEvictionIndex::RemoveOldestEntry(string_t& sCacheKey, IMAGE_SIZE& imageSize)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    // Evict from the probation segment first and only start on the protected segment once the probation segment is empty
+    while (!probation.empty() || !protectedEntries.empty()) {
+      const std::string sName = (!probation.empty() ? probation.begin()->second : protectedEntries.begin()->second);
+      Erase(sName);
+      AppendLines("R " + sName + "\n");
+      AddGhost(sName);
+
+      if (ParseEntryName(sName, sCacheKey, imageSize)) return true;
+    }
+
+    return false;
+  }
+
+  void cCacheEvictionIndex::RecordLookup(const string_t& sCacheKey, IMAGE_SIZE imageSize, bool bIsHit)
+  {
+    const std::string sName = GetEntryName(sCacheKey, imageSize);
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    cStatistics& s = statistics[(imageSize == IMAGE_SIZE::THUMBNAIL) ? 0 : 1];
+
+    if (!bIsHit) {
+      s.nMisses++;
+      if (ghosts.find(sName) != ghosts.end()) s.nEvictedMisses++;
+      return;
+    }
+
+    s.nHits++;
+
+    // The entry may not be in the index if it was added by another instance of the application
+    if (Access(sName)) {
+      unsavedAccesses.push_back(sName);
+
+      if (unsavedAccesses.size() >= nAccessesPerSave) AppendAccesses();
+    }
+  }
+
+  void cCacheEvictionIndex::SaveAccesses()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    AppendAccesses();
+  }
+
+  void cCacheEvictionIndex::AppendAccesses()
+  {
+    if (unsavedAccesses.empty()) return;
+
+    std::string sLines;
+    std::vector<std::string>::const_iterator iter = unsavedAccesses.begin();
+    const std::vector<std::string>::const_iterator iterEnd = unsavedAccesses.end();
+    while (iter != iterEnd) {
+      sLines += "T " + *iter + "\n";
+      iter++;
+    }
+
+    unsavedAccesses.clear();
+    AppendLines(sLines);
+  }
+
+  void cCacheEvictionIndex::LogStatistics()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    const char* szNames[2] = { "thumbnail", "full" };
+    for (size_t i = 0; i < 2; i++) {
+      const cStatistics& s = statistics[i];
+      const uint64_t nLookups = s.nHits + s.nMisses;
+      if (nLookups == 0) continue;
+
+      // The evicted misses would have been hits if the cache was bigger
+      LOG<<"cCacheEvictionIndex::LogStatistics "<<szNames[i]<<" hit rate "<<((100 * s.nHits) / nLookups)<<"% ("<<s.nHits<<" hits, "<<s.nMisses<<" misses, "<<s.nEvictedMisses<<" of them evicted), with a bigger cache "<<((100 * (s.nHits + s.nEvictedMisses)) / nLookups)<<"%"<<std::endl;
+    }
+
+    LOG<<"cCacheEvictionIndex::LogStatistics "<<entries.size()<<" entries totalling "<<nTotalSizeBytes<<" bytes, "<<nProtectedSizeBytes<<" bytes protected"<<std::endl;
+  }
+}
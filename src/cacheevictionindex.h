@@ -0,0 +1,111 @@
+#ifndef DIESEL_CACHEEVICTIONINDEX_H
+#define DIESEL_CACHEEVICTIONINDEX_H
+
+// Standard headers
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+// Diesel headers
+#include "diesel.h"
+
+namespace diesel
+{
+  // ** cCacheEvictionIndex
+  //
+  // Keeps a running total of the size of the cache and the entries in the order that they should be evicted, so that enforcing the maximum cache size only has to
+  // look at the entries that are evicted instead of scanning and sorting the whole cache
+  // Entries are evicted with a segmented LRU, new entries start in the probation segment and are moved to the protected segment when they are used again, entries
+  // are evicted from the least recently used end of the probation segment first, so a folder that is scrolled through once can't push out the photos that we keep
+  // coming back to, the protected segment is limited to 80% of the cache and its least recently used entries fall back into the probation segment
+  // Every entry that is added to or removed from the cache is appended to a file, accesses only happen in memory and are appended in batches, the file is loaded
+  // the first time the index is needed and rewritten without the stale lines when it has grown too big
+  // The hit rate for each image size is counted along with how many of the misses were for entries that we had evicted, which is how many more hits a bigger
+  // cache would have had
+  // NOTE: If the file is lost then the cache has to be scanned once to build the index again, see cImageCacheManager::GetCacheEvictionIndex
+  //
+
+  class cCacheEvictionIndex
+  {
+  public:
+    explicit cCacheEvictionIndex(const string_t& sIndexFilePath);
+    ~cCacheEvictionIndex();
+
+    bool Load(); // Returns false if there is no index file yet
+    void Clear(); // Forgets every entry, for when the cache folder has been deleted
+
+    uint64_t GetTotalSizeBytes();
+
+    void AddEntry(const string_t& sCacheKey, IMAGE_SIZE imageSize, uint64_t nSizeBytes, int64_t createdSeconds); // Replaces the entry if it is already in the index
+    void RemoveEntry(const string_t& sCacheKey, IMAGE_SIZE imageSize);
+    bool RemoveOldestEntry(string_t& sCacheKey, IMAGE_SIZE& imageSize); // Returns false if the index is empty
+
+    void RecordLookup(const string_t& sCacheKey, IMAGE_SIZE imageSize, bool bIsHit); // Updates the hit rate and moves the entry to the most recently used end on a hit
+
+    void SaveAccesses(); // Appends the accesses that have not been saved yet
+    void LogStatistics();
+
+  private:
+    enum class SEGMENT {
+      PROBATION,
+      PROTECTED
+    };
+
+    class cEntry
+    {
+    public:
+      uint64_t nSizeBytes;
+      int64_t createdSeconds;
+      SEGMENT segment;
+      uint64_t sequence; // The position of the entry in its segment
+    };
+
+    class cStatistics
+    {
+    public:
+      cStatistics();
+
+      uint64_t nHits;
+      uint64_t nMisses;
+      uint64_t nEvictedMisses; // Misses for entries that we evicted earlier
+    };
+
+    static std::string GetEntryName(const string_t& sCacheKey, IMAGE_SIZE imageSize);
+    static bool ParseEntryName(const std::string& sName, string_t& sCacheKey, IMAGE_SIZE& imageSize);
+
+    void Insert(const std::string& sName, uint64_t nSizeBytes, int64_t createdSeconds);
+    bool Access(const std::string& sName);
+    bool Erase(const std::string& sName);
+    void AddGhost(const std::string& sName);
+
+    void AppendLines(const std::string& sLines);
+    void AppendAccesses();
+    void Rewrite();
+
+    std::mutex mutex;
+
+    const string_t sIndexFilePath;
+    std::ofstream file;
+    size_t nLinesInFile;
+
+    std::map<std::string, cEntry> entries; // Indexed by "<cache key>_thumbnail" or "<cache key>_full"
+    std::map<uint64_t, std::string> probation; // Least recently used first
+    std::map<uint64_t, std::string> protectedEntries; // Least recently used first
+    uint64_t sequence;
+    uint64_t nTotalSizeBytes;
+    uint64_t nProtectedSizeBytes;
+
+    std::vector<std::string> unsavedAccesses;
+
+    cStatistics statistics[2]; // Indexed by IMAGE_SIZE
+    std::set<std::string> ghosts; // The most recently evicted entries
+    std::deque<std::string> ghostOrder; // Oldest first
+  };
+}
+
+#endif // DIESEL_CACHEEVICTIONINDEX_H
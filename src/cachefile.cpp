@@ -0,0 +1,280 @@
+// Standard headers
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <thread>
+
+#ifndef __WIN__
+// POSIX headers
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+#endif
+
+// Spitfire headers
+#include <spitfire/storage/filesystem.h>
+#include <spitfire/util/log.h>
+
+// Diesel headers
+#include "cachefile.h"
+#include "cachekeyindex.h"
+#include "contenthash.h"
+
+namespace diesel
+{
+  // Conversions time out long before this so a temporary file this old was left behind by a crash
+  const int64_t nStaleTemporaryFileSeconds = 60 * 60;
+
+  // How often we check whether we have been stopped while waiting for another process to release a lock
+  const size_t nLockPollMS = 20;
+
+  // Enough lock files that two conversions rarely share one
+  const uint64_t nCacheEntryLockFiles = 1024;
+
+  std::atomic<uint64_t> nextTemporaryFile(0);
+
+  uint64_t GetProcessID()
+  {
+    #ifdef __WIN__
+    return uint64_t(::GetCurrentProcessId());
+    #else
+    return uint64_t(::getpid());
+    #endif
+  }
+
+  bool SyncFile(const string_t& sFilePath)
+  {
+    #ifdef __WIN__
+    HANDLE hFile = ::CreateFileW(sFilePath.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return false;
+
+    const bool bResult = (::FlushFileBuffers(hFile) != 0);
+    ::CloseHandle(hFile);
+    return bResult;
+    #else
+    const int fd = ::open(sFilePath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+
+    const bool bResult = (::fsync(fd) == 0);
+    ::close(fd);
+    return bResult;
+    #endif
+  }
+
+  #ifndef __WIN__
+  void SyncFolder(const string_t& sFolderPath)
+  {
+    // The rename is only on disk once the folder that contains it has been synced too
+    const int fd = ::open(sFolderPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) return;
+
+    ::fsync(fd);
+    ::close(fd);
+  }
+  #endif
+
+  string_t GetTemporaryFilePath(const string_t& sFilePath)
+  {
+    // NOTE: The tmp folder is next to the file so that the rename never has to move the file to another file system
+    const string_t sTemporaryFolderPath = spitfire::filesystem::MakeFilePath(spitfire::filesystem::GetFolder(sFilePath), TEXT("tmp"));
+    if (!spitfire::filesystem::DirectoryExists(sTemporaryFolderPath)) spitfire::filesystem::CreateDirectory(sTemporaryFolderPath);
+
+    ostringstream_t o;
+    o<<GetProcessID()<<TEXT("_")<<nextTemporaryFile++<<TEXT("_")<<spitfire::filesystem::GetFile(sFilePath);
+    return spitfire::filesystem::MakeFilePath(sTemporaryFolderPath, o.str());
+  }
+
+  bool PublishFile(const string_t& sTemporaryFilePath, const string_t& sFilePath)
+  {
+    if (!SyncFile(sTemporaryFilePath)) {
+      LOG<<"PublishFile Failed to sync \""<<sTemporaryFilePath<<"\", returning false"<<std::endl;
+      if (spitfire::filesystem::FileExists(sTemporaryFilePath)) spitfire::filesystem::DeleteFile(sTemporaryFilePath);
+      return false;
+    }
+
+    // Replace the file in one step, readers either see the old file or the new one
+    #ifdef __WIN__
+    const bool bIsMoved = (::MoveFileExW(sTemporaryFilePath.c_str(), sFilePath.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0);
+    #else
+    const bool bIsMoved = (::rename(sTemporaryFilePath.c_str(), sFilePath.c_str()) == 0);
+    #endif
+    if (!bIsMoved) {
+      LOG<<"PublishFile Failed to move \""<<sTemporaryFilePath<<"\" to \""<<sFilePath<<"\", returning false"<<std::endl;
+      spitfire::filesystem::DeleteFile(sTemporaryFilePath);
+      return false;
+    }
+
+    #ifndef __WIN__
+    SyncFolder(spitfire::filesystem::GetFolder(sFilePath));
+    #endif
+
+    return true;
+  }
+
+  void DeleteStaleTemporaryFiles(const string_t& sFolderPath)
+  {
+    const string_t sTemporaryFolderPath = spitfire::filesystem::MakeFilePath(sFolderPath, TEXT("tmp"));
+    if (!spitfire::filesystem::DirectoryExists(sTemporaryFolderPath)) return;
+
+    const int64_t nowSeconds = int64_t(std::time(nullptr));
+
+    // Another instance may still be writing the newer files
+    for (spitfire::filesystem::cFolderIterator iter(sTemporaryFolderPath); iter.IsValid(); iter.Next()) {
+      const string_t sFilePath = iter.GetFullPath();
+
+      cFileStat stat;
+      if (!GetFileStat(sFilePath, stat) || ((nowSeconds - stat.modifiedSeconds) < nStaleTemporaryFileSeconds)) continue;
+
+      LOG<<"DeleteStaleTemporaryFiles Deleting \""<<sFilePath<<"\""<<std::endl;
+      if (iter.IsFolder()) spitfire::filesystem::DeleteDirectory(sFilePath);
+      else spitfire::filesystem::DeleteFile(sFilePath);
+    }
+  }
+
+
+  // ** cFileLock
+
+  cFileLock::cFileLock(const string_t& _sFilePath) :
+    sFilePath(_sFilePath),
+    bIsLocked(false),
+    #ifdef __WIN__
+    hFile(INVALID_HANDLE_VALUE)
+    #else
+    fd(-1)
+    #endif
+  {
+  }
+
+  cFileLock::~cFileLock()
+  {
+    Close();
+  }
+
+  bool cFileLock::OpenIfRequired()
+  {
+    #ifdef __WIN__
+    if (hFile != INVALID_HANDLE_VALUE) return true;
+
+    hFile = ::CreateFileW(sFilePath.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+      LOG<<"cFileLock::OpenIfRequired Failed to open \""<<sFilePath<<"\", returning false"<<std::endl;
+      return false;
+    }
+    #else
+    if (fd != -1) return true;
+
+    fd = ::open(sFilePath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+      LOG<<"cFileLock::OpenIfRequired Failed to open \""<<sFilePath<<"\", returning false"<<std::endl;
+      return false;
+    }
+    #endif
+
+    return true;
+  }
+
+  bool cFileLock::LockFile(bool bIsBlocking)
+  {
+    if (bIsLocked) return true;
+
+    if (!OpenIfRequired()) return false;
+
+    #ifdef __WIN__
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0, sizeof(overlapped));
+    bIsLocked = (::LockFileEx(hFile, LOCKFILE_EXCLUSIVE_LOCK | (bIsBlocking ? 0 : LOCKFILE_FAIL_IMMEDIATELY), 0, 1, 0, &overlapped) != 0);
+    #else
+    int iResult = -1;
+    do {
+      iResult = ::flock(fd, LOCK_EX | (bIsBlocking ? 0 : LOCK_NB));
+    } while ((iResult != 0) && (errno == EINTR));
+
+    bIsLocked = (iResult == 0);
+    #endif
+
+    return bIsLocked;
+  }
+
+  bool cFileLock::Lock()
+  {
+    return LockFile(true);
+  }
+
+  bool cFileLock::Lock(spitfire::util::cProcessInterface& processInterface)
+  {
+    while (!TryLock()) {
+      #ifdef __WIN__
+      if (hFile == INVALID_HANDLE_VALUE) return false;
+      #else
+      if (fd == -1) return false;
+      #endif
+
+      if (processInterface.IsToStop()) return false;
+
+      std::this_thread::sleep_for(std::chrono::milliseconds(nLockPollMS));
+    }
+
+    return true;
+  }
+
+  bool cFileLock::TryLock()
+  {
+    return LockFile(false);
+  }
+
+  void cFileLock::Unlock()
+  {
+    if (!bIsLocked) return;
+
+    #ifdef __WIN__
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0, sizeof(overlapped));
+    ::UnlockFileEx(hFile, 0, 1, 0, &overlapped);
+    #else
+    ::flock(fd, LOCK_UN);
+    #endif
+
+    bIsLocked = false;
+  }
+
+  void cFileLock::Close()
+  {
+    Unlock();
+
+    #ifdef __WIN__
+    if (hFile != INVALID_HANDLE_VALUE) {
+      ::CloseHandle(hFile);
+      hFile = INVALID_HANDLE_VALUE;
+    }
+    #else
+    if (fd != -1) {
+      ::close(fd);
+      fd = -1;
+    }
+    #endif
+  }
+
+
+  // ** cCacheEntryLock
+
+  cCacheEntryLock::cCacheEntryLock(const string_t& sCacheFolderPath, const string_t& sCacheKey, IMAGE_SIZE imageSize) :
+    lock(GetLockFilePath(sCacheFolderPath, sCacheKey, imageSize))
+  {
+  }
+
+  string_t cCacheEntryLock::GetLockFilePath(const string_t& sCacheFolderPath, const string_t& sCacheKey, IMAGE_SIZE imageSize)
+  {
+    const string_t sLocksFolderPath = spitfire::filesystem::MakeFilePath(sCacheFolderPath, TEXT("locks"));
+    if (!spitfire::filesystem::DirectoryExists(sLocksFolderPath)) spitfire::filesystem::CreateDirectory(sLocksFolderPath);
+
+    // NOTE: Cache keys are always ascii
+    const std::string sKey = std::string(sCacheKey.begin(), sCacheKey.end()) + ((imageSize == IMAGE_SIZE::THUMBNAIL) ? "_thumbnail" : "_full");
+
+    ostringstream_t o;
+    o<<(XXH64(sKey.data(), sKey.length(), 0) % nCacheEntryLockFiles)<<TEXT(".lock");
+    return spitfire::filesystem::MakeFilePath(sLocksFolderPath, o.str());
+  }
+}
@@ -0,0 +1,89 @@
+#ifndef DIESEL_CACHEFILE_H
+#define DIESEL_CACHEFILE_H
+
+// Standard headers
+#include <cstddef>
+#include <cstdint>
+
+// Spitfire headers
+#include <spitfire/util/process.h>
+
+// Diesel headers
+#include "diesel.h"
+
+namespace diesel
+{
+  // ** Publishing files
+  //
+  // Nothing is written in place in the cache, a file that a crash or a killed tool leaves half written would otherwise look like a finished file to the
+  // next FileExists check, by this instance or by another instance sharing the cache
+  // Files are written to a uniquely named file in a tmp folder next to where they belong, flushed to disk, then renamed over the real file name in one step,
+  // so the real file name either doesn't exist yet or is the complete file
+  // Temporary files that a crash leaves behind are deleted the next time we start once they are old enough that no other instance can still be writing them
+  //
+
+  string_t GetTemporaryFilePath(const string_t& sFilePath); // Unique to this process and call, the file name and extension of sFilePath are kept at the end for tools that check them
+  bool PublishFile(const string_t& sTemporaryFilePath, const string_t& sFilePath); // The temporary file is deleted if it could not be published
+  void DeleteStaleTemporaryFiles(const string_t& sFolderPath);
+
+
+  // ** cFileLock
+  //
+  // An advisory exclusive lock on a lock file, shared between processes as well as threads, flock on Linux and LockFileEx on Windows
+  // Each cFileLock opens its own handle so two cFileLocks on the same file in the same process exclude each other too
+  // The lock file is never deleted, deleting a lock file while another process is waiting on it would let a third process lock a new file with the same name
+  //
+
+  class cFileLock
+  {
+  public:
+    explicit cFileLock(const string_t& sFilePath);
+    ~cFileLock();
+
+    bool Lock(); // Waits for the lock, returns false if the lock file could not be opened
+    bool Lock(spitfire::util::cProcessInterface& processInterface); // Returns false if processInterface is stopped before we get the lock
+    bool TryLock();
+    void Unlock();
+    void Close(); // Unlocks and closes the lock file, it is opened again the next time that it is locked
+
+    bool IsLocked() const { return bIsLocked; }
+
+  private:
+    cFileLock(const cFileLock&) = delete;
+    cFileLock& operator=(const cFileLock&) = delete;
+
+    bool OpenIfRequired();
+    bool LockFile(bool bIsBlocking);
+
+    const string_t sFilePath;
+    bool bIsLocked;
+
+    #ifdef __WIN__
+    HANDLE hFile;
+    #else
+    int fd;
+    #endif
+  };
+
+
+  // ** cCacheEntryLock
+  //
+  // Owns a cache entry while it is being created so that two instances filling the same cache don't both convert the same image
+  // Cache keys are spread over a fixed set of lock files in the locks folder, a rare collision between two keys only means that one waits for the other
+  //
+
+  class cCacheEntryLock
+  {
+  public:
+    cCacheEntryLock(const string_t& sCacheFolderPath, const string_t& sCacheKey, IMAGE_SIZE imageSize);
+
+    bool Lock(spitfire::util::cProcessInterface& processInterface) { return lock.Lock(processInterface); }
+
+  private:
+    static string_t GetLockFilePath(const string_t& sCacheFolderPath, const string_t& sCacheKey, IMAGE_SIZE imageSize);
+
+    cFileLock lock;
+  };
+}
+
+#endif // DIESEL_CACHEFILE_H
@@ -0,0 +1,188 @@
+// Standard headers
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+// POSIX headers
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// Spitfire headers
+#include <spitfire/storage/filesystem.h>
+#include <spitfire/util/log.h>
+#include <spitfire/util/string.h>
+
+// Diesel headers
+#include "cachefile.h"
+#include "cachekeyindex.h"
+
+namespace diesel
+{
+  // Once the file has this many more lines than there are entries we rewrite it without the stale lines
+  const size_t nMaximumStaleLines = 1000;
+
+  // ** cFileStat
+
+  cFileStat::cFileStat() :
+    device(0),
+    inode(0),
+    nSizeBytes(0),
+    modifiedSeconds(0),
+    modifiedNanoSeconds(0)
+  {
+  }
+
+  bool cFileStat::operator==(const cFileStat& rhs) const
+  {
+    return (
+      (device == rhs.device) &&
+      (inode == rhs.inode) &&
+      (nSizeBytes == rhs.nSizeBytes) &&
+      (modifiedSeconds == rhs.modifiedSeconds) &&
+      (modifiedNanoSeconds == rhs.modifiedNanoSeconds)
+    );
+  }
+
+  bool GetFileStat(const string_t& sFilePath, cFileStat& stat)
+  {
+    #ifdef __WIN__
+    struct _stat64 s;
+    if (::_wstat64(sFilePath.c_str(), &s) != 0) return false;
+
+    stat.modifiedNanoSeconds = 0;
+    #else
+    struct ::stat s;
+    if (::stat(sFilePath.c_str(), &s) != 0) return false;
+
+    stat.modifiedNanoSeconds = s.st_mtim.tv_nsec;
+    #endif
+
+    stat.device = s.st_dev;
+    stat.inode = s.st_ino;
+    stat.nSizeBytes = s.st_size;
+    stat.modifiedSeconds = s.st_mtime;
+
+    return true;
+  }
+
+
+  // ** cCacheKeyIndex
+
+  cCacheKeyIndex::cCacheKeyIndex(const string_t& _sIndexFilePath) :
+    sIndexFilePath(_sIndexFilePath),
+    bIsLoaded(false),
+    nLinesInFile(0)
+  {
+  }
+
+  std::string cCacheKeyIndex::GetLine(const std::string& sFilePathUTF8, const cEntry& entry)
+  {
+    // NOTE: The path goes last because it is the only field that can contain spaces
+    std::ostringstream o;
+    o<<entry.stat.device<<"\t"<<entry.stat.inode<<"\t"<<entry.stat.nSizeBytes<<"\t"<<entry.stat.modifiedSeconds<<"\t"<<entry.stat.modifiedNanoSeconds<<"\t"<<entry.sCacheKey<<"\t"<<sFilePathUTF8<<"\n";
+    return o.str();
+  }
+
+  void cCacheKeyIndex::LoadIfRequired()
+  {
+    if (bIsLoaded) return;
+
+    bIsLoaded = true;
+
+    std::ifstream file(sIndexFilePath.c_str());
+    if (!file.good()) return;
+
+    // Later lines replace earlier lines for the same path
+    std::string sLine;
+    while (std::getline(file, sLine)) {
+      nLinesInFile++;
+
+      std::istringstream i(sLine);
+      cEntry entry;
+      if (!(i>>entry.stat.device>>entry.stat.inode>>entry.stat.nSizeBytes>>entry.stat.modifiedSeconds>>entry.stat.modifiedNanoSeconds>>entry.sCacheKey)) continue;
+
+      // Skip the tab before the path
+      if (i.get() != '\t') continue;
+
+      std::string sFilePathUTF8;
+      std::getline(i, sFilePathUTF8);
+      if (sFilePathUTF8.empty()) continue;
+
+      entries[sFilePathUTF8] = entry;
+    }
+
+    LOG<<"cCacheKeyIndex::LoadIfRequired Loaded "<<entries.size()<<" keys from "<<nLinesInFile<<" lines"<<std::endl;
+
+    if (nLinesInFile > entries.size() + nMaximumStaleLines) Rewrite();
+  }
+
+  void cCacheKeyIndex::Rewrite()
+  {
+    LOG<<"cCacheKeyIndex::Rewrite Rewriting \""<<sIndexFilePath<<"\" with "<<entries.size()<<" keys"<<std::endl;
+
+    const string_t sTemporaryFilePath = GetTemporaryFilePath(sIndexFilePath);
+
+    {
+      std::ofstream file(sTemporaryFilePath.c_str(), std::ios::out | std::ios::trunc);
+      if (!file.good()) return;
+
+      std::map<std::string, cEntry>::const_iterator iter = entries.begin();
+      const std::map<std::string, cEntry>::const_iterator iterEnd = entries.end();
+      while (iter != iterEnd) {
+        file<<GetLine(iter->first, iter->second);
+
+        iter++;
+      }
+
+      if (!file.good()) {
+        file.close();
+        spitfire::filesystem::DeleteFile(sTemporaryFilePath);
+        return;
+      }
+    }
+
+    if (!PublishFile(sTemporaryFilePath, sIndexFilePath)) return;
+
+    nLinesInFile = entries.size();
+  }
+
+  string_t cCacheKeyIndex::GetCacheKey(const string_t& sFilePath, const cFileStat& stat)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    LoadIfRequired();
+
+    std::map<std::string, cEntry>::const_iterator iter = entries.find(spitfire::string::ToUTF8(sFilePath));
+    if ((iter == entries.end()) || (iter->second.stat != stat)) return TEXT("");
+
+    // NOTE: Cache keys are always ascii
+    const std::string& sCacheKey = iter->second.sCacheKey;
+    return string_t(sCacheKey.begin(), sCacheKey.end());
+  }
+
+  void cCacheKeyIndex::SetCacheKey(const string_t& sFilePath, const cFileStat& stat, const string_t& sCacheKey)
+  {
+    ASSERT(!sCacheKey.empty());
+
+    const std::string sFilePathUTF8 = spitfire::string::ToUTF8(sFilePath);
+
+    // Paths with tabs or new lines would break the file format so we just don't remember them
+    if (sFilePathUTF8.find_first_of("\t\r\n") != std::string::npos) return;
+
+    cEntry entry;
+    entry.stat = stat;
+    entry.sCacheKey = std::string(sCacheKey.begin(), sCacheKey.end());
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    LoadIfRequired();
+
+    entries[sFilePathUTF8] = entry;
+
+    std::ofstream file(sIndexFilePath.c_str(), std::ios::out | std::ios::app);
+    if (!file.good()) return;
+
+    file<<GetLine(sFilePathUTF8, entry);
+    nLinesInFile++;
+  }
+}
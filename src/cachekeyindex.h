@@ -0,0 +1,75 @@
+#ifndef DIESEL_CACHEKEYINDEX_H
+#define DIESEL_CACHEKEYINDEX_H
+
+// Standard headers
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+// Diesel headers
+#include "diesel.h"
+
+namespace diesel
+{
+  // ** cFileStat
+  //
+  // The parts of a file's stat that change when the file is replaced or modified
+  //
+
+  class cFileStat
+  {
+  public:
+    cFileStat();
+
+    bool operator==(const cFileStat& rhs) const;
+    bool operator!=(const cFileStat& rhs) const { return !(*this == rhs); }
+
+    uint64_t device;
+    uint64_t inode; // Always 0 on Windows
+    uint64_t nSizeBytes;
+    int64_t modifiedSeconds;
+    int64_t modifiedNanoSeconds;
+  };
+
+  bool GetFileStat(const string_t& sFilePath, cFileStat& stat);
+
+
+  // ** cCacheKeyIndex
+  //
+  // Remembers the cache key of each source file along with the file's stat so that opening a folder that is already in the cache only has to stat
+  // each file instead of reading the whole file to calculate its key, the key is only calculated again when the path or any part of the stat changes
+  // The index is kept in memory and each new key is appended to a file, the file is loaded the first time it is needed and
+  // rewritten without the stale entries when it has grown too big
+  //
+
+  class cCacheKeyIndex
+  {
+  public:
+    explicit cCacheKeyIndex(const string_t& sIndexFilePath);
+
+    string_t GetCacheKey(const string_t& sFilePath, const cFileStat& stat); // Returns "" if the file is not in the index or it has changed
+    void SetCacheKey(const string_t& sFilePath, const cFileStat& stat, const string_t& sCacheKey);
+
+  private:
+    class cEntry
+    {
+    public:
+      cFileStat stat;
+      std::string sCacheKey;
+    };
+
+    void LoadIfRequired();
+    void Rewrite();
+    static std::string GetLine(const std::string& sFilePathUTF8, const cEntry& entry);
+
+    std::mutex mutex;
+
+    const string_t sIndexFilePath;
+    bool bIsLoaded;
+    size_t nLinesInFile;
+    std::map<std::string, cEntry> entries; // Indexed by the UTF8 path of the source file
+  };
+}
+
+#endif // DIESEL_CACHEKEYINDEX_H
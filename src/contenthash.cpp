@@ -0,0 +1,305 @@
+// Standard headers
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#ifndef __WIN__
+// POSIX headers
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Spitfire headers
+#include <spitfire/algorithm/md5.h>
+#include <spitfire/util/log.h>
+
+// Diesel headers
+#include "contenthash.h"
+
+namespace diesel
+{
+  // Each chunk of the file is hashed separately so that large files can be hashed on several threads
+  const size_t nContentHashChunkSizeBytes = 16 * 1024 * 1024;
+  const size_t nContentHashMaximumThreads = 8;
+
+  // ** XXH64
+  //
+  // https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+  // NOTE: The input is read as little endian which is what every platform that we build for is
+  //
+
+  const uint64_t XXH64_PRIME_1 = 0x9E3779B185EBCA87ULL;
+  const uint64_t XXH64_PRIME_2 = 0xC2B2AE3D27D4EB4FULL;
+  const uint64_t XXH64_PRIME_3 = 0x165667B19E3779F9ULL;
+  const uint64_t XXH64_PRIME_4 = 0x85EBCA77C2B2AE63ULL;
+  const uint64_t XXH64_PRIME_5 = 0x27D4EB2F165667C5ULL;
+
+  inline uint64_t XXH64RotateLeft(uint64_t value, int bits)
+  {
+    return (value << bits) | (value >> (64 - bits));
+  }
+
+  inline uint64_t XXH64Read64(const uint8_t* p)
+  {
+    uint64_t value = 0;
+    memcpy(&value, p, sizeof(value));
+    return value;
+  }
+
+  inline uint32_t XXH64Read32(const uint8_t* p)
+  {
+    uint32_t value = 0;
+    memcpy(&value, p, sizeof(value));
+    return value;
+  }
+
+  inline uint64_t XXH64Round(uint64_t accumulator, uint64_t input)
+  {
+    accumulator += input * XXH64_PRIME_2;
+    accumulator = XXH64RotateLeft(accumulator, 31);
+    return accumulator * XXH64_PRIME_1;
+  }
+
+  inline uint64_t XXH64MergeRound(uint64_t accumulator, uint64_t value)
+  {
+    accumulator ^= XXH64Round(0, value);
+    return (accumulator * XXH64_PRIME_1) + XXH64_PRIME_4;
+  }
+
+  uint64_t XXH64(const void* pData, size_t nBytes, uint64_t seed)
+  {
+    const uint8_t* p = static_cast<const uint8_t*>(pData);
+    const uint8_t* const pEnd = p + nBytes;
+
+    uint64_t hash = 0;
+
+    if (nBytes >= 32) {
+      uint64_t v1 = seed + XXH64_PRIME_1 + XXH64_PRIME_2;
+      uint64_t v2 = seed + XXH64_PRIME_2;
+      uint64_t v3 = seed;
+      uint64_t v4 = seed - XXH64_PRIME_1;
+
+      const uint8_t* const pLimit = pEnd - 32;
+      do {
+        v1 = XXH64Round(v1, XXH64Read64(p));
+        v2 = XXH64Round(v2, XXH64Read64(p + 8));
+        v3 = XXH64Round(v3, XXH64Read64(p + 16));
+        v4 = XXH64Round(v4, XXH64Read64(p + 24));
+        p += 32;
+      } while (p <= pLimit);
+
+      hash = XXH64RotateLeft(v1, 1) + XXH64RotateLeft(v2, 7) + XXH64RotateLeft(v3, 12) + XXH64RotateLeft(v4, 18);
+      hash = XXH64MergeRound(hash, v1);
+      hash = XXH64MergeRound(hash, v2);
+      hash = XXH64MergeRound(hash, v3);
+      hash = XXH64MergeRound(hash, v4);
+    } else hash = seed + XXH64_PRIME_5;
+
+    hash += uint64_t(nBytes);
+
+    while ((p + 8) <= pEnd) {
+      hash ^= XXH64Round(0, XXH64Read64(p));
+      hash = (XXH64RotateLeft(hash, 27) * XXH64_PRIME_1) + XXH64_PRIME_4;
+      p += 8;
+    }
+
+    if ((p + 4) <= pEnd) {
+      hash ^= uint64_t(XXH64Read32(p)) * XXH64_PRIME_1;
+      hash = (XXH64RotateLeft(hash, 23) * XXH64_PRIME_2) + XXH64_PRIME_3;
+      p += 4;
+    }
+
+    while (p < pEnd) {
+      hash ^= uint64_t(*p) * XXH64_PRIME_5;
+      hash = XXH64RotateLeft(hash, 11) * XXH64_PRIME_1;
+      p++;
+    }
+
+    hash ^= hash >> 33;
+    hash *= XXH64_PRIME_2;
+    hash ^= hash >> 29;
+    hash *= XXH64_PRIME_3;
+    hash ^= hash >> 32;
+
+    return hash;
+  }
+
+  // ** cContentHashFile
+  //
+  // Reads chunks of a file into a buffer, each thread has its own buffer so that several threads can read different chunks at the same time
+  // NOTE: We read rather than mapping the file into memory because a file that is truncated while it is mapped crashes the whole process
+  //
+
+  class cContentHashFile
+  {
+  public:
+    cContentHashFile();
+    ~cContentHashFile();
+
+    bool Open(const string_t& sFilePath);
+
+    uint64_t GetSizeBytes() const { return nSizeBytes; }
+
+    bool ReadChunk(uint64_t offset, size_t nBytes, std::vector<uint8_t>& buffer) const;
+
+  private:
+    cContentHashFile(const cContentHashFile&) = delete;
+    cContentHashFile& operator=(const cContentHashFile&) = delete;
+
+    string_t sFilePath;
+    uint64_t nSizeBytes;
+
+    #ifndef __WIN__
+    int fd;
+    #endif
+  };
+
+  cContentHashFile::cContentHashFile() :
+    nSizeBytes(0)
+    #ifndef __WIN__
+    ,
+    fd(-1)
+    #endif
+  {
+  }
+
+  cContentHashFile::~cContentHashFile()
+  {
+    #ifndef __WIN__
+    if (fd != -1) ::close(fd);
+    #endif
+  }
+
+  bool cContentHashFile::Open(const string_t& _sFilePath)
+  {
+    sFilePath = _sFilePath;
+
+    #ifdef __WIN__
+    std::ifstream file(sFilePath.c_str(), std::ios::in | std::ios::binary | std::ios::ate);
+    if (!file.good()) return false;
+
+    nSizeBytes = uint64_t(file.tellg());
+    #else
+    fd = ::open(sFilePath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+
+    struct ::stat s;
+    if (::fstat(fd, &s) != 0) return false;
+
+    nSizeBytes = uint64_t(s.st_size);
+
+    // Tell the kernel to read ahead in large blocks
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    #endif
+
+    return true;
+  }
+
+  bool cContentHashFile::ReadChunk(uint64_t offset, size_t nBytes, std::vector<uint8_t>& buffer) const
+  {
+    buffer.resize(nBytes);
+
+    #ifdef __WIN__
+    // NOTE: Each call opens the file again so that threads don't share a position in the file
+    std::ifstream file(sFilePath.c_str(), std::ios::in | std::ios::binary);
+    if (!file.good()) return false;
+
+    file.seekg(std::streamoff(offset));
+    file.read(reinterpret_cast<char*>(buffer.data()), std::streamsize(nBytes));
+    return (size_t(file.gcount()) == nBytes);
+    #else
+    size_t nRead = 0;
+    while (nRead < nBytes) {
+      const ssize_t result = ::pread(fd, buffer.data() + nRead, nBytes - nRead, off_t(offset + nRead));
+      if (result < 0) {
+        if (errno == EINTR) continue;
+        return false;
+      }
+
+      // The file has been truncated since we opened it
+      if (result == 0) return false;
+
+      nRead += size_t(result);
+    }
+
+    return true;
+    #endif
+  }
+
+  string_t CalculateXXH64ForFile(const string_t& sFilePath)
+  {
+    cContentHashFile file;
+    if (!file.Open(sFilePath)) return TEXT("");
+
+    const uint64_t nSizeBytes = file.GetSizeBytes();
+    const size_t nChunks = size_t((nSizeBytes + nContentHashChunkSizeBytes - 1) / nContentHashChunkSizeBytes);
+
+    std::vector<uint64_t> chunkHashes(nChunks, 0);
+
+    std::atomic<size_t> nextChunk(0);
+    std::atomic<bool> bIsError(false);
+    auto HashChunks = [&]() {
+      std::vector<uint8_t> buffer;
+      while (!bIsError) {
+        const size_t i = nextChunk++;
+        if (i >= nChunks) break;
+
+        const uint64_t offset = uint64_t(i) * nContentHashChunkSizeBytes;
+        const size_t nChunkSizeBytes = size_t(min<uint64_t>(nContentHashChunkSizeBytes, nSizeBytes - offset));
+        if (!file.ReadChunk(offset, nChunkSizeBytes, buffer)) {
+          bIsError = true;
+          break;
+        }
+
+        chunkHashes[i] = XXH64(buffer.data(), nChunkSizeBytes, 0);
+      }
+    };
+
+    // Files that fit in one chunk are hashed on this thread, starting a thread would take longer than hashing the file
+    const size_t nThreads = min(min<size_t>(std::thread::hardware_concurrency(), nContentHashMaximumThreads), nChunks);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < nThreads; i++) threads.push_back(std::thread(HashChunks));
+
+    HashChunks();
+
+    const size_t n = threads.size();
+    for (size_t i = 0; i < n; i++) threads[i].join();
+
+    if (bIsError) return TEXT("");
+
+    // Hash the chunk hashes together, seeded with the size so that a file of zeroes doesn't hash the same as a shorter file of zeroes
+    const uint64_t hash = XXH64(chunkHashes.data(), chunkHashes.size() * sizeof(uint64_t), nSizeBytes);
+
+    const char_t* szDigits = TEXT("0123456789abcdef");
+    string_t sHash(16, TEXT('0'));
+    for (size_t i = 0; i < 16; i++) sHash[i] = szDigits[(hash >> (60 - (4 * i))) & 0xF];
+
+    return sHash;
+  }
+
+  string_t CalculateContentHashForFile(CONTENT_HASH algorithm, const string_t& sFilePath)
+  {
+    switch (algorithm) {
+      case CONTENT_HASH::MD5: {
+        spitfire::algorithm::cMD5 md5;
+        if (!md5.CalculateForFile(sFilePath)) break;
+
+        return md5.GetResultFormatted();
+      }
+      case CONTENT_HASH::XXH64: {
+        const string_t sHash = CalculateXXH64ForFile(sFilePath);
+        if (sHash.empty()) break;
+
+        return sHash;
+      }
+    }
+
+    LOG<<"CalculateContentHashForFile Failed to hash \""<<sFilePath<<"\", returning \"\""<<std::endl;
+    return TEXT("");
+  }
+}
@@ -0,0 +1,32 @@
+#ifndef DIESEL_CONTENTHASH_H
+#define DIESEL_CONTENTHASH_H
+
+// Standard headers
+#include <cstddef>
+#include <cstdint>
+
+// Diesel headers
+#include "diesel.h"
+
+namespace diesel
+{
+  // ** Content hashing
+  //
+  // Hashes the contents of files for the cache keys and for checking that imported files were copied correctly
+  // XXH64 is the default, it runs at memory speed where MD5 manages a few hundred MB a second, the file is read in large chunks with sequential
+  // read ahead, large files have their chunks hashed on several threads, then the chunk hashes are hashed together
+  // NOTE: Because of the chunks the XXH64 result is not the same as XXH64 of the whole file, but it doesn't depend on the number of threads either
+  // MD5 is only kept so that cache entries created by older versions can still be found
+  //
+
+  enum class CONTENT_HASH {
+    MD5, // 32 hex digits
+    XXH64 // 16 hex digits
+  };
+
+  string_t CalculateContentHashForFile(CONTENT_HASH algorithm, const string_t& sFilePath); // Returns "" if the file could not be read
+
+  uint64_t XXH64(const void* pData, size_t nBytes, uint64_t seed);
+}
+
+#endif // DIESEL_CONTENTHASH_H
@@ -0,0 +1,297 @@
+// Standard headers
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#ifndef __WIN__
+// POSIX headers
+#include <unistd.h>
+#endif
+
+// Spitfire headers
+#include <spitfire/storage/filesystem.h>
+#include <spitfire/util/log.h>
+#include <spitfire/util/process.h>
+#include <spitfire/util/string.h>
+
+// Diesel headers
+#include "contenthash.h"
+#include "converterbackends.h"
+#include "jpegthumbnail.h"
+#include "librawdecoder.h"
+#include "processrunner.h"
+#include "util.h"
+
+namespace diesel
+{
+  #ifndef __WIN__
+  // Asking a tool for its version should be instant, this is only here in case a tool hangs
+  const size_t nProbeTimeoutMS = 5000;
+
+  class cProbeProcessInterface : public spitfire::util::cProcessInterface
+  {
+  public:
+    virtual bool _IsToStop() const override { return false; }
+  };
+
+  string_t GetFirstLine(const std::string& sText)
+  {
+    std::istringstream i(sText);
+    std::string sLine;
+    while (std::getline(i, sLine)) {
+      const size_t first = sLine.find_first_not_of(" \t\r");
+      if (first == std::string::npos) continue;
+
+      const size_t last = sLine.find_last_not_of(" \t\r");
+      return sLine.substr(first, (last - first) + 1);
+    }
+
+    return TEXT("");
+  }
+  #endif
+
+
+  // ** cConverterTool
+
+  cConverterTool::cConverterTool() :
+    bIsAvailable(false)
+  {
+  }
+
+
+  // ** cConverterBackends
+
+  cConverterBackends::cConverterBackends()
+  {
+    Probe();
+    CalculateToolsVersion();
+    Log();
+  }
+
+  const cConverterBackends& cConverterBackends::Get()
+  {
+    // NOTE: This is only constructed once even if several threads get here at the same time
+    static const cConverterBackends backends;
+    return backends;
+  }
+
+  CONVERTER_FILE_TYPE cConverterBackends::GetFileTypeForExtension(const string_t& sExtensionLower)
+  {
+    if ((sExtensionLower == TEXT(".jpg")) || (sExtensionLower == TEXT(".jpeg"))) return CONVERTER_FILE_TYPE::JPEG;
+    else if (sExtensionLower == TEXT(".png")) return CONVERTER_FILE_TYPE::PNG;
+    else if (sExtensionLower == TEXT(".dng")) return CONVERTER_FILE_TYPE::DNG;
+    else if (util::IsFileTypeRaw(sExtensionLower)) return CONVERTER_FILE_TYPE::RAW;
+
+    return CONVERTER_FILE_TYPE::IMAGE;
+  }
+
+  const cConverterTool& cConverterBackends::GetTool(CONVERTER_TOOL tool) const
+  {
+    const size_t index = static_cast<size_t>(tool);
+    ASSERT(index < CONVERTER_TOOL_COUNT);
+    return tools[index];
+  }
+
+  bool cConverterBackends::IsAdobeDNGConverterAvailable() const
+  {
+    #ifndef __WIN__
+    if (!IsAvailable(CONVERTER_TOOL::WINE)) return false;
+    #endif
+
+    return IsAvailable(CONVERTER_TOOL::ADOBE_DNG_CONVERTER);
+  }
+
+  void cConverterBackends::GetBackendsForFile(CONVERTER_FILE_TYPE fileType, IMAGE_SIZE imageSize, std::vector<CONVERTER_TOOL>& backends) const
+  {
+    backends.clear();
+
+    std::vector<CONVERTER_TOOL> preferred;
+
+    switch (fileType) {
+      case CONVERTER_FILE_TYPE::JPEG:
+      case CONVERTER_FILE_TYPE::PNG:
+      case CONVERTER_FILE_TYPE::IMAGE: {
+        if (imageSize == IMAGE_SIZE::THUMBNAIL) {
+          // libjpeg decodes jpegs at 1/8 scale without starting a process at all
+          if (fileType == CONVERTER_FILE_TYPE::JPEG) preferred.push_back(CONVERTER_TOOL::LIBJPEG);
+
+          // GraphicsMagick and vipsthumbnail only decode as much of a jpeg as they need for the thumbnail size, GraphicsMagick goes first
+          // because its jobs are sent to a gm batch process that is already running instead of starting a process for each image
+          preferred.push_back(CONVERTER_TOOL::GRAPHICSMAGICK);
+          preferred.push_back(CONVERTER_TOOL::VIPSTHUMBNAIL);
+          preferred.push_back(CONVERTER_TOOL::IMAGEMAGICK);
+        } else if (fileType != CONVERTER_FILE_TYPE::IMAGE) {
+          // Full size jpegs and pngs are loaded as they are, jpegs are turned to match their orientation when they are drawn so they don't need a copy in the cache
+          preferred.push_back(CONVERTER_TOOL::IN_PROCESS);
+        } else {
+          // Other images may be in a format that the decode stage can't load, so they are converted to jpeg
+          preferred.push_back(CONVERTER_TOOL::GRAPHICSMAGICK);
+          preferred.push_back(CONVERTER_TOOL::IMAGEMAGICK);
+        }
+        break;
+      }
+      case CONVERTER_FILE_TYPE::DNG: {
+        // We can use the embedded preview ourselves without starting a process, or develop the raw data ourselves with LibRaw, the tools are only
+        // used if both of those fail
+        preferred.push_back(CONVERTER_TOOL::RAW_PREVIEW);
+        preferred.push_back(CONVERTER_TOOL::LIBRAW);
+        if (imageSize == IMAGE_SIZE::THUMBNAIL) preferred.push_back(CONVERTER_TOOL::DCRAW);
+        preferred.push_back(CONVERTER_TOOL::UFRAW);
+        break;
+      }
+      case CONVERTER_FILE_TYPE::RAW: {
+        preferred.push_back(CONVERTER_TOOL::RAW_PREVIEW);
+        preferred.push_back(CONVERTER_TOOL::LIBRAW);
+        break;
+      }
+    }
+
+    std::vector<CONVERTER_TOOL>::const_iterator iter = preferred.begin();
+    const std::vector<CONVERTER_TOOL>::const_iterator iterEnd = preferred.end();
+    while (iter != iterEnd) {
+      if (IsAvailable(*iter)) backends.push_back(*iter);
+
+      iter++;
+    }
+  }
+
+  void cConverterBackends::Probe()
+  {
+    cConverterTool& inProcess = tools[static_cast<size_t>(CONVERTER_TOOL::IN_PROCESS)];
+    inProcess.bIsAvailable = true;
+    inProcess.sName = TEXT("in-process");
+    inProcess.sVersion = TEXT("libvoodoomm");
+
+    cConverterTool& libJPEG = tools[static_cast<size_t>(CONVERTER_TOOL::LIBJPEG)];
+    libJPEG.bIsAvailable = true;
+    libJPEG.sName = TEXT("libjpeg");
+    libJPEG.sVersion = GetLibJPEGVersion();
+
+    // NOTE: Change the version when the way that previews are chosen changes so that files that failed are tried again
+    cConverterTool& rawPreview = tools[static_cast<size_t>(CONVERTER_TOOL::RAW_PREVIEW)];
+    rawPreview.bIsAvailable = true;
+    rawPreview.sName = TEXT("raw-preview");
+    rawPreview.sVersion = TEXT("1");
+
+    cConverterTool& libRaw = tools[static_cast<size_t>(CONVERTER_TOOL::LIBRAW)];
+    libRaw.bIsAvailable = true;
+    libRaw.sName = TEXT("libraw");
+    libRaw.sVersion = GetLibRawVersion();
+
+    ProbeTool(CONVERTER_TOOL::VIPSTHUMBNAIL, TEXT("vipsthumbnail"), TEXT("--vips-version"));
+    ProbeTool(CONVERTER_TOOL::GRAPHICSMAGICK, TEXT("gm"), TEXT("-version"));
+    ProbeTool(CONVERTER_TOOL::IMAGEMAGICK, TEXT("convert"), TEXT("-version"));
+    ProbeTool(CONVERTER_TOOL::UFRAW, TEXT("ufraw-batch"), TEXT("--version"));
+    ProbeTool(CONVERTER_TOOL::DCRAW, TEXT("dcraw"), TEXT("")); // dcraw prints its version when it is run without any arguments
+    ProbeTool(CONVERTER_TOOL::WINE, TEXT("wine"), TEXT("--version"));
+    ProbeTool(CONVERTER_TOOL::WINESERVER, TEXT("wineserver"), TEXT("--version"));
+
+    cConverterTool& adobeDNGConverter = tools[static_cast<size_t>(CONVERTER_TOOL::ADOBE_DNG_CONVERTER)];
+    adobeDNGConverter.sName = TEXT("Adobe DNG Converter");
+
+    #ifdef __WIN__
+    // On Windows we only look in the usual install locations
+    const string_t sProgramFiles = spitfire::filesystem::GetProgramFilesDirectory();
+
+    // For some reason the 64 bit version of ImageMagick installs into "Program Files" too
+    for (spitfire::filesystem::cFolderIterator iter(TEXT("C:\\Program Files\\")); iter.IsValid(); iter.Next()) {
+      if (spitfire::string::StartsWith(iter.GetFileOrFolder(), TEXT("ImageMagick"))) {
+        cConverterTool& imageMagick = tools[static_cast<size_t>(CONVERTER_TOOL::IMAGEMAGICK)];
+        imageMagick.sPath = spitfire::filesystem::MakeFilePath(iter.GetFullPath(), TEXT("convert.exe"));
+        imageMagick.bIsAvailable = spitfire::filesystem::FileExists(imageMagick.sPath);
+        break;
+      }
+    }
+
+    cConverterTool& ufraw = tools[static_cast<size_t>(CONVERTER_TOOL::UFRAW)];
+    const string_t sUFRawBin = spitfire::filesystem::MakeFilePath(sProgramFiles, TEXT("UFRaw"), TEXT("bin"));
+    ufraw.sPath = spitfire::filesystem::MakeFilePath(sUFRawBin, TEXT("ufraw-batch.exe"));
+    ufraw.bIsAvailable = spitfire::filesystem::FileExists(ufraw.sPath);
+
+    adobeDNGConverter.sPath = spitfire::filesystem::MakeFilePath(sProgramFiles, TEXT("Adobe"), TEXT("Adobe DNG Converter.exe"));
+    adobeDNGConverter.bIsAvailable = spitfire::filesystem::FileExists(adobeDNGConverter.sPath);
+    #else
+    // The Adobe DNG Converter is run under wine, we assume that it is installed in the default wine prefix
+    adobeDNGConverter.sPath = TEXT("C:\\Program Files (x86)\\Adobe\\Adobe DNG Converter.exe");
+    adobeDNGConverter.bIsAvailable = IsAvailable(CONVERTER_TOOL::WINE);
+    #endif
+  }
+
+  #ifndef __WIN__
+  string_t cConverterBackends::FindExecutableOnPath(const string_t& sName)
+  {
+    const char* szPath = getenv("PATH");
+    if (szPath == nullptr) return TEXT("");
+
+    std::istringstream i(szPath);
+    std::string sFolder;
+    while (std::getline(i, sFolder, ':')) {
+      if (sFolder.empty()) continue;
+
+      const string_t sFilePath = spitfire::filesystem::MakeFilePath(sFolder, sName);
+      if (::access(sFilePath.c_str(), X_OK) == 0) return sFilePath;
+    }
+
+    return TEXT("");
+  }
+  #endif
+
+  void cConverterBackends::ProbeTool(CONVERTER_TOOL tool, const string_t& sName, const string_t& sVersionArgument)
+  {
+    cConverterTool& entry = tools[static_cast<size_t>(tool)];
+    entry.sName = sName;
+
+    #ifdef __WIN__
+    // The Windows tools are found in their install locations in Probe
+    (void)sVersionArgument;
+    #else
+    entry.sPath = FindExecutableOnPath(sName);
+    if (entry.sPath.empty()) return;
+
+    entry.bIsAvailable = true;
+
+    std::vector<string_t> arguments;
+    arguments.push_back(entry.sPath);
+    if (!sVersionArgument.empty()) arguments.push_back(sVersionArgument);
+
+    // Some tools print their version to standard error and some return an error code when asked for their version so we just take whatever they printed
+    cProbeProcessInterface processInterface;
+    cProcessRunner runner;
+    runner.SetTimeoutMS(nProbeTimeoutMS);
+    runner.SetCaptureStandardOutput();
+    runner.Run(arguments, processInterface);
+
+    entry.sVersion = GetFirstLine(runner.GetStandardOutput());
+    if (entry.sVersion.empty()) entry.sVersion = GetFirstLine(runner.GetStandardError());
+    #endif
+  }
+
+  void cConverterBackends::CalculateToolsVersion()
+  {
+    // NOTE: The Windows tools don't report a version so their paths are included too, a new version usually installs somewhere else
+    std::ostringstream o;
+    for (size_t i = 0; i < CONVERTER_TOOL_COUNT; i++) {
+      const cConverterTool& tool = tools[i];
+      o<<spitfire::string::ToUTF8(tool.sName)<<"\t"<<(tool.bIsAvailable ? "1" : "0")<<"\t"<<spitfire::string::ToUTF8(tool.sPath)<<"\t"<<spitfire::string::ToUTF8(tool.sVersion)<<"\n";
+    }
+
+    const std::string sTools = o.str();
+    const uint64_t hash = XXH64(sTools.data(), sTools.length(), 0);
+
+    ostringstream_t version;
+    version<<std::hex<<std::setfill(TEXT('0'))<<std::setw(16)<<hash;
+    sToolsVersion = version.str();
+  }
+
+  void cConverterBackends::Log() const
+  {
+    for (size_t i = 0; i < CONVERTER_TOOL_COUNT; i++) {
+      const cConverterTool& tool = tools[i];
+      if (tool.bIsAvailable) LOG<<"cConverterBackends::Log "<<tool.sName<<" found at \""<<tool.sPath<<"\", version \""<<tool.sVersion<<"\""<<std::endl;
+      else LOG<<"cConverterBackends::Log "<<tool.sName<<" not found"<<std::endl;
+    }
+
+    LOG<<"cConverterBackends::Log Tools version "<<sToolsVersion<<std::endl;
+  }
+}
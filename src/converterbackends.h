@@ -0,0 +1,91 @@
+#ifndef DIESEL_CONVERTERBACKENDS_H
+#define DIESEL_CONVERTERBACKENDS_H
+
+// Standard headers
+#include <vector>
+
+// Diesel headers
+#include "diesel.h"
+
+namespace diesel
+{
+  // ** cConverterBackends
+  //
+  // Finds the tools that we can use to create cached images, once, the first time it is needed
+  // Each tool is looked up on the path (Or in its usual install location on Windows) and asked for its version, the results are logged and then
+  // used for the rest of the session so that we don't fork a shell to check whether a tool is installed for every image
+  // For each file type and image size the available backends are returned fastest first, if one fails the next one can be tried
+  //
+
+  enum class CONVERTER_TOOL {
+    IN_PROCESS, // libvoodoomm loads the source file directly in the decode stage
+    LIBJPEG, // Jpeg thumbnails are decoded at a smaller scale and resized in process, see CreateJPEGThumbnail
+    RAW_PREVIEW, // The jpeg preview embedded in a raw or dng file is used in process, see ExtractRawPreview
+    LIBRAW, // Raw and dng files are developed in process, see CreateImageWithLibRaw
+    VIPSTHUMBNAIL,
+    GRAPHICSMAGICK,
+    IMAGEMAGICK,
+    UFRAW,
+    DCRAW,
+    WINE,
+    WINESERVER, // Kept running while we convert raw files so that each run of wine starts quickly
+    ADOBE_DNG_CONVERTER
+  };
+
+  const size_t CONVERTER_TOOL_COUNT = 12;
+
+  enum class CONVERTER_FILE_TYPE {
+    JPEG,
+    PNG,
+    IMAGE, // Bmp and anything else that the converters can read
+    DNG,
+    RAW // Raw files that have a preview or that LibRaw supports, the others are converted to dng first
+  };
+
+  class cConverterTool
+  {
+  public:
+    cConverterTool();
+
+    bool bIsAvailable;
+    string_t sName;
+    string_t sPath;
+    string_t sVersion;
+  };
+
+  class cConverterBackends
+  {
+  public:
+    static const cConverterBackends& Get(); // Probes the tools the first time it is called
+
+    static CONVERTER_FILE_TYPE GetFileTypeForExtension(const string_t& sExtensionLower);
+
+    const cConverterTool& GetTool(CONVERTER_TOOL tool) const;
+    bool IsAvailable(CONVERTER_TOOL tool) const { return GetTool(tool).bIsAvailable; }
+
+    bool IsAdobeDNGConverterAvailable() const;
+
+    // Fastest first, only backends that are available are added
+    void GetBackendsForFile(CONVERTER_FILE_TYPE fileType, IMAGE_SIZE imageSize, std::vector<CONVERTER_TOOL>& backends) const;
+
+    // 16 hex digits that change whenever a tool is installed, removed or upgraded
+    const string_t& GetToolsVersion() const { return sToolsVersion; }
+
+  private:
+    cConverterBackends();
+
+    void Probe();
+    void ProbeTool(CONVERTER_TOOL tool, const string_t& sName, const string_t& sVersionArgument);
+    void CalculateToolsVersion();
+    void Log() const;
+
+    #ifndef __WIN__
+    static string_t FindExecutableOnPath(const string_t& sName);
+    #endif
+
+    cConverterTool tools[CONVERTER_TOOL_COUNT];
+    string_t sToolsVersion;
+  };
+}
+
+#endif // DIESEL_CONVERTERBACKENDS_H
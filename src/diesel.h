@@ -18,6 +18,18 @@ namespace diesel
     THUMBNAIL,
     FULL
   };
+
+  enum class THUMBNAIL_FORMAT {
+    JPEG,
+    RGBA,
+    BC1
+  };
+
+  enum class CONVERSION_RESULT {
+    SUCCESS,
+    INVALID_FILE, // The file couldn't be decoded, it will fail the same way every time
+    TEMPORARY_FAILURE // Timed out, stopped, couldn't start a tool, couldn't read the file or couldn't write to the cache, it may work next time
+  };
 }
 
 #endif // DIESEL_H
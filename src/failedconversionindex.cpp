@@ -0,0 +1,160 @@
+// Standard headers
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+// Spitfire headers
+#include <spitfire/storage/filesystem.h>
+#include <spitfire/util/log.h>
+#include <spitfire/util/string.h>
+
+// Diesel headers
+#include "cachefile.h"
+#include "failedconversionindex.h"
+
+namespace diesel
+{
+  // Once the file has this many more lines than there are failures we rewrite it without the stale lines
+  const size_t nMaximumStaleLines = 1000;
+
+  // ** cFailedConversionIndex
+
+  cFailedConversionIndex::cFailedConversionIndex(const string_t& _sIndexFilePath) :
+    sIndexFilePath(_sIndexFilePath),
+    bIsLoaded(false),
+    nLinesInFile(0)
+  {
+  }
+
+  std::string cFailedConversionIndex::GetKey(const std::string& sFilePathUTF8, IMAGE_SIZE imageSize)
+  {
+    return ((imageSize == IMAGE_SIZE::THUMBNAIL) ? "thumbnail\t" : "full\t") + sFilePathUTF8;
+  }
+
+  std::string cFailedConversionIndex::GetLine(const std::string& sKey, const cEntry& entry)
+  {
+    // NOTE: The key goes last because the path is the only field that can contain spaces
+    std::ostringstream o;
+    o<<entry.stat.device<<"\t"<<entry.stat.inode<<"\t"<<entry.stat.nSizeBytes<<"\t"<<entry.stat.modifiedSeconds<<"\t"<<entry.stat.modifiedNanoSeconds<<"\t"<<entry.sToolsVersion<<"\t"<<sKey<<"\n";
+    return o.str();
+  }
+
+  void cFailedConversionIndex::LoadIfRequired()
+  {
+    if (bIsLoaded) return;
+
+    bIsLoaded = true;
+
+    std::ifstream file(sIndexFilePath.c_str());
+    if (!file.good()) return;
+
+    // Later lines replace earlier lines for the same key
+    std::string sLine;
+    while (std::getline(file, sLine)) {
+      nLinesInFile++;
+
+      std::istringstream i(sLine);
+      cEntry entry;
+      if (!(i>>entry.stat.device>>entry.stat.inode>>entry.stat.nSizeBytes>>entry.stat.modifiedSeconds>>entry.stat.modifiedNanoSeconds>>entry.sToolsVersion)) continue;
+
+      // Skip the tab before the key
+      if (i.get() != '\t') continue;
+
+      std::string sKey;
+      std::getline(i, sKey);
+      if (sKey.empty()) continue;
+
+      entries[sKey] = entry;
+    }
+
+    LOG<<"cFailedConversionIndex::LoadIfRequired Loaded "<<entries.size()<<" failures from "<<nLinesInFile<<" lines"<<std::endl;
+
+    if (nLinesInFile > entries.size() + nMaximumStaleLines) Rewrite();
+  }
+
+  void cFailedConversionIndex::Rewrite()
+  {
+    LOG<<"cFailedConversionIndex::Rewrite Rewriting \""<<sIndexFilePath<<"\" with "<<entries.size()<<" failures"<<std::endl;
+
+    const string_t sTemporaryFilePath = GetTemporaryFilePath(sIndexFilePath);
+
+    {
+      std::ofstream file(sTemporaryFilePath.c_str(), std::ios::out | std::ios::trunc);
+      if (!file.good()) return;
+
+      std::map<std::string, cEntry>::const_iterator iter = entries.begin();
+      const std::map<std::string, cEntry>::const_iterator iterEnd = entries.end();
+      while (iter != iterEnd) {
+        file<<GetLine(iter->first, iter->second);
+
+        iter++;
+      }
+
+      if (!file.good()) {
+        file.close();
+        spitfire::filesystem::DeleteFile(sTemporaryFilePath);
+        return;
+      }
+    }
+
+    if (!PublishFile(sTemporaryFilePath, sIndexFilePath)) return;
+
+    nLinesInFile = entries.size();
+  }
+
+  bool cFailedConversionIndex::IsFailed(const string_t& sFilePath, IMAGE_SIZE imageSize, const cFileStat& stat, const string_t& sToolsVersion)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    LoadIfRequired();
+
+    std::map<std::string, cEntry>::iterator iter = entries.find(GetKey(spitfire::string::ToUTF8(sFilePath), imageSize));
+    if (iter == entries.end()) return false;
+
+    // NOTE: Tool versions are always ascii
+    if ((iter->second.stat == stat) && (iter->second.sToolsVersion == std::string(sToolsVersion.begin(), sToolsVersion.end()))) return true;
+
+    // The file or the tools have changed so the file can be tried again, the line in the file is now stale
+    entries.erase(iter);
+    return false;
+  }
+
+  void cFailedConversionIndex::AddFailure(const string_t& sFilePath, IMAGE_SIZE imageSize, const cFileStat& stat, const string_t& sToolsVersion)
+  {
+    ASSERT(!sToolsVersion.empty());
+
+    const std::string sFilePathUTF8 = spitfire::string::ToUTF8(sFilePath);
+
+    // Paths with tabs or new lines would break the file format so we just don't remember them
+    if (sFilePathUTF8.find_first_of("\t\r\n") != std::string::npos) return;
+
+    const std::string sKey = GetKey(sFilePathUTF8, imageSize);
+
+    cEntry entry;
+    entry.stat = stat;
+    entry.sToolsVersion = std::string(sToolsVersion.begin(), sToolsVersion.end());
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    LoadIfRequired();
+
+    entries[sKey] = entry;
+
+    std::ofstream file(sIndexFilePath.c_str(), std::ios::out | std::ios::app);
+    if (!file.good()) return;
+
+    file<<GetLine(sKey, entry);
+    nLinesInFile++;
+  }
+
+  void cFailedConversionIndex::Clear()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (spitfire::filesystem::FileExists(sIndexFilePath)) spitfire::filesystem::DeleteFile(sIndexFilePath);
+
+    entries.clear();
+    nLinesInFile = 0;
+    bIsLoaded = true;
+  }
+}
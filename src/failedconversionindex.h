@@ -0,0 +1,55 @@
+#ifndef DIESEL_FAILEDCONVERSIONINDEX_H
+#define DIESEL_FAILEDCONVERSIONINDEX_H
+
+// Standard headers
+#include <map>
+#include <mutex>
+#include <string>
+
+// Diesel headers
+#include "diesel.h"
+#include "cachekeyindex.h"
+
+namespace diesel
+{
+  // ** cFailedConversionIndex
+  //
+  // Remembers the source files that could not be converted or decoded so that a folder with corrupt or unsupported files doesn't run every converter
+  // on them again each time it is opened
+  // Each failure is stored with the file's stat and the version of the converter tools, the file is only tried again when one of them changes
+  // Like cCacheKeyIndex the failures are kept in memory and appended to a file, the file is rewritten without the stale lines when it has grown too big
+  //
+
+  class cFailedConversionIndex
+  {
+  public:
+    explicit cFailedConversionIndex(const string_t& sIndexFilePath);
+
+    bool IsFailed(const string_t& sFilePath, IMAGE_SIZE imageSize, const cFileStat& stat, const string_t& sToolsVersion);
+    void AddFailure(const string_t& sFilePath, IMAGE_SIZE imageSize, const cFileStat& stat, const string_t& sToolsVersion);
+
+    void Clear(); // Forgets every failure, for when the cache folder has been deleted
+
+  private:
+    class cEntry
+    {
+    public:
+      cFileStat stat;
+      std::string sToolsVersion;
+    };
+
+    void LoadIfRequired();
+    void Rewrite();
+    static std::string GetKey(const std::string& sFilePathUTF8, IMAGE_SIZE imageSize);
+    static std::string GetLine(const std::string& sKey, const cEntry& entry);
+
+    std::mutex mutex;
+
+    const string_t sIndexFilePath;
+    bool bIsLoaded;
+    size_t nLinesInFile;
+    std::map<std::string, cEntry> entries; // Indexed by the image size and the UTF8 path of the source file
+  };
+}
+
+#endif // DIESEL_FAILEDCONVERSIONINDEX_H
@@ -22,6 +22,7 @@
 // Diesel headers
 #include "gtkmmopenglview.h"
 #include "gtkmmphotobrowser.h"
+#include "util.h"
 
 namespace diesel
 {
@@ -37,61 +38,69 @@ namespace diesel
   class cGtkmmOpenGLViewFolderFoundEvent : public cGtkmmOpenGLViewEvent
   {
   public:
-    cGtkmmOpenGLViewFolderFoundEvent(const string_t& sFolderName);
+    cGtkmmOpenGLViewFolderFoundEvent(size_t generation, const string_t& sFolderName);
 
     virtual void EventFunction(cGtkmmOpenGLView& view) override;
 
+    size_t generation;
     string_t sFolderName;
   };
 
-  cGtkmmOpenGLViewFolderFoundEvent::cGtkmmOpenGLViewFolderFoundEvent(const string_t& _sFolderName) :
+  cGtkmmOpenGLViewFolderFoundEvent::cGtkmmOpenGLViewFolderFoundEvent(size_t _generation, const string_t& _sFolderName) :
+    generation(_generation),
     sFolderName(_sFolderName)
   {
   }
 
   void cGtkmmOpenGLViewFolderFoundEvent::EventFunction(cGtkmmOpenGLView& view)
   {
-    view.OnFolderFound(sFolderName);
+    view.OnFolderFound(generation, sFolderName);
   }
 
 
   class cGtkmmOpenGLViewFileFoundEvent : public cGtkmmOpenGLViewEvent
   {
   public:
-    cGtkmmOpenGLViewFileFoundEvent(const string_t& sFileNameNoExtension);
+    cGtkmmOpenGLViewFileFoundEvent(size_t generation, const string_t& sFileNameNoExtension);
 
     virtual void EventFunction(cGtkmmOpenGLView& view) override;
 
+    size_t generation;
     string_t sFileNameNoExtension;
   };
 
-  cGtkmmOpenGLViewFileFoundEvent::cGtkmmOpenGLViewFileFoundEvent(const string_t& _sFileNameNoExtension) :
+  cGtkmmOpenGLViewFileFoundEvent::cGtkmmOpenGLViewFileFoundEvent(size_t _generation, const string_t& _sFileNameNoExtension) :
+    generation(_generation),
     sFileNameNoExtension(_sFileNameNoExtension)
   {
   }
 
   void cGtkmmOpenGLViewFileFoundEvent::EventFunction(cGtkmmOpenGLView& view)
   {
-    view.OnFileFound(sFileNameNoExtension);
+    view.OnFileFound(generation, sFileNameNoExtension);
   }
 
 
   class cGtkmmOpenGLViewImageLoadedEvent : public cGtkmmOpenGLViewEvent
   {
   public:
-    cGtkmmOpenGLViewImageLoadedEvent(const string_t& sFileNameNoExtension, IMAGE_SIZE imageSize, voodoo::cImage* pImage);
+    cGtkmmOpenGLViewImageLoadedEvent(size_t generation, const string_t& sFileNameNoExtension, IMAGE_SIZE imageSize, int orientation, voodoo::cImage* pImage);
     ~cGtkmmOpenGLViewImageLoadedEvent();
 
     virtual void EventFunction(cGtkmmOpenGLView& view) override;
 
+    size_t generation;
     string_t sFileNameNoExtension;
     IMAGE_SIZE imageSize;
+    int orientation;
     voodoo::cImage* pImage;
   };
 
-  cGtkmmOpenGLViewImageLoadedEvent::cGtkmmOpenGLViewImageLoadedEvent(const string_t& _sFileNameNoExtension, IMAGE_SIZE _imageSize, voodoo::cImage* _pImage) :
+  cGtkmmOpenGLViewImageLoadedEvent::cGtkmmOpenGLViewImageLoadedEvent(size_t _generation, const string_t& _sFileNameNoExtension, IMAGE_SIZE _imageSize, int _orientation, voodoo::cImage* _pImage) :
+    generation(_generation),
     sFileNameNoExtension(_sFileNameNoExtension),
     imageSize(_imageSize),
+    orientation(_orientation),
     pImage(_pImage)
   {
   }
@@ -103,28 +112,30 @@ namespace diesel
 
   void cGtkmmOpenGLViewImageLoadedEvent::EventFunction(cGtkmmOpenGLView& view)
   {
-    view.OnImageLoaded(sFileNameNoExtension, imageSize, pImage);
+    view.OnImageLoaded(generation, sFileNameNoExtension, imageSize, orientation, pImage);
   }
 
 
   class cGtkmmOpenGLViewImageErrorEvent : public cGtkmmOpenGLViewEvent
   {
   public:
-    explicit cGtkmmOpenGLViewImageErrorEvent(const string_t& sFileNameNoExtension);
+    cGtkmmOpenGLViewImageErrorEvent(size_t generation, const string_t& sFileNameNoExtension);
 
     virtual void EventFunction(cGtkmmOpenGLView& view) override;
 
+    size_t generation;
     string_t sFileNameNoExtension;
   };
 
-  cGtkmmOpenGLViewImageErrorEvent::cGtkmmOpenGLViewImageErrorEvent(const string_t& _sFileNameNoExtension) :
+  cGtkmmOpenGLViewImageErrorEvent::cGtkmmOpenGLViewImageErrorEvent(size_t _generation, const string_t& _sFileNameNoExtension) :
+    generation(_generation),
     sFileNameNoExtension(_sFileNameNoExtension)
   {
   }
 
   void cGtkmmOpenGLViewImageErrorEvent::EventFunction(cGtkmmOpenGLView& view)
   {
-    view.OnImageError(sFileNameNoExtension);
+    view.OnImageError(generation, sFileNameNoExtension);
   }
 
 
@@ -344,6 +355,23 @@ namespace diesel
     pageHeight = resolution.height * fScale;
 
     LOG<<"cGtkmmOpenGLView::UpdateColumnsPageHeightAndRequiredHeight fScale="<<fScale<<", photos="<<photos.size()<<", rows="<<rows<<", columns="<<columns<<", requiredHeight="<<requiredHeight<<", pageHeight="<<pageHeight<<std::endl;
+
+    // Tell the image load thread how many pixels the thumbnails take up on screen so that it can load a thumbnail that is big enough
+    imageLoadThread.SetThumbnailSize(spitfire::math::RoundUpToNearestInt(max(fThumbNailWidth, fThumbNailHeight) * fScale));
+
+    UpdateVisibleRange();
+  }
+
+  void cGtkmmOpenGLView::UpdateVisibleRange()
+  {
+    // Tell the image load thread which photos are visible so that it can load them first
+    const float fRowHeight = fThumbNailHeight + fThumbNailSpacing;
+    const float fVisibleHeight = float(resolution.height) / fScale;
+
+    const size_t firstRow = size_t(max(0.0f, fScrollPosition - fThumbNailSpacing) / fRowHeight);
+    const size_t lastRow = size_t(max(0.0f, fScrollPosition + fVisibleHeight - fThumbNailSpacing) / fRowHeight);
+
+    imageLoadThread.SetVisibleRange(firstRow * columns, ((lastRow + 1) * columns) - 1);
   }
 
   bool cGtkmmOpenGLView::GetPhotoAtPoint(size_t& index, const spitfire::math::cVec2& _point) const
@@ -419,7 +447,7 @@ namespace diesel
     pStaticVertexBufferObject->Compile2D(system);
   }
 
-  void cGtkmmOpenGLView::CreateVertexBufferObjectRect(opengl::cStaticVertexBufferObject* pStaticVertexBufferObject, float fX, float fY, float fWidth, float fHeight, size_t textureWidth, size_t textureHeight)
+  void cGtkmmOpenGLView::CreateVertexBufferObjectRect(opengl::cStaticVertexBufferObject* pStaticVertexBufferObject, float fX, float fY, float fWidth, float fHeight, size_t textureWidth, size_t textureHeight, int orientation)
   {
     ASSERT(pStaticVertexBufferObject != nullptr);
 
@@ -431,15 +459,24 @@ namespace diesel
     const spitfire::math::cVec2 vMin(fX, fY);
     const spitfire::math::cVec2 vMax(vMin.x + fWidth, vMin.y + fHeight);
 
+    // The photo is turned by sampling the texture from a different corner for each corner of the rectangle
+    spitfire::math::cVec2 vTexture[4]; // Top left, top right, bottom left, bottom right
+    for (size_t i = 0; i < 4; i++) {
+      float fTextureU = 0.0f;
+      float fTextureV = 0.0f;
+      util::GetTextureCoordinateForOrientation(orientation, float(i % 2), float(i / 2), fTextureU, fTextureV);
+      vTexture[i] = spitfire::math::cVec2(fTextureU * fTextureWidth, fTextureV * fTextureHeight);
+    }
+
     opengl::cGeometryBuilder_v2_t2 builder(*pGeometryDataPtr);
 
     // Front facing rectangle
-    builder.PushBack(spitfire::math::cVec2(vMax.x, vMin.y), spitfire::math::cVec2(fTextureWidth, 0.0f));
-    builder.PushBack(spitfire::math::cVec2(vMin.x, vMax.y), spitfire::math::cVec2(0.0f, fTextureHeight));
-    builder.PushBack(spitfire::math::cVec2(vMax.x, vMax.y), spitfire::math::cVec2(fTextureWidth, fTextureHeight));
-    builder.PushBack(spitfire::math::cVec2(vMin.x, vMin.y), spitfire::math::cVec2(0.0f, 0.0f));
-    builder.PushBack(spitfire::math::cVec2(vMin.x, vMax.y), spitfire::math::cVec2(0.0f, fTextureHeight));
-    builder.PushBack(spitfire::math::cVec2(vMax.x, vMin.y), spitfire::math::cVec2(fTextureWidth, 0.0f));
+    builder.PushBack(spitfire::math::cVec2(vMax.x, vMin.y), vTexture[1]);
+    builder.PushBack(spitfire::math::cVec2(vMin.x, vMax.y), vTexture[2]);
+    builder.PushBack(spitfire::math::cVec2(vMax.x, vMax.y), vTexture[3]);
+    builder.PushBack(spitfire::math::cVec2(vMin.x, vMin.y), vTexture[0]);
+    builder.PushBack(spitfire::math::cVec2(vMin.x, vMax.y), vTexture[2]);
+    builder.PushBack(spitfire::math::cVec2(vMax.x, vMin.y), vTexture[1]);
 
     pStaticVertexBufferObject->SetData(pGeometryDataPtr);
 
@@ -454,10 +491,12 @@ namespace diesel
     CreateVertexBufferObjectSquare(pStaticVertexBufferObjectIcon, fWidthAndHeight, fWidthAndHeight);
   }
 
-  void cGtkmmOpenGLView::CreateVertexBufferObjectPhoto(opengl::cStaticVertexBufferObject* pStaticVertexBufferObjectPhoto, size_t textureWidth, size_t textureHeight)
+  void cGtkmmOpenGLView::CreateVertexBufferObjectPhoto(opengl::cStaticVertexBufferObject* pStaticVertexBufferObjectPhoto, size_t textureWidth, size_t textureHeight, int orientation)
   {
     ASSERT(pStaticVertexBufferObjectPhoto != nullptr);
-    const float fRatio = float(textureWidth) / float(textureHeight);
+    // Photos that are turned on their side are drawn with their width and height swapped
+    const bool bIsSwapped = util::IsOrientationSwapWidthAndHeight(orientation);
+    const float fRatio = bIsSwapped ? (float(textureHeight) / float(textureWidth)) : (float(textureWidth) / float(textureHeight));
     float fWidth = fThumbNailWidth;
     float fHeight = fWidth * (1.0f / fRatio);
     if (fHeight > fThumbNailHeight) {
@@ -467,7 +506,7 @@ namespace diesel
     // Center the photo
     const float fX = 0.5f * (fThumbNailWidth - fWidth);
     const float fY = 0.5f * (fThumbNailHeight - fHeight);
-    CreateVertexBufferObjectRect(pStaticVertexBufferObjectPhoto, fX, fY, fWidth, fHeight, textureWidth, textureHeight);
+    CreateVertexBufferObjectRect(pStaticVertexBufferObjectPhoto, fX, fY, fWidth, fHeight, textureWidth, textureHeight, orientation);
   }
 
   /*void cGtkmmOpenGLView::CreateVertexBufferObjectPhotos()
@@ -1034,15 +1073,19 @@ namespace diesel
     return TRUE;
   }
 
-  void cGtkmmOpenGLView::OnFolderFound(const string_t& sFolderName)
+  void cGtkmmOpenGLView::OnFolderFound(size_t generation, const string_t& sFolderName)
   {
     LOG<<"cGtkmmOpenGLView::OnFolderFound \""<<sFolderName<<"\""<<std::endl;
 
     if (!spitfire::util::IsMainThread()) {
-      cGtkmmOpenGLViewFolderFoundEvent* pEvent = new cGtkmmOpenGLViewFolderFoundEvent(sFolderName);
+      cGtkmmOpenGLViewFolderFoundEvent* pEvent = new cGtkmmOpenGLViewFolderFoundEvent(generation, sFolderName);
       notifyMainThread.PushEventToMainThread(pEvent);
     } else {
       LOG<<"cGtkmmOpenGLView::OnFolderFound On main thread \""<<sFolderName<<"\""<<std::endl;
+
+      // Throw away anything from a folder that we have already left
+      if (generation != imageLoadThread.GetGeneration()) return;
+
       cPhotoEntry* pEntry = new cPhotoEntry;
       pEntry->sFileNameNoExtension = sFolderName;
       pEntry->state = cPhotoEntry::STATE::FOLDER;
@@ -1052,15 +1095,19 @@ namespace diesel
     }
   }
 
-  void cGtkmmOpenGLView::OnFileFound(const string_t& sFileNameNoExtension)
+  void cGtkmmOpenGLView::OnFileFound(size_t generation, const string_t& sFileNameNoExtension)
   {
     LOG<<"cGtkmmOpenGLView::OnFileFound \""<<sFileNameNoExtension<<"\""<<std::endl;
 
     if (!spitfire::util::IsMainThread()) {
-      cGtkmmOpenGLViewFileFoundEvent* pEvent = new cGtkmmOpenGLViewFileFoundEvent(sFileNameNoExtension);
+      cGtkmmOpenGLViewFileFoundEvent* pEvent = new cGtkmmOpenGLViewFileFoundEvent(generation, sFileNameNoExtension);
       notifyMainThread.PushEventToMainThread(pEvent);
     } else {
       LOG<<"cGtkmmOpenGLView::OnFileFound On main thread \""<<sFileNameNoExtension<<"\""<<std::endl;
+
+      // Throw away anything from a folder that we have already left
+      if (generation != imageLoadThread.GetGeneration()) return;
+
       cPhotoEntry* pEntry = new cPhotoEntry;
       pEntry->sFileNameNoExtension = sFileNameNoExtension;
       pEntry->state = cPhotoEntry::STATE::LOADING;
@@ -1070,15 +1117,19 @@ namespace diesel
     }
   }
 
-  void cGtkmmOpenGLView::OnImageError(const string_t& sFileNameNoExtension)
+  void cGtkmmOpenGLView::OnImageError(size_t generation, const string_t& sFileNameNoExtension)
   {
     LOG<<"cGtkmmOpenGLView::OnImageError \""<<sFileNameNoExtension<<"\""<<std::endl;
 
     if (!spitfire::util::IsMainThread()) {
-      cGtkmmOpenGLViewImageErrorEvent* pEvent = new cGtkmmOpenGLViewImageErrorEvent(sFileNameNoExtension);
+      cGtkmmOpenGLViewImageErrorEvent* pEvent = new cGtkmmOpenGLViewImageErrorEvent(generation, sFileNameNoExtension);
       notifyMainThread.PushEventToMainThread(pEvent);
     } else {
       LOG<<"cGtkmmOpenGLView::OnImageError On main thread \""<<sFileNameNoExtension<<"\""<<std::endl;
+
+      // Throw away anything from a folder that we have already left
+      if (generation != imageLoadThread.GetGeneration()) return;
+
       const size_t n = photos.size();
       for (size_t i = 0; i < n; i++) {
         if (photos[i]->sFileNameNoExtension == sFileNameNoExtension) {
@@ -1092,15 +1143,19 @@ namespace diesel
     }
   }
 
-  void cGtkmmOpenGLView::OnImageLoaded(const string_t& sFileNameNoExtension, IMAGE_SIZE imageSize, voodoo::cImage* pImage)
+  void cGtkmmOpenGLView::OnImageLoaded(size_t generation, const string_t& sFileNameNoExtension, IMAGE_SIZE imageSize, int orientation, voodoo::cImage* pImage)
   {
     LOG<<"cGtkmmOpenGLView::OnImageLoaded \""<<sFileNameNoExtension<<"\""<<std::endl;
 
     if (!spitfire::util::IsMainThread()) {
-      cGtkmmOpenGLViewImageLoadedEvent* pEvent = new cGtkmmOpenGLViewImageLoadedEvent(sFileNameNoExtension, imageSize, pImage);
+      cGtkmmOpenGLViewImageLoadedEvent* pEvent = new cGtkmmOpenGLViewImageLoadedEvent(generation, sFileNameNoExtension, imageSize, orientation, pImage);
       notifyMainThread.PushEventToMainThread(pEvent);
     } else {
       LOG<<"cGtkmmOpenGLView::OnImageLoaded On main thread \""<<sFileNameNoExtension<<"\""<<std::endl;
+
+      // Throw away anything from a folder that we have already left
+      if (generation != imageLoadThread.GetGeneration()) return;
+
       const size_t n = photos.size();
       for (size_t i = 0; i < n; i++) {
         if (photos[i]->sFileNameNoExtension == sFileNameNoExtension) {
@@ -1108,8 +1163,15 @@ namespace diesel
           pEntry->state = cPhotoEntry::STATE::LOADED;
 
           if (imageSize == IMAGE_SIZE::THUMBNAIL) {
-            ASSERT(pEntry->pTexturePhotoThumbnail == nullptr);
-            ASSERT(pEntry->pStaticVertexBufferObjectPhotoThumbnail == nullptr);
+            // Replace the placeholder, or the thumbnail if it has been loaded again at a bigger size
+            if (pEntry->pTexturePhotoThumbnail != nullptr) {
+              pContext->DestroyTexture(pEntry->pTexturePhotoThumbnail);
+              pEntry->pTexturePhotoThumbnail = nullptr;
+            }
+            if (pEntry->pStaticVertexBufferObjectPhotoThumbnail != nullptr) {
+              pContext->DestroyStaticVertexBufferObject(pEntry->pStaticVertexBufferObjectPhotoThumbnail);
+              pEntry->pStaticVertexBufferObjectPhotoThumbnail = nullptr;
+            }
 
             // Create the texture
             pEntry->pTexturePhotoThumbnail = pContext->CreateTextureFromImage(*pImage);
@@ -1117,7 +1179,7 @@ namespace diesel
 
             // Create the static vertex buffer object
             pEntry->pStaticVertexBufferObjectPhotoThumbnail = pContext->CreateStaticVertexBufferObject();
-            CreateVertexBufferObjectPhoto(pEntry->pStaticVertexBufferObjectPhotoThumbnail, pEntry->pTexturePhotoThumbnail->GetWidth(), pEntry->pTexturePhotoThumbnail->GetHeight());
+            CreateVertexBufferObjectPhoto(pEntry->pStaticVertexBufferObjectPhotoThumbnail, pEntry->pTexturePhotoThumbnail->GetWidth(), pEntry->pTexturePhotoThumbnail->GetHeight(), orientation);
             ASSERT(pEntry->pStaticVertexBufferObjectPhotoThumbnail != nullptr);
           } else {
             ASSERT(pEntry->pTexturePhotoFull == nullptr);
@@ -1129,7 +1191,7 @@ namespace diesel
 
             // Create the static vertex buffer object
             pEntry->pStaticVertexBufferObjectPhotoFull = pContext->CreateStaticVertexBufferObject();
-            CreateVertexBufferObjectPhoto(pEntry->pStaticVertexBufferObjectPhotoFull, pEntry->pTexturePhotoFull->GetWidth(), pEntry->pTexturePhotoFull->GetHeight());
+            CreateVertexBufferObjectPhoto(pEntry->pStaticVertexBufferObjectPhotoFull, pEntry->pTexturePhotoFull->GetWidth(), pEntry->pTexturePhotoFull->GetHeight(), orientation);
             ASSERT(pEntry->pStaticVertexBufferObjectPhotoFull != nullptr);
           }
 
@@ -1359,5 +1421,8 @@ namespace diesel
 
     // Clamp the value to our range
     ClampScrollBarPosition();
+
+    // Load the photos that are now visible first
+    UpdateVisibleRange();
   }
 }
@@ -111,6 +111,7 @@ namespace diesel
 
     void ClampScrollBarPosition();
     void UpdateColumnsPageHeightAndRequiredHeight();
+    void UpdateVisibleRange();
 
     bool GetPhotoAtPoint(size_t& index, const spitfire::math::cVec2& point) const;
 
@@ -121,9 +122,9 @@ namespace diesel
 
     void CreateVertexBufferObjectSelectionRectangle(opengl::cStaticVertexBufferObject* pStaticVertexBufferObject, float fWidth, float fHeight);
     void CreateVertexBufferObjectSquare(opengl::cStaticVertexBufferObject* pStaticVertexBufferObject, float fWidth, float fHeight);
-    void CreateVertexBufferObjectRect(opengl::cStaticVertexBufferObject* pStaticVertexBufferObject, float fX, float fY, float fWidth, float fHeight, size_t textureWidth, size_t textureHeight);
+    void CreateVertexBufferObjectRect(opengl::cStaticVertexBufferObject* pStaticVertexBufferObject, float fX, float fY, float fWidth, float fHeight, size_t textureWidth, size_t textureHeight, int orientation);
     void CreateVertexBufferObjectIcon();
-    void CreateVertexBufferObjectPhoto(opengl::cStaticVertexBufferObject* pStaticVertexBufferObjectPhoto, size_t textureWidth, size_t textureHeight);
+    void CreateVertexBufferObjectPhoto(opengl::cStaticVertexBufferObject* pStaticVertexBufferObjectPhoto, size_t textureWidth, size_t textureHeight, int orientation); // orientation is the EXIF orientation to turn the photo by
 
     virtual bool on_draw(const Cairo::RefPtr<Cairo::Context>& cr) override;
 
@@ -145,10 +146,10 @@ namespace diesel
     static gboolean configure_cb(GtkWidget* pWidget, GdkEventConfigure* event, gpointer pUserData);
     static gboolean idle_cb(gpointer pUserData);
 
-    virtual void OnFolderFound(const string_t& sFolderName) override;
-    virtual void OnFileFound(const string_t& sFileNameNoExtension) override;
-    virtual void OnImageLoaded(const string_t& sFileNameNoExtension, IMAGE_SIZE imageSize, voodoo::cImage* pImage) override;
-    virtual void OnImageError(const string_t& sFileNameNoExtension) override;
+    virtual void OnFolderFound(size_t generation, const string_t& sFolderName) override;
+    virtual void OnFileFound(size_t generation, const string_t& sFileNameNoExtension) override;
+    virtual void OnImageLoaded(size_t generation, const string_t& sFileNameNoExtension, IMAGE_SIZE imageSize, int orientation, voodoo::cImage* pImage) override;
+    virtual void OnImageError(size_t generation, const string_t& sFileNameNoExtension) override;
 
     cGtkmmPhotoBrowser& parent;
 
@@ -1,15 +1,31 @@
 // Standard headers
+#include <algorithm>
+#include <atomic>
 #include <cstdlib>
+#include <ctime>
+#include <fstream>
 #include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 // Spitfire headers
-#include <spitfire/algorithm/md5.h>
 #include <spitfire/storage/filesystem.h>
-#include <spitfire/util/datetime.h>
 #include <spitfire/util/log.h>
 
 // Diesel headers
+#include "cacheevictionindex.h"
+#include "cachefile.h"
+#include "cachekeyindex.h"
+#include "contenthash.h"
+#include "failedconversionindex.h"
 #include "imagecachemanager.h"
+#include "imagedecoder.h"
+#include "jpegthumbnail.h"
+#include "librawdecoder.h"
+#include "processrunner.h"
+#include "rawpreview.h"
+#include "thumbnailformat.h"
 
 namespace diesel
 {
@@ -137,80 +153,328 @@ namespace diesel
   }
   #endif
 
+  // The converters create the largest level of the thumbnail pyramid and the smaller levels are made from it
+  const size_t nThumbnailSize = nLargestThumbnailLevel;
+
+  // Set from the settings when the image load thread starts
+  std::atomic<THUMBNAIL_FORMAT> thumbnailFormat(THUMBNAIL_FORMAT::JPEG);
+
+  #ifndef __WIN__
+  // ** cGraphicsMagickBatchPool
+  //
+  // Long running "gm batch" processes that read one command per line on standard input and print the pass or fail text after each command
+  // A convert worker takes a process while it is converting an image and gives it back afterwards, so there is at most one process per convert worker
+  //
+
+  const std::string sGraphicsMagickBatchPass = "DIESEL_PASS";
+  const std::string sGraphicsMagickBatchFail = "DIESEL_FAIL";
+
+  class cGraphicsMagickBatchPool
+  {
+  public:
+    ~cGraphicsMagickBatchPool();
+
+    cPersistentProcess* Acquire(); // Returns nullptr if a gm batch process could not be started
+    void Release(cPersistentProcess* pProcess);
+    void Clear();
+
+  private:
+    std::mutex mutex;
+    std::vector<cPersistentProcess*> idle;
+  };
+
+  cGraphicsMagickBatchPool::~cGraphicsMagickBatchPool()
+  {
+    Clear();
+  }
+
+  cPersistentProcess* cGraphicsMagickBatchPool::Acquire()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!idle.empty()) {
+        cPersistentProcess* pProcess = idle.back();
+        idle.pop_back();
+        return pProcess;
+      }
+    }
+
+    std::vector<string_t> arguments;
+    arguments.push_back(cConverterBackends::Get().GetTool(CONVERTER_TOOL::GRAPHICSMAGICK).sPath);
+    arguments.push_back(TEXT("batch"));
+    arguments.push_back(TEXT("-echo"));
+    arguments.push_back(TEXT("off"));
+    arguments.push_back(TEXT("-escape"));
+    arguments.push_back(TEXT("unix"));
+    arguments.push_back(TEXT("-feedback"));
+    arguments.push_back(TEXT("on"));
+    arguments.push_back(TEXT("-pass"));
+    arguments.push_back(sGraphicsMagickBatchPass);
+    arguments.push_back(TEXT("-fail"));
+    arguments.push_back(sGraphicsMagickBatchFail);
+    arguments.push_back(TEXT("-")); // Read the commands from standard input
+
+    cPersistentProcess* pProcess = new cPersistentProcess;
+    if (!pProcess->Start(arguments)) {
+      LOG<<"cGraphicsMagickBatchPool::Acquire Failed to start gm batch, returning nullptr"<<std::endl;
+      spitfire::SAFE_DELETE(pProcess);
+      return nullptr;
+    }
+
+    return pProcess;
+  }
+
+  void cGraphicsMagickBatchPool::Release(cPersistentProcess* pProcess)
+  {
+    ASSERT(pProcess != nullptr);
+
+    // A process that was killed because its job was cancelled or timed out is not reused
+    if (!pProcess->IsRunning()) {
+      spitfire::SAFE_DELETE(pProcess);
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    idle.push_back(pProcess);
+  }
+
+  void cGraphicsMagickBatchPool::Clear()
+  {
+    std::vector<cPersistentProcess*> processes;
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      processes.swap(idle);
+    }
+
+    const size_t n = processes.size();
+    for (size_t i = 0; i < n; i++) spitfire::SAFE_DELETE(processes[i]);
+  }
+
+  cGraphicsMagickBatchPool graphicsMagickBatchPool;
+
+  // Quotes an argument for a gm batch command line with "-escape unix"
+  std::string QuoteGraphicsMagickBatchArgument(const string_t& sArgument)
+  {
+    std::string sQuoted = "\"";
+    const size_t n = sArgument.length();
+    for (size_t i = 0; i < n; i++) {
+      const char c = sArgument[i];
+      if ((c == '\\') || (c == '"')) sQuoted += '\\';
+      sQuoted += c;
+    }
+    sQuoted += "\"";
+    return sQuoted;
+  }
+
+  PROCESS_RESULT RunGraphicsMagickBatchJob(const std::vector<string_t>& arguments, size_t nTimeoutMS, spitfire::util::cProcessInterface& processInterface)
+  {
+    if (processInterface.IsToStop()) return PROCESS_RESULT::CANCELLED;
+
+    cPersistentProcess* pProcess = graphicsMagickBatchPool.Acquire();
+    if (pProcess == nullptr) return PROCESS_RESULT::ERROR_STARTING;
+
+    std::string sCommand;
+    const size_t n = arguments.size();
+    for (size_t i = 0; i < n; i++) {
+      if (i != 0) sCommand += " ";
+      sCommand += QuoteGraphicsMagickBatchArgument(arguments[i]);
+    }
+
+    pProcess->ClearStandardError();
+
+    // If the gm batch process has gone away we run gm for just this image instead, failing here would blame the image
+    PROCESS_RESULT result = PROCESS_RESULT::ERROR_STARTING;
+    if (pProcess->WriteLine(sCommand)) {
+      while (true) {
+        std::string sReply;
+        result = pProcess->ReadLine(sReply, nTimeoutMS, processInterface);
+        if (result != PROCESS_RESULT::SUCCESS) break;
+
+        if (sReply == sGraphicsMagickBatchPass) break;
+        else if (sReply == sGraphicsMagickBatchFail) {
+          LOG<<"RunGraphicsMagickBatchJob gm batch FAILED for "<<sCommand<<", standard error \""<<pProcess->GetStandardError()<<"\""<<std::endl;
+          result = PROCESS_RESULT::FAILED;
+          break;
+        }
+
+        // Ignore anything else that the command printed
+      }
+    }
+
+    graphicsMagickBatchPool.Release(pProcess);
+
+    return result;
+  }
+
+  CONVERSION_RESULT GetConversionResult(PROCESS_RESULT result)
+  {
+    if (result == PROCESS_RESULT::SUCCESS) return CONVERSION_RESULT::SUCCESS;
+
+    // Only a tool that ran and returned an error tells us that the file can't be converted, it may work next time if the tool timed out, was stopped or couldn't be started
+    return (result == PROCESS_RESULT::FAILED) ? CONVERSION_RESULT::INVALID_FILE : CONVERSION_RESULT::TEMPORARY_FAILURE;
+  }
+
+
+  // ** cWarmWineServer
+  //
+  // Each run of wine takes several seconds to start when there is no wineserver running, and the wineserver normally exits a few seconds after
+  // the last wine process, so while we are converting raw files we keep one running with "wineserver -f -p" (Stay in the foreground and don't exit
+  // when idle) and each run of the Adobe DNG Converter only pays for starting the converter itself
+  // NOTE: If the user already has a wineserver running for the prefix then ours exits straight away and theirs is used instead
+  //
+
+  class cWarmWineServer
+  {
+  public:
+    void Start();
+    void Stop();
+
+  private:
+    std::mutex mutex;
+    cPersistentProcess process;
+  };
+
+  void cWarmWineServer::Start()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (process.IsRunning()) return;
+
+    const cConverterTool& wineServer = cConverterBackends::Get().GetTool(CONVERTER_TOOL::WINESERVER);
+    if (!wineServer.bIsAvailable) return;
+
+    std::vector<string_t> arguments;
+    arguments.push_back(wineServer.sPath);
+    arguments.push_back(TEXT("-f"));
+    arguments.push_back(TEXT("-p"));
+    if (!process.Start(arguments)) LOG<<"cWarmWineServer::Start Failed to start wineserver"<<std::endl;
+  }
+
+  void cWarmWineServer::Stop()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (process.IsRunning()) process.Stop();
+  }
+
+  cWarmWineServer warmWineServer;
+  #endif
+
+  // How long each tool gets before we give up on it and kill it
+  const size_t nDNGConverterTimeoutMS = 120 * 1000;
+  const size_t nUFRawBatchTimeoutMS = 60 * 1000;
+  const size_t nDCRawTimeoutMS = 10 * 1000;
+  const size_t nConvertTimeoutMS = 30 * 1000;
+
+  // Entries are kept in two levels of shard folders named after the first characters of their cache keys, 256 * 256 folders keeps each folder to a few dozen files
+  // even in a cache with millions of entries
+  const size_t nCacheShardPrefixLength = 2;
+
+  // Listing folders is mostly waiting on the file system, particularly for network home folders, so the scan uses more threads than there are cores
+  const size_t nCacheScanThreads = 16;
+
   #ifdef __WIN__
   const string_t sFolderSeparator = TEXT("\\");
   #else
   const string_t sFolderSeparator = TEXT("/");
   #endif
 
-  class cFileAgeAndSize
+  // ** cCacheFolderContents
+  //
+  // What older versions left behind in the cache folder, found when the cache is migrated to shard folders and remembered in shards.txt
+  //
+
+  class cCacheFolderContents
   {
   public:
-    cFileAgeAndSize(const string_t& sFilePath, size_t nFileSizeBytes);
+    cCacheFolderContents();
 
-    string_t sFilePath;
-    size_t nFileSizeBytes;
+    bool bIsLegacyCacheEntriesFound; // Entries with an MD5 cache key
+    bool bIsThumbnailFilesFound; // Thumbnails that are not in the thumbnail pack
   };
 
-  cFileAgeAndSize::cFileAgeAndSize(const string_t& _sFilePath, size_t _nFileSizeBytes) :
-    sFilePath(_sFilePath),
-    nFileSizeBytes(_nFileSizeBytes)
+  cCacheFolderContents::cCacheFolderContents() :
+    bIsLegacyCacheEntriesFound(false),
+    bIsThumbnailFilesFound(false)
   {
   }
 
-  void cImageCacheManager::EnforceMaximumCacheSize(size_t nMaximumCacheSizeGB)
-  {
-    const string_t sCacheFolderPath = GetCacheFolderPath();
-
-    size_t nFolderSizeBytes = 0;
 
-    // Get a list of all the files in the cache folder sorted by
-    std::multimap<spitfire::util::cDateTime, cFileAgeAndSize*> files;
-    for (spitfire::filesystem::cFolderIterator iter(sCacheFolderPath); iter.IsValid(); iter.Next()) {
-      ASSERT(!iter.IsFolder());
-      const string_t sFilePath = iter.GetFullPath();
-      const spitfire::util::cDateTime dateTimeModified = spitfire::filesystem::GetLastModifiedDate(sFilePath);
-      const size_t nFileSizeBytes = spitfire::filesystem::GetFileSizeBytes(sFilePath);
+  // ** cCacheEntryAgeAndSize
+  //
+  // An entry that was found when scanning the cache folder to build the eviction index
+  //
 
-      files.insert(std::make_pair(dateTimeModified, new cFileAgeAndSize(sFilePath, nFileSizeBytes)));
+  class cCacheEntryAgeAndSize
+  {
+  public:
+    cCacheEntryAgeAndSize(const string_t& sCacheKey, IMAGE_SIZE imageSize, uint64_t nSizeBytes, int64_t createdSeconds);
 
-      nFolderSizeBytes += nFileSizeBytes;
-    }
+    string_t sCacheKey;
+    IMAGE_SIZE imageSize;
+    uint64_t nSizeBytes;
+    int64_t createdSeconds;
+  };
 
-    const size_t nMaximumCacheSizeBytes = nMaximumCacheSizeGB * 1024 * 1024 * 1024;
-    if (nFolderSizeBytes > nMaximumCacheSizeBytes) {
-      // Remove the last files until we have removed enough files to get below nMaximumCacheSizeGB * 1024
-      const size_t nDifferenceBytes = nFolderSizeBytes - nMaximumCacheSizeBytes;
-      size_t nDeletedBytes = 0;
-      std::multimap<spitfire::util::cDateTime, cFileAgeAndSize*>::const_iterator iter = files.begin();
-      const std::multimap<spitfire::util::cDateTime, cFileAgeAndSize*>::const_iterator iterEnd = files.end();
-      while (iter != iterEnd) {
-        cFileAgeAndSize* pEntry = iter->second;
-        spitfire::filesystem::DeleteFile(pEntry->sFilePath);
+  cCacheEntryAgeAndSize::cCacheEntryAgeAndSize(const string_t& _sCacheKey, IMAGE_SIZE _imageSize, uint64_t _nSizeBytes, int64_t _createdSeconds) :
+    sCacheKey(_sCacheKey),
+    imageSize(_imageSize),
+    nSizeBytes(_nSizeBytes),
+    createdSeconds(_createdSeconds)
+  {
+  }
 
-        // Break if we have now deleted enough bytes
-        nDeletedBytes += pEntry->nFileSizeBytes;
-        if (nDeletedBytes >= nDifferenceBytes) break;
 
-        iter++;
+  bool cImageCacheManager::EnforceMaximumCacheSize(size_t nMaximumCacheSizeGB, spitfire::util::cProcessInterface& processInterface)
+  {
+    cCacheEvictionIndex& evictionIndex = GetCacheEvictionIndex();
+    cThumbnailPack& thumbnailPack = GetThumbnailPack();
+
+    // The accesses since the last time are saved so that the order survives a crash
+    evictionIndex.SaveAccesses();
+
+    // The hit rate tells us whether the maximum cache size is too small
+    const uint64_t nMaximumCacheSizeBytes = uint64_t(nMaximumCacheSizeGB) * 1024 * 1024 * 1024;
+    LOG<<"cImageCacheManager::EnforceMaximumCacheSize Maximum cache size "<<nMaximumCacheSizeBytes<<" bytes"<<std::endl;
+    evictionIndex.LogStatistics();
+
+    // The index keeps a running total so we only have to look at the entries that we evict
+    size_t nEvicted = 0;
+    while (evictionIndex.GetTotalSizeBytes() > nMaximumCacheSizeBytes) {
+      if (processInterface.IsToStop()) return false;
+
+      string_t sCacheKey;
+      IMAGE_SIZE imageSize = IMAGE_SIZE::THUMBNAIL;
+      if (!evictionIndex.RemoveOldestEntry(sCacheKey, imageSize)) break;
+
+      // A thumbnail may still be in its own file if it couldn't be added to the pack
+      if ((imageSize != IMAGE_SIZE::THUMBNAIL) || !thumbnailPack.RemoveThumbnail(sCacheKey)) {
+        const string_t sFilePath = GetCacheFilePath(sCacheKey, imageSize);
+        if (spitfire::filesystem::FileExists(sFilePath)) spitfire::filesystem::DeleteFile(sFilePath);
       }
+
+      nEvicted++;
     }
 
-    // Delete the items
-    std::multimap<spitfire::util::cDateTime, cFileAgeAndSize*>::const_iterator iter = files.begin();
-    const std::multimap<spitfire::util::cDateTime, cFileAgeAndSize*>::const_iterator iterEnd = files.end();
-    while (iter != iterEnd) {
-      cFileAgeAndSize* pEntry = iter->second;
-      spitfire::SAFE_DELETE(pEntry);
+    if (nEvicted != 0) LOG<<"cImageCacheManager::EnforceMaximumCacheSize Evicted "<<nEvicted<<" entries"<<std::endl;
 
-      iter++;
-    }
+    // Reclaim the space used by the thumbnails that have been removed from the thumbnail pack
+    if (thumbnailPack.IsCompactRequired() && !thumbnailPack.Compact(processInterface) && processInterface.IsToStop()) return false;
+
+    return true;
   }
 
   void cImageCacheManager::ClearCache()
   {
+    // The thumbnail pack is opened again the next time that it is needed
+    GetThumbnailPack().Close();
+
     const string_t sCacheFolderPath = GetCacheFolderPath();
     if (spitfire::filesystem::DirectoryExists(sCacheFolderPath)) spitfire::filesystem::DeleteDirectory(sCacheFolderPath);
+
+    GetCacheEvictionIndex().Clear();
+
+    // Clearing the cache is also how the user can ask for failed files to be tried again
+    GetFailedConversionIndex().Clear();
   }
 
   string_t cImageCacheManager::GetCacheFolderPath()
@@ -223,291 +487,898 @@ namespace diesel
     spitfire::filesystem::CreateDirectory(sCacheFolder);
     ASSERT(spitfire::filesystem::DirectoryExists(sCacheFolder));
 
+    // Clean up after any instance that crashed part way through writing to the cache and move entries from older versions into the shard folders
+    static const bool bIsStaleTemporaryFilesDeleted = [&sCacheFolder]() {
+      DeleteStaleTemporaryFiles(sCacheFolder);
+      MigrateCacheToShardFolders(sCacheFolder);
+      return true;
+    }();
+    (void)bIsStaleTemporaryFilesDeleted;
+
     return sCacheFolder;
   }
 
-  #ifdef __WIN__
-  string_t cImageCacheManager::GetUFRawBatchPath()
+  string_t cImageCacheManager::GetCacheShardFolderPath(const string_t& sCacheFolderPath, const string_t& sCacheKey)
+  {
+    ASSERT(sCacheKey.length() >= 2 * nCacheShardPrefixLength);
+
+    const string_t sFirstShardFolderPath = spitfire::filesystem::MakeFilePath(sCacheFolderPath, sCacheKey.substr(0, nCacheShardPrefixLength));
+    return spitfire::filesystem::MakeFilePath(sFirstShardFolderPath, sCacheKey.substr(nCacheShardPrefixLength, nCacheShardPrefixLength));
+  }
+
+  void cImageCacheManager::CreateCacheShardFolderIfRequired(const string_t& sCacheFolderPath, const string_t& sCacheKey)
   {
-    const string_t sProgramFiles = spitfire::filesystem::GetProgramFilesDirectory();
-    const string_t sUFRawBin = spitfire::filesystem::MakeFilePath(sProgramFiles, TEXT("UFRaw"), TEXT("bin"));
-    const string_t sExecutablePath = spitfire::filesystem::MakeFilePath(sUFRawBin, TEXT("ufraw-batch.exe"));
-    return sExecutablePath;
+    const string_t sShardFolderPath = GetCacheShardFolderPath(sCacheFolderPath, sCacheKey);
+    if (spitfire::filesystem::DirectoryExists(sShardFolderPath)) return;
+
+    const string_t sFirstShardFolderPath = spitfire::filesystem::MakeFilePath(sCacheFolderPath, sCacheKey.substr(0, nCacheShardPrefixLength));
+    if (!spitfire::filesystem::DirectoryExists(sFirstShardFolderPath)) spitfire::filesystem::CreateDirectory(sFirstShardFolderPath);
+
+    spitfire::filesystem::CreateDirectory(sShardFolderPath);
+  }
+
+  string_t cImageCacheManager::GetCacheFilePath(const string_t& sCacheKey, IMAGE_SIZE imageSize)
+  {
+    ASSERT(!sCacheKey.empty());
+
+    const string_t sFileJPG = (imageSize == IMAGE_SIZE::THUMBNAIL) ? TEXT("thumbnail.jpg") : TEXT("full.jpg");
+
+    return spitfire::filesystem::MakeFilePath(GetCacheShardFolderPath(GetCacheFolderPath(), sCacheKey), sCacheKey + TEXT("_") + sFileJPG);
+  }
+
+  bool cImageCacheManager::ParseCacheFileName(const string_t& sFile, string_t& sCacheKey, IMAGE_SIZE& imageSize)
+  {
+    const size_t separator = sFile.find(TEXT('_'));
+    if ((separator == string_t::npos) || (separator < 2 * nCacheShardPrefixLength)) return false;
+
+    const string_t sSuffix = sFile.substr(separator);
+    if (sSuffix == TEXT("_thumbnail.jpg")) imageSize = IMAGE_SIZE::THUMBNAIL;
+    else if (sSuffix == TEXT("_full.jpg")) imageSize = IMAGE_SIZE::FULL;
+    else return false;
+
+    sCacheKey = sFile.substr(0, separator);
+    return true;
   }
 
-  string_t cImageCacheManager::GetConvertPath()
+  void cImageCacheManager::MigrateCacheToShardFolders(const string_t& sCacheFolderPath)
   {
-    // For some reason the 64 bit version installs into "Program Files" too
-    const string_t sProgramFiles = TEXT("C:\\Program Files\\");
-    for (spitfire::filesystem::cFolderIterator iter(sProgramFiles); iter.IsValid(); iter.Next()) {
-      if (spitfire::string::StartsWith(iter.GetFileOrFolder(), TEXT("ImageMagick"))) {
-        const string_t sImageMagickPath = iter.GetFullPath();
-        return spitfire::filesystem::MakeFilePath(sImageMagickPath, TEXT("convert.exe"));
+    // NOTE: This is called while the cache folder path is being initialised so everything here has to use sCacheFolderPath rather than GetCacheFolderPath
+    const string_t sShardsFilePath = spitfire::filesystem::MakeFilePath(sCacheFolderPath, TEXT("shards.txt"));
+    if (spitfire::filesystem::FileExists(sShardsFilePath)) return;
+
+    // Another instance may be migrating the cache at the same time, we wait for it to finish
+    cFileLock lock(spitfire::filesystem::MakeFilePath(sCacheFolderPath, TEXT("shards.lock")));
+    lock.Lock();
+    if (spitfire::filesystem::FileExists(sShardsFilePath)) return;
+
+    // Moving files while we iterate over the folder could skip or repeat files so we get the list first
+    std::vector<string_t> files;
+    for (spitfire::filesystem::cFolderIterator iter(sCacheFolderPath); iter.IsValid(); iter.Next()) {
+      if (!iter.IsFolder()) files.push_back(iter.GetFileOrFolder());
+    }
+
+    cCacheFolderContents contents;
+    size_t nMoved = 0;
+
+    std::vector<string_t>::const_iterator iter = files.begin();
+    const std::vector<string_t>::const_iterator iterEnd = files.end();
+    while (iter != iterEnd) {
+      const string_t& sFile = *iter;
+
+      string_t sCacheKey;
+      IMAGE_SIZE imageSize = IMAGE_SIZE::THUMBNAIL;
+      if (ParseCacheFileName(sFile, sCacheKey, imageSize)) {
+        if (IsLegacyCacheKey(sCacheKey)) contents.bIsLegacyCacheEntriesFound = true;
+        else if (imageSize == IMAGE_SIZE::THUMBNAIL) contents.bIsThumbnailFilesFound = true;
+
+        CreateCacheShardFolderIfRequired(sCacheFolderPath, sCacheKey);
+
+        const string_t sFilePath = spitfire::filesystem::MakeFilePath(sCacheFolderPath, sFile);
+        const string_t sShardFilePath = spitfire::filesystem::MakeFilePath(GetCacheShardFolderPath(sCacheFolderPath, sCacheKey), sFile);
+        if (spitfire::filesystem::MoveFile(sFilePath, sShardFilePath)) nMoved++;
+        else LOG<<"cImageCacheManager::MigrateCacheToShardFolders Failed to move \""<<sFilePath<<"\" to \""<<sShardFilePath<<"\""<<std::endl;
       }
+
+      iter++;
     }
 
-    return TEXT("");
+    LOG<<"cImageCacheManager::MigrateCacheToShardFolders Moved "<<nMoved<<" entries into shard folders"<<std::endl;
+
+    // The file marks the cache as migrated so we only list the top of the cache folder once
+    const string_t sTemporaryFilePath = GetTemporaryFilePath(sShardsFilePath);
+
+    {
+      std::ofstream file(sTemporaryFilePath.c_str(), std::ios::out | std::ios::trunc);
+      if (!file.good()) return;
+
+      if (contents.bIsLegacyCacheEntriesFound) file<<"legacy\n";
+      if (contents.bIsThumbnailFilesFound) file<<"thumbnailfiles\n";
+    }
+
+    PublishFile(sTemporaryFilePath, sShardsFilePath);
   }
-  #endif
 
-  string_t cImageCacheManager::GetAdobeDNGConverterPath()
+  cCacheKeyIndex& cImageCacheManager::GetCacheKeyIndex()
   {
-    #ifdef __WIN__
-    const string_t sProgramFiles = spitfire::filesystem::GetProgramFilesDirectory();
-    const string_t sExecutablePath = spitfire::filesystem::MakeFilePath(sProgramFiles, TEXT("Adobe"), TEXT("Adobe DNG Converter.exe"));
-    return sExecutablePath;
-    #else
-    return TEXT("C:\\Program Files (x86)\\Adobe\\Adobe DNG Converter.exe");
-    #endif
+    // NOTE: The index lives next to the cache folder rather than in it, the keys only depend on the source files so they are still valid after the cache has been cleared
+    static cCacheKeyIndex index(spitfire::filesystem::MakeFilePath(spitfire::filesystem::GetThisApplicationSettingsDirectory(), TEXT("cachekeys.txt")));
+    return index;
   }
 
-  #ifndef __WIN__
-  bool cImageCacheManager::IsWineInstalled()
+  string_t cImageCacheManager::GetCacheKeyForFile(const string_t& sFilePath)
+  {
+    // If we can't stat the file then we can't tell whether it has changed so we always calculate the key
+    cFileStat stat;
+    if (!GetFileStat(sFilePath, stat)) return CalculateCacheKeyForFile(sFilePath);
+
+    cCacheKeyIndex& index = GetCacheKeyIndex();
+    string_t sCacheKey = index.GetCacheKey(sFilePath, stat);
+    if (!sCacheKey.empty()) return sCacheKey;
+
+    sCacheKey = CalculateCacheKeyForFile(sFilePath);
+    if (sCacheKey.empty()) return TEXT("");
+
+    // Only remember the key if the file didn't change while we were reading it
+    cFileStat statAfter;
+    if (GetFileStat(sFilePath, statAfter) && (statAfter == stat)) index.SetCacheKey(sFilePath, stat, sCacheKey);
+
+    return sCacheKey;
+  }
+
+  cFailedConversionIndex& cImageCacheManager::GetFailedConversionIndex()
   {
-    const int iResult = system("which wine");
-    LOG<<"cImageCacheManager::IsWineInstalled returned "<<iResult<<std::endl;
-    return (iResult == 0);
+    static cFailedConversionIndex index(spitfire::filesystem::MakeFilePath(GetCacheFolderPath(), TEXT("failedconversions.txt")));
+    return index;
   }
-  #endif
 
-  #ifdef __WIN__
-  bool cImageCacheManager::IsAdobeDNGConverterInstalled()
+  bool cImageCacheManager::IsFailedConversion(const string_t& sFilePath, IMAGE_SIZE imageSize, const cFileStat& stat)
   {
-    const string_t sAdobeDNGConverterPath = GetAdobeDNGConverterPath();
-    const bool bExists = spitfire::filesystem::FileExists(sAdobeDNGConverterPath);
-    LOG<<"cImageCacheManager::IsAdobeDNGConverterInstalled returning "<<spitfire::string::ToString(bExists)<<std::endl;
-    return bExists;
+    return GetFailedConversionIndex().IsFailed(sFilePath, imageSize, stat, cConverterBackends::Get().GetToolsVersion());
   }
 
-  bool cImageCacheManager::IsUFRawBatchInstalled()
+  void cImageCacheManager::AddFailedConversion(const string_t& sFilePath, IMAGE_SIZE imageSize, const cFileStat& stat)
   {
-    const string_t sUFRawBatchPath = GetUFRawBatchPath();
-    const bool bExists = spitfire::filesystem::FileExists(sUFRawBatchPath);
-    LOG<<"cImageCacheManager::IsUFRawBatchInstalled returning "<<spitfire::string::ToString(bExists)<<std::endl;
-    return bExists;
+    LOG<<"cImageCacheManager::AddFailedConversion \""<<sFilePath<<"\" won't be tried again until it or the converter tools change"<<std::endl;
+    GetFailedConversionIndex().AddFailure(sFilePath, imageSize, stat, cConverterBackends::Get().GetToolsVersion());
   }
 
-  bool cImageCacheManager::IsConvertInstalled()
+  string_t cImageCacheManager::CalculateCacheKeyForFile(const string_t& sFilePath)
   {
-    const string_t sConvertPath = GetConvertPath();
-    const bool bExists = spitfire::filesystem::FileExists(sConvertPath);
-    LOG<<"cImageCacheManager::IsConvertInstalled returning "<<spitfire::string::ToString(bExists)<<std::endl;
-    return bExists;
+    return CalculateContentHashForFile(CONTENT_HASH::XXH64, sFilePath);
   }
-  #else
-  bool cImageCacheManager::IsUFRawBatchInstalled()
+
+  bool cImageCacheManager::IsLegacyCacheKey(const string_t& sCacheKey)
   {
-    const int iResult = system("which ufraw-batch");
-    LOG<<"cImageCacheManager::IsUFRawBatchInstalled returned "<<iResult<<std::endl;
-    return (iResult == 0);
+    // Older versions used the MD5 of the file which is twice as long as the keys that we use now
+    if (sCacheKey.length() != 32) return false;
+
+    return (sCacheKey.find_first_not_of(TEXT("0123456789abcdef")) == string_t::npos);
   }
 
-  bool cImageCacheManager::IsConvertInstalled()
+  const cCacheFolderContents& cImageCacheManager::GetCacheFolderContents()
   {
-    const int iResult = system("which convert");
-    LOG<<"cImageCacheManager::IsConvertInstalled returned "<<iResult<<std::endl;
-    return (iResult == 0);
+    // NOTE: This is only checked once, the first time that it is needed
+    // NOTE: Listing every shard folder would be too slow so we use what was found when the cache was migrated, until the cache is cleared
+    static const cCacheFolderContents contents = []() {
+      cCacheFolderContents contents;
+
+      std::ifstream file(spitfire::filesystem::MakeFilePath(GetCacheFolderPath(), TEXT("shards.txt")).c_str());
+
+      std::string sLine;
+      while (std::getline(file, sLine)) {
+        if (sLine == "legacy") contents.bIsLegacyCacheEntriesFound = true;
+        else if (sLine == "thumbnailfiles") contents.bIsThumbnailFilesFound = true;
+      }
+
+      return contents;
+    }();
+
+    return contents;
   }
-  #endif
 
-  string_t cImageCacheManager::GetOrCreateDNGForRawFile(const string_t& sRawFilePath)
+  cCachedImage cImageCacheManager::GetLegacyCachedImage(const string_t& sSourceFilePath, const string_t& sCacheKey, IMAGE_SIZE imageSize)
   {
-    LOG<<"cImageCacheManager::GetOrCreateDNGForRawFile \""<<sRawFilePath<<"\""<<std::endl;
+    if (IsLegacyCacheKey(sCacheKey) || !GetCacheFolderContents().bIsLegacyCacheEntriesFound) return cCachedImage();
 
-    ASSERT(spitfire::filesystem::FileExists(sRawFilePath));
+    // Calculating the MD5 is still much quicker than running a converter
+    const string_t sLegacyCacheKey = CalculateContentHashForFile(CONTENT_HASH::MD5, sSourceFilePath);
+    if (sLegacyCacheKey.empty()) return cCachedImage();
 
-    #ifndef __WIN__
-    if (!IsWineInstalled()) {
-      LOG<<"cImageCacheManager::GetOrCreateDNGForRawFile wine is not installed, returning \"\""<<std::endl;
-      return TEXT("");
+    const string_t sLegacyFilePathJPG = GetCacheFilePath(sLegacyCacheKey, imageSize);
+    if (!spitfire::filesystem::FileExists(sLegacyFilePathJPG)) return cCachedImage();
+
+    if (imageSize == IMAGE_SIZE::THUMBNAIL) {
+      GetCacheEvictionIndex().RemoveEntry(sLegacyCacheKey, imageSize);
+      return AddThumbnailFileToPack(sCacheKey, sLegacyFilePathJPG);
     }
-    #endif
 
+    // Move the cached image over to the new key so that we don't have to do this again
+    CreateCacheShardFolderIfRequired(GetCacheFolderPath(), sCacheKey);
+
+    cCachedImage cachedImage;
+    cachedImage.sFilePath = GetCacheFilePath(sCacheKey, imageSize);
+    if (!spitfire::filesystem::MoveFile(sLegacyFilePathJPG, cachedImage.sFilePath)) {
+      cachedImage.sFilePath = sLegacyFilePathJPG;
+      return cachedImage;
+    }
+
+    LOG<<"cImageCacheManager::GetLegacyCachedImage Moved \""<<sLegacyFilePathJPG<<"\" to \""<<cachedImage.sFilePath<<"\""<<std::endl;
+
+    cCacheEvictionIndex& evictionIndex = GetCacheEvictionIndex();
+    evictionIndex.RemoveEntry(sLegacyCacheKey, imageSize);
+
+    cFileStat stat;
+    if (GetFileStat(cachedImage.sFilePath, stat)) evictionIndex.AddEntry(sCacheKey, imageSize, stat.nSizeBytes, stat.modifiedSeconds);
+
+    return cachedImage;
+  }
+
+  cThumbnailPack& cImageCacheManager::GetThumbnailPack()
+  {
+    static cThumbnailPack thumbnailPack(GetCacheFolderPath());
+    return thumbnailPack;
+  }
+
+  cCacheEvictionIndex& cImageCacheManager::GetCacheEvictionIndex()
+  {
+    static cCacheEvictionIndex index(spitfire::filesystem::MakeFilePath(GetCacheFolderPath(), TEXT("evictionindex.txt")));
+
+    // NOTE: The cache is only scanned if there is no index yet, after that the index is kept up to date as entries are added and removed
+    static const bool bIsLoaded = []() {
+      if (!index.Load()) BuildCacheEvictionIndex(index);
+      return true;
+    }();
+    (void)bIsLoaded;
+
+    return index;
+  }
+
+  void cImageCacheManager::BuildCacheEvictionIndex(cCacheEvictionIndex& index)
+  {
+    LOG<<"cImageCacheManager::BuildCacheEvictionIndex Scanning the cache folder"<<std::endl;
+
+    cThumbnailPack& thumbnailPack = GetThumbnailPack();
+
+    std::vector<string_t> shardFolderPaths;
+
+    for (spitfire::filesystem::cFolderIterator iter(GetCacheFolderPath()); iter.IsValid(); iter.Next()) {
+      const string_t sFile = iter.GetFileOrFolder();
+      const string_t sFilePath = iter.GetFullPath();
+
+      // Pack files from an older generation are left over from an index that was lost
+      if (cThumbnailPack::IsPackFile(sFile)) {
+        if (!thumbnailPack.IsInUse(sFile)) spitfire::filesystem::DeleteFile(sFilePath);
+        continue;
+      }
+
+      // The tmp and locks folders are skipped, shard folders are always named with hex digits
+      if (iter.IsFolder() && (sFile.length() == nCacheShardPrefixLength) && (sFile.find_first_not_of(TEXT("0123456789abcdef")) == string_t::npos)) shardFolderPaths.push_back(sFilePath);
+    }
+
+    // Each thread scans whole shard folders into its own list so that they don't have to share anything
+    const size_t nShards = shardFolderPaths.size();
+    std::vector<std::vector<cCacheEntryAgeAndSize>> shardEntries(nShards);
+
+    std::atomic<size_t> nextShard(0);
+    auto ScanShards = [&]() {
+      while (true) {
+        const size_t i = nextShard++;
+        if (i >= nShards) break;
+
+        for (spitfire::filesystem::cFolderIterator iterShard(shardFolderPaths[i]); iterShard.IsValid(); iterShard.Next()) {
+          if (!iterShard.IsFolder()) continue;
+
+          for (spitfire::filesystem::cFolderIterator iterFile(iterShard.GetFullPath()); iterFile.IsValid(); iterFile.Next()) {
+            string_t sCacheKey;
+            IMAGE_SIZE imageSize = IMAGE_SIZE::THUMBNAIL;
+            if (!ParseCacheFileName(iterFile.GetFileOrFolder(), sCacheKey, imageSize)) continue;
+
+            cFileStat stat;
+            if (GetFileStat(iterFile.GetFullPath(), stat)) shardEntries[i].push_back(cCacheEntryAgeAndSize(sCacheKey, imageSize, stat.nSizeBytes, stat.modifiedSeconds));
+          }
+        }
+      }
+    };
+
+    const size_t nThreads = std::min(nCacheScanThreads, nShards);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < nThreads; i++) threads.push_back(std::thread(ScanShards));
+
+    ScanShards();
+
+    const size_t n = threads.size();
+    for (size_t i = 0; i < n; i++) threads[i].join();
+
+    std::vector<cCacheEntryAgeAndSize> entries;
+    for (size_t i = 0; i < nShards; i++) entries.insert(entries.end(), shardEntries[i].begin(), shardEntries[i].end());
+
+    std::vector<cThumbnailPackEntry> thumbnails;
+    thumbnailPack.GetEntries(thumbnails);
+
+    {
+      std::vector<cThumbnailPackEntry>::const_iterator iter = thumbnails.begin();
+      const std::vector<cThumbnailPackEntry>::const_iterator iterEnd = thumbnails.end();
+      while (iter != iterEnd) {
+        entries.push_back(cCacheEntryAgeAndSize(iter->sCacheKey, IMAGE_SIZE::THUMBNAIL, iter->nSizeBytes, iter->createdSeconds));
+
+        iter++;
+      }
+    }
+
+    // We don't know when the entries were last used so we add them oldest first, which evicts the oldest entries first
+    std::stable_sort(entries.begin(), entries.end(), [](const cCacheEntryAgeAndSize& lhs, const cCacheEntryAgeAndSize& rhs) { return (lhs.createdSeconds < rhs.createdSeconds); });
+
+    std::vector<cCacheEntryAgeAndSize>::const_iterator iter = entries.begin();
+    const std::vector<cCacheEntryAgeAndSize>::const_iterator iterEnd = entries.end();
+    while (iter != iterEnd) {
+      index.AddEntry(iter->sCacheKey, iter->imageSize, iter->nSizeBytes, iter->createdSeconds);
+
+      iter++;
+    }
+
+    LOG<<"cImageCacheManager::BuildCacheEvictionIndex Found "<<index.GetTotalSizeBytes()<<" bytes"<<std::endl;
+  }
+
+  cCachedImage cImageCacheManager::AddThumbnailFileToPack(const string_t& sCacheKey, const string_t& sFilePathJPG)
+  {
+    cCachedImage cachedImage;
+
+    std::vector<uint8_t> data;
+
+    {
+      std::ifstream file(sFilePathJPG.c_str(), std::ios::in | std::ios::binary | std::ios::ate);
+      if (!file.good()) return cachedImage;
+
+      data.resize(size_t(file.tellg()));
+      file.seekg(0);
+      file.read(reinterpret_cast<char*>(data.data()), std::streamsize(data.size()));
+      if (data.empty() || (size_t(file.gcount()) != data.size())) return cachedImage;
+    }
+
+    const size_t nFileSizeBytes = data.size();
+
+    // Make the smaller levels of the pyramid and decode the thumbnail once here rather than every time that it is loaded
+    std::vector<uint8_t> pyramid;
+    if (EncodeThumbnailPyramid(thumbnailFormat, data, pyramid)) data.swap(pyramid);
+    else LOG<<"cImageCacheManager::AddThumbnailFileToPack Failed to create the pyramid for \""<<sFilePathJPG<<"\", keeping the jpeg"<<std::endl;
+
+    cachedImage.thumbnail = GetThumbnailPack().AddThumbnail(sCacheKey, data);
+
+    // The eviction index counts the bytes that the entry takes up on disk, the pyramid in the pack or the jpeg as it came from the converter
+    size_t nSizeBytes = data.size();
+
+    if (cachedImage.thumbnail.IsValid()) spitfire::filesystem::DeleteFile(sFilePathJPG);
+    else {
+      // If the pack can't be written to then we can still use the file, files from the converters have to be moved out of the tmp folder first
+      const string_t sCacheFilePathJPG = GetCacheFilePath(sCacheKey, IMAGE_SIZE::THUMBNAIL);
+      if (sFilePathJPG != sCacheFilePathJPG) {
+        CreateCacheShardFolderIfRequired(GetCacheFolderPath(), sCacheKey);
+        if (!PublishFile(sFilePathJPG, sCacheFilePathJPG)) return cachedImage;
+      }
+
+      cachedImage.sFilePath = sCacheFilePathJPG;
+      nSizeBytes = nFileSizeBytes;
+    }
+
+    GetCacheEvictionIndex().AddEntry(sCacheKey, IMAGE_SIZE::THUMBNAIL, nSizeBytes, int64_t(std::time(nullptr)));
+
+    return cachedImage;
+  }
+
+  cCachedImage cImageCacheManager::GetCachedImage(const string_t& sCacheKey, IMAGE_SIZE imageSize)
+  {
+    const cCachedImage cachedImage = FindCachedImage(sCacheKey, imageSize);
+
+    // Misses are counted when the image is created, the source file is used directly for some images so they are never cached
+    if (cachedImage.IsValid()) GetCacheEvictionIndex().RecordLookup(sCacheKey, imageSize, true);
+
+    return cachedImage;
+  }
+
+  cCachedImage cImageCacheManager::FindCachedImage(const string_t& sCacheKey, IMAGE_SIZE imageSize)
+  {
+    cCachedImage cachedImage;
+
+    if (imageSize == IMAGE_SIZE::THUMBNAIL) {
+      cachedImage.thumbnail = GetThumbnailPack().GetThumbnail(sCacheKey);
+      if (cachedImage.thumbnail.IsValid()) return cachedImage;
+
+      // Older versions kept each thumbnail in its own file, they are moved into the pack as they are found
+      if (GetCacheFolderContents().bIsThumbnailFilesFound) {
+        const string_t sFilePathJPG = GetCacheFilePath(sCacheKey, imageSize);
+        if (spitfire::filesystem::FileExists(sFilePathJPG)) return AddThumbnailFileToPack(sCacheKey, sFilePathJPG);
+      }
+
+      return cachedImage;
+    }
+
+    const string_t sFilePathJPG = GetCacheFilePath(sCacheKey, imageSize);
+    if (spitfire::filesystem::FileExists(sFilePathJPG)) cachedImage.sFilePath = sFilePathJPG;
+
+    return cachedImage;
+  }
+
+  bool cImageCacheManager::LoadCachedImage(const cCachedImage& cachedImage, size_t nThumbnailSizePixels, voodoo::cImage& image)
+  {
+    ASSERT(cachedImage.IsValid());
+
+    // Thumbnails are decoded straight out of the mapped thumbnail pack
+    if (cachedImage.thumbnail.IsValid()) {
+      const uint8_t* pData = nullptr;
+      size_t nSizeBytes = 0;
+      GetThumbnailPyramidLevel(cachedImage.thumbnail.GetData(), cachedImage.thumbnail.GetSizeBytes(), nThumbnailSizePixels, pData, nSizeBytes);
+
+      // The pack can have a mix of formats if the setting has been changed
+      if (IsEncodedThumbnail(pData, nSizeBytes)) return DecodeThumbnail(pData, nSizeBytes, image);
+
+      return LoadImageFromMemory(pData, nSizeBytes, image);
+    }
+
+    image.LoadFromFile(cachedImage.sFilePath);
+    return image.IsValid();
+  }
+
+  bool cImageCacheManager::IsJPEGFile(const string_t& sFilePath)
+  {
+    std::ifstream file(sFilePath.c_str(), std::ios::in | std::ios::binary);
+    if (!file.good()) return false;
+
+    unsigned char signature[2] = { 0, 0 };
+    file.read(reinterpret_cast<char*>(signature), sizeof(signature));
+    return (file.gcount() == sizeof(signature)) && (signature[0] == 0xFF) && (signature[1] == 0xD8);
+  }
+
+  CONVERSION_RESULT cImageCacheManager::RunTool(const std::vector<string_t>& arguments, const string_t& sStandardOutputFilePath, size_t nTimeoutMS, spitfire::util::cProcessInterface& processInterface)
+  {
     #ifdef __WIN__
-    // TODO: Use the actual dng sdk instead?
+    // NOTE: Once RunCommandLine has started the tool it can't be cancelled, and we don't get its exit code so the output file is all we have to go on
+    (void)nTimeoutMS;
+    ASSERT(sStandardOutputFilePath.empty());
+    if (processInterface.IsToStop()) return CONVERSION_RESULT::TEMPORARY_FAILURE;
+
+    ostringstream_t o;
+    const size_t n = arguments.size();
+    for (size_t i = 0; i < n; i++) {
+      if (i != 0) o<<" ";
+      o<<"\""<<arguments[i]<<"\"";
+    }
+    const string_t sCommandLine = o.str();
+    LOG<<"cImageCacheManager::RunTool Running command line \""<<sCommandLine<<"\""<<std::endl;
+    RunCommandLine(sCommandLine);
+    return CONVERSION_RESULT::SUCCESS;
     #else
-    // TODO: Use the actual dng sdk like this instead?
-    // https://projects.kde.org/projects/extragear/graphics/kipi-plugins/repository/revisions/master/show/dngconverter
-    #endif
+    LOG<<"cImageCacheManager::RunTool Running "<<cProcessRunner::GetCommandLine(arguments)<<std::endl;
 
-    const string_t sFolder = spitfire::filesystem::GetFolder(sRawFilePath);
-    const string_t sFile = spitfire::filesystem::GetFileNoExtension(sRawFilePath);
-    const string_t sDNGFilePath = spitfire::filesystem::MakeFilePath(sFolder, sFile + TEXT(".dng"));
+    cProcessRunner runner;
+    runner.SetTimeoutMS(nTimeoutMS);
+    if (!sStandardOutputFilePath.empty()) runner.SetStandardOutputFilePath(sStandardOutputFilePath);
+    return GetConversionResult(runner.Run(arguments, processInterface));
+    #endif
+  }
 
-    ostringstream_t o;
+  CONVERSION_RESULT cImageCacheManager::RunGraphicsMagickTool(const std::vector<string_t>& arguments, size_t nTimeoutMS, spitfire::util::cProcessInterface& processInterface)
+  {
     #ifndef __WIN__
-    o<<"wine ";
+    // Send the command to a gm batch process that is already running, leaving out the path to gm
+    const std::vector<string_t> batchArguments(arguments.begin() + 1, arguments.end());
+    const PROCESS_RESULT result = RunGraphicsMagickBatchJob(batchArguments, nTimeoutMS, processInterface);
+    if (result != PROCESS_RESULT::ERROR_STARTING) return GetConversionResult(result);
+
+    // We couldn't start gm batch so we run gm for just this image instead
     #endif
-    const string_t sExecutablePath = GetAdobeDNGConverterPath();
-    o<<"\""<<sExecutablePath<<"\" -c \""<<sRawFilePath<<"\"";
-    #ifndef BUILD_DEBUG
-    o<<" &> /dev/null";
+
+    return RunTool(arguments, TEXT(""), nTimeoutMS, processInterface);
+  }
+
+  void cImageCacheManager::SetThumbnailFormat(THUMBNAIL_FORMAT format)
+  {
+    thumbnailFormat = format;
+  }
+
+  void cImageCacheManager::StopConverterWorkers()
+  {
+    #ifndef __WIN__
+    graphicsMagickBatchPool.Clear();
+    warmWineServer.Stop();
     #endif
-    const string_t sCommandLine = o.str();
-    LOG<<"cImageCacheManager::GetOrCreateDNGForRawFile Running command line \""<<sCommandLine<<"\""<<std::endl;
+  }
+
+  void cImageCacheManager::DeletePartialFile(const string_t& sFilePath)
+  {
+    // A tool that was killed or failed part way through may have left a partial file behind which we would otherwise mistake for a finished one
+    if (spitfire::filesystem::FileExists(sFilePath)) spitfire::filesystem::DeleteFile(sFilePath);
+  }
+
+  string_t cImageCacheManager::GetDNGFilePathForRawFile(const string_t& sRawFilePath)
+  {
+    const string_t sFolder = spitfire::filesystem::GetFolder(sRawFilePath);
+    const string_t sFile = spitfire::filesystem::GetFileNoExtension(sRawFilePath);
+    return spitfire::filesystem::MakeFilePath(sFolder, sFile + TEXT(".dng"));
+  }
+
+  CONVERSION_RESULT cImageCacheManager::RunAdobeDNGConverter(const std::vector<string_t>& rawFilePaths, spitfire::util::cProcessInterface& processInterface)
+  {
+    ASSERT(!rawFilePaths.empty());
+
+    const cConverterBackends& backends = cConverterBackends::Get();
+
     #ifdef __WIN__
-    RunCommandLine(sCommandLine);
-    if (!spitfire::filesystem::FileExists(sDNGFilePath)) {
-      LOG<<"cImageCacheManager::GetOrCreateDNGForRawFile \""<<sCommandLine<<"\" FAILED, returning \"\""<<std::endl;
-      return TEXT("");
-    }
+    // TODO: Use the actual dng sdk instead?
     #else
-    const int iResult = system(sCommandLine.c_str());
-    if (iResult != 0) {
-      LOG<<"cImageCacheManager::GetOrCreateDNGForRawFile \""<<sCommandLine<<"\" returned "<<iResult<<", returning \"\""<<std::endl;
-      return TEXT("");
-    }
+    // TODO: Use the actual dng sdk like this instead?
+    // https://projects.kde.org/projects/extragear/graphics/kipi-plugins/repository/revisions/master/show/dngconverter
     #endif
 
-    return sDNGFilePath;
+    // The converter takes any number of files, each dng is written next to its raw file
+    std::vector<string_t> arguments;
+    #ifndef __WIN__
+    arguments.push_back(backends.GetTool(CONVERTER_TOOL::WINE).sPath);
+    #endif
+    arguments.push_back(backends.GetTool(CONVERTER_TOOL::ADOBE_DNG_CONVERTER).sPath);
+    arguments.push_back(TEXT("-c"));
+    arguments.insert(arguments.end(), rawFilePaths.begin(), rawFilePaths.end());
+
+    return RunTool(arguments, TEXT(""), nDNGConverterTimeoutMS * rawFilePaths.size(), processInterface);
   }
 
-  string_t cImageCacheManager::GetOrCreateThumbnailForDNGFile(const string_t& sDNGFilePath, IMAGE_SIZE imageSize)
+  void cImageCacheManager::GetOrCreateDNGsForRawFiles(const std::vector<string_t>& rawFilePaths, std::vector<string_t>& dngFilePaths, std::vector<CONVERSION_RESULT>& results, spitfire::util::cProcessInterface& processInterface)
   {
-    LOG<<"cImageCacheManager::GetOrCreateThumbnailForDNGFile \""<<sDNGFilePath<<"\""<<std::endl;
+    LOG<<"cImageCacheManager::GetOrCreateDNGsForRawFiles "<<rawFilePaths.size()<<" files"<<std::endl;
 
-    ASSERT(spitfire::filesystem::FileExists(sDNGFilePath));
+    const size_t n = rawFilePaths.size();
+    dngFilePaths.assign(n, TEXT(""));
+    results.assign(n, CONVERSION_RESULT::TEMPORARY_FAILURE);
+
+    const cConverterBackends& backends = cConverterBackends::Get();
+    if (!backends.IsAdobeDNGConverterAvailable()) {
+      LOG<<"cImageCacheManager::GetOrCreateDNGsForRawFiles Adobe DNG Converter is not available, returning"<<std::endl;
+      return;
+    }
 
-    if (!IsUFRawBatchInstalled()) {
-      LOG<<"cImageCacheManager::GetOrCreateThumbnailForDNGFile ufraw-batch is not installed, returning \"\""<<std::endl;
-      return TEXT("");
+    // Only the files that don't have a dng yet are converted
+    std::vector<size_t> convert;
+    std::vector<string_t> convertFilePaths;
+    for (size_t i = 0; i < n; i++) {
+      ASSERT(spitfire::filesystem::FileExists(rawFilePaths[i]));
+
+      const string_t sDNGFilePath = GetDNGFilePathForRawFile(rawFilePaths[i]);
+      if (spitfire::filesystem::FileExists(sDNGFilePath)) {
+        dngFilePaths[i] = sDNGFilePath;
+        results[i] = CONVERSION_RESULT::SUCCESS;
+      } else {
+        convert.push_back(i);
+        convertFilePaths.push_back(rawFilePaths[i]);
+      }
     }
 
-    spitfire::algorithm::cMD5 md5;
-    md5.CalculateForFile(sDNGFilePath);
+    if (convert.empty()) return;
 
-    const string_t sCacheFolder = GetCacheFolderPath();
+    #ifndef __WIN__
+    warmWineServer.Start();
+    #endif
 
-    string_t sFileJPG = TEXT("full.jpg");
-    size_t size = 0;
+    const size_t nConvert = convert.size();
+    const CONVERSION_RESULT result = RunAdobeDNGConverter(convertFilePaths, processInterface);
+    if (result == CONVERSION_RESULT::SUCCESS) {
+      for (size_t i = 0; i < nConvert; i++) results[convert[i]] = CONVERSION_RESULT::SUCCESS;
+    } else {
+      // We don't know how far the converter got so any of the dngs could be partial
+      for (size_t i = 0; i < nConvert; i++) DeletePartialFile(GetDNGFilePathForRawFile(convertFilePaths[i]));
+
+      if (processInterface.IsToStop()) return;
+
+      if (nConvert == 1) results[convert[0]] = result;
+      else {
+        // A single bad file can fail the whole run so we convert each file on its own to find out which ones actually fail
+        LOG<<"cImageCacheManager::GetOrCreateDNGsForRawFiles Adobe DNG Converter FAILED for a batch of "<<nConvert<<" files, converting them one at a time"<<std::endl;
+        for (size_t i = 0; i < nConvert; i++) {
+          if (processInterface.IsToStop()) break;
+
+          const std::vector<string_t> single(1, convertFilePaths[i]);
+          results[convert[i]] = RunAdobeDNGConverter(single, processInterface);
+          if (results[convert[i]] != CONVERSION_RESULT::SUCCESS) DeletePartialFile(GetDNGFilePathForRawFile(convertFilePaths[i]));
+        }
+      }
+    }
 
-    switch (imageSize) {
-      case IMAGE_SIZE::THUMBNAIL: {
-        sFileJPG = TEXT("thumbnail.jpg");
-        size = 200;
-        break;
+    for (size_t i = 0; i < n; i++) {
+      if (!dngFilePaths[i].empty()) continue;
+
+      const string_t sDNGFilePath = GetDNGFilePathForRawFile(rawFilePaths[i]);
+      if (spitfire::filesystem::FileExists(sDNGFilePath)) dngFilePaths[i] = sDNGFilePath;
+      else {
+        LOG<<"cImageCacheManager::GetOrCreateDNGsForRawFiles Adobe DNG Converter FAILED for \""<<rawFilePaths[i]<<"\""<<std::endl;
+
+        // The converter said that it succeeded but didn't write a dng for this file
+        if (results[i] == CONVERSION_RESULT::SUCCESS) results[i] = CONVERSION_RESULT::INVALID_FILE;
       }
     }
+  }
 
-    const string_t sFilePathJPG = spitfire::filesystem::MakeFilePath(sCacheFolder, md5.GetResultFormatted() + TEXT("_") + sFileJPG);
-    if (spitfire::filesystem::FileExists(sFilePathJPG)) return sFilePathJPG;
+  CONVERSION_RESULT cImageCacheManager::CreateImageWithUFRaw(const string_t& sDNGFilePath, const string_t& sFilePathJPG, IMAGE_SIZE imageSize, spitfire::util::cProcessInterface& processInterface)
+  {
+    const size_t size = (imageSize == IMAGE_SIZE::THUMBNAIL) ? nThumbnailSize : 0;
 
-    const string_t sFolderJPG = spitfire::filesystem::GetFolder(sFilePathJPG);
+    // ufraw-batch names its output after the dng so it gets a folder of its own, another job may be converting a dng with the same name from another folder
+    const string_t sFolderJPG = sFilePathJPG + TEXT(".ufraw");
+    spitfire::filesystem::CreateDirectory(sFolderJPG);
 
     const string_t sFileUFRawEmbeddedJPG = spitfire::filesystem::GetFileNoExtension(sDNGFilePath) + TEXT(".embedded.jpg");
     const string_t sFilePathUFRawEmbeddedJPG = spitfire::filesystem::MakeFilePath(sFolderJPG, sFileUFRawEmbeddedJPG);
     const string_t sFileUFRawJPG = spitfire::filesystem::GetFileNoExtension(sDNGFilePath) + TEXT(".jpg");
     const string_t sFilePathUFRawJPG = spitfire::filesystem::MakeFilePath(sFolderJPG, sFileUFRawJPG);
 
-    ostringstream_t o;
-    #ifdef __WIN__
-    o<<"\""<<GetUFRawBatchPath()<<"\"";
-    #else
-    o<<"ufraw-batch";
-    #endif
-    o<<" --out-type=jpg";
-    if (size != 0) o<<" --embedded-image --size="<<size;
-    o<<" \""<<sDNGFilePath<<"\" --overwrite --out-path=\""<<spitfire::string::StripTrailing(sFolderJPG, sFolderSeparator)<<"\"";
+    std::vector<string_t> arguments;
+    arguments.push_back(cConverterBackends::Get().GetTool(CONVERTER_TOOL::UFRAW).sPath);
+    arguments.push_back(TEXT("--out-type=jpg"));
+    if (size != 0) {
+      arguments.push_back(TEXT("--embedded-image"));
+      arguments.push_back(TEXT("--size=") + spitfire::string::ToString(size));
+    }
+    arguments.push_back(sDNGFilePath);
+    arguments.push_back(TEXT("--overwrite"));
+    arguments.push_back(TEXT("--out-path=") + spitfire::string::StripTrailing(sFolderJPG, sFolderSeparator));
     #ifndef BUILD_DEBUG
-    o<<" --silent";
+    arguments.push_back(TEXT("--silent"));
     #endif
-    const string_t sCommandLine = o.str();
-    LOG<<"cImageCacheManager::GetOrCreateThumbnailForDNGFile Running command line \""<<sCommandLine<<"\""<<std::endl;
-    #ifdef __WIN__
-    RunCommandLine(sCommandLine);
-    #else
-    const int iResult = system(sCommandLine.c_str());
-    if (iResult != 0) {
-      LOG<<"cImageCacheManager::GetOrCreateThumbnailForDNGFile ufraw-batch returned "<<iResult<<" for \""<<sCommandLine<<"\", returning \"\""<<std::endl;
-      return TEXT("");
+    const CONVERSION_RESULT result = RunTool(arguments, TEXT(""), nUFRawBatchTimeoutMS, processInterface);
+    if (result != CONVERSION_RESULT::SUCCESS) {
+      LOG<<"cImageCacheManager::CreateImageWithUFRaw ufraw-batch FAILED for \""<<sDNGFilePath<<"\", returning the failure"<<std::endl;
+      spitfire::filesystem::DeleteDirectory(sFolderJPG);
+      return result;
     }
-    #endif
 
     if (!spitfire::filesystem::FileExists(sFilePathUFRawEmbeddedJPG) && !spitfire::filesystem::FileExists(sFilePathUFRawJPG)) {
-      LOG<<"cImageCacheManager::GetOrCreateThumbnailForDNGFile ufraw-batch FAILED for \""<<sCommandLine<<"\", embedded file \""<<sFilePathUFRawEmbeddedJPG<<"\" and file \""<<sFilePathUFRawJPG<<"\" were not found, returning \"\""<<std::endl;
-      return TEXT("");
+      LOG<<"cImageCacheManager::CreateImageWithUFRaw ufraw-batch FAILED for \""<<sDNGFilePath<<"\", embedded file \""<<sFilePathUFRawEmbeddedJPG<<"\" and file \""<<sFilePathUFRawJPG<<"\" were not found, returning INVALID_FILE"<<std::endl;
+      spitfire::filesystem::DeleteDirectory(sFolderJPG);
+      return CONVERSION_RESULT::INVALID_FILE;
     }
 
     // ufraw-batch doesn't respect the output folder if we provide our own output filename, so we have to rename the file after it is converted
-    const string_t sNameJPG = spitfire::filesystem::GetFileNoExtension(sFilePathJPG);
 
     // Try to rename from file.embedded.jpg to abcdefghi_file.jpg
-    LOG<<"cImageCacheManager::GetOrCreateThumbnailForDNGFile Looking for \""<<sFilePathUFRawEmbeddedJPG<<"\""<<std::endl;
+    LOG<<"cImageCacheManager::CreateImageWithUFRaw Looking for \""<<sFilePathUFRawEmbeddedJPG<<"\""<<std::endl;
     if (spitfire::filesystem::FileExists(sFilePathUFRawEmbeddedJPG)) {
       if (!spitfire::filesystem::MoveFile(sFilePathUFRawEmbeddedJPG, sFilePathJPG)) {
-        LOG<<"cImageCacheManager::GetOrCreateThumbnailForDNGFile Failed to move the file from \""<<sFilePathUFRawEmbeddedJPG<<"\" to \""<<sFilePathJPG<<"\""<<std::endl;
+        LOG<<"cImageCacheManager::CreateImageWithUFRaw Failed to move the file from \""<<sFilePathUFRawEmbeddedJPG<<"\" to \""<<sFilePathJPG<<"\""<<std::endl;
       }
     }
 
     // Try to rename from file.jpg to abcdefghi_file.jpg
-    LOG<<"cImageCacheManager::GetOrCreateThumbnailForDNGFile Looking for \""<<sFilePathUFRawJPG<<"\""<<std::endl;
+    LOG<<"cImageCacheManager::CreateImageWithUFRaw Looking for \""<<sFilePathUFRawJPG<<"\""<<std::endl;
     if (spitfire::filesystem::FileExists(sFilePathUFRawJPG)) {
       if (!spitfire::filesystem::MoveFile(sFilePathUFRawJPG, sFilePathJPG)) {
-        LOG<<"cImageCacheManager::GetOrCreateThumbnailForDNGFile Failed to move the file from \""<<sFilePathUFRawJPG<<"\" to \""<<sFilePathJPG<<"\""<<std::endl;
+        LOG<<"cImageCacheManager::CreateImageWithUFRaw Failed to move the file from \""<<sFilePathUFRawJPG<<"\" to \""<<sFilePathJPG<<"\""<<std::endl;
       }
     }
 
-    if (!spitfire::filesystem::FileExists(sFilePathJPG)) {
-      LOG<<"cImageCacheManager::GetOrCreateThumbnailForDNGFile Failed to create the thumbnail image \""<<sFilePathJPG<<"\", returning \"\""<<std::endl;
-      return TEXT("");
-    }
+    spitfire::filesystem::DeleteDirectory(sFolderJPG);
 
-    return sFilePathJPG;
+    // ufraw-batch created the image, so if it isn't there now we couldn't move it
+    return spitfire::filesystem::FileExists(sFilePathJPG) ? CONVERSION_RESULT::SUCCESS : CONVERSION_RESULT::TEMPORARY_FAILURE;
   }
 
-  string_t cImageCacheManager::GetOrCreateThumbnailForImageFile(const string_t& sImageFilePath, IMAGE_SIZE imageSize)
+  CONVERSION_RESULT cImageCacheManager::CreateImageWithTool(CONVERTER_TOOL tool, const string_t& sSourceFilePath, const string_t& sFilePathJPG, IMAGE_SIZE imageSize, spitfire::util::cProcessInterface& processInterface)
   {
-    LOG<<"cImageCacheManager::GetOrCreateThumbnailForImageFile \""<<sImageFilePath<<"\""<<std::endl;
+    if (tool == CONVERTER_TOOL::UFRAW) return CreateImageWithUFRaw(sSourceFilePath, sFilePathJPG, imageSize, processInterface);
 
-    if (!IsConvertInstalled()) {
-      LOG<<"cImageCacheManager::GetOrCreateThumbnailForImageFile convert is not installed, returning \"\""<<std::endl;
-      return TEXT("");
+    if (tool == CONVERTER_TOOL::RAW_PREVIEW) {
+      // Full size images use the largest preview
+      const CONVERSION_RESULT result = ExtractRawPreview(sSourceFilePath, (imageSize == IMAGE_SIZE::THUMBNAIL) ? nThumbnailSize : 0, sFilePathJPG);
+      if (result != CONVERSION_RESULT::SUCCESS) DeletePartialFile(sFilePathJPG);
+      return result;
     }
 
-    spitfire::algorithm::cMD5 md5;
-    md5.CalculateForFile(sImageFilePath);
+    if (tool == CONVERTER_TOOL::LIBRAW) {
+      // Thumbnails are decoded at half size
+      const CONVERSION_RESULT result = CreateImageWithLibRaw(sSourceFilePath, (imageSize == IMAGE_SIZE::THUMBNAIL) ? nThumbnailSize : 0, sFilePathJPG, processInterface);
+      if (result != CONVERSION_RESULT::SUCCESS) DeletePartialFile(sFilePathJPG);
+      return result;
+    }
 
-    const string_t sCacheFolder = GetCacheFolderPath();
+    if (tool == CONVERTER_TOOL::LIBJPEG) {
+      ASSERT(imageSize == IMAGE_SIZE::THUMBNAIL);
 
-    string_t sFileJPG = TEXT("full.jpg");
-    size_t width = 0;
-    size_t height = 0;
+      // A jpeg that libjpeg can't convert, such as a CMYK jpeg, can still be converted by the tools
+      const CONVERSION_RESULT result = CreateJPEGThumbnail(sSourceFilePath, nThumbnailSize, sFilePathJPG);
+      if (result != CONVERSION_RESULT::SUCCESS) DeletePartialFile(sFilePathJPG);
+      return result;
+    }
 
-    switch (imageSize) {
-      case IMAGE_SIZE::THUMBNAIL: {
-        sFileJPG = TEXT("thumbnail.jpg");
-        width = 200;
-        height = 200;
+    const bool bIsThumbnail = (imageSize == IMAGE_SIZE::THUMBNAIL);
+    const string_t sSize = spitfire::string::ToString(nThumbnailSize) + TEXT("x") + spitfire::string::ToString(nThumbnailSize);
+
+    // A hint for the jpeg decoder so that it only decodes at twice the size that we need
+    const string_t sJPEGDecodeSize = spitfire::string::ToString(2 * nThumbnailSize) + TEXT("x") + spitfire::string::ToString(2 * nThumbnailSize);
+
+    std::vector<string_t> arguments;
+    arguments.push_back(cConverterBackends::Get().GetTool(tool).sPath);
+
+    string_t sStandardOutputFilePath;
+    size_t nTimeoutMS = nConvertTimeoutMS;
+
+    switch (tool) {
+      case CONVERTER_TOOL::VIPSTHUMBNAIL: {
+        // vipsthumbnail rotates the image to match its orientation tag itself
+        ASSERT(bIsThumbnail);
+        arguments.push_back(sSourceFilePath);
+        arguments.push_back(TEXT("--size"));
+        arguments.push_back(sSize);
+        arguments.push_back(TEXT("-o"));
+        arguments.push_back(sFilePathJPG + TEXT("[Q=90]"));
+        break;
+      }
+      case CONVERTER_TOOL::GRAPHICSMAGICK: {
+        arguments.push_back(TEXT("convert"));
+        if (bIsThumbnail) {
+          arguments.push_back(TEXT("-size"));
+          arguments.push_back(sJPEGDecodeSize);
+        }
+        arguments.push_back(sSourceFilePath);
+        if (bIsThumbnail) {
+          arguments.push_back(TEXT("-resize"));
+          arguments.push_back(sSize);
+        }
+        arguments.push_back(TEXT("-auto-orient"));
+        arguments.push_back(sFilePathJPG);
         break;
       }
+      case CONVERTER_TOOL::IMAGEMAGICK: {
+        if (bIsThumbnail) {
+          arguments.push_back(TEXT("-define"));
+          arguments.push_back(TEXT("jpeg:size=") + sJPEGDecodeSize);
+        }
+        arguments.push_back(sSourceFilePath);
+        if (bIsThumbnail) {
+          arguments.push_back(TEXT("-resize"));
+          arguments.push_back(sSize);
+        }
+        arguments.push_back(TEXT("-auto-orient"));
+        arguments.push_back(sFilePathJPG);
+        break;
+      }
+      case CONVERTER_TOOL::DCRAW: {
+        // Write the embedded preview to standard output
+        ASSERT(bIsThumbnail);
+        arguments.push_back(TEXT("-e"));
+        arguments.push_back(TEXT("-c"));
+        arguments.push_back(sSourceFilePath);
+        sStandardOutputFilePath = sFilePathJPG;
+        nTimeoutMS = nDCRawTimeoutMS;
+        break;
+      }
+      default: {
+        LOG<<"cImageCacheManager::CreateImageWithTool Unsupported tool "<<cConverterBackends::Get().GetTool(tool).sName<<", returning TEMPORARY_FAILURE"<<std::endl;
+        return CONVERSION_RESULT::TEMPORARY_FAILURE;
+      }
+    }
+
+    const CONVERSION_RESULT result = (tool == CONVERTER_TOOL::GRAPHICSMAGICK) ? RunGraphicsMagickTool(arguments, nTimeoutMS, processInterface) : RunTool(arguments, sStandardOutputFilePath, nTimeoutMS, processInterface);
+    if (result != CONVERSION_RESULT::SUCCESS) {
+      LOG<<"cImageCacheManager::CreateImageWithTool "<<cConverterBackends::Get().GetTool(tool).sName<<" FAILED for \""<<sSourceFilePath<<"\", returning the failure"<<std::endl;
+      DeletePartialFile(sFilePathJPG);
+      return result;
     }
 
-    const string_t sFilePathJPG = spitfire::filesystem::MakeFilePath(sCacheFolder, md5.GetResultFormatted() + TEXT("_") + sFileJPG);
-    if (spitfire::filesystem::FileExists(sFilePathJPG)) return sFilePathJPG;
+    if (!spitfire::filesystem::FileExists(sFilePathJPG)) {
+      LOG<<"cImageCacheManager::CreateImageWithTool "<<cConverterBackends::Get().GetTool(tool).sName<<" didn't create an image for \""<<sSourceFilePath<<"\", returning INVALID_FILE"<<std::endl;
+      return CONVERSION_RESULT::INVALID_FILE;
+    }
 
-    const string_t sFolderJPG = spitfire::filesystem::GetFolder(sFilePathJPG);
+    // Some raw files have a preview that is not a jpeg, in which case we let the next backend have a go
+    if ((tool == CONVERTER_TOOL::DCRAW) && !IsJPEGFile(sFilePathJPG)) {
+      LOG<<"cImageCacheManager::CreateImageWithTool The preview in \""<<sSourceFilePath<<"\" is not a jpeg, returning INVALID_FILE"<<std::endl;
+      DeletePartialFile(sFilePathJPG);
+      return CONVERSION_RESULT::INVALID_FILE;
+    }
 
-    ostringstream_t o;
-    o<<"\""<<GetConvertPath()<<"\" \""<<sImageFilePath<<"\"";
-    if ((width != 0) && (height != 0)) o<<" -resize "<<width<<"x"<<height;
-    o<<" -auto-orient \""<<sFilePathJPG<<"\"";
-    const string_t sCommandLine = o.str();
-    //LOG<<"cImageCacheManager::GetOrCreateThumbnailForImageFile Running command line \""<<sCommandLine<<"\""<<std::endl;
-    #ifdef __WIN__
-    RunCommandLine(sCommandLine);
-    #else
-    const int iResult = system(sCommandLine.c_str());
-    if (iResult != 0) {
-      LOG<<"cImageCacheManager::GetOrCreateThumbnailForImageFile convert returned "<<iResult<<" for \""<<sCommandLine<<"\", returning \"\""<<std::endl;
-      return TEXT("");
+    return CONVERSION_RESULT::SUCCESS;
+  }
+
+  cCachedImage cImageCacheManager::CreateImageWithBackends(CONVERTER_FILE_TYPE fileType, const string_t& sSourceFilePath, const string_t& sCacheKey, IMAGE_SIZE imageSize, CONVERSION_RESULT& result, spitfire::util::cProcessInterface& processInterface)
+  {
+    result = CONVERSION_RESULT::SUCCESS;
+
+    // Another worker may have created the image while this job was waiting
+    cCachedImage cachedImage = FindCachedImage(sCacheKey, imageSize);
+    if (cachedImage.IsValid()) return cachedImage;
+
+    std::vector<CONVERTER_TOOL> backends;
+    cConverterBackends::Get().GetBackendsForFile(fileType, imageSize, backends);
+
+    // The decode stage can load the source file directly, nothing is written to the cache so we don't need the lock
+    // NOTE: This is checked before we look for a legacy entry, which would hash the whole source file on the way to opening it
+    if (!backends.empty() && (backends.front() == CONVERTER_TOOL::IN_PROCESS)) {
+      cachedImage.sFilePath = sSourceFilePath;
+      return cachedImage;
     }
-    #endif
 
-    if (!spitfire::filesystem::FileExists(sFilePathJPG)) {
-      LOG<<"cImageCacheManager::GetOrCreateThumbnailForImageFile Failed to create the thumbnail image \""<<sFilePathJPG<<"\", returning \"\""<<std::endl;
-      return TEXT("");
+    // The image may be in the cache under the key that older versions used
+    cachedImage = GetLegacyCachedImage(sSourceFilePath, sCacheKey, imageSize);
+    if (cachedImage.IsValid()) return cachedImage;
+
+    // From here on anything that goes wrong is a temporary failure unless every backend that we try says that the file is invalid
+    result = CONVERSION_RESULT::TEMPORARY_FAILURE;
+
+    if (backends.empty()) {
+      LOG<<"cImageCacheManager::CreateImageWithBackends No backend is installed that can convert \""<<sSourceFilePath<<"\", returning an invalid image"<<std::endl;
+      return cachedImage;
     }
 
-    return sFilePathJPG;
+    // Another instance sharing the cache may be creating this image, if so we wait for it and then use its image instead of creating it again
+    cCacheEntryLock entryLock(GetCacheFolderPath(), sCacheKey, imageSize);
+    if (!entryLock.Lock(processInterface) && processInterface.IsToStop()) return cachedImage;
+
+    cachedImage = FindCachedImage(sCacheKey, imageSize);
+    if (cachedImage.IsValid()) {
+      result = CONVERSION_RESULT::SUCCESS;
+      return cachedImage;
+    }
+
+    // The tools write to a temporary file which is then moved into the thumbnail pack, or renamed into place once it is complete
+    // NOTE: Temporary files go in the tmp folder at the top of the cache folder rather than in a tmp folder in every shard folder
+    const string_t sFilePathJPG = GetCacheFilePath(sCacheKey, imageSize);
+    const string_t sTemporaryFilePathJPG = GetTemporaryFilePath(spitfire::filesystem::MakeFilePath(GetCacheFolderPath(), spitfire::filesystem::GetFile(sFilePathJPG)));
+
+    // Try the fastest backend first and fall back to the slower ones if it fails
+    bool bIsInvalidFile = true;
+    std::vector<CONVERTER_TOOL>::const_iterator iter = backends.begin();
+    const std::vector<CONVERTER_TOOL>::const_iterator iterEnd = backends.end();
+    while (iter != iterEnd) {
+      const CONVERSION_RESULT toolResult = CreateImageWithTool(*iter, sSourceFilePath, sTemporaryFilePathJPG, imageSize, processInterface);
+      if (toolResult == CONVERSION_RESULT::SUCCESS) {
+        GetCacheEvictionIndex().RecordLookup(sCacheKey, imageSize, false);
+
+        // NOTE: If the image can't be written to the cache the result stays a temporary failure
+        if (imageSize == IMAGE_SIZE::THUMBNAIL) {
+          cachedImage = AddThumbnailFileToPack(sCacheKey, sTemporaryFilePathJPG);
+          if (cachedImage.IsValid()) result = CONVERSION_RESULT::SUCCESS;
+          return cachedImage;
+        }
+
+        CreateCacheShardFolderIfRequired(GetCacheFolderPath(), sCacheKey);
+        if (!PublishFile(sTemporaryFilePathJPG, sFilePathJPG)) return cachedImage;
+
+        GetCacheEvictionIndex().AddEntry(sCacheKey, imageSize, spitfire::filesystem::GetFileSizeBytes(sFilePathJPG), int64_t(std::time(nullptr)));
+
+        cachedImage.sFilePath = sFilePathJPG;
+        result = CONVERSION_RESULT::SUCCESS;
+        return cachedImage;
+      }
+
+      if (toolResult != CONVERSION_RESULT::INVALID_FILE) bIsInvalidFile = false;
+
+      if (processInterface.IsToStop()) return cachedImage;
+
+      iter++;
+    }
+
+    if (bIsInvalidFile) result = CONVERSION_RESULT::INVALID_FILE;
+
+    LOG<<"cImageCacheManager::CreateImageWithBackends Failed to create the image \""<<sFilePathJPG<<"\" for \""<<sSourceFilePath<<"\", returning an invalid image"<<std::endl;
+    return cachedImage;
+  }
+
+  bool cImageCacheManager::IsRawFileSupported(const string_t& sRawFilePath, IMAGE_SIZE imageSize)
+  {
+    // Checking for a preview is quicker than asking LibRaw to parse the file
+    return (IsRawPreviewAvailable(sRawFilePath, (imageSize == IMAGE_SIZE::THUMBNAIL) ? nThumbnailSize : 0) || IsLibRawSupported(sRawFilePath));
+  }
+
+  cCachedImage cImageCacheManager::GetOrCreateThumbnailForDNGFile(const string_t& sDNGFilePath, const string_t& sCacheKey, IMAGE_SIZE imageSize, CONVERSION_RESULT& result, spitfire::util::cProcessInterface& processInterface)
+  {
+    LOG<<"cImageCacheManager::GetOrCreateThumbnailForDNGFile \""<<sDNGFilePath<<"\""<<std::endl;
+
+    ASSERT(spitfire::filesystem::FileExists(sDNGFilePath));
+
+    return CreateImageWithBackends(CONVERTER_FILE_TYPE::DNG, sDNGFilePath, sCacheKey, imageSize, result, processInterface);
+  }
+
+  cCachedImage cImageCacheManager::GetOrCreateThumbnailForImageFile(const string_t& sImageFilePath, const string_t& sCacheKey, IMAGE_SIZE imageSize, CONVERSION_RESULT& result, spitfire::util::cProcessInterface& processInterface)
+  {
+    LOG<<"cImageCacheManager::GetOrCreateThumbnailForImageFile \""<<sImageFilePath<<"\""<<std::endl;
+
+    const string_t sExtensionLower = spitfire::string::ToLower(spitfire::filesystem::GetExtension(sImageFilePath));
+    return CreateImageWithBackends(cConverterBackends::GetFileTypeForExtension(sExtensionLower), sImageFilePath, sCacheKey, imageSize, result, processInterface);
   }
 }
@@ -1,40 +1,106 @@
 #ifndef DIESEL_IMAGECACHEMANAGER_H
 #define DIESEL_IMAGECACHEMANAGER_H
 
+// Standard headers
+#include <vector>
+
 // libvoodoomm headers
 #include <libvoodoomm/cImage.h>
 
+// Spitfire headers
+#include <spitfire/util/process.h>
+
 // Diesel headers
 #include "diesel.h"
+#include "converterbackends.h"
+#include "thumbnailpack.h"
 
 namespace diesel
 {
+  class cCacheEvictionIndex;
+  class cCacheFolderContents;
+  class cCacheKeyIndex;
+  class cFailedConversionIndex;
+  class cFileStat;
+
+  // ** cCachedImage
+  //
+  // Where the decode stage can find an image, thumbnails are in the thumbnail pack and everything else is a file
+  //
+
+  class cCachedImage
+  {
+  public:
+    bool IsValid() const { return (!sFilePath.empty() || thumbnail.IsValid()); }
+
+    string_t sFilePath;
+    cThumbnailPackRecord thumbnail;
+  };
+
+
   class cImageCacheManager
   {
   public:
-    static void EnforceMaximumCacheSize(size_t nMaximumCacheSizeGB);
+    static bool EnforceMaximumCacheSize(size_t nMaximumCacheSizeGB, spitfire::util::cProcessInterface& processInterface);
     static void ClearCache();
 
-    #ifndef __WIN__
-    static bool IsWineInstalled();
-    #endif
-    static bool IsUFRawBatchInstalled();
-    static bool IsConvertInstalled();
-    #ifdef __WIN__
-    static bool IsAdobeDNGConverterInstalled();
-    #endif
+    static void SetThumbnailFormat(THUMBNAIL_FORMAT format); // Only affects thumbnails that are created after this is called
+    static void StopConverterWorkers(); // Stops any converter processes that are kept running between images
+
+    // The key is only calculated from the contents of the file the first time we see the file, or if it has changed since then
+    static string_t GetCacheKeyForFile(const string_t& sFilePath);
+    static cCachedImage GetCachedImage(const string_t& sCacheKey, IMAGE_SIZE imageSize);
+    static bool LoadCachedImage(const cCachedImage& cachedImage, size_t nThumbnailSizePixels, voodoo::cImage& image); // Thumbnails are loaded from the smallest level that covers nThumbnailSizePixels
+
+    // Files that failed to convert or decode are skipped until the file or the converter tools change, stat is the stat of the file from before it was tried
+    // NOTE: Only files that couldn't be decoded should be added, a timeout or a full disk doesn't mean that the file will fail next time
+    static bool IsFailedConversion(const string_t& sFilePath, IMAGE_SIZE imageSize, const cFileStat& stat);
+    static void AddFailedConversion(const string_t& sFilePath, IMAGE_SIZE imageSize, const cFileStat& stat);
 
-    static string_t GetOrCreateDNGForRawFile(const string_t& sRawFilePath);
-    static string_t GetOrCreateThumbnailForDNGFile(const string_t& sDNGFilePath, IMAGE_SIZE imageSize);
-    static string_t GetOrCreateThumbnailForImageFile(const string_t& sImageFilePath, IMAGE_SIZE imageSize);
+    // Raw files with a preview that is big enough, or that LibRaw can develop, are passed to GetOrCreateThumbnailForImageFile as they are, the others have
+    // to be converted to dng first
+    static bool IsRawFileSupported(const string_t& sRawFilePath, IMAGE_SIZE imageSize);
+
+    // Converts the raw files with as few runs of the Adobe DNG Converter as possible, dngFilePaths is filled with the dng for each raw file, or "" if that file failed
+    // and results with why it failed
+    static void GetOrCreateDNGsForRawFiles(const std::vector<string_t>& rawFilePaths, std::vector<string_t>& dngFilePaths, std::vector<CONVERSION_RESULT>& results, spitfire::util::cProcessInterface& processInterface);
+
+    // The fastest backend that is installed is used and the slower ones are tried if it fails
+    // The external tools are killed as soon as processInterface is stopped, partial output files are deleted and "" is returned
+    // NOTE: For images that can be loaded directly the source file path may be returned instead of a cached image
+    // result is INVALID_FILE only if every backend that was tried couldn't decode the file
+    static cCachedImage GetOrCreateThumbnailForDNGFile(const string_t& sDNGFilePath, const string_t& sCacheKey, IMAGE_SIZE imageSize, CONVERSION_RESULT& result, spitfire::util::cProcessInterface& processInterface);
+    static cCachedImage GetOrCreateThumbnailForImageFile(const string_t& sImageFilePath, const string_t& sCacheKey, IMAGE_SIZE imageSize, CONVERSION_RESULT& result, spitfire::util::cProcessInterface& processInterface);
 
   private:
     static string_t GetCacheFolderPath();
-    #ifdef __WIN__
-    static string_t GetUFRawBatchPath();
-    static string_t GetConvertPath();
-    #endif
-    static string_t GetAdobeDNGConverterPath();
+    static cCacheKeyIndex& GetCacheKeyIndex();
+    static cFailedConversionIndex& GetFailedConversionIndex();
+    static string_t CalculateCacheKeyForFile(const string_t& sFilePath);
+    static bool IsLegacyCacheKey(const string_t& sCacheKey);
+    static const cCacheFolderContents& GetCacheFolderContents();
+    static cCachedImage FindCachedImage(const string_t& sCacheKey, IMAGE_SIZE imageSize); // Like GetCachedImage but doesn't count as an access
+    static cCachedImage GetLegacyCachedImage(const string_t& sSourceFilePath, const string_t& sCacheKey, IMAGE_SIZE imageSize);
+    static string_t GetCacheShardFolderPath(const string_t& sCacheFolderPath, const string_t& sCacheKey);
+    static void CreateCacheShardFolderIfRequired(const string_t& sCacheFolderPath, const string_t& sCacheKey);
+    static string_t GetCacheFilePath(const string_t& sCacheKey, IMAGE_SIZE imageSize);
+    static bool ParseCacheFileName(const string_t& sFile, string_t& sCacheKey, IMAGE_SIZE& imageSize); // Returns false if the file is not a cache entry
+    static void MigrateCacheToShardFolders(const string_t& sCacheFolderPath); // Moves entries left at the top of the cache folder by older versions into the shard folders
+    static cThumbnailPack& GetThumbnailPack();
+    static cCacheEvictionIndex& GetCacheEvictionIndex();
+    static void BuildCacheEvictionIndex(cCacheEvictionIndex& index);
+    static cCachedImage AddThumbnailFileToPack(const string_t& sCacheKey, const string_t& sFilePathJPG);
+
+    static CONVERSION_RESULT RunTool(const std::vector<string_t>& arguments, const string_t& sStandardOutputFilePath, size_t nTimeoutMS, spitfire::util::cProcessInterface& processInterface);
+    static CONVERSION_RESULT RunAdobeDNGConverter(const std::vector<string_t>& rawFilePaths, spitfire::util::cProcessInterface& processInterface);
+    static CONVERSION_RESULT RunGraphicsMagickTool(const std::vector<string_t>& arguments, size_t nTimeoutMS, spitfire::util::cProcessInterface& processInterface);
+    static void DeletePartialFile(const string_t& sFilePath);
+    static bool IsJPEGFile(const string_t& sFilePath);
+    static string_t GetDNGFilePathForRawFile(const string_t& sRawFilePath);
+
+    static cCachedImage CreateImageWithBackends(CONVERTER_FILE_TYPE fileType, const string_t& sSourceFilePath, const string_t& sCacheKey, IMAGE_SIZE imageSize, CONVERSION_RESULT& result, spitfire::util::cProcessInterface& processInterface);
+    static CONVERSION_RESULT CreateImageWithTool(CONVERTER_TOOL tool, const string_t& sSourceFilePath, const string_t& sFilePathJPG, IMAGE_SIZE imageSize, spitfire::util::cProcessInterface& processInterface);
+    static CONVERSION_RESULT CreateImageWithUFRaw(const string_t& sDNGFilePath, const string_t& sFilePathJPG, IMAGE_SIZE imageSize, spitfire::util::cProcessInterface& processInterface);
   };
 }
 
@@ -0,0 +1,83 @@
+// Standard headers
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+// SDL headers
+#ifdef __WIN__
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_image.h>
+#else
+#include <SDL/SDL.h>
+#include <SDL/SDL_image.h>
+#endif
+
+// Spitfire headers
+#include <spitfire/util/log.h>
+
+// Diesel headers
+#include "imagedecoder.h"
+
+namespace diesel
+{
+  bool DecodeImageFromMemory(const uint8_t* pData, size_t nSizeBytes, std::vector<uint8_t>& pixels, size_t& width, size_t& height)
+  {
+    ASSERT(pData != nullptr);
+
+    // SDL_image reads straight from our buffer, nothing is copied until the image has been decoded
+    SDL_RWops* pRWops = SDL_RWFromConstMem(pData, int(nSizeBytes));
+    if (pRWops == nullptr) return false;
+
+    SDL_Surface* pSurface = IMG_Load_RW(pRWops, 1);
+    if (pSurface == nullptr) {
+      LOG<<"DecodeImageFromMemory Failed to decode the image \""<<IMG_GetError()<<"\", returning false"<<std::endl;
+      return false;
+    }
+
+    width = size_t(pSurface->w);
+    height = size_t(pSurface->h);
+
+    // Convert to RGBA in byte order, the same as the images that we load from files
+    #if SDL_BYTEORDER == SDL_BIG_ENDIAN
+    SDL_Surface* pSurfaceRGBA = SDL_CreateRGBSurface(SDL_SWSURFACE, pSurface->w, pSurface->h, 32, 0xFF000000, 0x00FF0000, 0x0000FF00, 0x000000FF);
+    #else
+    SDL_Surface* pSurfaceRGBA = SDL_CreateRGBSurface(SDL_SWSURFACE, pSurface->w, pSurface->h, 32, 0x000000FF, 0x0000FF00, 0x00FF0000, 0xFF000000);
+    #endif
+    if (pSurfaceRGBA == nullptr) {
+      SDL_FreeSurface(pSurface);
+      return false;
+    }
+
+    // Copy the alpha channel rather than blending with it
+    #if SDL_VERSION_ATLEAST(2, 0, 0)
+    SDL_SetSurfaceBlendMode(pSurface, SDL_BLENDMODE_NONE);
+    #else
+    SDL_SetAlpha(pSurface, 0, SDL_ALPHA_OPAQUE);
+    #endif
+
+    SDL_BlitSurface(pSurface, nullptr, pSurfaceRGBA, nullptr);
+    SDL_FreeSurface(pSurface);
+
+    // Remove any padding at the end of each row
+    pixels.resize(width * height * 4);
+
+    SDL_LockSurface(pSurfaceRGBA);
+    const uint8_t* pPixels = static_cast<const uint8_t*>(pSurfaceRGBA->pixels);
+    for (size_t y = 0; y < height; y++) memcpy(pixels.data() + (y * width * 4), pPixels + (y * size_t(pSurfaceRGBA->pitch)), width * 4);
+    SDL_UnlockSurface(pSurfaceRGBA);
+
+    SDL_FreeSurface(pSurfaceRGBA);
+
+    return true;
+  }
+
+  bool LoadImageFromMemory(const uint8_t* pData, size_t nSizeBytes, voodoo::cImage& image)
+  {
+    std::vector<uint8_t> pixels;
+    size_t width = 0;
+    size_t height = 0;
+    if (!DecodeImageFromMemory(pData, nSizeBytes, pixels, width, height)) return false;
+
+    return image.CreateFromBuffer(pixels.data(), width, height, voodoo::PIXELFORMAT::R8G8B8A8);
+  }
+}
@@ -0,0 +1,28 @@
+#ifndef DIESEL_IMAGEDECODER_H
+#define DIESEL_IMAGEDECODER_H
+
+// Standard headers
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// libvoodoomm headers
+#include <libvoodoomm/cImage.h>
+
+// Diesel headers
+#include "diesel.h"
+
+namespace diesel
+{
+  // ** Image decoding
+  //
+  // Decodes an image that is already in memory, such as a thumbnail in the mapped thumbnail pack, without writing it out to a file first
+  // This uses SDL_image which is what libvoodoomm uses to load files, so any format that can be loaded from a file can be loaded from memory
+  //
+
+  // Pixels are 8 bits per channel RGBA with no padding between rows
+  bool DecodeImageFromMemory(const uint8_t* pData, size_t nSizeBytes, std::vector<uint8_t>& pixels, size_t& width, size_t& height);
+  bool LoadImageFromMemory(const uint8_t* pData, size_t nSizeBytes, voodoo::cImage& image);
+}
+
+#endif // DIESEL_IMAGEDECODER_H
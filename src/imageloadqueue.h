@@ -0,0 +1,373 @@
+#ifndef DIESEL_IMAGELOADQUEUE_H
+#define DIESEL_IMAGELOADQUEUE_H
+
+// Standard headers
+#include <algorithm>
+#include <condition_variable>
+#include <list>
+#include <mutex>
+
+// Spitfire headers
+#include <spitfire/spitfire.h>
+
+namespace diesel
+{
+  // ** cWakeUpSignal
+  //
+  // Wakes up a thread that is waiting for something to do
+  // A signal that arrives while the thread is busy is remembered so the next Wait returns straight away instead of the signal getting lost
+  //
+
+  class cWakeUpSignal
+  {
+  public:
+    cWakeUpSignal();
+
+    void Signal();
+    void Wait();
+
+    bool IsSignalled() const;
+
+  private:
+    mutable std::mutex mutex;
+    std::condition_variable condition;
+    bool bIsSignalled;
+  };
+
+  inline cWakeUpSignal::cWakeUpSignal() :
+    bIsSignalled(false)
+  {
+  }
+
+  inline void cWakeUpSignal::Signal()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      bIsSignalled = true;
+    }
+
+    condition.notify_one();
+  }
+
+  inline void cWakeUpSignal::Wait()
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!bIsSignalled) condition.wait(lock);
+
+    bIsSignalled = false;
+  }
+
+  inline bool cWakeUpSignal::IsSignalled() const
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return bIsSignalled;
+  }
+
+
+  // ** cBoundedQueue
+  //
+  // A thread safe queue with a maximum number of items that sits between two stages of the image loading pipeline
+  // PushBack blocks while the queue is full and PopFront blocks while the queue is empty, both return as soon as the queue is closed
+  // PushFront never blocks, it is for the occasional urgent item that must not wait behind the others so it may take the queue over its maximum size
+  // PushBackWithoutWaiting never blocks either, it is for a slow lane that must never hold up the stage that feeds it
+  // PopFrontBatch waits for at least one item and then takes as many of the waiting items as it can up to a maximum, for consumers that are quicker at many items at once
+  // PopFirstMatching lets a consumer that is reserved for a particular kind of item wait for one of those items, skipping over the rest
+  // MoveMatchingToFront lets the producer change its mind about which of the waiting items are the most urgent without taking them back out
+  // The queue owns the items while they are in the queue, RemoveAll hands them back to the caller
+  //
+
+  template <class T>
+  class cBoundedQueue
+  {
+  public:
+    explicit cBoundedQueue(size_t nMaximumSize);
+    ~cBoundedQueue();
+
+    void SetSignalOnSpaceAvailable(cWakeUpSignal& signalSpaceAvailable);
+
+    size_t GetSize() const;
+    bool IsFull() const;
+
+    bool PushBack(T* pItem);
+    bool TryPushBack(T* pItem);
+    bool PushFront(T* pItem);
+    bool PushBackWithoutWaiting(T* pItem);
+    T* PopFront();
+    T* TryPopFront();
+    bool PopFrontBatch(std::list<T*>& batch, size_t nMaximumItems);
+    template <class P>
+    T* PopFirstMatching(P predicate);
+
+    template <class P>
+    void MoveMatchingToFront(P predicate);
+
+    void Close();
+    void RemoveAll(std::list<T*>& removed);
+
+  private:
+    void NotifySpaceAvailable();
+
+    mutable std::mutex mutex;
+    std::condition_variable conditionNotEmpty;
+    std::condition_variable conditionNotFull;
+
+    const size_t nMaximumSize;
+    bool bIsClosed;
+    std::list<T*> items;
+
+    cWakeUpSignal* pSignalOnSpaceAvailable;
+  };
+
+  template <class T>
+  inline cBoundedQueue<T>::cBoundedQueue(size_t _nMaximumSize) :
+    nMaximumSize(_nMaximumSize),
+    bIsClosed(false),
+    pSignalOnSpaceAvailable(nullptr)
+  {
+    ASSERT(nMaximumSize != 0);
+  }
+
+  template <class T>
+  inline cBoundedQueue<T>::~cBoundedQueue()
+  {
+    // Delete any remaining items
+    typename std::list<T*>::iterator iter = items.begin();
+    const typename std::list<T*>::iterator iterEnd = items.end();
+    while (iter != iterEnd) {
+      spitfire::SAFE_DELETE(*iter);
+
+      iter++;
+    }
+  }
+
+  template <class T>
+  inline void cBoundedQueue<T>::SetSignalOnSpaceAvailable(cWakeUpSignal& signalSpaceAvailable)
+  {
+    pSignalOnSpaceAvailable = &signalSpaceAvailable;
+  }
+
+  template <class T>
+  inline size_t cBoundedQueue<T>::GetSize() const
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return items.size();
+  }
+
+  template <class T>
+  inline bool cBoundedQueue<T>::IsFull() const
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return (items.size() >= nMaximumSize);
+  }
+
+  template <class T>
+  inline bool cBoundedQueue<T>::PushBack(T* pItem)
+  {
+    ASSERT(pItem != nullptr);
+
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (!bIsClosed && (items.size() >= nMaximumSize)) conditionNotFull.wait(lock);
+
+      if (bIsClosed) return false;
+
+      items.push_back(pItem);
+    }
+
+    // NOTE: We wake up everyone because a consumer waiting in PopFirstMatching may not want this item
+    conditionNotEmpty.notify_all();
+
+    return true;
+  }
+
+  template <class T>
+  inline bool cBoundedQueue<T>::TryPushBack(T* pItem)
+  {
+    ASSERT(pItem != nullptr);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (bIsClosed || (items.size() >= nMaximumSize)) return false;
+
+      items.push_back(pItem);
+    }
+
+    // NOTE: We wake up everyone because a consumer waiting in PopFirstMatching may not want this item
+    conditionNotEmpty.notify_all();
+
+    return true;
+  }
+
+  template <class T>
+  inline bool cBoundedQueue<T>::PushFront(T* pItem)
+  {
+    ASSERT(pItem != nullptr);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (bIsClosed) return false;
+
+      items.push_front(pItem);
+    }
+
+    // NOTE: We wake up everyone because a consumer waiting in PopFirstMatching may not want this item
+    conditionNotEmpty.notify_all();
+
+    return true;
+  }
+
+  template <class T>
+  inline bool cBoundedQueue<T>::PushBackWithoutWaiting(T* pItem)
+  {
+    ASSERT(pItem != nullptr);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (bIsClosed) return false;
+
+      items.push_back(pItem);
+    }
+
+    // NOTE: We wake up everyone because a consumer waiting in PopFirstMatching may not want this item
+    conditionNotEmpty.notify_all();
+
+    return true;
+  }
+
+  template <class T>
+  inline T* cBoundedQueue<T>::PopFront()
+  {
+    T* pItem = nullptr;
+
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (!bIsClosed && items.empty()) conditionNotEmpty.wait(lock);
+
+      if (bIsClosed) return nullptr;
+
+      pItem = items.front();
+      items.pop_front();
+    }
+
+    NotifySpaceAvailable();
+
+    return pItem;
+  }
+
+  template <class T>
+  inline T* cBoundedQueue<T>::TryPopFront()
+  {
+    T* pItem = nullptr;
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (items.empty()) return nullptr;
+
+      pItem = items.front();
+      items.pop_front();
+    }
+
+    NotifySpaceAvailable();
+
+    return pItem;
+  }
+
+  template <class T>
+  inline bool cBoundedQueue<T>::PopFrontBatch(std::list<T*>& batch, size_t nMaximumItems)
+  {
+    ASSERT(nMaximumItems != 0);
+
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (!bIsClosed && items.empty()) conditionNotEmpty.wait(lock);
+
+      if (bIsClosed) return false;
+
+      while (!items.empty() && (batch.size() < nMaximumItems)) {
+        batch.push_back(items.front());
+        items.pop_front();
+      }
+    }
+
+    NotifySpaceAvailable();
+
+    return true;
+  }
+
+  template <class T>
+  template <class P>
+  inline T* cBoundedQueue<T>::PopFirstMatching(P predicate)
+  {
+    T* pItem = nullptr;
+
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (true) {
+        if (bIsClosed) return nullptr;
+
+        typename std::list<T*>::iterator iter = items.begin();
+        const typename std::list<T*>::iterator iterEnd = items.end();
+        while (iter != iterEnd) {
+          if (predicate(**iter)) break;
+
+          iter++;
+        }
+
+        if (iter != iterEnd) {
+          pItem = *iter;
+          items.erase(iter);
+          break;
+        }
+
+        conditionNotEmpty.wait(lock);
+      }
+    }
+
+    NotifySpaceAvailable();
+
+    return pItem;
+  }
+
+  template <class T>
+  template <class P>
+  inline void cBoundedQueue<T>::MoveMatchingToFront(P predicate)
+  {
+    // NOTE: The predicate is called with the queue locked so it may update the items, the items keep their order otherwise
+    std::lock_guard<std::mutex> lock(mutex);
+    std::stable_partition(items.begin(), items.end(), [&predicate](T* pItem) { return predicate(*pItem); });
+  }
+
+  template <class T>
+  inline void cBoundedQueue<T>::Close()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      bIsClosed = true;
+    }
+
+    // Wake up everyone that is waiting on this queue so that they can see that it is closed
+    conditionNotEmpty.notify_all();
+    conditionNotFull.notify_all();
+  }
+
+  template <class T>
+  inline void cBoundedQueue<T>::RemoveAll(std::list<T*>& removed)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      removed.splice(removed.end(), items);
+    }
+
+    NotifySpaceAvailable();
+  }
+
+  template <class T>
+  inline void cBoundedQueue<T>::NotifySpaceAvailable()
+  {
+    conditionNotFull.notify_all();
+
+    if (pSignalOnSpaceAvailable != nullptr) pSignalOnSpaceAvailable->Signal();
+  }
+}
+
+#endif // DIESEL_IMAGELOADQUEUE_H
@@ -1,27 +1,174 @@
+// Standard headers
+#include <thread>
+
+#ifndef __WIN__
+// POSIX headers
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 // Spitfire headers
+#include <spitfire/math/math.h>
 #include <spitfire/storage/filesystem.h>
 #include <spitfire/util/log.h>
 
 // Diesel headers
+#include "converterbackends.h"
 #include "imagecachemanager.h"
 #include "imageloadthread.h"
+#include "jpegthumbnail.h"
+#include "settings.h"
+#include "thumbnailformat.h"
 #include "util.h"
 
 namespace diesel
 {
+  const size_t nQueueSizePerWorker = 4;
+
+  // Each stage keeps this many workers free for interactive jobs
+  const size_t nReservedInteractiveWorkersPerStage = 1;
+
+  // The most raw files that are converted to dng in one run of the converter, a bigger batch saves more starts but each job waits for the whole batch
+  const size_t nMaximumRawToDNGBatchSize = 8;
+
+  #ifndef __WIN__
+  // The nice value of the raw to dng lane, the converters that it starts inherit it so they only get the cores that the other stages aren't using
+  const int iRawToDNGNiceness = 10;
+  #endif
+
+  // How far ahead of the visible photos we load, in seconds of scrolling at the current speed and in pages
+  const float fLookAheadSeconds = 1.0f;
+  const size_t nMaximumLookAheadPages = 10;
+
+  // How many steps ahead in the scroll direction we take for every step behind while within the look ahead distance
+  const size_t nLookAheadStepsPerStepBehind = 4;
+
   // ** cFolderLoadThumbnailsRequest
 
-  cFolderLoadThumbnailsRequest::cFolderLoadThumbnailsRequest(const string_t& _sFolderPath) :
-    sFolderPath(_sFolderPath)
+  cFolderLoadThumbnailsRequest::cFolderLoadThumbnailsRequest(const string_t& _sFolderPath, size_t _generation) :
+    sFolderPath(_sFolderPath),
+    generation(_generation),
+    requestedTime(std::chrono::steady_clock::now())
   {
   }
 
 
   // ** cFileLoadFullHighPriorityRequest
 
-  cFileLoadFullHighPriorityRequest::cFileLoadFullHighPriorityRequest(const string_t& _sFileNameNoExtension) :
-    sFileNameNoExtension(_sFileNameNoExtension)
+  cFileLoadFullHighPriorityRequest::cFileLoadFullHighPriorityRequest(const string_t& _sFileNameNoExtension, size_t _generation) :
+    sFileNameNoExtension(_sFileNameNoExtension),
+    generation(_generation),
+    requestedTime(std::chrono::steady_clock::now())
+  {
+  }
+
+
+  // ** cImageLoadJob
+
+  cImageLoadJob::cImageLoadJob(const string_t& _sFolderPath, const string_t& _sFileNameNoExtension, IMAGE_SIZE _imageSize, size_t _index, const cPhoto& _photo, size_t _generation, const std::chrono::steady_clock::time_point& _requestedTime) :
+    sFolderPath(_sFolderPath),
+    sFileNameNoExtension(_sFileNameNoExtension),
+    imageSize(_imageSize),
+    index(_index),
+    priority((_imageSize == IMAGE_SIZE::FULL) ? IMAGE_LOAD_PRIORITY::INTERACTIVE : IMAGE_LOAD_PRIORITY::PREFETCH),
+    photo(_photo),
+    generation(_generation),
+    requestedTime(_requestedTime),
+    nThumbnailSize(0),
+    orientation(1),
+    bIsError(false),
+    pImage(nullptr)
+  {
+  }
+
+  cImageLoadJob::~cImageLoadJob()
+  {
+    spitfire::SAFE_DELETE(pImage);
+  }
+
+  string_t cImageLoadJob::GetKey() const
+  {
+    // NOTE: The generation is part of the key so that a request is never merged into a job that is about to be thrown away
+    // Background raw to dng conversions have their own key so that a thumbnail request is never merged into one
+    ostringstream_t o;
+    o<<spitfire::filesystem::MakeFilePath(sFolderPath, sFileNameNoExtension);
+    if (priority == IMAGE_LOAD_PRIORITY::MAINTENANCE) o<<TEXT("_dng");
+    else o<<((imageSize == IMAGE_SIZE::THUMBNAIL) ? TEXT("_thumbnail") : TEXT("_full"));
+    o<<TEXT("_")<<generation;
+    return o.str();
+  }
+
+
+  // ** cImageLoadPlaceholder
+
+  cImageLoadPlaceholder::cImageLoadPlaceholder(const string_t& _sFileNameNoExtension, size_t _generation, voodoo::cImage* _pImage) :
+    sFileNameNoExtension(_sFileNameNoExtension),
+    generation(_generation),
+    pImage(_pImage)
+  {
+  }
+
+  cImageLoadPlaceholder::~cImageLoadPlaceholder()
+  {
+    spitfire::SAFE_DELETE(pImage);
+  }
+
+
+  // ** cImageLoadWorker
+
+  cImageLoadWorker::cImageLoadWorker(cImageLoadThread& _owner, IMAGE_LOAD_STAGE _stage, cBoundedQueue<cImageLoadJob>& _queue, bool _bIsReservedForInteractive) :
+    spitfire::util::cThread(soAction, TEXT("cImageLoadWorker::cThread")),
+    owner(_owner),
+    stage(_stage),
+    queue(_queue),
+    bIsReservedForInteractive(_bIsReservedForInteractive),
+    soAction(TEXT("cImageLoadWorker::soAction"))
+  {
+  }
+
+  void cImageLoadWorker::Start()
+  {
+    Run();
+  }
+
+  void cImageLoadWorker::StopSoon()
+  {
+    StopThreadSoon();
+  }
+
+  void cImageLoadWorker::StopNow()
+  {
+    StopThreadNow();
+  }
+
+  void cImageLoadWorker::ThreadFunction()
   {
+    #ifndef __WIN__
+    // NOTE: On Linux the nice value is per thread and a process that is started from this thread inherits it
+    if ((stage == IMAGE_LOAD_STAGE::RAW_TO_DNG) && !bIsReservedForInteractive) {
+      if (setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), iRawToDNGNiceness) != 0) LOG<<"cImageLoadWorker::ThreadFunction Failed to lower the priority of the raw to dng worker"<<std::endl;
+    }
+    #endif
+
+    while (!IsToStop()) {
+      // Raw files are converted together, so we take every job that is waiting up to the batch size
+      if ((stage == IMAGE_LOAD_STAGE::RAW_TO_DNG) && !bIsReservedForInteractive) {
+        std::list<cImageLoadJob*> batch;
+        if (!queue.PopFrontBatch(batch, nMaximumRawToDNGBatchSize)) break;
+
+        owner.ProcessRawToDNGStage(batch);
+        continue;
+      }
+
+      // Wait for the next job, the queue returns nullptr when it is closed
+      cImageLoadJob* pJob = nullptr;
+      if (bIsReservedForInteractive) pJob = queue.PopFirstMatching([](const cImageLoadJob& job) { return (job.priority == IMAGE_LOAD_PRIORITY::INTERACTIVE); });
+      else pJob = queue.PopFront();
+      if (pJob == nullptr) break;
+
+      owner.ProcessJob(stage, pJob);
+    }
   }
 
 
@@ -33,12 +180,134 @@ namespace diesel
     soAction(TEXT("cImageLoadThread::soAction")),
     requestQueue(soAction),
     highPriorityRequestQueue(soAction),
-    mutexMaximumCacheSize(TEXT("cImageLoadThread::mutexMaximumCacheSize"))
+    mutexMaximumCacheSize(TEXT("cImageLoadThread::mutexMaximumCacheSize")),
+    nMaximumCacheSizeGB(2),
+    generation(0),
+    mutexVisibleRange(TEXT("cImageLoadThread::mutexVisibleRange")),
+    bIsVisibleRangeChanged(false),
+    nThumbnailSize(GetThumbnailLevelForSize(128)),
+    nFolders(0),
+    nHandledThumbnailSize(GetThumbnailLevelForSize(128)),
+    bIsEnforceMaximumCacheSizeRequired(false),
+    bIsBackgroundRawToDNGRequired(false),
+    mutexJobs(TEXT("cImageLoadThread::mutexJobs")),
+    nInteractiveJobs(0),
+    pHashQueue(nullptr),
+    pRawToDNGQueue(nullptr),
+    pConvertQueue(nullptr),
+    pDecodeQueue(nullptr),
+    placeholderQueue(soAction),
+    handOffQueue(soAction),
+    latencyRequest(TEXT("Request")),
+    latencyFullImage(TEXT("Full image"))
   {
   }
 
+  cImageLoadThread::~cImageLoadThread()
+  {
+    StopWorkers();
+
+    spitfire::SAFE_DELETE(pDecodeQueue);
+    spitfire::SAFE_DELETE(pConvertQueue);
+    spitfire::SAFE_DELETE(pRawToDNGQueue);
+    spitfire::SAFE_DELETE(pHashQueue);
+  }
+
+  size_t cImageLoadThread::GetDefaultWorkerCount(IMAGE_LOAD_STAGE stage)
+  {
+    const size_t nCores = max<size_t>(1, std::thread::hardware_concurrency());
+
+    switch (stage) {
+      case IMAGE_LOAD_STAGE::HASH: return max<size_t>(1, nCores / 4); // Mostly waiting on the disk
+      case IMAGE_LOAD_STAGE::RAW_TO_DNG: return 1; // Each run of the converter works through its batch using all of the cores
+      case IMAGE_LOAD_STAGE::CONVERT: return max<size_t>(1, nCores - 1); // Mostly waiting on external tools
+      case IMAGE_LOAD_STAGE::DECODE: return max<size_t>(1, nCores / 2);
+    }
+
+    return 1;
+  }
+
+  void cImageLoadThread::StartWorkers(IMAGE_LOAD_STAGE stage, size_t nWorkers, cBoundedQueue<cImageLoadJob>& queue)
+  {
+    if (nWorkers == 0) nWorkers = GetDefaultWorkerCount(stage);
+
+    for (size_t i = 0; i < nWorkers; i++) {
+      cImageLoadWorker* pWorker = new cImageLoadWorker(*this, stage, queue, false);
+      workers.push_back(pWorker);
+      pWorker->Start();
+    }
+
+    // Keep some workers free for interactive jobs
+    for (size_t i = 0; i < nReservedInteractiveWorkersPerStage; i++) {
+      cImageLoadWorker* pWorker = new cImageLoadWorker(*this, stage, queue, true);
+      workers.push_back(pWorker);
+      pWorker->Start();
+    }
+  }
+
+  void cImageLoadThread::NotifyWaitingWorkers()
+  {
+    // Wake up any workers that are waiting for interactive jobs so that they can check if their job has been cancelled
+    {
+      std::lock_guard<std::mutex> lock(mutexInteractiveJobs);
+    }
+
+    conditionInteractiveJobs.notify_all();
+  }
+
+  void cImageLoadThread::StopWorkers()
+  {
+    // Close the queues first so that any workers waiting on a queue wake up
+    if (pHashQueue != nullptr) pHashQueue->Close();
+    if (pRawToDNGQueue != nullptr) pRawToDNGQueue->Close();
+    if (pConvertQueue != nullptr) pConvertQueue->Close();
+    if (pDecodeQueue != nullptr) pDecodeQueue->Close();
+
+    NotifyWaitingWorkers();
+
+    const size_t n = workers.size();
+    for (size_t i = 0; i < n; i++) workers[i]->StopSoon();
+
+    for (size_t i = 0; i < n; i++) {
+      workers[i]->StopNow();
+      spitfire::SAFE_DELETE(workers[i]);
+    }
+
+    workers.clear();
+
+    // Now that nothing is converting we can stop any converter processes that were kept running
+    cImageCacheManager::StopConverterWorkers();
+  }
+
   void cImageLoadThread::Start()
   {
+    ASSERT(workers.empty());
+
+    // Read the worker counts for each stage
+    cSettings settings;
+    settings.Load();
+
+    const size_t nHashWorkers = (settings.GetImageLoadHashWorkerCount() != 0) ? settings.GetImageLoadHashWorkerCount() : GetDefaultWorkerCount(IMAGE_LOAD_STAGE::HASH);
+    const size_t nConvertWorkers = (settings.GetImageLoadConvertWorkerCount() != 0) ? settings.GetImageLoadConvertWorkerCount() : GetDefaultWorkerCount(IMAGE_LOAD_STAGE::CONVERT);
+    const size_t nDecodeWorkers = (settings.GetImageLoadDecodeWorkerCount() != 0) ? settings.GetImageLoadDecodeWorkerCount() : GetDefaultWorkerCount(IMAGE_LOAD_STAGE::DECODE);
+    const size_t nRawToDNGWorkers = (settings.GetImageLoadRawToDNGWorkerCount() != 0) ? settings.GetImageLoadRawToDNGWorkerCount() : GetDefaultWorkerCount(IMAGE_LOAD_STAGE::RAW_TO_DNG);
+    LOG<<"cImageLoadThread::Start hash="<<nHashWorkers<<", raw to dng="<<nRawToDNGWorkers<<", convert="<<nConvertWorkers<<", decode="<<nDecodeWorkers<<std::endl;
+
+    cImageCacheManager::SetThumbnailFormat(settings.GetThumbnailFormat());
+
+    pHashQueue = new cBoundedQueue<cImageLoadJob>(nQueueSizePerWorker * nHashWorkers);
+    pRawToDNGQueue = new cBoundedQueue<cImageLoadJob>(nMaximumRawToDNGBatchSize * nRawToDNGWorkers); // NOTE: Jobs are added with PushBackWithoutWaiting so this can be exceeded
+    pConvertQueue = new cBoundedQueue<cImageLoadJob>(nQueueSizePerWorker * nConvertWorkers);
+    pDecodeQueue = new cBoundedQueue<cImageLoadJob>(nQueueSizePerWorker * nDecodeWorkers);
+
+    // Wake up the image load thread whenever there is room for more jobs in the hash queue
+    pHashQueue->SetSignalOnSpaceAvailable(wakeUp);
+
+    StartWorkers(IMAGE_LOAD_STAGE::HASH, nHashWorkers, *pHashQueue);
+    StartWorkers(IMAGE_LOAD_STAGE::RAW_TO_DNG, nRawToDNGWorkers, *pRawToDNGQueue);
+    StartWorkers(IMAGE_LOAD_STAGE::CONVERT, nConvertWorkers, *pConvertQueue);
+    StartWorkers(IMAGE_LOAD_STAGE::DECODE, nDecodeWorkers, *pDecodeQueue);
+
     // Start
     Run();
   }
@@ -46,10 +315,16 @@ namespace diesel
   void cImageLoadThread::StopSoon()
   {
     StopThreadSoon();
+    wakeUp.Signal();
   }
 
   void cImageLoadThread::StopNow()
   {
+    // Make sure that the image load thread wakes up to see that it has to stop before we wait for it
+    // NOTE: The workers are stopped by the image load thread as it exits
+    StopThreadSoon();
+    NotifyWaitingWorkers();
+    wakeUp.Signal();
     StopThreadNow();
   }
 
@@ -64,22 +339,138 @@ namespace diesel
     // If we are adding a folder request then we can reset our loading process interface
     loadingProcessInterface.Reset();
 
+    // Start a new generation, anything still being loaded for the previous folder is now stale
+    const size_t newGeneration = ++generation;
+
     // Add an event to the queue
-    requestQueue.AddItemToBack(new cFolderLoadThumbnailsRequest(sFolderPath));
+    requestQueue.AddItemToBack(new cFolderLoadThumbnailsRequest(sFolderPath, newGeneration));
+    wakeUp.Signal();
+
+    // Let any suspended jobs from the previous folder see that they are no longer wanted
+    NotifyWaitingWorkers();
   }
 
   void cImageLoadThread::LoadFileFullHighPriority(const string_t& sFilePath)
   {
     // Add an event to the queue
-    highPriorityRequestQueue.AddItemToBack(new cFileLoadFullHighPriorityRequest(sFilePath));
+    highPriorityRequestQueue.AddItemToBack(new cFileLoadFullHighPriorityRequest(sFilePath, generation.load()));
+    wakeUp.Signal();
   }
 
   void cImageLoadThread::StopLoading()
   {
+    // Start a new generation so that the jobs that are already running see that they have been cancelled, the external tools are killed straight away
+    ++generation;
+
     loadingProcessInterface.SetStop();
 
     // Remove all the remaining events
     ClearEventQueue();
+
+    // Wake up the image load thread so that it can remove the remaining jobs
+    wakeUp.Signal();
+    NotifyWaitingWorkers();
+  }
+
+  void cImageLoadThread::SetVisibleRange(size_t firstVisibleIndex, size_t lastVisibleIndex)
+  {
+    ASSERT(firstVisibleIndex <= lastVisibleIndex);
+
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    {
+      spitfire::util::cLockObject lock(mutexVisibleRange);
+
+      if ((firstVisibleIndex == visibleRangeFromView.firstVisibleIndex) && (lastVisibleIndex == visibleRangeFromView.lastVisibleIndex)) return;
+
+      // Work out which way and how fast the view is scrolling
+      const float fSeconds = max(0.001f, std::chrono::duration<float>(now - visibleRangeChangedTime).count());
+      const size_t nItemsMoved = (firstVisibleIndex > visibleRangeFromView.firstVisibleIndex) ? (firstVisibleIndex - visibleRangeFromView.firstVisibleIndex) : (visibleRangeFromView.firstVisibleIndex - firstVisibleIndex);
+      if (firstVisibleIndex > visibleRangeFromView.firstVisibleIndex) visibleRangeFromView.iLookAheadDirection = 1;
+      else if (firstVisibleIndex < visibleRangeFromView.firstVisibleIndex) visibleRangeFromView.iLookAheadDirection = -1;
+
+      // Look ahead at least a page and further the faster we are scrolling
+      const size_t nVisibleItems = (lastVisibleIndex - firstVisibleIndex) + 1;
+      const size_t nItemsPerLookAhead = size_t(fLookAheadSeconds * (float(nItemsMoved) / fSeconds));
+      visibleRangeFromView.nLookAheadItems = spitfire::math::clamp(nItemsPerLookAhead, nVisibleItems, nMaximumLookAheadPages * nVisibleItems);
+
+      visibleRangeFromView.firstVisibleIndex = firstVisibleIndex;
+      visibleRangeFromView.lastVisibleIndex = lastVisibleIndex;
+      visibleRangeChangedTime = now;
+      bIsVisibleRangeChanged = true;
+    }
+
+    // Wake up the image load thread so that it can reschedule the jobs
+    wakeUp.Signal();
+  }
+
+  void cImageLoadThread::SetThumbnailSize(size_t nSizePixels)
+  {
+    const size_t nLevel = GetThumbnailLevelForSize(nSizePixels);
+    if (nThumbnailSize.exchange(nLevel) == nLevel) return;
+
+    // Wake up the image load thread so that it can load the thumbnails again at the new size
+    wakeUp.Signal();
+  }
+
+  size_t cImageLoadThread::GetGeneration() const
+  {
+    return generation.load();
+  }
+
+  bool cImageLoadThread::IsJobCancelled(const cImageLoadJob& job)
+  {
+    // NOTE: StopLoading starts a new generation too, so the generation is all we need to check
+    return (IsToStop() || (job.generation != generation.load()));
+  }
+
+  bool cImageLoadThread::IsJobSuspended(const cImageLoadJob& job)
+  {
+    if (job.priority == IMAGE_LOAD_PRIORITY::INTERACTIVE) return false;
+
+    std::lock_guard<std::mutex> lock(mutexInteractiveJobs);
+    return (nInteractiveJobs != 0);
+  }
+
+  bool cImageLoadThread::IsBatchCancelled(const std::list<cImageLoadJob*>& batch)
+  {
+    std::list<cImageLoadJob*>::const_iterator iter = batch.begin();
+    const std::list<cImageLoadJob*>::const_iterator iterEnd = batch.end();
+    while (iter != iterEnd) {
+      if (!IsJobCancelled(**iter)) return false;
+
+      iter++;
+    }
+
+    return true;
+  }
+
+  bool cImageLoadThread::WaitForInteractiveJobs(const std::list<cImageLoadJob*>& batch)
+  {
+    std::list<cImageLoadJob*>::const_iterator iter = batch.begin();
+    const std::list<cImageLoadJob*>::const_iterator iterEnd = batch.end();
+    while (iter != iterEnd) {
+      if ((*iter)->priority == IMAGE_LOAD_PRIORITY::INTERACTIVE) return true;
+
+      iter++;
+    }
+
+    // Suspend this batch until there are no interactive jobs left in the pipeline
+    std::unique_lock<std::mutex> lock(mutexInteractiveJobs);
+    while ((nInteractiveJobs != 0) && !IsBatchCancelled(batch)) conditionInteractiveJobs.wait(lock);
+
+    return !IsBatchCancelled(batch);
+  }
+
+  bool cImageLoadThread::WaitForInteractiveJobs(const cImageLoadJob& job)
+  {
+    if (job.priority == IMAGE_LOAD_PRIORITY::INTERACTIVE) return true;
+
+    // Suspend this job until there are no interactive jobs left in the pipeline
+    std::unique_lock<std::mutex> lock(mutexInteractiveJobs);
+    while ((nInteractiveJobs != 0) && !IsJobCancelled(job)) conditionInteractiveJobs.wait(lock);
+
+    return !IsJobCancelled(job);
   }
 
   void cImageLoadThread::ClearEventQueue()
@@ -101,309 +492,1065 @@ namespace diesel
     }
   }
 
-  bool cImageLoadThread::GetOrCreateDNGForRawFile(const string_t& sFolderPath, const string_t& sFileNameNoExtension, cPhoto& photo)
+  void cImageLoadThread::ClearPhotos()
   {
-    if (spitfire::filesystem::GetLastDirectory(sFolderPath) == TEXT("raw")) {
-      LOG<<"cImageLoadThread::GetOrCreateDNGForRawFile Skipping files in raw/ folder"<<std::endl;
-      return false;
-    } else LOG<<"folder="<<spitfire::filesystem::GetLastDirectory(sFolderPath)<<std::endl;
+    // Delete the photos
+    std::map<string_t, cPhoto*>::iterator iter = files.begin();
+    const std::map<string_t, cPhoto*>::iterator iterEnd = files.end();
+    while (iter != iterEnd) {
+      spitfire::SAFE_DELETE(iter->second);
 
-    const string_t sExtension = util::FindFileExtensionForRawFile(sFolderPath, sFileNameNoExtension);
-    ASSERT(!sExtension.empty());
+      iter++;
+    }
 
-    const string_t sFilePathRAW = spitfire::filesystem::MakeFilePath(sFolderPath, sFileNameNoExtension + sExtension);
+    files.clear();
+  }
 
-    // Convert the file to dng and use the dng
-    const string_t sFilePathDNG = cImageCacheManager::GetOrCreateDNGForRawFile(sFilePathRAW);
-    if (sFilePathDNG.empty()) {
-      // There was an error converting to dng so we need to notify the handler
-      handler.OnImageError(sFileNameNoExtension);
+  string_t cImageLoadThread::GetSourceFilePath(const string_t& sFolderPath, const string_t& sFileNameNoExtension, const cPhoto& photo)
+  {
+    if (photo.bHasDNG) return spitfire::filesystem::MakeFilePath(sFolderPath, sFileNameNoExtension + TEXT(".dng"));
 
-      return false;
-    }
+    ASSERT(photo.bHasImage);
+    const string_t sExtension = util::FindFileExtensionForImageFile(sFolderPath, sFileNameNoExtension);
+    if (sExtension.empty()) return TEXT("");
+
+    return spitfire::filesystem::MakeFilePath(sFolderPath, sFileNameNoExtension + sExtension);
+  }
+
+  void cImageLoadThread::MoveRawFileToRawFolder(const string_t& sFolderPath, const string_t& sFileNameNoExtension)
+  {
+    const string_t sExtension = util::FindFileExtensionForRawFile(sFolderPath, sFileNameNoExtension);
+    if (sExtension.empty()) return;
 
     // Creating the dng worked so we should move the raw file into the raw/ folder in that directory
     const string_t sRawFolderPath = spitfire::filesystem::MakeFilePath(sFolderPath, TEXT("raw"));
     if (!spitfire::filesystem::DirectoryExists(sRawFolderPath)) spitfire::filesystem::CreateDirectory(sRawFolderPath);
 
+    const string_t sFilePathRAW = spitfire::filesystem::MakeFilePath(sFolderPath, sFileNameNoExtension + sExtension);
     const string_t sFilePathRAWInRawFolder = spitfire::filesystem::MakeFilePath(sRawFolderPath, sFileNameNoExtension + sExtension);
     spitfire::filesystem::MoveFile(sFilePathRAW, sFilePathRAWInRawFolder);
+  }
 
-    photo.bHasDNG = true;
+  void cImageLoadThread::AddBackgroundRawToDNGJobs()
+  {
+    if (spitfire::filesystem::GetLastDirectory(sFolderPath) == TEXT("raw")) return;
+
+    const size_t requestGeneration = generation.load();
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    size_t index = nFolders;
+    std::map<string_t, cPhoto*>::const_iterator iter = files.begin();
+    const std::map<string_t, cPhoto*>::const_iterator iterEnd = files.end();
+    while (iter != iterEnd) {
+      const cPhoto* pPhoto = iter->second;
+      if (pPhoto->bHasRaw && !pPhoto->bHasDNG && pPhoto->bHasImage) {
+        const string_t sExtension = util::FindFileExtensionForRawFile(sFolderPath, iter->first);
+        if (!sExtension.empty()) {
+          cImageLoadJob* pJob = new cImageLoadJob(sFolderPath, iter->first, IMAGE_SIZE::THUMBNAIL, index, *pPhoto, requestGeneration, now);
+          pJob->priority = IMAGE_LOAD_PRIORITY::MAINTENANCE;
+
+          // Skip raw files that failed to convert the last time unless they or the converter tools have changed since then
+          SetFailureFile(*pJob, spitfire::filesystem::MakeFilePath(sFolderPath, iter->first + sExtension));
+
+          bool bIsAdded = false;
+          if (!IsFailedConversion(*pJob)) {
+            spitfire::util::cLockObject lock(mutexJobs);
+            bIsAdded = jobs.insert(pJob->GetKey()).second;
+          }
 
-    return true;
+          if (!bIsAdded) spitfire::SAFE_DELETE(pJob);
+          else PushJobToRawToDNGStage(pJob);
+        }
+      }
+
+      index++;
+      iter++;
+    }
   }
 
-  string_t cImageLoadThread::GetOrCreateThumbnail(const string_t& sFolderPath, const string_t& sFileNameNoExtension, IMAGE_SIZE imageSize, cPhoto& photo)
+  void cImageLoadThread::AddJob(const string_t& sFileNameNoExtension, IMAGE_SIZE imageSize, size_t index, size_t requestGeneration, const std::chrono::steady_clock::time_point& requestedTime)
   {
-    string_t sThumbnailFilePath;
+    std::map<string_t, cPhoto*>::const_iterator iter = files.find(sFileNameNoExtension);
+    ASSERT(iter != files.end());
+    if (iter == files.end()) return;
 
-    if (photo.bHasDNG) {
-      const string_t sFilePathDNG = spitfire::filesystem::MakeFilePath(sFolderPath, sFileNameNoExtension + TEXT(".dng"));
+    cImageLoadJob* pJob = new cImageLoadJob(sFolderPath, sFileNameNoExtension, imageSize, index, *(iter->second), requestGeneration, requestedTime);
 
-      // Create thumbnail from dng
-      sThumbnailFilePath = cImageCacheManager::GetOrCreateThumbnailForDNGFile(sFilePathDNG, imageSize);
-    } else {
-      ASSERT(photo.bHasImage);
-      const string_t sExtension = util::FindFileExtensionForImageFile(sFolderPath, sFileNameNoExtension);
-      ASSERT(!sExtension.empty());
-      const string_t sFilePathImage = spitfire::filesystem::MakeFilePath(sFolderPath, sFileNameNoExtension + sExtension);
+    {
+      // If this photo is already in the pipeline then this request is merged with the existing job
+      spitfire::util::cLockObject lock(mutexJobs);
+      if (!jobs.insert(pJob->GetKey()).second) {
+        LOG<<"cImageLoadThread::AddJob Merging duplicate request for \""<<pJob->GetKey()<<"\""<<std::endl;
+        spitfire::SAFE_DELETE(pJob);
+        return;
+      }
+    }
 
-      // Create thumbnail from image
-      sThumbnailFilePath = cImageCacheManager::GetOrCreateThumbnailForImageFile(sFilePathImage, imageSize);
+    if (pJob->priority == IMAGE_LOAD_PRIORITY::INTERACTIVE) {
+      std::lock_guard<std::mutex> lock(mutexInteractiveJobs);
+      nInteractiveJobs++;
     }
 
-    return sThumbnailFilePath;
+    AddPendingJob(pJob);
   }
 
-  void cImageLoadThread::LoadThumbnailImage(const string_t& sThumbnailFilePath, const string_t& sFileNameNoExtension, IMAGE_SIZE imageSize)
+  void cImageLoadThread::RemoveJob(cImageLoadJob* pJob)
   {
-    ASSERT(!sThumbnailFilePath.empty());
+    ASSERT(pJob != nullptr);
 
-    // Load the thumbnail image
-    voodoo::cImage* pImage = new voodoo::cImage;
+    bool bIsPipelineEmpty = false;
 
-    pImage->LoadFromFile(sThumbnailFilePath);
+    {
+      spitfire::util::cLockObject lock(mutexJobs);
+      jobs.erase(pJob->GetKey());
+      bIsPipelineEmpty = jobs.empty();
+    }
 
-    // Notify the handler
-    if (pImage->IsValid()) handler.OnImageLoaded(sFileNameNoExtension, imageSize, pImage);
-    else {
-      handler.OnImageError(sFileNameNoExtension);
+    if (pJob->priority == IMAGE_LOAD_PRIORITY::INTERACTIVE) {
+      {
+        std::lock_guard<std::mutex> lock(mutexInteractiveJobs);
+        ASSERT(nInteractiveJobs != 0);
+        nInteractiveJobs--;
+      }
 
-      // Delete the image
-      delete pImage;
+      // Resume the suspended jobs
+      conditionInteractiveJobs.notify_all();
     }
+
+    spitfire::SAFE_DELETE(pJob);
+
+    // Wake up the image load thread so that it can do the work that waits for the pipeline to be idle
+    if (bIsPipelineEmpty) wakeUp.Signal();
   }
 
-  void cImageLoadThread::HandleHighPriorityRequestQueue(const string_t& sFolderPath, std::map<string_t, cPhoto*>& files)
+  void cImageLoadThread::ClearPendingJobs()
   {
-    while (true) {
-      // Loading the image can take a while so we need to check again if we should stop
-      if (IsToStop() || loadingProcessInterface.IsToStop()) break;
+    std::list<cImageLoadJob*> removed;
+    removed.swap(pendingFullJobs);
 
-      //LOG<<"cImageLoadThread::ThreadFunction Loop getting event"<<std::endl;
-      cFileLoadFullHighPriorityRequest* pRequest = highPriorityRequestQueue.RemoveItemFromFront();
-      if (pRequest == nullptr) break;
+    const size_t n = pendingThumbnailJobs.size();
+    for (size_t i = 0; i < n; i++) {
+      if (pendingThumbnailJobs[i] != nullptr) removed.push_back(pendingThumbnailJobs[i]);
+    }
 
-      const string_t sFileNameNoExtension = pRequest->sFileNameNoExtension;
-      LOG<<"cImageLoadThread::HandleHighPriorityRequestQueue Request found \""<<sFileNameNoExtension<<"\""<<std::endl;
+    pendingThumbnailJobs.clear();
+    pendingThumbnailOrder.clear();
 
-      // Convert from raw to dng
-      std::map<string_t, cPhoto*>::iterator iter = files.find(sFileNameNoExtension);
-      ASSERT(iter != files.end());
-      if (iter != files.end()) {
-        LOG<<"cImageLoadThread::HandleHighPriorityRequestQueue Photo found"<<std::endl;
-        cPhoto* pPhoto = iter->second;
+    // Remove the jobs that haven't been started yet from each stage
+    if (pHashQueue != nullptr) pHashQueue->RemoveAll(removed);
+    if (pRawToDNGQueue != nullptr) pRawToDNGQueue->RemoveAll(removed);
+    if (pConvertQueue != nullptr) pConvertQueue->RemoveAll(removed);
+    if (pDecodeQueue != nullptr) pDecodeQueue->RemoveAll(removed);
 
-        bool bStop = false;
+    std::list<cImageLoadJob*>::iterator iter = removed.begin();
+    const std::list<cImageLoadJob*>::iterator iterEnd = removed.end();
+    while (iter != iterEnd) {
+      RemoveJob(*iter);
 
-        if (pPhoto->bHasRaw && !pPhoto->bHasDNG) {
-          LOG<<"cImageLoadThread::HandleHighPriorityRequestQueue Creating DNG"<<std::endl;
-          if (!GetOrCreateDNGForRawFile(sFolderPath, sFileNameNoExtension, *pPhoto)) {
-            // If the conversion failed then we need to get out of here
-            bStop = true;
-          }
-        }
+      iter++;
+    }
+  }
 
-        // Creating a dng file can take a while so we need to check again if we should stop
-        if (IsToStop() || loadingProcessInterface.IsToStop()) bStop = true;
+  void cImageLoadThread::FeedPipeline()
+  {
+    // Move as many jobs into the hash stage as it has room for, the rest wait until the hash queue signals us that there is room
+    // NOTE: We are the only thread that adds to the hash queue so if it isn't full now it won't be full when we add the job
+    // Full size jobs skip ahead of the thumbnails
+    while (!pendingFullJobs.empty()) {
+      cImageLoadJob* pJob = RemoveNextPendingJob();
+      if (!pHashQueue->PushFront(pJob)) {
+        // The queue has been closed
+        AddPendingJob(pJob);
+        return;
+      }
+    }
 
-        if (!bStop) {
-          LOG<<"cImageLoadThread::HandleHighPriorityRequestQueue Creating thumbnail"<<std::endl;
-          const string_t sThumbnailFilePath = GetOrCreateThumbnail(sFolderPath, sFileNameNoExtension, IMAGE_SIZE::FULL, *pPhoto);
-          ASSERT(!sThumbnailFilePath.empty());
+    while (!pHashQueue->IsFull()) {
+      cImageLoadJob* pJob = RemoveNextPendingJob();
+      if (pJob == nullptr) break;
 
-          LOG<<"cImageLoadThread::HandleHighPriorityRequestQueue Loading thumbnail"<<std::endl;
-          LoadThumbnailImage(sThumbnailFilePath, sFileNameNoExtension, IMAGE_SIZE::FULL);
-        }
+      if (!pHashQueue->TryPushBack(pJob)) {
+        // The queue has been closed
+        AddPendingJob(pJob);
+        break;
       }
+    }
+  }
 
-      spitfire::SAFE_DELETE(pRequest);
+  bool cImageLoadThread::IsPipelineIdle() const
+  {
+    if (!pendingFullJobs.empty() || !pendingThumbnailOrder.empty()) return false;
+
+    spitfire::util::cLockObject lock(mutexJobs);
+    return jobs.empty();
+  }
+
+  void cImageLoadThread::UpdateVisibleRange()
+  {
+    {
+      spitfire::util::cLockObject lock(mutexVisibleRange);
+
+      if (!bIsVisibleRangeChanged) return;
+
+      visibleRange = visibleRangeFromView;
+      bIsVisibleRangeChanged = false;
     }
+
+    ReschedulePendingJobs();
   }
 
-  void cImageLoadThread::ThreadFunction()
+  void cImageLoadThread::UpdateThumbnailSize()
   {
-    LOG<<"cImageLoadThread::ThreadFunction"<<std::endl;
+    const size_t nSize = nThumbnailSize.load();
+    if (nSize == nHandledThumbnailSize) return;
 
-    std::list<string_t> folders;
-    std::map<string_t, cPhoto*> files;
+    const bool bIsBigger = (nSize > nHandledThumbnailSize);
+    nHandledThumbnailSize = nSize;
 
-    string_t sFolderPath;
+    // Zooming out keeps the thumbnails that are already loaded, they are just drawn smaller
+    if (!bIsBigger) return;
 
-    while (true) {
-      //LOG<<"cImageLoadThread::ThreadFunction Loop"<<std::endl;
-      soAction.WaitTimeoutMS(1000);
+    // The user has stopped loading this folder, the thumbnails are loaded at the new size when the folder is opened again
+    if (pendingThumbnailJobs.empty()) return;
 
-      if (IsToStop()) break;
+    LOG<<"cImageLoadThread::UpdateThumbnailSize Loading thumbnails again at "<<nSize<<" pixels"<<std::endl;
 
-      // Check if we need to handle a high priority request
-      HandleHighPriorityRequestQueue(sFolderPath, files);
+    // Load the thumbnails that have been loaded at a smaller level again, the thumbnails that are still in the pipeline are checked when they are handed off
+    const size_t requestGeneration = generation.load();
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
 
-      //LOG<<"cImageLoadThread::ThreadFunction Loop getting event"<<std::endl;
-      cFolderLoadThumbnailsRequest* pRequest = requestQueue.RemoveItemFromFront();
-      if (pRequest != nullptr) {
-        // Remove the known folders
-        folders.clear();
+    size_t index = nFolders;
+    std::map<string_t, cPhoto*>::const_iterator iter = files.begin();
+    const std::map<string_t, cPhoto*>::const_iterator iterEnd = files.end();
+    while (iter != iterEnd) {
+      const size_t nLoadedThumbnailSize = iter->second->nLoadedThumbnailSize;
+      if ((nLoadedThumbnailSize != 0) && (nLoadedThumbnailSize < nSize)) AddJob(iter->first, IMAGE_SIZE::THUMBNAIL, index, requestGeneration, now);
 
-        {
-          // Delete the photos
-          std::map<string_t, cPhoto*>::iterator iter = files.begin();
-          const std::map<string_t, cPhoto*>::iterator iterEnd = files.end();
-          while (iter != iterEnd) {
-            spitfire::SAFE_DELETE(iter->second);
+      index++;
+      iter++;
+    }
+  }
 
-            iter++;
-          }
+  void cImageLoadThread::ReschedulePendingJobs()
+  {
+    // Rank the pending thumbnail jobs again for the new visible range
+    std::set<std::pair<size_t, size_t>> order;
+    std::set<std::pair<size_t, size_t>>::const_iterator iterOrder = pendingThumbnailOrder.begin();
+    const std::set<std::pair<size_t, size_t>>::const_iterator iterOrderEnd = pendingThumbnailOrder.end();
+    while (iterOrder != iterOrderEnd) {
+      order.insert(std::make_pair(GetPendingThumbnailJobRank(iterOrder->second), iterOrder->second));
+
+      iterOrder++;
+    }
 
-          files.clear();
-        }
+    pendingThumbnailOrder.swap(order);
 
-        // Change our folder
-        sFolderPath = pRequest->sFolderPath;
+    // Take back the jobs that haven't been hashed yet so that they can be fed into the pipeline again in the new order
+    std::list<cImageLoadJob*> removed;
+    pHashQueue->RemoveAll(removed);
 
-        // Collect a list of the files in this directory
-        for (spitfire::filesystem::cFolderIterator iter(sFolderPath); iter.IsValid(); iter.Next()) {
-          if (iter.IsFolder()) {
-            const string_t sFolderName = iter.GetFileOrFolder();
+    // Keep the full size jobs in the same order
+    std::list<cImageLoadJob*>::reverse_iterator iter = removed.rbegin();
+    const std::list<cImageLoadJob*>::reverse_iterator iterEnd = removed.rend();
+    while (iter != iterEnd) {
+      cImageLoadJob* pJob = *iter;
 
-            // Tell the handler that we found a folder
-            handler.OnFolderFound(sFolderName);
+      // Throw away jobs from a previous folder
+      if ((pJob->generation != generation.load()) || (pJob->sFolderPath != sFolderPath)) RemoveJob(pJob);
+      else AddPendingJob(pJob);
 
-            folders.push_back(sFolderName);
-            continue;
-          }
+      iter++;
+    }
 
-          const string_t sFilePath = iter.GetFullPath();
-          const string_t sFileNameNoExtension = spitfire::filesystem::GetFileNoExtension(iter.GetFileOrFolder());
+    // The jobs that have already been hashed keep their place in the raw to dng and convert queues, we only move the thumbnails that have just become
+    // visible to the front so that they don't have to wait behind the ones that have just scrolled out of view
+    // NOTE: The decode stage is quick so we leave those jobs where they are
+    const size_t currentGeneration = generation.load();
+    auto updatePriority = [this, currentGeneration](cImageLoadJob& job) {
+      if ((job.priority == IMAGE_LOAD_PRIORITY::VISIBLE) || (job.priority == IMAGE_LOAD_PRIORITY::PREFETCH)) {
+        if (job.generation == currentGeneration) job.priority = GetThumbnailJobPriority(job.index);
+      }
 
-          const string_t sExtension = spitfire::filesystem::GetExtension(iter.GetFileOrFolder());
-          const string_t sExtensionLower = spitfire::string::ToLower(sExtension);
-          if (!util::IsFileTypeSupported(sExtensionLower)) continue;
+      return (job.priority == IMAGE_LOAD_PRIORITY::INTERACTIVE) || (job.priority == IMAGE_LOAD_PRIORITY::VISIBLE);
+    };
+    pRawToDNGQueue->MoveMatchingToFront(updatePriority);
+    pConvertQueue->MoveMatchingToFront(updatePriority);
+  }
 
-          // Change the extension of all supported files to lower case
-          if (sExtensionLower != sExtension) {
-            const string_t sFrom = spitfire::filesystem::MakeFilePath(sFolderPath, sFileNameNoExtension + sExtension);
-            const string_t sTo = spitfire::filesystem::MakeFilePath(sFolderPath, sFileNameNoExtension + sExtensionLower);
-            LOG<<"cImageLoadThread::ThreadFunction Moving file from \""<<sFrom<<"\" to\""<<sTo<<"\""<<std::endl;
-            spitfire::filesystem::MoveFile(sFrom, sTo);
-          }
+  void cImageLoadThread::AddPendingJob(cImageLoadJob* pJob)
+  {
+    ASSERT(pJob != nullptr);
 
-          cPhoto* pPhoto = nullptr;
+    if (pJob->imageSize == IMAGE_SIZE::FULL) {
+      pendingFullJobs.push_front(pJob);
+      return;
+    }
 
-          std::map<string_t, cPhoto*>::iterator found = files.find(sFileNameNoExtension);
-          if (found != files.end()) pPhoto = found->second;
-          else {
-            // Add a new photo
-            pPhoto = new cPhoto;
-            files[sFileNameNoExtension] = pPhoto;
-            pPhoto->sFilePath = sFilePath;
-          }
+    ASSERT(pJob->index < pendingThumbnailJobs.size());
+    ASSERT(pendingThumbnailJobs[pJob->index] == nullptr);
+    if ((pJob->index >= pendingThumbnailJobs.size()) || (pendingThumbnailJobs[pJob->index] != nullptr)) {
+      RemoveJob(pJob);
+      return;
+    }
 
-          if (util::IsFileTypeRaw(sExtensionLower)) pPhoto->bHasRaw = true;
-          else if (sExtensionLower == TEXT(".dng")) pPhoto->bHasDNG = true;
-          else if (util::IsFileTypeImage(sExtensionLower)) pPhoto->bHasImage = true;
-        }
+    pendingThumbnailJobs[pJob->index] = pJob;
+    pendingThumbnailOrder.insert(std::make_pair(GetPendingThumbnailJobRank(pJob->index), pJob->index));
+  }
 
+  cImageLoadJob* cImageLoadThread::RemoveNextPendingJob()
+  {
+    // Full size images are always loaded first
+    if (!pendingFullJobs.empty()) {
+      cImageLoadJob* pJob = pendingFullJobs.front();
+      pendingFullJobs.pop_front();
+      return pJob;
+    }
 
-        {
-          // Tell the handler about the files that were found
-          std::map<string_t, cPhoto*>::const_iterator iter = files.begin();
-          const std::map<string_t, cPhoto*>::const_iterator iterEnd = files.end();
-          while (iter != iterEnd) {
-            handler.OnFileFound(iter->first);
+    if (pendingThumbnailOrder.empty()) return nullptr;
 
-            iter++;
-          }
-        }
+    const size_t index = pendingThumbnailOrder.begin()->second;
+    pendingThumbnailOrder.erase(pendingThumbnailOrder.begin());
 
+    cImageLoadJob* pJob = pendingThumbnailJobs[index];
+    ASSERT(pJob != nullptr);
+    pendingThumbnailJobs[index] = nullptr;
 
-        // Load the images
-        std::map<string_t, cPhoto*>::iterator iter = files.begin();
-        const std::map<string_t, cPhoto*>::iterator iterEnd = files.end();
-        while (iter != iterEnd) {
-          if (IsToStop() || loadingProcessInterface.IsToStop()) break;
+    pJob->priority = GetThumbnailJobPriority(index);
 
-          HandleHighPriorityRequestQueue(sFolderPath, files);
+    return pJob;
+  }
 
-          if (IsToStop() || loadingProcessInterface.IsToStop()) break;
+  size_t cImageLoadThread::GetPendingThumbnailJobRank(size_t index) const
+  {
+    // The visible photos go first, from the top of the view
+    if ((index >= visibleRange.firstVisibleIndex) && (index <= visibleRange.lastVisibleIndex)) return 0;
+
+    // Then we work outwards from the visible photos, favouring the direction that the view is scrolling in until we have looked far enough ahead
+    // Each step takes nLookAheadStepsPerStepBehind photos ahead (Or one once we are past the look ahead distance) and then one photo behind
+    const bool bIsScrollingDown = (visibleRange.iLookAheadDirection >= 0);
+    const bool bIsAfter = (index > visibleRange.lastVisibleIndex);
+    const size_t nDistance = bIsAfter ? (index - visibleRange.lastVisibleIndex) : (visibleRange.firstVisibleIndex - index);
+    if (bIsAfter != bIsScrollingDown) return (2 * nDistance) + 1;
+
+    const size_t nLookAheadItems = visibleRange.nLookAheadItems;
+    const size_t nLookAheadSteps = (nLookAheadItems + nLookAheadStepsPerStepBehind - 1) / nLookAheadStepsPerStepBehind;
+    const size_t nSteps = (nDistance <= nLookAheadItems) ? ((nDistance + nLookAheadStepsPerStepBehind - 1) / nLookAheadStepsPerStepBehind) : (nLookAheadSteps + (nDistance - nLookAheadItems));
+    return 2 * nSteps;
+  }
 
-          const string_t sFileNameNoExtension = iter->first;
+  IMAGE_LOAD_PRIORITY cImageLoadThread::GetThumbnailJobPriority(size_t index) const
+  {
+    const bool bIsVisible = ((index >= visibleRange.firstVisibleIndex) && (index <= visibleRange.lastVisibleIndex));
+    return bIsVisible ? IMAGE_LOAD_PRIORITY::VISIBLE : IMAGE_LOAD_PRIORITY::PREFETCH;
+  }
 
-          // Convert from raw to dng
-          cPhoto* pPhoto = iter->second;
-          ASSERT(pPhoto != nullptr);
-          if (pPhoto->bHasRaw && !pPhoto->bHasDNG) {
-            if (!GetOrCreateDNGForRawFile(sFolderPath, sFileNameNoExtension, *pPhoto)) {
-              // If the conversion failed then we need to skip to the next file
-              iter++;
-              continue;
-            }
-          }
+  void cImageLoadThread::PushJobToStage(cBoundedQueue<cImageLoadJob>& queue, cImageLoadJob* pJob)
+  {
+    // Don't pass on jobs that we no longer want
+    if (IsJobCancelled(*pJob)) {
+      RemoveJob(pJob);
+      return;
+    }
 
-          // Creating a dng file can take a while so we need to check again if we should stop
-          if (IsToStop() || loadingProcessInterface.IsToStop()) break;
+    // The user is waiting for full size images so they skip ahead of the thumbnails
+    // Otherwise this blocks while the next stage is full, if the queue has been closed we are shutting down so we can throw the job away
+    const bool bResult = (pJob->imageSize == IMAGE_SIZE::FULL) ? queue.PushFront(pJob) : queue.PushBack(pJob);
+    if (!bResult) RemoveJob(pJob);
+  }
 
-          HandleHighPriorityRequestQueue(sFolderPath, files);
+  void cImageLoadThread::PushJobToRawToDNGStage(cImageLoadJob* pJob)
+  {
+    if (IsJobCancelled(*pJob)) {
+      RemoveJob(pJob);
+      return;
+    }
 
-          if (IsToStop() || loadingProcessInterface.IsToStop()) break;
+    // Raw conversions are slow so we never wait for room in the raw to dng queue, the hash worker can carry on with the photos that don't need converting
+    const bool bResult = (pJob->imageSize == IMAGE_SIZE::FULL) ? pRawToDNGQueue->PushFront(pJob) : pRawToDNGQueue->PushBackWithoutWaiting(pJob);
+    if (!bResult) {
+      RemoveJob(pJob);
+      return;
+    }
 
-          const string_t sThumbnailFilePath = GetOrCreateThumbnail(sFolderPath, sFileNameNoExtension, IMAGE_SIZE::THUMBNAIL, *pPhoto);
+    // Photos that only have a raw file go ahead of the background conversions of photos that are already shown from their image
+    if (pJob->priority != IMAGE_LOAD_PRIORITY::MAINTENANCE) pRawToDNGQueue->MoveMatchingToFront([](const cImageLoadJob& job) { return (job.priority != IMAGE_LOAD_PRIORITY::MAINTENANCE); });
+  }
 
-          // Loading the image can take a while so we need to check again if we should stop
-          if (IsToStop() || loadingProcessInterface.IsToStop()) break;
+  void cImageLoadThread::HandOffJob(cImageLoadJob* pJob)
+  {
+    handOffQueue.AddItemToBack(pJob);
+    wakeUp.Signal();
+  }
+
+  void cImageLoadThread::HandOffJobError(cImageLoadJob* pJob)
+  {
+    pJob->bIsError = true;
+    HandOffJob(pJob);
+  }
+
+  void cImageLoadThread::HandOffJobFailedConversion(cImageLoadJob* pJob)
+  {
+    if (!pJob->sFailureFilePath.empty()) cImageCacheManager::AddFailedConversion(pJob->sFailureFilePath, pJob->imageSize, pJob->failureFileStat);
+
+    HandOffJobError(pJob);
+  }
+
+  void cImageLoadThread::HandOffPlaceholder(const cImageLoadJob& job)
+  {
+    // Only jpegs have an EXIF thumbnail that we can read quickly
+    const string_t sExtensionLower = spitfire::string::ToLower(spitfire::filesystem::GetExtension(job.sSourceFilePath));
+    if (cConverterBackends::GetFileTypeForExtension(sExtensionLower) != CONVERTER_FILE_TYPE::JPEG) return;
+
+    std::vector<uint8_t> pixels;
+    size_t width = 0;
+    size_t height = 0;
+    if (!LoadEXIFThumbnail(job.sSourceFilePath, pixels, width, height)) return;
+
+    voodoo::cImage* pImage = new voodoo::cImage;
+    if (!pImage->CreateFromBuffer(pixels.data(), width, height, voodoo::PIXELFORMAT::R8G8B8A8)) {
+      spitfire::SAFE_DELETE(pImage);
+      return;
+    }
+
+    placeholderQueue.AddItemToBack(new cImageLoadPlaceholder(job.sFileNameNoExtension, job.generation, pImage));
+    wakeUp.Signal();
+  }
+
+  void cImageLoadThread::SetFailureFile(cImageLoadJob& job, const string_t& sFilePath)
+  {
+    // The stat is taken before we try the file so that a file that is still being written while we convert it is tried again next time
+    job.sFailureFilePath = sFilePath;
+    if (sFilePath.empty() || !GetFileStat(sFilePath, job.failureFileStat)) job.sFailureFilePath.clear();
+  }
+
+  bool cImageLoadThread::IsFailedConversion(const cImageLoadJob& job)
+  {
+    if (job.sFailureFilePath.empty() || !cImageCacheManager::IsFailedConversion(job.sFailureFilePath, job.imageSize, job.failureFileStat)) return false;
+
+    LOG<<"cImageLoadThread::IsFailedConversion Skipping \""<<job.sFailureFilePath<<"\" which failed the last time that it was tried"<<std::endl;
+    return true;
+  }
+
+  void cImageLoadThread::ProcessJob(IMAGE_LOAD_STAGE stage, cImageLoadJob* pJob)
+  {
+    ASSERT(pJob != nullptr);
+
+    // Throw away jobs that we no longer want
+    if (IsJobCancelled(*pJob)) {
+      RemoveJob(pJob);
+      return;
+    }
+
+    switch (stage) {
+      case IMAGE_LOAD_STAGE::HASH: {
+        ProcessHashStage(pJob);
+        break;
+      }
+      case IMAGE_LOAD_STAGE::RAW_TO_DNG: {
+        // The worker that is reserved for interactive jobs converts them on their own
+        std::list<cImageLoadJob*> batch(1, pJob);
+        ProcessRawToDNGStage(batch);
+        break;
+      }
+      case IMAGE_LOAD_STAGE::CONVERT: {
+        ProcessConvertStage(pJob);
+        break;
+      }
+      case IMAGE_LOAD_STAGE::DECODE: {
+        ProcessDecodeStage(pJob);
+        break;
+      }
+    }
+  }
+
+  void cImageLoadThread::ProcessHashStage(cImageLoadJob* pJob)
+  {
+    // Raw files have to be converted before we know which file to hash, photos that also have an image use the image until the raw file has been converted
+    if (pJob->photo.bHasRaw && !pJob->photo.bHasDNG && !pJob->photo.bHasImage && pJob->sCacheKey.empty()) {
+      // Skip raw files that failed to convert the last time unless they or the converter tools have changed since then
+      const string_t sExtension = util::FindFileExtensionForRawFile(pJob->sFolderPath, pJob->sFileNameNoExtension);
+      const string_t sRawFilePath = sExtension.empty() ? TEXT("") : spitfire::filesystem::MakeFilePath(pJob->sFolderPath, pJob->sFileNameNoExtension + sExtension);
+      SetFailureFile(*pJob, sRawFilePath);
+      if (IsFailedConversion(*pJob)) {
+        HandOffJobError(pJob);
+        return;
+      }
+
+      // Most raw files have a jpeg preview that we can use, or can be developed by LibRaw, straight away without converting them to dng
+      if (sRawFilePath.empty() || !cImageCacheManager::IsRawFileSupported(sRawFilePath, pJob->imageSize)) {
+        PushJobToRawToDNGStage(pJob);
+        return;
+      }
+
+      pJob->sSourceFilePath = sRawFilePath;
+      pJob->sCacheKey = cImageCacheManager::GetCacheKeyForFile(pJob->sSourceFilePath);
+      if (pJob->sCacheKey.empty()) {
+        HandOffJobError(pJob);
+        return;
+      }
+    }
+
+    // Jobs that were rescheduled may have already been hashed
+    if (pJob->sCacheKey.empty()) {
+      pJob->sSourceFilePath = GetSourceFilePath(pJob->sFolderPath, pJob->sFileNameNoExtension, pJob->photo);
+      if (pJob->sSourceFilePath.empty()) {
+        HandOffJobError(pJob);
+        return;
+      }
 
-          HandleHighPriorityRequestQueue(sFolderPath, files);
+      // Skip files that failed the last time unless they or the converter tools have changed since then, we don't even hash them
+      SetFailureFile(*pJob, pJob->sSourceFilePath);
+      if (IsFailedConversion(*pJob)) {
+        HandOffJobError(pJob);
+        return;
+      }
+
+      pJob->sCacheKey = cImageCacheManager::GetCacheKeyForFile(pJob->sSourceFilePath);
+      if (pJob->sCacheKey.empty()) {
+        HandOffJobError(pJob);
+        return;
+      }
+    }
 
-          if (IsToStop() || loadingProcessInterface.IsToStop()) break;
+    // If the image is already in the cache then we can skip the convert stage
+    pJob->cachedImage = cImageCacheManager::GetCachedImage(pJob->sCacheKey, pJob->imageSize);
+    if (pJob->cachedImage.IsValid()) {
+      PushJobToStage(*pDecodeQueue, pJob);
+      return;
+    }
+
+    // Show a placeholder for thumbnails that haven't been shown yet while we create the real thumbnail
+    if ((pJob->imageSize == IMAGE_SIZE::THUMBNAIL) && (pJob->photo.nLoadedThumbnailSize == 0)) HandOffPlaceholder(*pJob);
 
-          if (sThumbnailFilePath.empty()) LOG<<"cImageLoadThread::ThreadFunction Error creating thumbnail \""<<sFolderPath<<"\" for \""<<pPhoto->sFilePath<<"\""<<std::endl;
-          else LoadThumbnailImage(sThumbnailFilePath, sFileNameNoExtension, IMAGE_SIZE::THUMBNAIL);
+    PushJobToStage(*pConvertQueue, pJob);
+  }
+
+  void cImageLoadThread::ProcessRawToDNGStage(std::list<cImageLoadJob*>& batch)
+  {
+    ASSERT(!batch.empty());
+
+    // Let any interactive jobs finish before we start a slow conversion
+    WaitForInteractiveJobs(batch);
+
+    // Throw away the jobs that we no longer want
+    std::list<cImageLoadJob*> jobs;
+    {
+      std::list<cImageLoadJob*>::iterator iter = batch.begin();
+      const std::list<cImageLoadJob*>::iterator iterEnd = batch.end();
+      while (iter != iterEnd) {
+        cImageLoadJob* pJob = *iter;
+        if (IsJobCancelled(*pJob)) RemoveJob(pJob);
+        else if (spitfire::filesystem::GetLastDirectory(pJob->sFolderPath) == TEXT("raw")) {
+          LOG<<"cImageLoadThread::ProcessRawToDNGStage Skipping files in raw/ folder"<<std::endl;
+          RemoveJob(pJob);
+        } else jobs.push_back(pJob);
+
+        iter++;
+      }
+
+      batch.clear();
+    }
+
+    if (jobs.empty()) return;
+
+    // The thumbnail and full size jobs for a photo can be in the same batch, each photo is only converted once
+    std::set<string_t> photos;
+    {
+      std::list<cImageLoadJob*>::const_iterator iter = jobs.begin();
+      const std::list<cImageLoadJob*>::const_iterator iterEnd = jobs.end();
+      while (iter != iterEnd) {
+        photos.insert(spitfire::filesystem::MakeFilePath((*iter)->sFolderPath, (*iter)->sFileNameNoExtension));
+
+        iter++;
+      }
+    }
+
+    // Wait for any other worker that is converting one of these photos
+    {
+      std::unique_lock<std::mutex> lock(mutexRawConversions);
+      while (true) {
+        bool bIsAnyPhotoConverting = false;
+        std::set<string_t>::const_iterator iter = photos.begin();
+        const std::set<string_t>::const_iterator iterEnd = photos.end();
+        while (iter != iterEnd) {
+          if (rawConversions.find(*iter) != rawConversions.end()) {
+            bIsAnyPhotoConverting = true;
+            break;
+          }
 
           iter++;
         }
 
-        //LOG<<"cImageLoadThread::ThreadFunction Loop deleting event"<<std::endl;
-        spitfire::SAFE_DELETE(pRequest);
+        if (!bIsAnyPhotoConverting) break;
 
-        // Now that have processed this event we can enforce the maximum cache size if we have not been asked to stop
-        // We don't do this if we are stopping because it takes ages on Windows
-        if (!IsToStop()) {
-          size_t nTempMaximumCacheSizeGB = 0;
+        conditionRawConversions.wait(lock);
+      }
 
-          {
-            spitfire::util::cLockObject lock(mutexMaximumCacheSize);
-            nTempMaximumCacheSizeGB = nMaximumCacheSizeGB;
-          }
+      rawConversions.insert(photos.begin(), photos.end());
+    }
 
-          cImageCacheManager::EnforceMaximumCacheSize(nTempMaximumCacheSizeGB);
+    // Another worker may have already converted some of these photos while we were waiting
+    std::set<string_t> converted;
+    std::vector<string_t> rawPhotos;
+    std::vector<string_t> rawFilePaths;
+    {
+      std::set<string_t>::const_iterator iter = photos.begin();
+      const std::set<string_t>::const_iterator iterEnd = photos.end();
+      while (iter != iterEnd) {
+        const string_t sFolderPath = spitfire::filesystem::GetFolder(*iter);
+        const string_t sFileNameNoExtension = spitfire::filesystem::GetFile(*iter);
+        const string_t sExtension = util::FindFileExtensionForRawFile(sFolderPath, sFileNameNoExtension);
+        if (spitfire::filesystem::FileExists(*iter + TEXT(".dng"))) converted.insert(*iter);
+        else if (!sExtension.empty()) {
+          rawPhotos.push_back(*iter);
+          rawFilePaths.push_back(*iter + sExtension);
         }
-      } else {
-        // If the queue is empty then we know that there are no more actions and it is safe to reset our stop loading signal object
-        loadingProcessInterface.Reset();
+
+        iter++;
       }
+    }
 
-      // Try to avoid hogging the CPU
-      spitfire::util::SleepThisThreadMS(1);
-      spitfire::util::YieldThisThread();
+    // Convert them all with one run of the converter
+    std::set<string_t> invalid;
+    if (!rawFilePaths.empty()) {
+      std::vector<string_t> dngFilePaths;
+      std::vector<CONVERSION_RESULT> results;
+      cBatchProcessInterface processInterface(*this, jobs);
+      cImageCacheManager::GetOrCreateDNGsForRawFiles(rawFilePaths, dngFilePaths, results, processInterface);
+
+      const size_t n = rawPhotos.size();
+      for (size_t i = 0; i < n; i++) {
+        if (dngFilePaths[i].empty()) {
+          if (results[i] == CONVERSION_RESULT::INVALID_FILE) invalid.insert(rawPhotos[i]);
+          continue;
+        }
+
+        MoveRawFileToRawFolder(spitfire::filesystem::GetFolder(rawPhotos[i]), spitfire::filesystem::GetFile(rawPhotos[i]));
+        converted.insert(rawPhotos[i]);
+      }
     }
 
     {
-      // Delete the photos
-      std::map<string_t, cPhoto*>::iterator iter = files.begin();
-      const std::map<string_t, cPhoto*>::iterator iterEnd = files.end();
+      std::lock_guard<std::mutex> lock(mutexRawConversions);
+      std::set<string_t>::const_iterator iter = photos.begin();
+      const std::set<string_t>::const_iterator iterEnd = photos.end();
       while (iter != iterEnd) {
-        spitfire::SAFE_DELETE(iter->second);
+        rawConversions.erase(*iter);
 
         iter++;
       }
+    }
 
-      files.clear();
+    conditionRawConversions.notify_all();
+
+    // Each job carries on or fails on its own
+    std::list<cImageLoadJob*>::iterator iter = jobs.begin();
+    const std::list<cImageLoadJob*>::iterator iterEnd = jobs.end();
+    while (iter != iterEnd) {
+      cImageLoadJob* pJob = *iter;
+      const string_t sPhoto = spitfire::filesystem::MakeFilePath(pJob->sFolderPath, pJob->sFileNameNoExtension);
+      if (converted.find(sPhoto) != converted.end()) {
+        pJob->photo.bHasDNG = true;
+
+        // Background conversions are finished, the photo is still shown from its image
+        if (pJob->priority == IMAGE_LOAD_PRIORITY::MAINTENANCE) HandOffJob(pJob);
+        else PushJobToStage(*pConvertQueue, pJob);
+      } else if (IsJobCancelled(*pJob)) {
+        // The conversion was killed because the job was cancelled
+        RemoveJob(pJob);
+      } else if (invalid.find(sPhoto) != invalid.end()) {
+        // The converter couldn't read the raw file so we need to notify the handler
+        HandOffJobFailedConversion(pJob);
+      } else {
+        // There was an error converting to dng that may not happen next time, such as a timeout, so we need to notify the handler
+        HandOffJobError(pJob);
+      }
+
+      iter++;
+    }
+  }
+
+  void cImageLoadThread::ProcessConvertStage(cImageLoadJob* pJob)
+  {
+    // Let any interactive jobs finish before we start a slow conversion
+    if (!WaitForInteractiveJobs(*pJob)) {
+      RemoveJob(pJob);
+      return;
+    }
+
+    // Raw files have already been converted to dng by the raw to dng stage, have a preview that we can use, or the photo has an image that we can use instead
+    ASSERT(!pJob->photo.bHasRaw || pJob->photo.bHasDNG || pJob->photo.bHasImage || !pJob->sCacheKey.empty());
+
+    // Jobs that came from the raw to dng stage haven't been hashed yet, from here on failures are recorded against the dng
+    if (pJob->sCacheKey.empty()) {
+      pJob->sSourceFilePath = GetSourceFilePath(pJob->sFolderPath, pJob->sFileNameNoExtension, pJob->photo);
+      SetFailureFile(*pJob, pJob->sSourceFilePath);
+      if (!pJob->sSourceFilePath.empty()) pJob->sCacheKey = cImageCacheManager::GetCacheKeyForFile(pJob->sSourceFilePath);
+      if (pJob->sCacheKey.empty()) {
+        HandOffJobError(pJob);
+        return;
+      }
+    }
+
+    // Create the cached image
+    CONVERSION_RESULT result = CONVERSION_RESULT::SUCCESS;
+    cJobProcessInterface processInterface(*this, *pJob);
+    if (pJob->photo.bHasDNG) pJob->cachedImage = cImageCacheManager::GetOrCreateThumbnailForDNGFile(pJob->sSourceFilePath, pJob->sCacheKey, pJob->imageSize, result, processInterface);
+    else pJob->cachedImage = cImageCacheManager::GetOrCreateThumbnailForImageFile(pJob->sSourceFilePath, pJob->sCacheKey, pJob->imageSize, result, processInterface);
+
+    // The tool was killed because the job was cancelled
+    if (!pJob->cachedImage.IsValid() && IsJobCancelled(*pJob)) {
+      RemoveJob(pJob);
+      return;
+    }
+
+    // The tool was killed to make way for an interactive job, put the job back at the front of the queue so that it is started again once the
+    // interactive jobs have finished
+    if (!pJob->cachedImage.IsValid() && IsJobSuspended(*pJob)) {
+      LOG<<"cImageLoadThread::ProcessConvertStage Suspending \""<<pJob->sFileNameNoExtension<<"\" for an interactive job"<<std::endl;
+      if (!pConvertQueue->PushFront(pJob)) RemoveJob(pJob);
+      return;
     }
 
+    if (!pJob->cachedImage.IsValid()) {
+      LOG<<"cImageLoadThread::ProcessConvertStage Error creating thumbnail \""<<pJob->sFolderPath<<"\" for \""<<pJob->photo.sFilePath<<"\""<<std::endl;
+
+      // Only a file that couldn't be decoded is skipped next time, timeouts and failures to write to the cache are tried again
+      if (result == CONVERSION_RESULT::INVALID_FILE) HandOffJobFailedConversion(pJob);
+      else HandOffJobError(pJob);
+      return;
+    }
+
+    PushJobToStage(*pDecodeQueue, pJob);
+  }
+
+  void cImageLoadThread::ProcessDecodeStage(cImageLoadJob* pJob)
+  {
+    ASSERT(pJob->cachedImage.IsValid());
+
+    // Load the cached image, thumbnails are loaded from the level of the pyramid that the view needs right now
+    voodoo::cImage* pImage = new voodoo::cImage;
+
+    if (pJob->imageSize == IMAGE_SIZE::THUMBNAIL) pJob->nThumbnailSize = nThumbnailSize.load();
+    else if (pJob->cachedImage.sFilePath == pJob->sSourceFilePath) {
+      // Jpegs are loaded as they are instead of being turned and saved again by a converter, the view turns them when it draws them
+      const string_t sExtensionLower = spitfire::string::ToLower(spitfire::filesystem::GetExtension(pJob->sSourceFilePath));
+      if (cConverterBackends::GetFileTypeForExtension(sExtensionLower) == CONVERTER_FILE_TYPE::JPEG) pJob->orientation = LoadEXIFOrientation(pJob->sSourceFilePath);
+    }
+
+    const bool bIsLoaded = cImageCacheManager::LoadCachedImage(pJob->cachedImage, pJob->nThumbnailSize, *pImage);
+
+    // Let go of the thumbnail pack as soon as we can in case it has been compacted
+    pJob->cachedImage = cCachedImage();
+
+    if (!bIsLoaded) {
+      // The image couldn't be decoded, it will fail the same way next time
+      spitfire::SAFE_DELETE(pImage);
+      HandOffJobFailedConversion(pJob);
+      return;
+    }
+
+    // The folder may have changed while we were decoding
+    if (IsJobCancelled(*pJob)) {
+      spitfire::SAFE_DELETE(pImage);
+      RemoveJob(pJob);
+      return;
+    }
+
+    pJob->pImage = pImage;
+    HandOffJob(pJob);
+  }
+
+  void cImageLoadThread::HandlePlaceholderQueue()
+  {
+    while (true) {
+      cImageLoadPlaceholder* pPlaceholder = placeholderQueue.RemoveItemFromFront();
+      if (pPlaceholder == nullptr) break;
+
+      // Throw away placeholders from a previous folder, and placeholders for photos that the real thumbnail has already been handed off for
+      if (pPlaceholder->generation == generation.load()) {
+        std::map<string_t, cPhoto*>::const_iterator iter = files.find(pPlaceholder->sFileNameNoExtension);
+        if ((iter != files.end()) && (iter->second->nLoadedThumbnailSize == 0)) {
+          // The handler takes ownership of the image, the photo is still not loaded as far as we are concerned
+          voodoo::cImage* pImage = pPlaceholder->pImage;
+          pPlaceholder->pImage = nullptr;
+          handler.OnImageLoaded(pPlaceholder->generation, pPlaceholder->sFileNameNoExtension, IMAGE_SIZE::THUMBNAIL, 1, pImage);
+        }
+      }
+
+      spitfire::SAFE_DELETE(pPlaceholder);
+    }
+  }
+
+  void cImageLoadThread::HandleHandOffQueue()
+  {
+    while (true) {
+      cImageLoadJob* pJob = handOffQueue.RemoveItemFromFront();
+      if (pJob == nullptr) break;
+
+      // Throw away results from a previous folder
+      if (pJob->generation != generation.load()) {
+        RemoveJob(pJob);
+        continue;
+      }
+
+      // Background raw to dng conversions only tell us that the photo has a dng now, the handler doesn't need to know
+      if (pJob->priority == IMAGE_LOAD_PRIORITY::MAINTENANCE) {
+        std::map<string_t, cPhoto*>::iterator iter = files.find(pJob->sFileNameNoExtension);
+        if (!pJob->bIsError && (iter != files.end())) iter->second->bHasDNG = true;
+
+        RemoveJob(pJob);
+        continue;
+      }
+
+      // Notify the handler
+      if (pJob->bIsError) handler.OnImageError(pJob->generation, pJob->sFileNameNoExtension);
+      else {
+        ASSERT(pJob->pImage != nullptr);
+
+        // The handler takes ownership of the image
+        voodoo::cImage* pImage = pJob->pImage;
+        pJob->pImage = nullptr;
+        handler.OnImageLoaded(pJob->generation, pJob->sFileNameNoExtension, pJob->imageSize, pJob->orientation, pImage);
+      }
+
+      if (pJob->imageSize == IMAGE_SIZE::FULL) {
+        const float fMS = latencyFullImage.AddSample(pJob->requestedTime);
+        LOG<<"cImageLoadThread::HandleHandOffQueue Full image \""<<pJob->sFileNameNoExtension<<"\" took "<<fMS<<"ms, average "<<latencyFullImage.GetAverageMS()<<"ms"<<std::endl;
+      }
+
+      // Remember which level the thumbnail was loaded at, if the view zoomed in while it was being decoded then load it again at the new level
+      bool bIsReloadRequired = false;
+      if ((pJob->imageSize == IMAGE_SIZE::THUMBNAIL) && !pJob->bIsError) {
+        std::map<string_t, cPhoto*>::iterator iter = files.find(pJob->sFileNameNoExtension);
+        if (iter != files.end()) {
+          iter->second->nLoadedThumbnailSize = pJob->nThumbnailSize;
+          bIsReloadRequired = (pJob->nThumbnailSize < nHandledThumbnailSize);
+        }
+      }
+
+      const string_t sFileNameNoExtension = pJob->sFileNameNoExtension;
+      const size_t index = pJob->index;
+      const size_t jobGeneration = pJob->generation;
+
+      RemoveJob(pJob);
+
+      if (bIsReloadRequired) AddJob(sFileNameNoExtension, IMAGE_SIZE::THUMBNAIL, index, jobGeneration, std::chrono::steady_clock::now());
+    }
+  }
+
+  void cImageLoadThread::HandleHighPriorityRequestQueue()
+  {
+    while (true) {
+      cFileLoadFullHighPriorityRequest* pRequest = highPriorityRequestQueue.RemoveItemFromFront();
+      if (pRequest == nullptr) break;
+
+      // Throw away requests for a previous folder
+      if (pRequest->generation != generation.load()) {
+        spitfire::SAFE_DELETE(pRequest);
+        continue;
+      }
+
+      const float fMS = latencyRequest.AddSample(pRequest->requestedTime);
+      LOG<<"cImageLoadThread::HandleHighPriorityRequestQueue Request found \""<<pRequest->sFileNameNoExtension<<"\" after "<<fMS<<"ms"<<std::endl;
+
+      // Put the job at the front of the pipeline
+      AddJob(pRequest->sFileNameNoExtension, IMAGE_SIZE::FULL, 0, pRequest->generation, pRequest->requestedTime);
+
+      spitfire::SAFE_DELETE(pRequest);
+    }
+  }
+
+  void cImageLoadThread::HandleFolderRequest(const cFolderLoadThumbnailsRequest& request)
+  {
+    // Throw away the jobs for the previous folder
+    ClearPendingJobs();
+
+    // Remove the known photos
+    ClearPhotos();
+
+    // Change our folder
+    sFolderPath = request.sFolderPath;
+    nFolders = 0;
+
+    // Collect a list of the files in this directory
+    for (spitfire::filesystem::cFolderIterator iter(sFolderPath); iter.IsValid(); iter.Next()) {
+      // Stop scanning if the view has already moved on to another folder, the next folder request is already waiting for us
+      if (request.generation != generation.load()) {
+        LOG<<"cImageLoadThread::HandleFolderRequest Folder changed while scanning \""<<sFolderPath<<"\""<<std::endl;
+        ClearPhotos();
+        return;
+      }
+
+      if (iter.IsFolder()) {
+        const string_t sFolderName = iter.GetFileOrFolder();
+
+        // Tell the handler that we found a folder
+        handler.OnFolderFound(request.generation, sFolderName);
+        nFolders++;
+        continue;
+      }
+
+      const string_t sFilePath = iter.GetFullPath();
+      const string_t sFileNameNoExtension = spitfire::filesystem::GetFileNoExtension(iter.GetFileOrFolder());
+
+      const string_t sExtension = spitfire::filesystem::GetExtension(iter.GetFileOrFolder());
+      const string_t sExtensionLower = spitfire::string::ToLower(sExtension);
+      if (!util::IsFileTypeSupported(sExtensionLower)) continue;
+
+      // Change the extension of all supported files to lower case
+      if (sExtensionLower != sExtension) {
+        const string_t sFrom = spitfire::filesystem::MakeFilePath(sFolderPath, sFileNameNoExtension + sExtension);
+        const string_t sTo = spitfire::filesystem::MakeFilePath(sFolderPath, sFileNameNoExtension + sExtensionLower);
+        LOG<<"cImageLoadThread::HandleFolderRequest Moving file from \""<<sFrom<<"\" to\""<<sTo<<"\""<<std::endl;
+        spitfire::filesystem::MoveFile(sFrom, sTo);
+      }
+
+      cPhoto* pPhoto = nullptr;
+
+      std::map<string_t, cPhoto*>::iterator found = files.find(sFileNameNoExtension);
+      if (found != files.end()) pPhoto = found->second;
+      else {
+        // Add a new photo
+        pPhoto = new cPhoto;
+        files[sFileNameNoExtension] = pPhoto;
+        pPhoto->sFilePath = sFilePath;
+      }
+
+      if (util::IsFileTypeRaw(sExtensionLower)) pPhoto->bHasRaw = true;
+      else if (sExtensionLower == TEXT(".dng")) pPhoto->bHasDNG = true;
+      else if (util::IsFileTypeImage(sExtensionLower)) pPhoto->bHasImage = true;
+    }
+
+    // The view shows the folders first and then the files
+    pendingThumbnailJobs.resize(nFolders + files.size(), nullptr);
+
+    // Tell the handler about the files that were found and create a job to load each one
+    size_t index = nFolders;
+    std::map<string_t, cPhoto*>::const_iterator iter = files.begin();
+    const std::map<string_t, cPhoto*>::const_iterator iterEnd = files.end();
+    while (iter != iterEnd) {
+      handler.OnFileFound(request.generation, iter->first);
+
+      AddJob(iter->first, IMAGE_SIZE::THUMBNAIL, index, request.generation, request.requestedTime);
+
+      index++;
+      iter++;
+    }
+
+    // Once this folder has loaded we can enforce the maximum cache size
+    bIsEnforceMaximumCacheSizeRequired = true;
+    bIsBackgroundRawToDNGRequired = true;
+  }
+
+  void cImageLoadThread::ThreadFunction()
+  {
+    LOG<<"cImageLoadThread::ThreadFunction"<<std::endl;
+
+    // Find out which tools are installed before the first folder is requested rather than in the middle of the first conversion
+    cConverterBackends::Get();
+
+    while (true) {
+      // Sleep until there is something to do
+      wakeUp.Wait();
+
+      if (IsToStop()) break;
+
+      if (loadingProcessInterface.IsToStop()) {
+        // Throw away the jobs that haven't been started yet, the workers will throw away the jobs that they are working on
+        // NOTE: We reset the signal before we clear the jobs so that a full size request that is made after the stop is still loaded
+        loadingProcessInterface.Reset();
+        ClearPendingJobs();
+
+        // The raw files are converted in the background the next time the folder is opened instead
+        bIsBackgroundRawToDNGRequired = false;
+      }
+
+      // The user is waiting for full size images so check for them first
+      HandleHighPriorityRequestQueue();
+
+      // Tell the handler about any images that have finished loading, placeholders first so that they never replace a real thumbnail
+      HandlePlaceholderQueue();
+      HandleHandOffQueue();
+
+      // Only the most recent folder request matters, the view has already moved on from the others
+      cFolderLoadThumbnailsRequest* pRequest = nullptr;
+      while (true) {
+        cFolderLoadThumbnailsRequest* pNextRequest = requestQueue.RemoveItemFromFront();
+        if (pNextRequest == nullptr) break;
+
+        spitfire::SAFE_DELETE(pRequest);
+        pRequest = pNextRequest;
+      }
+
+      if (pRequest != nullptr) {
+        const float fMS = latencyRequest.AddSample(pRequest->requestedTime);
+        LOG<<"cImageLoadThread::ThreadFunction Folder request found \""<<pRequest->sFolderPath<<"\" after "<<fMS<<"ms"<<std::endl;
+
+        HandleFolderRequest(*pRequest);
+
+        spitfire::SAFE_DELETE(pRequest);
+
+        // Scanning a large folder can take a while so check again for full size requests
+        HandleHighPriorityRequestQueue();
+      }
+
+      // Move the next jobs into the pipeline, closest to the visible photos first
+      UpdateThumbnailSize();
+      UpdateVisibleRange();
+      FeedPipeline();
+
+      // Photos that have an image were shown from the image, now that there is nothing else to do we can convert their raw files
+      // They are converted by the raw to dng lane so that this thread carries on handling requests, photos that only have a raw file go ahead of them
+      if (bIsBackgroundRawToDNGRequired && IsPipelineIdle() && !IsToStop()) {
+        bIsBackgroundRawToDNGRequired = false;
+        AddBackgroundRawToDNGJobs();
+      }
+
+      // Now that the folder has been processed we can enforce the maximum cache size if we have not been asked to stop
+      // We don't do this if we are stopping because it takes ages on Windows
+      if (bIsEnforceMaximumCacheSizeRequired && IsPipelineIdle() && !IsToStop()) {
+        bIsEnforceMaximumCacheSizeRequired = false;
+
+        size_t nTempMaximumCacheSizeGB = 0;
+
+        {
+          spitfire::util::cLockObject lock(mutexMaximumCacheSize);
+          nTempMaximumCacheSizeGB = nMaximumCacheSizeGB;
+        }
+
+        // If something else needs doing then we give up and try again the next time the pipeline is idle
+        cMaintenanceProcessInterface maintenanceProcessInterface(wakeUp);
+        if (!cImageCacheManager::EnforceMaximumCacheSize(nTempMaximumCacheSizeGB, maintenanceProcessInterface)) bIsEnforceMaximumCacheSizeRequired = true;
+      }
+    }
+
+    // Stop the workers and throw away any jobs that are still in the pipeline
+    StopWorkers();
+    ClearPendingJobs();
+
+    while (true) {
+      cImageLoadPlaceholder* pPlaceholder = placeholderQueue.RemoveItemFromFront();
+      if (pPlaceholder == nullptr) break;
+
+      spitfire::SAFE_DELETE(pPlaceholder);
+    }
+
+    while (true) {
+      cImageLoadJob* pJob = handOffQueue.RemoveItemFromFront();
+      if (pJob == nullptr) break;
+
+      RemoveJob(pJob);
+    }
+
+    ClearPhotos();
+
     // Remove any further events because we don't care any more
     ClearEventQueue();
 
+    latencyRequest.Log();
+    latencyFullImage.Log();
+
     LOG<<"cImageLoadThread::ThreadFunction returning"<<std::endl;
   }
 }
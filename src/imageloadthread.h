@@ -1,6 +1,16 @@
 #ifndef DIESEL_IMAGELOADTHREAD_H
 #define DIESEL_IMAGELOADTHREAD_H
 
+// Standard headers
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <mutex>
+#include <set>
+#include <vector>
+
 // libvoodoomm headers
 #include <libvoodoomm/cImage.h>
 
@@ -11,6 +21,10 @@
 
 // Diesel headers
 #include "diesel.h"
+#include "cachekeyindex.h"
+#include "imagecachemanager.h"
+#include "imageloadqueue.h"
+#include "latencycounter.h"
 
 namespace diesel
 {
@@ -22,24 +36,96 @@ namespace diesel
   // Image files are jpg, png, etc.
   //
   // Diesel will convert a raw file to dng if a dng file doesn't exist already
-  // It will then create full sized images and thumbnails from the dng if it exists, or the image files if no raw or dng files exist and only the image files are available
+  // It will then create full sized images and thumbnails from the dng if it exists, or the image files if no dng file exists yet
+  // Photos that only have a raw file are shown once their dng has been created, photos that also have an image are shown from the image straight
+  // away and their raw file is converted in the background by the raw to dng stage once there is nothing else to do
+  //
+
+  // Image loading pipeline
+  //
+  // The cImageLoadThread scans the folder and then feeds a job for each photo through a set of stages, each with its own pool of workers
+  // Scan -> Hash -> Raw to dng -> Convert -> Decode -> Hand off
+  // Scan: (cImageLoadThread) Find the folders and photos in the folder and create a job for each photo
+  // Hash: Work out the cache key for the photo, if the image is already in the cache then the job skips the convert stage
+  // Raw to dng: Convert raw files for photos that only have a raw file, the jobs that are waiting are converted together in one run of the converter
+  // Convert: Create the cached thumbnail or full image with the external tools, full size jpegs and pngs are decoded straight from the file instead
+  // Decode: Load the cached image
+  // Hand off: (cImageLoadThread) Tell the cImageLoadHandler about the result
+  //
+  // The stages are connected by bounded queues so that a slow stage applies back pressure to the previous stage instead of collecting every photo in the folder
+  // Duplicate requests for the same photo and image size are merged into the job that is already in the pipeline
+  // Starting the Adobe DNG Converter under wine takes seconds, so the raw to dng stage takes every job that is waiting (Up to a limit) and
+  // converts them with one run while a wineserver is kept running in the background, each job still succeeds or fails on its own
+  // The raw to dng stage is a separate low priority lane with its own worker count, its queue never fills up so the hash stage never waits for
+  // it and the jpeg and dng thumbnails around a raw file are shown while it is still converting
+  //
+  // A thumbnail that isn't in the cache yet can take a while to create, so for jpegs the hash stage first loads the small thumbnail from the EXIF block,
+  // which only needs the first few KB of the file, and hands it off straight away as a placeholder, the real thumbnail replaces it when it is ready
+  //
+  // Files that fail to convert or decode are remembered along with their stat and the version of the converter tools, the hash stage fails them
+  // straight away the next time the folder is opened until the file or the tools change, so a folder of corrupt files opens as quickly as any other
+  //
+  // Scheduling
+  //
+  // Full size requests always go first, thumbnails are fed into the pipeline in order of distance from the photos that are visible in the view
+  // The view tells us which photos are visible every time it scrolls, we look further ahead in the direction the view is scrolling the faster it scrolls
+  // Jobs that are still waiting in the hash queue are taken back out and rescheduled when the visible range changes, so a jump to the other end of a
+  // large folder only has to wait for a few jobs to be hashed
+  // Jobs that have already been hashed keep their place in the raw to dng and convert queues, the ones that have just become visible are moved to the front
+  //
+  // Thumbnail size
+  //
+  // The view tells us how big the thumbnails are drawn at its current zoom and each thumbnail is decoded from the smallest level of its pyramid that covers
+  // that size, see thumbnailformat.h
+  // When the view zooms in past the level that a thumbnail was loaded at the thumbnail is loaded again from the next level up, zooming out keeps the
+  // thumbnails that have already been loaded and only the thumbnails that are loaded after that use the smaller level
+  //
+  // Waking up
+  //
+  // The image load thread sleeps on a cWakeUpSignal until there is something to do, anything that gives it work (a request, a stop, a finished job,
+  // room in the hash queue or a change in the visible range) signals it so that the work is picked up straight away
+  // The time from each request to it being picked up and the time from a full size request to the image being handed off are measured and logged
+  //
+  // Priority
+  //
+  // Each job has a priority class, from highest to lowest: interactive (a full size image the user is waiting for), visible thumbnails,
+  // prefetched thumbnails and cache maintenance
+  // Each stage has a worker that is reserved for interactive jobs so that a full size request never waits for a slow conversion to finish
+  // While there are interactive jobs in the pipeline the other jobs are suspended before they start converting so that the interactive
+  // job has the machine to itself, cache maintenance only runs when the pipeline is idle and gives up as soon as anything else needs doing
+  // Conversions that are already running when an interactive job arrives are stopped and put back at the front of the convert queue
+  // Raw to dng batches are left running at their lower priority because they would have to start again from the beginning, and the in process
+  // jpeg thumbnails are quick enough to let finish
+  // Background raw to dng conversions are queued in the raw to dng stage when the pipeline is idle, photos that only have a raw file go ahead of them
+  //
+  // Cancellation
+  //
+  // Each folder request and each stop starts a new generation, every request, job and result is tagged with the generation that it belongs to
+  // Jobs from an older generation are thrown away at every stage boundary, and again when they are handed off, and the handler is given the
+  // generation with each callback so that it can throw away results that were already on their way to the main thread
+  // The external tools are run without a shell and are killed within a few milliseconds of their job being cancelled, so pressing stop or
+  // changing folders doesn't have to wait for a long raw conversion to finish
   //
 
 
   class cFolderLoadThumbnailsRequest
   {
   public:
-    cFolderLoadThumbnailsRequest(const string_t& sFolderPath);
+    cFolderLoadThumbnailsRequest(const string_t& sFolderPath, size_t generation);
 
     string_t sFolderPath;
+    size_t generation;
+    std::chrono::steady_clock::time_point requestedTime;
   };
 
   class cFileLoadFullHighPriorityRequest
   {
   public:
-    cFileLoadFullHighPriorityRequest(const string_t& sFileNameNoExtension);
+    cFileLoadFullHighPriorityRequest(const string_t& sFileNameNoExtension, size_t generation);
 
     string_t sFileNameNoExtension;
+    size_t generation;
+    std::chrono::steady_clock::time_point requestedTime;
   };
 
 
@@ -56,16 +142,75 @@ namespace diesel
     bool bHasRaw; // Nef, crw, etc.
     bool bHasDNG;
     bool bHasImage; // Jpg, png, etc.
+
+    size_t nLoadedThumbnailSize; // The pyramid level that the thumbnail was last handed off at, 0 if it hasn't been handed off yet
   };
 
   inline cPhoto::cPhoto() :
     bHasRaw(false),
     bHasDNG(false),
-    bHasImage(false)
+    bHasImage(false),
+    nLoadedThumbnailSize(0)
   {
   }
 
 
+  // ** cImageLoadJob
+
+  enum class IMAGE_LOAD_PRIORITY {
+    INTERACTIVE, // A full size image that the user is waiting for
+    VISIBLE, // A thumbnail that is visible in the view
+    PREFETCH, // A thumbnail that is not visible yet
+    MAINTENANCE // Cache maintenance and background raw to dng conversions
+  };
+
+  class cImageLoadJob
+  {
+  public:
+    cImageLoadJob(const string_t& sFolderPath, const string_t& sFileNameNoExtension, IMAGE_SIZE imageSize, size_t index, const cPhoto& photo, size_t generation, const std::chrono::steady_clock::time_point& requestedTime);
+    ~cImageLoadJob();
+
+    string_t GetKey() const;
+
+    string_t sFolderPath;
+    string_t sFileNameNoExtension;
+    IMAGE_SIZE imageSize;
+    size_t index; // The position of the photo in the view, used to schedule thumbnails
+    IMAGE_LOAD_PRIORITY priority;
+    cPhoto photo;
+    size_t generation;
+    std::chrono::steady_clock::time_point requestedTime;
+
+    string_t sSourceFilePath; // The dng or image file that the cached image is created from
+    string_t sFailureFilePath; // The file that a failure is recorded against, the raw file until it has been converted, "" if it couldn't be stat'd
+    cFileStat failureFileStat; // The stat of the failure file from before we tried it
+    string_t sCacheKey;
+    cCachedImage cachedImage;
+    size_t nThumbnailSize; // The pyramid level that the thumbnail was decoded at
+    int orientation; // The EXIF orientation that the image has to be turned by when it is drawn, 1 if the image is already the right way up
+
+    bool bIsError;
+    voodoo::cImage* pImage; // Owned by the job until it is handed off to the handler
+  };
+
+
+  // ** cImageLoadPlaceholder
+  //
+  // A low quality thumbnail that is shown while the real thumbnail is created
+  //
+
+  class cImageLoadPlaceholder
+  {
+  public:
+    cImageLoadPlaceholder(const string_t& sFileNameNoExtension, size_t generation, voodoo::cImage* pImage);
+    ~cImageLoadPlaceholder();
+
+    string_t sFileNameNoExtension;
+    size_t generation;
+    voodoo::cImage* pImage; // Owned by the placeholder until it is handed off to the handler
+  };
+
+
   class cImageLoadThread;
 
   class cImageLoadHandler
@@ -76,16 +221,71 @@ namespace diesel
     virtual ~cImageLoadHandler() {}
 
   private:
-    virtual void OnFolderFound(const string_t& sFolderName) = 0;
-    virtual void OnFileFound(const string_t& sFileNameNoExtension) = 0;
-    virtual void OnImageLoaded(const string_t& sFileNameNoExtension, IMAGE_SIZE imageSize, voodoo::cImage* pImage) = 0;
-    virtual void OnImageError(const string_t& sFileNameNoExtension) = 0;
+    // NOTE: The generation is the generation of the folder request that the callback belongs to, compare it with cImageLoadThread::GetGeneration on the main thread
+    virtual void OnFolderFound(size_t generation, const string_t& sFolderName) = 0;
+    virtual void OnFileFound(size_t generation, const string_t& sFileNameNoExtension) = 0;
+    // NOTE: Full size jpegs are loaded as they are, orientation is the EXIF orientation that the image has to be turned by when it is drawn
+    virtual void OnImageLoaded(size_t generation, const string_t& sFileNameNoExtension, IMAGE_SIZE imageSize, int orientation, voodoo::cImage* pImage) = 0;
+    virtual void OnImageError(size_t generation, const string_t& sFileNameNoExtension) = 0;
+  };
+
+
+  // ** cImageLoadVisibleRange
+  //
+  // The photos that are visible in the view and how far ahead of them we should load
+  //
+
+  class cImageLoadVisibleRange
+  {
+  public:
+    cImageLoadVisibleRange();
+
+    size_t firstVisibleIndex;
+    size_t lastVisibleIndex;
+    int iLookAheadDirection; // 1 when scrolling down, -1 when scrolling up
+    size_t nLookAheadItems;
+  };
+
+
+  // ** cImageLoadWorker
+
+  enum class IMAGE_LOAD_STAGE {
+    HASH,
+    RAW_TO_DNG,
+    CONVERT,
+    DECODE
   };
 
+  class cImageLoadWorker : protected spitfire::util::cThread
+  {
+  public:
+    cImageLoadWorker(cImageLoadThread& owner, IMAGE_LOAD_STAGE stage, cBoundedQueue<cImageLoadJob>& queue, bool bIsReservedForInteractive);
+
+    void Start();
+    void StopSoon();
+    void StopNow();
+
+  private:
+    virtual void ThreadFunction() override;
+
+    cImageLoadThread& owner;
+    IMAGE_LOAD_STAGE stage;
+    cBoundedQueue<cImageLoadJob>& queue;
+    bool bIsReservedForInteractive; // Only handles interactive jobs
+
+    spitfire::util::cSignalObject soAction;
+  };
+
+
+  // ** cImageLoadThread
+
   class cImageLoadThread : protected spitfire::util::cThread
   {
   public:
+    friend class cImageLoadWorker;
+
     explicit cImageLoadThread(cImageLoadHandler& handler);
+    ~cImageLoadThread();
 
     void Start();
     void StopSoon();
@@ -97,20 +297,78 @@ namespace diesel
     void LoadFileFullHighPriority(const string_t& sFilePath);
     void StopLoading();
 
+    size_t GetGeneration() const;
+
+    // Called by the view whenever it scrolls or changes layout, the indices are positions in the view including folders
+    void SetVisibleRange(size_t firstVisibleIndex, size_t lastVisibleIndex);
+
+    // Called by the view whenever the size that the thumbnails are drawn at changes
+    void SetThumbnailSize(size_t nSizePixels);
+
   private:
     virtual void ThreadFunction() override;
 
-    void ClearEventQueue();
-
-    bool GetOrCreateDNGForRawFile(const string_t& sFolderPath, const string_t& sFileNameNoExtension, cPhoto& photo);
-    string_t GetOrCreateThumbnail(const string_t& sFolderPath, const string_t& sFileNameNoExtension, IMAGE_SIZE imageSize, cPhoto& photo);
-    void LoadThumbnailImage(const string_t& sThumbnailFilePath, const string_t& sFileNameNoExtension, IMAGE_SIZE imageSize);
+    static size_t GetDefaultWorkerCount(IMAGE_LOAD_STAGE stage);
+    void StartWorkers(IMAGE_LOAD_STAGE stage, size_t nWorkers, cBoundedQueue<cImageLoadJob>& queue);
+    void NotifyWaitingWorkers();
+    void StopWorkers();
 
-    void HandleHighPriorityRequestQueue(const string_t& sFolderPath, std::map<string_t, cPhoto*>& files);
+    void ClearEventQueue();
+    void ClearPhotos();
+
+    bool IsJobCancelled(const cImageLoadJob& job);
+    bool IsJobSuspended(const cImageLoadJob& job); // True while a job that isn't interactive has to make way for interactive jobs
+    bool IsBatchCancelled(const std::list<cImageLoadJob*>& batch);
+    bool WaitForInteractiveJobs(const cImageLoadJob& job);
+    bool WaitForInteractiveJobs(const std::list<cImageLoadJob*>& batch);
+
+    // Scan stage
+    void HandleFolderRequest(const cFolderLoadThumbnailsRequest& request);
+    void HandleHighPriorityRequestQueue();
+
+    // Job tracking
+    void AddJob(const string_t& sFileNameNoExtension, IMAGE_SIZE imageSize, size_t index, size_t requestGeneration, const std::chrono::steady_clock::time_point& requestedTime);
+    void RemoveJob(cImageLoadJob* pJob);
+    void ClearPendingJobs();
+    void FeedPipeline();
+    bool IsPipelineIdle() const;
+
+    // Scheduling
+    void UpdateVisibleRange();
+    void UpdateThumbnailSize();
+    void ReschedulePendingJobs();
+    void AddPendingJob(cImageLoadJob* pJob);
+    cImageLoadJob* RemoveNextPendingJob();
+    size_t GetPendingThumbnailJobRank(size_t index) const;
+    IMAGE_LOAD_PRIORITY GetThumbnailJobPriority(size_t index) const;
+
+    // Worker stages
+    void ProcessJob(IMAGE_LOAD_STAGE stage, cImageLoadJob* pJob);
+    void ProcessHashStage(cImageLoadJob* pJob);
+    void ProcessRawToDNGStage(std::list<cImageLoadJob*>& batch);
+    void ProcessConvertStage(cImageLoadJob* pJob);
+    void ProcessDecodeStage(cImageLoadJob* pJob);
+    void PushJobToStage(cBoundedQueue<cImageLoadJob>& queue, cImageLoadJob* pJob);
+    void PushJobToRawToDNGStage(cImageLoadJob* pJob);
+    void HandOffJob(cImageLoadJob* pJob);
+    void HandOffJobError(cImageLoadJob* pJob);
+    void HandOffJobFailedConversion(cImageLoadJob* pJob); // Like HandOffJobError but the file is skipped next time until it or the converter tools change
+    void HandOffPlaceholder(const cImageLoadJob& job);
+    static void SetFailureFile(cImageLoadJob& job, const string_t& sFilePath);
+    static bool IsFailedConversion(const cImageLoadJob& job);
+
+    // Hand off stage
+    void HandlePlaceholderQueue();
+    void HandleHandOffQueue();
+
+    static void MoveRawFileToRawFolder(const string_t& sFolderPath, const string_t& sFileNameNoExtension);
+    void AddBackgroundRawToDNGJobs();
+    static string_t GetSourceFilePath(const string_t& sFolderPath, const string_t& sFileNameNoExtension, const cPhoto& photo);
 
     cImageLoadHandler& handler;
 
     spitfire::util::cSignalObject soAction;
+    cWakeUpSignal wakeUp; // Signalled whenever there is something for the image load thread to do
 
     spitfire::util::cThreadSafeQueue<cFolderLoadThumbnailsRequest> requestQueue;
 
@@ -134,15 +392,130 @@ namespace diesel
     size_t nMaximumCacheSizeGB;
 
     cLoadingProcessInterface loadingProcessInterface; // Signalled by the controller when the the model thread should stop loading files
+
+    // Cache maintenance only runs while there is nothing else to do, it stops as soon as the image load thread is woken up
+    class cMaintenanceProcessInterface : public spitfire::util::cProcessInterface
+    {
+    public:
+      explicit cMaintenanceProcessInterface(const cWakeUpSignal& wakeUp);
+
+      virtual bool _IsToStop() const override { return wakeUp.IsSignalled(); }
+
+    private:
+      const cWakeUpSignal& wakeUp;
+    };
+
+    // The external tools that are run for a job, and LibRaw, are stopped as soon as the job is cancelled, or as soon as an interactive job arrives
+    // if this job isn't interactive, in which case the job is started again once the interactive jobs have finished
+    class cJobProcessInterface : public spitfire::util::cProcessInterface
+    {
+    public:
+      cJobProcessInterface(cImageLoadThread& owner, const cImageLoadJob& job);
+
+      virtual bool _IsToStop() const override { return (owner.IsJobCancelled(job) || owner.IsJobSuspended(job)); }
+
+    private:
+      cImageLoadThread& owner;
+      const cImageLoadJob& job;
+    };
+
+    // A batch of raw files is only converted while at least one of its jobs is still wanted
+    class cBatchProcessInterface : public spitfire::util::cProcessInterface
+    {
+    public:
+      cBatchProcessInterface(cImageLoadThread& owner, const std::list<cImageLoadJob*>& batch);
+
+      virtual bool _IsToStop() const override { return owner.IsBatchCancelled(batch); }
+
+    private:
+      cImageLoadThread& owner;
+      const std::list<cImageLoadJob*>& batch;
+    };
+
+    std::atomic<size_t> generation; // Incremented for each folder request and each stop
+
+    // Set by the view on the main thread
+    spitfire::util::cMutex mutexVisibleRange;
+    cImageLoadVisibleRange visibleRangeFromView;
+    bool bIsVisibleRangeChanged;
+    std::chrono::steady_clock::time_point visibleRangeChangedTime;
+    std::atomic<size_t> nThumbnailSize; // The pyramid level that thumbnails are decoded at
+
+    // Only accessed on the image load thread
+    string_t sFolderPath;
+    std::map<string_t, cPhoto*> files;
+    size_t nFolders;
+    size_t nHandledThumbnailSize; // The thumbnail size that the loaded thumbnails have been checked against
+    bool bIsEnforceMaximumCacheSizeRequired;
+    bool bIsBackgroundRawToDNGRequired; // There may be photos with a raw file and an image that haven't been converted to dng yet
+
+    // Jobs that are waiting for space in the hash queue
+    cImageLoadVisibleRange visibleRange;
+    std::list<cImageLoadJob*> pendingFullJobs; // Most recent request first
+    std::vector<cImageLoadJob*> pendingThumbnailJobs; // Indexed by the position of the photo in the view, nullptr once the job has been fed into the pipeline
+    std::set<std::pair<size_t, size_t>> pendingThumbnailOrder; // The rank and index of each pending thumbnail job, the next job to feed into the pipeline first
+
+    // Jobs in the pipeline, used to merge duplicate requests
+    mutable spitfire::util::cMutex mutexJobs;
+    std::set<string_t> jobs;
+
+    // Interactive jobs in the pipeline, the other jobs wait for these before they start converting
+    std::mutex mutexInteractiveJobs;
+    std::condition_variable conditionInteractiveJobs;
+    size_t nInteractiveJobs;
+
+    // Raw files that are currently being converted to dng, so that two workers don't convert the same photo at the same time
+    std::mutex mutexRawConversions;
+    std::condition_variable conditionRawConversions;
+    std::set<string_t> rawConversions;
+
+    // Stages
+    cBoundedQueue<cImageLoadJob>* pHashQueue;
+    cBoundedQueue<cImageLoadJob>* pRawToDNGQueue;
+    cBoundedQueue<cImageLoadJob>* pConvertQueue;
+    cBoundedQueue<cImageLoadJob>* pDecodeQueue;
+    spitfire::util::cThreadSafeQueue<cImageLoadPlaceholder> placeholderQueue;
+    spitfire::util::cThreadSafeQueue<cImageLoadJob> handOffQueue;
+
+    std::vector<cImageLoadWorker*> workers;
+
+    // Only accessed on the image load thread
+    cLatencyCounter latencyRequest; // From a request being queued to the image load thread handling it
+    cLatencyCounter latencyFullImage; // From a full size request being queued to the image being handed off
   };
 
 
   // Inlines
 
+  inline cImageLoadVisibleRange::cImageLoadVisibleRange() :
+    firstVisibleIndex(0),
+    lastVisibleIndex(0),
+    iLookAheadDirection(1),
+    nLookAheadItems(0)
+  {
+  }
+
   inline cImageLoadThread::cLoadingProcessInterface::cLoadingProcessInterface() :
     soStopLoading(TEXT("cImageLoadThread::cLoadingProcessInterface_soStopLoading"))
   {
   }
+
+  inline cImageLoadThread::cMaintenanceProcessInterface::cMaintenanceProcessInterface(const cWakeUpSignal& _wakeUp) :
+    wakeUp(_wakeUp)
+  {
+  }
+
+  inline cImageLoadThread::cJobProcessInterface::cJobProcessInterface(cImageLoadThread& _owner, const cImageLoadJob& _job) :
+    owner(_owner),
+    job(_job)
+  {
+  }
+
+  inline cImageLoadThread::cBatchProcessInterface::cBatchProcessInterface(cImageLoadThread& _owner, const std::list<cImageLoadJob*>& _batch) :
+    owner(_owner),
+    batch(_batch)
+  {
+  }
 }
 
 #endif // DIESEL_IMAGELOADTHREAD_H
@@ -2,11 +2,11 @@
 #include <unordered_set>
 
 // Spitfire headers
-#include <spitfire/algorithm/md5.h>
 #include <spitfire/storage/filesystem.h>
 #include <spitfire/util/log.h>
 
 // Diesel headers
+#include "contenthash.h"
 #include "importthread.h"
 #include "util.h"
 
@@ -136,12 +136,10 @@ namespace diesel
     interface.SetPercentageCompletePrimary0To100(50.0f);
     interface.SetPercentageCompleteSecondary0To100(0.0f);
 
-    // Check if the MD5 hashes match and we can delete the original files
+    // Check if the content hashes match and we can delete the original files
     if (bDeleteFromSourceFolderOnSuccessfulImport) {
       interface.SetTextSecondary(TEXT("Deleting source files..."));
 
-      spitfire::algorithm::cMD5 md5;
-
       spitfire::filesystem::cFolderIterator iter(sFromFolder);
       size_t i = 0;
       const size_t n = iter.GetFileAndFolderCount();
@@ -154,13 +152,11 @@ namespace diesel
           if (!spitfire::filesystem::DirectoryExists(sToFullFolder)) spitfire::filesystem::CreateDirectory(sToFullFolder);
           const string_t sToFilePath = spitfire::filesystem::MakeFilePath(sToFullFolder, spitfire::filesystem::GetFile(sFromFilePath));
 
-          // Check the MD5 hashes
-          string_t sFromMD5;
-          if (md5.CalculateForFile(sFromFilePath)) sFromMD5 = md5.GetResultFormatted();
-          string_t sToMD5;
-          if (md5.CalculateForFile(sToFilePath)) sToMD5 = md5.GetResultFormatted();
+          // Check the content hashes
+          const string_t sFromHash = CalculateContentHashForFile(CONTENT_HASH::XXH64, sFromFilePath);
+          const string_t sToHash = CalculateContentHashForFile(CONTENT_HASH::XXH64, sToFilePath);
 
-          if (!sFromMD5.empty() && !sToMD5.empty() && (sToMD5 == sFromMD5)) {
+          if (!sFromHash.empty() && !sToHash.empty() && (sToHash == sFromHash)) {
             // Delete the source file
             spitfire::filesystem::DeleteFile(sFromFilePath);
           }
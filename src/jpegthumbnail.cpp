@@ -0,0 +1,401 @@
+// Standard headers
+#include <algorithm>
+#include <csetjmp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+// libjpeg headers
+#include <jpeglib.h>
+
+// Spitfire headers
+#include <spitfire/util/log.h>
+#include <spitfire/util/string.h>
+
+// Diesel headers
+#include "jpegthumbnail.h"
+#include "thumbnailformat.h"
+#include "tiffreader.h"
+
+namespace diesel
+{
+  // The same quality that we ask vipsthumbnail for
+  const int nJPEGThumbnailQuality = 90;
+
+  // The EXIF block is at most 64 KB and comes straight after the start of the jpeg, or after a small JFIF block
+  const size_t nEXIFThumbnailReadSizeBytes = 128 * 1024;
+
+  // ** cJPEGError
+  //
+  // libjpeg calls exit on an error unless we jump out of it ourselves
+  //
+
+  class cJPEGError
+  {
+  public:
+    jpeg_error_mgr manager; // Must be first so that libjpeg's pointer to the manager is also a pointer to this
+    jmp_buf jump;
+  };
+
+  void OnJPEGError(j_common_ptr pInfo)
+  {
+    char szMessage[JMSG_LENGTH_MAX];
+    (*pInfo->err->format_message)(pInfo, szMessage);
+    LOG<<"OnJPEGError "<<szMessage<<std::endl;
+
+    cJPEGError* pError = reinterpret_cast<cJPEGError*>(pInfo->err);
+    longjmp(pError->jump, 1);
+  }
+
+  void OnJPEGMessage(j_common_ptr pInfo)
+  {
+    // Warnings about corrupt data are ignored, we still get an image that is good enough for a thumbnail
+    (void)pInfo;
+  }
+
+
+  // ** EXIF orientation
+
+  // Returns the orientation from an APP1 marker, or 1 if there is no orientation
+  int GetEXIFOrientation(const uint8_t* pData, size_t nSizeBytes)
+  {
+    // "Exif\0\0" is followed by a TIFF header and then the first IFD
+    if ((nSizeBytes < 14) || (memcmp(pData, "Exif\0\0", 6) != 0)) return 1;
+
+    cTIFFReader reader;
+    if (!reader.OpenMemory(pData + 6, nSizeBytes - 6)) return 1;
+
+    cTIFFIFD ifd;
+    uint32_t orientation = 1;
+    if (!reader.ReadIFD(reader.GetFirstIFDOffset(), ifd) || !reader.GetValue(ifd, TIFF_TAG_ORIENTATION, orientation)) return 1;
+
+    return ((orientation >= 1) && (orientation <= 8)) ? int(orientation) : 1;
+  }
+
+  // Turns and flips the pixels so that they are the right way up, orientations 5 to 8 swap the width and height
+  void ApplyEXIFOrientation(int orientation, std::vector<uint8_t>& pixels, size_t& width, size_t& height)
+  {
+    if (orientation == 1) return;
+
+    const bool bIsSwapped = (orientation >= 5);
+    const size_t orientedWidth = bIsSwapped ? height : width;
+    const size_t orientedHeight = bIsSwapped ? width : height;
+
+    std::vector<uint8_t> oriented(pixels.size());
+
+    for (size_t y = 0; y < height; y++) {
+      for (size_t x = 0; x < width; x++) {
+        size_t orientedX = x;
+        size_t orientedY = y;
+        switch (orientation) {
+          case 2: orientedX = width - 1 - x; break; // Flipped horizontally
+          case 3: orientedX = width - 1 - x; orientedY = height - 1 - y; break; // Upside down
+          case 4: orientedY = height - 1 - y; break; // Flipped vertically
+          case 5: orientedX = y; orientedY = x; break; // Transposed
+          case 6: orientedX = height - 1 - y; orientedY = x; break; // Turned 90 degrees clockwise
+          case 7: orientedX = height - 1 - y; orientedY = width - 1 - x; break; // Transversed
+          case 8: orientedX = y; orientedY = width - 1 - x; break; // Turned 90 degrees anticlockwise
+        }
+
+        memcpy(oriented.data() + (((orientedY * orientedWidth) + orientedX) * 4), pixels.data() + (((y * width) + x) * 4), 4);
+      }
+    }
+
+    pixels.swap(oriented);
+    width = orientedWidth;
+    height = orientedHeight;
+  }
+
+
+  // ** Decoding and encoding
+
+  // Decodes at the smallest DCT scale that is still at least nSizePixels, pixels are 8 bits per channel RGBA
+  bool DecodeJPEGScaled(const uint8_t* pData, size_t nSizeBytes, size_t nSizePixels, std::vector<uint8_t>& pixels, size_t& width, size_t& height, int& orientation)
+  {
+    jpeg_decompress_struct info;
+    cJPEGError error;
+    info.err = jpeg_std_error(&error.manager);
+    error.manager.error_exit = OnJPEGError;
+    error.manager.output_message = OnJPEGMessage;
+
+    std::vector<uint8_t> row;
+
+    // NOTE: Everything with a destructor is declared before this so that nothing is skipped when libjpeg jumps back here
+    if (setjmp(error.jump) != 0) {
+      jpeg_destroy_decompress(&info);
+      return false;
+    }
+
+    jpeg_create_decompress(&info);
+    jpeg_mem_src(&info, const_cast<unsigned char*>(pData), static_cast<unsigned long>(nSizeBytes));
+
+    // Keep the APP1 markers so that we can read the orientation
+    jpeg_save_markers(&info, JPEG_APP0 + 1, 0xFFFF);
+
+    if (jpeg_read_header(&info, TRUE) != JPEG_HEADER_OK) {
+      jpeg_destroy_decompress(&info);
+      return false;
+    }
+
+    orientation = 1;
+    for (jpeg_saved_marker_ptr pMarker = info.marker_list; pMarker != nullptr; pMarker = pMarker->next) {
+      if (pMarker->marker != (JPEG_APP0 + 1)) continue;
+
+      orientation = GetEXIFOrientation(pMarker->data, pMarker->data_length);
+      if (orientation != 1) break;
+    }
+
+    // Each halving is done in the DCT for almost nothing, the rest is done by our resize
+    const size_t nLargestSide = std::max<size_t>(info.image_width, info.image_height);
+    info.scale_num = 1;
+    info.scale_denom = 1;
+    while ((info.scale_denom < 8) && ((nLargestSide / (2 * info.scale_denom)) >= nSizePixels)) info.scale_denom *= 2;
+
+    // The fast DCT is slightly less accurate, which is lost in the resize anyway
+    info.dct_method = JDCT_IFAST;
+    info.out_color_space = JCS_RGB;
+
+    jpeg_start_decompress(&info);
+
+    width = info.output_width;
+    height = info.output_height;
+    pixels.resize(width * height * 4);
+    row.resize(width * info.output_components);
+
+    while (info.output_scanline < info.output_height) {
+      const size_t y = info.output_scanline;
+      JSAMPROW pRow = row.data();
+      jpeg_read_scanlines(&info, &pRow, 1);
+
+      uint8_t* pOut = pixels.data() + (y * width * 4);
+      for (size_t x = 0; x < width; x++) {
+        pOut[0] = row[(x * 3)];
+        pOut[1] = row[(x * 3) + 1];
+        pOut[2] = row[(x * 3) + 2];
+        pOut[3] = 0xFF;
+        pOut += 4;
+      }
+    }
+
+    jpeg_finish_decompress(&info);
+    jpeg_destroy_decompress(&info);
+
+    return true;
+  }
+
+  bool EncodeJPEG(const uint8_t* pPixels, size_t width, size_t height, size_t nBytesPerPixel, std::vector<uint8_t>& data)
+  {
+    ASSERT((nBytesPerPixel == 3) || (nBytesPerPixel == 4));
+
+    jpeg_compress_struct info;
+    cJPEGError error;
+    info.err = jpeg_std_error(&error.manager);
+    error.manager.error_exit = OnJPEGError;
+    error.manager.output_message = OnJPEGMessage;
+
+    std::vector<uint8_t> row(width * 3);
+
+    // libjpeg allocates the output buffer and grows it as it needs to
+    unsigned char* pOutput = nullptr;
+    unsigned long nOutputSizeBytes = 0;
+
+    if (setjmp(error.jump) != 0) {
+      jpeg_destroy_compress(&info);
+      free(pOutput);
+      return false;
+    }
+
+    jpeg_create_compress(&info);
+    jpeg_mem_dest(&info, &pOutput, &nOutputSizeBytes);
+
+    info.image_width = JDIMENSION(width);
+    info.image_height = JDIMENSION(height);
+    info.input_components = 3;
+    info.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&info);
+    jpeg_set_quality(&info, nJPEGThumbnailQuality, TRUE);
+
+    jpeg_start_compress(&info, TRUE);
+
+    while (info.next_scanline < info.image_height) {
+      const uint8_t* pIn = pPixels + (size_t(info.next_scanline) * width * nBytesPerPixel);
+
+      // Rows that are already RGB can be passed straight to libjpeg
+      JSAMPROW pRow = const_cast<JSAMPROW>(pIn);
+      if (nBytesPerPixel == 4) {
+        for (size_t x = 0; x < width; x++) {
+          row[(x * 3)] = pIn[0];
+          row[(x * 3) + 1] = pIn[1];
+          row[(x * 3) + 2] = pIn[2];
+          pIn += 4;
+        }
+
+        pRow = row.data();
+      }
+
+      jpeg_write_scanlines(&info, &pRow, 1);
+    }
+
+    jpeg_finish_compress(&info);
+    jpeg_destroy_compress(&info);
+
+    data.assign(pOutput, pOutput + nOutputSizeBytes);
+    free(pOutput);
+
+    return true;
+  }
+
+  bool CreateJPEGThumbnailFromMemory(const uint8_t* pData, size_t nSizeBytes, size_t nSizePixels, int orientation, std::vector<uint8_t>& thumbnail)
+  {
+    ASSERT(nSizePixels != 0);
+
+    std::vector<uint8_t> pixels;
+    size_t width = 0;
+    size_t height = 0;
+    int exifOrientation = 1;
+    if (!DecodeJPEGScaled(pData, nSizeBytes, nSizePixels, pixels, width, height, exifOrientation) || (width == 0) || (height == 0)) return false;
+
+    if (orientation == 0) orientation = exifOrientation;
+
+    // Finish the resize, the DCT scaling left the image less than twice the size that we want
+    const size_t nLargestSide = std::max(width, height);
+    if (nLargestSide > nSizePixels) {
+      const size_t resizedWidth = std::max<size_t>(1, (width * nSizePixels) / nLargestSide);
+      const size_t resizedHeight = std::max<size_t>(1, (height * nSizePixels) / nLargestSide);
+      std::vector<uint8_t> resized(resizedWidth * resizedHeight * 4);
+      ResizeImage(pixels.data(), width, height, resized.data(), resizedWidth, resizedHeight);
+      pixels.swap(resized);
+      width = resizedWidth;
+      height = resizedHeight;
+    }
+
+    // Turning the thumbnail is much cheaper than turning the photo before it was resized
+    ApplyEXIFOrientation(orientation, pixels, width, height);
+
+    return EncodeJPEG(pixels.data(), width, height, 4, thumbnail);
+  }
+
+  CONVERSION_RESULT CreateJPEGThumbnail(const string_t& sFilePath, size_t nSizePixels, const string_t& sThumbnailFilePath)
+  {
+    std::vector<uint8_t> data;
+
+    {
+      std::ifstream file(sFilePath.c_str(), std::ios::in | std::ios::binary | std::ios::ate);
+      if (!file.good()) return CONVERSION_RESULT::TEMPORARY_FAILURE;
+
+      data.resize(size_t(file.tellg()));
+      file.seekg(0);
+      file.read(reinterpret_cast<char*>(data.data()), std::streamsize(data.size()));
+      if (data.empty()) return CONVERSION_RESULT::INVALID_FILE;
+      if (size_t(file.gcount()) != data.size()) return CONVERSION_RESULT::TEMPORARY_FAILURE;
+    }
+
+    std::vector<uint8_t> thumbnail;
+    if (!CreateJPEGThumbnailFromMemory(data.data(), data.size(), nSizePixels, 0, thumbnail)) {
+      LOG<<"CreateJPEGThumbnail Failed to create the thumbnail for \""<<sFilePath<<"\", returning INVALID_FILE"<<std::endl;
+      return CONVERSION_RESULT::INVALID_FILE;
+    }
+
+    std::ofstream file(sThumbnailFilePath.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!file.good()) return CONVERSION_RESULT::TEMPORARY_FAILURE;
+
+    file.write(reinterpret_cast<const char*>(thumbnail.data()), std::streamsize(thumbnail.size()));
+    return file.good() ? CONVERSION_RESULT::SUCCESS : CONVERSION_RESULT::TEMPORARY_FAILURE;
+  }
+
+  // Reads the start of the jpeg and finds the APP1 block with the EXIF data in it, pEXIF points into data at the "Exif\0\0" header
+  bool ReadEXIFBlock(const string_t& sFilePath, std::vector<uint8_t>& data, const uint8_t*& pEXIF, size_t& nEXIFSizeBytes)
+  {
+    data.resize(nEXIFThumbnailReadSizeBytes);
+
+    {
+      std::ifstream file(sFilePath.c_str(), std::ios::in | std::ios::binary);
+      if (!file.good()) return false;
+
+      file.read(reinterpret_cast<char*>(data.data()), std::streamsize(data.size()));
+      data.resize(size_t(file.gcount()));
+    }
+
+    if ((data.size() < 4) || (data[0] != 0xFF) || (data[1] != 0xD8)) return false;
+
+    // The markers are always big endian
+    size_t position = 2;
+    while ((position + 4) <= data.size()) {
+      if (data[position] != 0xFF) return false;
+
+      const uint8_t marker = data[position + 1];
+
+      // The image data starts at the first frame or scan so there is no EXIF block after that
+      if ((marker == 0xDA) || ((marker >= 0xC0) && (marker <= 0xCF) && (marker != 0xC4) && (marker != 0xC8) && (marker != 0xCC))) return false;
+
+      const size_t length = (size_t(data[position + 2]) << 8) | data[position + 3];
+      if ((marker == 0xE1) && (length >= 8) && ((position + 2 + length) <= data.size()) && (memcmp(data.data() + position + 4, "Exif\0\0", 6) == 0)) {
+        pEXIF = data.data() + position + 4;
+        nEXIFSizeBytes = length - 2;
+        return true;
+      }
+
+      position += 2 + length;
+    }
+
+    return false;
+  }
+
+  int LoadEXIFOrientation(const string_t& sFilePath)
+  {
+    std::vector<uint8_t> data;
+    const uint8_t* pEXIF = nullptr;
+    size_t nEXIFSizeBytes = 0;
+    if (!ReadEXIFBlock(sFilePath, data, pEXIF, nEXIFSizeBytes)) return 1;
+
+    return GetEXIFOrientation(pEXIF, nEXIFSizeBytes);
+  }
+
+  bool LoadEXIFThumbnail(const string_t& sFilePath, std::vector<uint8_t>& pixels, size_t& width, size_t& height)
+  {
+    std::vector<uint8_t> data;
+    const uint8_t* pEXIF = nullptr;
+    size_t nEXIFSizeBytes = 0;
+    if (!ReadEXIFBlock(sFilePath, data, pEXIF, nEXIFSizeBytes)) return false;
+
+    // The thumbnail is pointed to by the second IFD, the offset is from the start of the TIFF header after "Exif\0\0"
+    cTIFFReader reader;
+    cTIFFIFD ifd0;
+    if (!reader.OpenMemory(pEXIF + 6, nEXIFSizeBytes - 6) || !reader.ReadIFD(reader.GetFirstIFDOffset(), ifd0) || (ifd0.nextIFDOffset == 0)) return false;
+
+    uint32_t orientation = 1;
+    if (!reader.GetValue(ifd0, TIFF_TAG_ORIENTATION, orientation) || (orientation < 1) || (orientation > 8)) orientation = 1;
+
+    cTIFFIFD ifd1;
+    uint32_t offset = 0;
+    uint32_t nSizeBytes = 0;
+    if (
+      !reader.ReadIFD(ifd0.nextIFDOffset, ifd1) ||
+      !reader.GetValue(ifd1, TIFF_TAG_JPEG_INTERCHANGE_FORMAT, offset) || !reader.GetValue(ifd1, TIFF_TAG_JPEG_INTERCHANGE_FORMAT_LENGTH, nSizeBytes) ||
+      (nSizeBytes == 0)
+    ) {
+      return false;
+    }
+
+    std::vector<uint8_t> thumbnail(nSizeBytes);
+    if (!reader.Read(offset, thumbnail.size(), thumbnail.data())) return false;
+
+    // The thumbnail is tiny so it is decoded at full size, it doesn't have an orientation of its own
+    int thumbnailOrientation = 1;
+    if (!DecodeJPEGScaled(thumbnail.data(), thumbnail.size(), std::numeric_limits<size_t>::max(), pixels, width, height, thumbnailOrientation) || (width == 0) || (height == 0)) return false;
+
+    ApplyEXIFOrientation(int(orientation), pixels, width, height);
+
+    return true;
+  }
+
+  string_t GetLibJPEGVersion()
+  {
+    // JPEG_LIB_VERSION is the version of the API, 62 for libjpeg 6b, 80 for libjpeg 8
+    return spitfire::string::ToString(size_t(JPEG_LIB_VERSION));
+  }
+}
@@ -0,0 +1,41 @@
+#ifndef DIESEL_JPEGTHUMBNAIL_H
+#define DIESEL_JPEGTHUMBNAIL_H
+
+// Standard headers
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Diesel headers
+#include "diesel.h"
+
+namespace diesel
+{
+  // ** In process jpeg thumbnails
+  //
+  // libjpeg can do most of the resize in the DCT while it decodes, so a photo is decoded straight to 1/2, 1/4 or 1/8 of its size and only a small resize
+  // is left to do ourselves, which is much quicker than decoding the whole photo in a converter process and then resizing it
+  // The thumbnail is turned to match the EXIF orientation and written out as a jpeg, the same as the thumbnails that the converters create, so it goes
+  // into the cache the same way
+  // Images are never enlarged, a jpeg that already fits in nSizePixels is just decoded, turned and encoded again
+  //
+
+  CONVERSION_RESULT CreateJPEGThumbnail(const string_t& sFilePath, size_t nSizePixels, const string_t& sThumbnailFilePath);
+
+  // orientation is the EXIF orientation to turn the image by, or 0 to use the orientation in the jpeg itself
+  bool CreateJPEGThumbnailFromMemory(const uint8_t* pData, size_t nSizeBytes, size_t nSizePixels, int orientation, std::vector<uint8_t>& thumbnail);
+
+  // Loads the small thumbnail, usually 160x120, that cameras put in the EXIF block of a jpeg, turned the right way up, as RGBA pixels
+  // Only the first 128 KB of the file are read, false if the jpeg doesn't have a thumbnail
+  bool LoadEXIFThumbnail(const string_t& sFilePath, std::vector<uint8_t>& pixels, size_t& width, size_t& height);
+
+  // The EXIF orientation of a jpeg, 1 if it doesn't have one, only the first 128 KB of the file are read
+  int LoadEXIFOrientation(const string_t& sFilePath);
+
+  // Pixels are 8 bits per channel RGB or RGBA with no padding between rows, the alpha channel is ignored
+  bool EncodeJPEG(const uint8_t* pPixels, size_t width, size_t height, size_t nBytesPerPixel, std::vector<uint8_t>& data);
+
+  string_t GetLibJPEGVersion();
+}
+
+#endif // DIESEL_JPEGTHUMBNAIL_H
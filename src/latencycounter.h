@@ -0,0 +1,72 @@
+#ifndef DIESEL_LATENCYCOUNTER_H
+#define DIESEL_LATENCYCOUNTER_H
+
+// Standard headers
+#include <chrono>
+
+// Spitfire headers
+#include <spitfire/util/log.h>
+
+// Diesel headers
+#include "diesel.h"
+
+namespace diesel
+{
+  // ** cLatencyCounter
+  //
+  // Collects the time between something being requested and it being handled
+  // NOTE: This is not thread safe, each counter should only be updated from one thread
+  //
+
+  class cLatencyCounter
+  {
+  public:
+    explicit cLatencyCounter(const string_t& sName);
+
+    // Adds the time from requestedTime until now and returns it
+    float AddSample(const std::chrono::steady_clock::time_point& requestedTime);
+
+    size_t GetCount() const { return nSamples; }
+    float GetAverageMS() const;
+    float GetMaximumMS() const { return fMaximumMS; }
+
+    void Log() const;
+
+  private:
+    string_t sName;
+    size_t nSamples;
+    float fTotalMS;
+    float fMaximumMS;
+  };
+
+  inline cLatencyCounter::cLatencyCounter(const string_t& _sName) :
+    sName(_sName),
+    nSamples(0),
+    fTotalMS(0.0f),
+    fMaximumMS(0.0f)
+  {
+  }
+
+  inline float cLatencyCounter::AddSample(const std::chrono::steady_clock::time_point& requestedTime)
+  {
+    const float fMS = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - requestedTime).count();
+
+    nSamples++;
+    fTotalMS += fMS;
+    if (fMS > fMaximumMS) fMaximumMS = fMS;
+
+    return fMS;
+  }
+
+  inline float cLatencyCounter::GetAverageMS() const
+  {
+    return (nSamples != 0) ? (fTotalMS / float(nSamples)) : 0.0f;
+  }
+
+  inline void cLatencyCounter::Log() const
+  {
+    LOG<<"cLatencyCounter::Log "<<sName<<" samples="<<nSamples<<", average="<<GetAverageMS()<<"ms, maximum="<<fMaximumMS<<"ms"<<std::endl;
+  }
+}
+
+#endif // DIESEL_LATENCYCOUNTER_H
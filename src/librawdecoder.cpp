@@ -0,0 +1,151 @@
+// Standard headers
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+// LibRaw headers
+#include <libraw/libraw.h>
+
+// Spitfire headers
+#include <spitfire/util/log.h>
+#include <spitfire/util/string.h>
+
+// Diesel headers
+#include "jpegthumbnail.h"
+#include "librawdecoder.h"
+#include "thumbnailformat.h"
+
+namespace diesel
+{
+  // ** cLibRawImage
+  //
+  // Frees the image that LibRaw allocated for us
+  //
+
+  class cLibRawImage
+  {
+  public:
+    explicit cLibRawImage(libraw_processed_image_t* pImage);
+    ~cLibRawImage();
+
+    libraw_processed_image_t* pImage;
+
+  private:
+    cLibRawImage(const cLibRawImage&) = delete;
+    cLibRawImage& operator=(const cLibRawImage&) = delete;
+  };
+
+  cLibRawImage::cLibRawImage(libraw_processed_image_t* _pImage) :
+    pImage(_pImage)
+  {
+  }
+
+  cLibRawImage::~cLibRawImage()
+  {
+    if (pImage != nullptr) LibRaw::dcraw_clear_mem(pImage);
+  }
+
+
+  // ** LibRaw decoder
+
+  int OnLibRawProgress(void* pData, enum LibRaw_progress stage, int iteration, int expected)
+  {
+    (void)stage;
+    (void)iteration;
+    (void)expected;
+
+    // Any value other than 0 cancels the decode
+    const spitfire::util::cProcessInterface* pProcessInterface = static_cast<const spitfire::util::cProcessInterface*>(pData);
+    return pProcessInterface->IsToStop() ? 1 : 0;
+  }
+
+  bool IsLibRawSupported(const string_t& sFilePath)
+  {
+    // LibRaw is much too big to go on the stack
+    std::unique_ptr<LibRaw> pLibRaw(new LibRaw);
+    return (pLibRaw->open_file(sFilePath.c_str()) == LIBRAW_SUCCESS);
+  }
+
+  CONVERSION_RESULT CreateImageWithLibRaw(const string_t& sFilePath, size_t nSizePixels, const string_t& sFilePathJPG, spitfire::util::cProcessInterface& processInterface)
+  {
+    std::unique_ptr<LibRaw> pLibRaw(new LibRaw);
+    pLibRaw->set_progress_handler(OnLibRawProgress, &processInterface);
+
+    // Half size skips the demosaic completely, the camera's white balance is what the preview and ufraw would have used
+    libraw_output_params_t& params = pLibRaw->imgdata.params;
+    params.half_size = (nSizePixels != 0) ? 1 : 0;
+    params.use_camera_wb = 1;
+    params.output_bps = 8;
+
+    int result = pLibRaw->open_file(sFilePath.c_str());
+    if (result == LIBRAW_SUCCESS) result = pLibRaw->unpack();
+    if (result == LIBRAW_SUCCESS) result = pLibRaw->dcraw_process();
+    if (result != LIBRAW_SUCCESS) {
+      if (result == LIBRAW_CANCELLED_BY_CALLBACK) LOG<<"CreateImageWithLibRaw Stopped while decoding \""<<sFilePath<<"\", returning TEMPORARY_FAILURE"<<std::endl;
+      else LOG<<"CreateImageWithLibRaw Failed to decode \""<<sFilePath<<"\" "<<LibRaw::strerror(result)<<std::endl;
+
+      // Positive results are errno values from opening the file
+      const bool bIsTemporary = (result > 0) || (result == LIBRAW_CANCELLED_BY_CALLBACK) || (result == LIBRAW_IO_ERROR) || (result == LIBRAW_UNSUFFICIENT_MEMORY);
+      return bIsTemporary ? CONVERSION_RESULT::TEMPORARY_FAILURE : CONVERSION_RESULT::INVALID_FILE;
+    }
+
+    // The image that LibRaw makes for us has already been turned to match the orientation of the raw file
+    cLibRawImage image(pLibRaw->dcraw_make_mem_image(&result));
+    if ((image.pImage == nullptr) || (image.pImage->type != LIBRAW_IMAGE_BITMAP) || (image.pImage->colors != 3) || (image.pImage->bits != 8)) {
+      LOG<<"CreateImageWithLibRaw Failed to create the image for \""<<sFilePath<<"\", returning INVALID_FILE"<<std::endl;
+      return CONVERSION_RESULT::INVALID_FILE;
+    }
+
+    // We don't need the raw data any more, this frees it while we resize and encode the image
+    pLibRaw.reset();
+
+    const uint8_t* pPixels = image.pImage->data;
+    size_t width = image.pImage->width;
+    size_t height = image.pImage->height;
+    size_t nBytesPerPixel = 3;
+
+    // Resize the thumbnail to fit in nSizePixels, ResizeImage wants RGBA pixels so we add the alpha channel first
+    std::vector<uint8_t> resized;
+    const size_t nLargestSide = std::max(width, height);
+    if ((nSizePixels != 0) && (nLargestSide > nSizePixels)) {
+      std::vector<uint8_t> pixels(width * height * 4);
+      const size_t n = width * height;
+      for (size_t i = 0; i < n; i++) {
+        pixels[(i * 4)] = pPixels[(i * 3)];
+        pixels[(i * 4) + 1] = pPixels[(i * 3) + 1];
+        pixels[(i * 4) + 2] = pPixels[(i * 3) + 2];
+        pixels[(i * 4) + 3] = 255;
+      }
+
+      const size_t resizedWidth = std::max<size_t>(1, (width * nSizePixels) / nLargestSide);
+      const size_t resizedHeight = std::max<size_t>(1, (height * nSizePixels) / nLargestSide);
+      resized.resize(resizedWidth * resizedHeight * 4);
+      ResizeImage(pixels.data(), width, height, resized.data(), resizedWidth, resizedHeight);
+
+      pPixels = resized.data();
+      width = resizedWidth;
+      height = resizedHeight;
+      nBytesPerPixel = 4;
+    }
+
+    std::vector<uint8_t> data;
+    if (!EncodeJPEG(pPixels, width, height, nBytesPerPixel, data)) {
+      LOG<<"CreateImageWithLibRaw Failed to encode the image for \""<<sFilePath<<"\", returning INVALID_FILE"<<std::endl;
+      return CONVERSION_RESULT::INVALID_FILE;
+    }
+
+    std::ofstream file(sFilePathJPG.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!file.good()) return CONVERSION_RESULT::TEMPORARY_FAILURE;
+
+    file.write(reinterpret_cast<const char*>(data.data()), std::streamsize(data.size()));
+    return file.good() ? CONVERSION_RESULT::SUCCESS : CONVERSION_RESULT::TEMPORARY_FAILURE;
+  }
+
+  string_t GetLibRawVersion()
+  {
+    // LibRaw only gives us a narrow string
+    return spitfire::string::ToString_t(LibRaw::version());
+  }
+}
@@ -0,0 +1,31 @@
+#ifndef DIESEL_LIBRAWDECODER_H
+#define DIESEL_LIBRAWDECODER_H
+
+// Standard headers
+#include <cstddef>
+
+// Spitfire headers
+#include <spitfire/util/process.h>
+
+// Diesel headers
+#include "diesel.h"
+
+namespace diesel
+{
+  // ** LibRaw decoder
+  //
+  // Develops raw files that don't have a preview that we can use in process with LibRaw, instead of converting them to dng under wine and then running
+  // ufraw-batch on the dng
+  // Thumbnails use LibRaw's half size mode, which takes each 2x2 block of the bayer pattern as one pixel instead of demosaicing it, that is several times
+  // quicker than a full render and still gives us more pixels than a thumbnail needs, full size images get a full render
+  // The image is turned to match the orientation of the raw file and written out as a jpeg so it goes into the cache the same way as the converters
+  // processInterface is checked between and during LibRaw's stages, the decode is abandoned as soon as the job is stopped
+  //
+
+  bool IsLibRawSupported(const string_t& sFilePath); // Only reads the header, false for cameras that this version of LibRaw doesn't know about
+  CONVERSION_RESULT CreateImageWithLibRaw(const string_t& sFilePath, size_t nSizePixels, const string_t& sFilePathJPG, spitfire::util::cProcessInterface& processInterface); // nSizePixels is 0 for a full size image
+
+  string_t GetLibRawVersion();
+}
+
+#endif // DIESEL_LIBRAWDECODER_H
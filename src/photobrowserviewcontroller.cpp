@@ -20,6 +20,7 @@
 
 // Diesel headers
 #include "photobrowserviewcontroller.h"
+#include "util.h"
 
 namespace diesel
 {
@@ -35,61 +36,69 @@ namespace diesel
   class cPhotoBrowserViewControllerFolderFoundEvent : public cPhotoBrowserViewControllerEvent
   {
   public:
-    cPhotoBrowserViewControllerFolderFoundEvent(const string_t& sFolderName);
+    cPhotoBrowserViewControllerFolderFoundEvent(size_t generation, const string_t& sFolderName);
 
     virtual void EventFunction(cPhotoBrowserViewController& view) override;
 
+    size_t generation;
     string_t sFolderName;
   };
 
-  cPhotoBrowserViewControllerFolderFoundEvent::cPhotoBrowserViewControllerFolderFoundEvent(const string_t& _sFolderName) :
+  cPhotoBrowserViewControllerFolderFoundEvent::cPhotoBrowserViewControllerFolderFoundEvent(size_t _generation, const string_t& _sFolderName) :
+    generation(_generation),
     sFolderName(_sFolderName)
   {
   }
 
   void cPhotoBrowserViewControllerFolderFoundEvent::EventFunction(cPhotoBrowserViewController& view)
   {
-    view.OnFolderFound(sFolderName);
+    view.OnFolderFound(generation, sFolderName);
   }
 
 
   class cPhotoBrowserViewControllerFileFoundEvent : public cPhotoBrowserViewControllerEvent
   {
   public:
-    cPhotoBrowserViewControllerFileFoundEvent(const string_t& sFileNameNoExtension);
+    cPhotoBrowserViewControllerFileFoundEvent(size_t generation, const string_t& sFileNameNoExtension);
 
     virtual void EventFunction(cPhotoBrowserViewController& view) override;
 
+    size_t generation;
     string_t sFileNameNoExtension;
   };
 
-  cPhotoBrowserViewControllerFileFoundEvent::cPhotoBrowserViewControllerFileFoundEvent(const string_t& _sFileNameNoExtension) :
+  cPhotoBrowserViewControllerFileFoundEvent::cPhotoBrowserViewControllerFileFoundEvent(size_t _generation, const string_t& _sFileNameNoExtension) :
+    generation(_generation),
     sFileNameNoExtension(_sFileNameNoExtension)
   {
   }
 
   void cPhotoBrowserViewControllerFileFoundEvent::EventFunction(cPhotoBrowserViewController& view)
   {
-    view.OnFileFound(sFileNameNoExtension);
+    view.OnFileFound(generation, sFileNameNoExtension);
   }
 
 
   class cPhotoBrowserViewControllerImageLoadedEvent : public cPhotoBrowserViewControllerEvent
   {
   public:
-    cPhotoBrowserViewControllerImageLoadedEvent(const string_t& sFileNameNoExtension, IMAGE_SIZE imageSize, voodoo::cImage* pImage);
+    cPhotoBrowserViewControllerImageLoadedEvent(size_t generation, const string_t& sFileNameNoExtension, IMAGE_SIZE imageSize, int orientation, voodoo::cImage* pImage);
     ~cPhotoBrowserViewControllerImageLoadedEvent();
 
     virtual void EventFunction(cPhotoBrowserViewController& view) override;
 
+    size_t generation;
     string_t sFileNameNoExtension;
     IMAGE_SIZE imageSize;
+    int orientation;
     voodoo::cImage* pImage;
   };
 
-  cPhotoBrowserViewControllerImageLoadedEvent::cPhotoBrowserViewControllerImageLoadedEvent(const string_t& _sFileNameNoExtension, IMAGE_SIZE _imageSize, voodoo::cImage* _pImage) :
+  cPhotoBrowserViewControllerImageLoadedEvent::cPhotoBrowserViewControllerImageLoadedEvent(size_t _generation, const string_t& _sFileNameNoExtension, IMAGE_SIZE _imageSize, int _orientation, voodoo::cImage* _pImage) :
+    generation(_generation),
     sFileNameNoExtension(_sFileNameNoExtension),
     imageSize(_imageSize),
+    orientation(_orientation),
     pImage(_pImage)
   {
   }
@@ -101,28 +110,30 @@ namespace diesel
 
   void cPhotoBrowserViewControllerImageLoadedEvent::EventFunction(cPhotoBrowserViewController& view)
   {
-    view.OnImageLoaded(sFileNameNoExtension, imageSize, pImage);
+    view.OnImageLoaded(generation, sFileNameNoExtension, imageSize, orientation, pImage);
   }
 
 
   class cPhotoBrowserViewControllerImageErrorEvent : public cPhotoBrowserViewControllerEvent
   {
   public:
-    explicit cPhotoBrowserViewControllerImageErrorEvent(const string_t& sFileNameNoExtension);
+    cPhotoBrowserViewControllerImageErrorEvent(size_t generation, const string_t& sFileNameNoExtension);
 
     virtual void EventFunction(cPhotoBrowserViewController& view) override;
 
+    size_t generation;
     string_t sFileNameNoExtension;
   };
 
-  cPhotoBrowserViewControllerImageErrorEvent::cPhotoBrowserViewControllerImageErrorEvent(const string_t& _sFileNameNoExtension) :
+  cPhotoBrowserViewControllerImageErrorEvent::cPhotoBrowserViewControllerImageErrorEvent(size_t _generation, const string_t& _sFileNameNoExtension) :
+    generation(_generation),
     sFileNameNoExtension(_sFileNameNoExtension)
   {
   }
 
   void cPhotoBrowserViewControllerImageErrorEvent::EventFunction(cPhotoBrowserViewController& view)
   {
-    view.OnImageError(sFileNameNoExtension);
+    view.OnImageError(generation, sFileNameNoExtension);
   }
 
 
@@ -318,6 +329,23 @@ namespace diesel
     pageHeight = resolution.height * fScale;
 
     LOG<<"cPhotoBrowserViewController::UpdateColumnsPageHeightAndRequiredHeight fScale="<<fScale<<", photos="<<photos.size()<<", rows="<<rows<<", columns="<<columns<<", requiredHeight="<<requiredHeight<<", pageHeight="<<pageHeight<<std::endl;
+
+    // Tell the image load thread how many pixels the thumbnails take up on screen so that it can load a thumbnail that is big enough
+    imageLoadThread.SetThumbnailSize(spitfire::math::RoundUpToNearestInt(max(fThumbNailWidth, fThumbNailHeight) * fScale));
+
+    UpdateVisibleRange();
+  }
+
+  void cPhotoBrowserViewController::UpdateVisibleRange()
+  {
+    // Tell the image load thread which photos are visible so that it can load them first
+    const float fRowHeight = fThumbNailHeight + fThumbNailSpacing;
+    const float fVisibleHeight = float(resolution.height) / fScale;
+
+    const size_t firstRow = size_t(max(0.0f, fScrollPosition - fThumbNailSpacing) / fRowHeight);
+    const size_t lastRow = size_t(max(0.0f, fScrollPosition + fVisibleHeight - fThumbNailSpacing) / fRowHeight);
+
+    imageLoadThread.SetVisibleRange(firstRow * columns, ((lastRow + 1) * columns) - 1);
   }
 
   bool cPhotoBrowserViewController::GetPhotoAtPoint(size_t& index, const spitfire::math::cVec2& _point) const
@@ -393,7 +421,7 @@ namespace diesel
     pStaticVertexBufferObject->Compile2D();
   }
 
-  void cPhotoBrowserViewController::CreateVertexBufferObjectRect(opengl::cStaticVertexBufferObject* pStaticVertexBufferObject, float fX, float fY, float fWidth, float fHeight, size_t textureWidth, size_t textureHeight)
+  void cPhotoBrowserViewController::CreateVertexBufferObjectRect(opengl::cStaticVertexBufferObject* pStaticVertexBufferObject, float fX, float fY, float fWidth, float fHeight, size_t textureWidth, size_t textureHeight, int orientation)
   {
     ASSERT(pStaticVertexBufferObject != nullptr);
 
@@ -405,15 +433,24 @@ namespace diesel
     const spitfire::math::cVec2 vMin(fX, fY);
     const spitfire::math::cVec2 vMax(vMin.x + fWidth, vMin.y + fHeight);
 
+    // The photo is turned by sampling the texture from a different corner for each corner of the rectangle
+    spitfire::math::cVec2 vTexture[4]; // Top left, top right, bottom left, bottom right
+    for (size_t i = 0; i < 4; i++) {
+      float fTextureU = 0.0f;
+      float fTextureV = 0.0f;
+      util::GetTextureCoordinateForOrientation(orientation, float(i % 2), float(i / 2), fTextureU, fTextureV);
+      vTexture[i] = spitfire::math::cVec2(fTextureU * fTextureWidth, fTextureV * fTextureHeight);
+    }
+
     opengl::cGeometryBuilder_v2_t2 builder(*pGeometryDataPtr);
 
     // Front facing rectangle
-    builder.PushBack(spitfire::math::cVec2(vMax.x, vMin.y), spitfire::math::cVec2(fTextureWidth, 0.0f));
-    builder.PushBack(spitfire::math::cVec2(vMin.x, vMax.y), spitfire::math::cVec2(0.0f, fTextureHeight));
-    builder.PushBack(spitfire::math::cVec2(vMax.x, vMax.y), spitfire::math::cVec2(fTextureWidth, fTextureHeight));
-    builder.PushBack(spitfire::math::cVec2(vMin.x, vMin.y), spitfire::math::cVec2(0.0f, 0.0f));
-    builder.PushBack(spitfire::math::cVec2(vMin.x, vMax.y), spitfire::math::cVec2(0.0f, fTextureHeight));
-    builder.PushBack(spitfire::math::cVec2(vMax.x, vMin.y), spitfire::math::cVec2(fTextureWidth, 0.0f));
+    builder.PushBack(spitfire::math::cVec2(vMax.x, vMin.y), vTexture[1]);
+    builder.PushBack(spitfire::math::cVec2(vMin.x, vMax.y), vTexture[2]);
+    builder.PushBack(spitfire::math::cVec2(vMax.x, vMax.y), vTexture[3]);
+    builder.PushBack(spitfire::math::cVec2(vMin.x, vMin.y), vTexture[0]);
+    builder.PushBack(spitfire::math::cVec2(vMin.x, vMax.y), vTexture[2]);
+    builder.PushBack(spitfire::math::cVec2(vMax.x, vMin.y), vTexture[1]);
 
     pStaticVertexBufferObject->SetData(pGeometryDataPtr);
 
@@ -428,10 +465,12 @@ namespace diesel
     CreateVertexBufferObjectSquare(pStaticVertexBufferObjectIcon, fWidthAndHeight, fWidthAndHeight);
   }
 
-  void cPhotoBrowserViewController::CreateVertexBufferObjectPhoto(opengl::cStaticVertexBufferObject* pStaticVertexBufferObjectPhoto, size_t textureWidth, size_t textureHeight)
+  void cPhotoBrowserViewController::CreateVertexBufferObjectPhoto(opengl::cStaticVertexBufferObject* pStaticVertexBufferObjectPhoto, size_t textureWidth, size_t textureHeight, int orientation)
   {
     ASSERT(pStaticVertexBufferObjectPhoto != nullptr);
-    const float fRatio = float(textureWidth) / float(textureHeight);
+    // Photos that are turned on their side are drawn with their width and height swapped
+    const bool bIsSwapped = util::IsOrientationSwapWidthAndHeight(orientation);
+    const float fRatio = bIsSwapped ? (float(textureHeight) / float(textureWidth)) : (float(textureWidth) / float(textureHeight));
     float fWidth = fThumbNailWidth;
     float fHeight = fWidth * (1.0f / fRatio);
     if (fHeight > fThumbNailHeight) {
@@ -441,7 +480,7 @@ namespace diesel
     // Center the photo
     const float fX = 0.5f * (fThumbNailWidth - fWidth);
     const float fY = 0.5f * (fThumbNailHeight - fHeight);
-    CreateVertexBufferObjectRect(pStaticVertexBufferObjectPhoto, fX, fY, fWidth, fHeight, textureWidth, textureHeight);
+    CreateVertexBufferObjectRect(pStaticVertexBufferObjectPhoto, fX, fY, fWidth, fHeight, textureWidth, textureHeight, orientation);
   }
 
   /*void cPhotoBrowserViewController::CreateVertexBufferObjectPhotos()
@@ -904,15 +943,19 @@ namespace diesel
     pContext->EndRenderToScreen();
   }
 
-  void cPhotoBrowserViewController::OnFolderFound(const string_t& sFolderName)
+  void cPhotoBrowserViewController::OnFolderFound(size_t generation, const string_t& sFolderName)
   {
     LOG<<"cPhotoBrowserViewController::OnFolderFound \""<<sFolderName<<"\""<<std::endl;
 
     if (!spitfire::util::IsMainThread()) {
-      cPhotoBrowserViewControllerFolderFoundEvent* pEvent = new cPhotoBrowserViewControllerFolderFoundEvent(sFolderName);
+      cPhotoBrowserViewControllerFolderFoundEvent* pEvent = new cPhotoBrowserViewControllerFolderFoundEvent(generation, sFolderName);
       notifyMainThread.PushEventToMainThread(pEvent);
     } else {
       LOG<<"cPhotoBrowserViewController::OnFolderFound On main thread \""<<sFolderName<<"\""<<std::endl;
+
+      // Throw away anything from a folder that we have already left
+      if (generation != imageLoadThread.GetGeneration()) return;
+
       cPhotoEntry* pEntry = new cPhotoEntry;
       pEntry->sFileNameNoExtension = sFolderName;
       pEntry->state = cPhotoEntry::STATE::FOLDER;
@@ -922,15 +965,19 @@ namespace diesel
     }
   }
 
-  void cPhotoBrowserViewController::OnFileFound(const string_t& sFileNameNoExtension)
+  void cPhotoBrowserViewController::OnFileFound(size_t generation, const string_t& sFileNameNoExtension)
   {
     LOG<<"cPhotoBrowserViewController::OnFileFound \""<<sFileNameNoExtension<<"\""<<std::endl;
 
     if (!spitfire::util::IsMainThread()) {
-      cPhotoBrowserViewControllerFileFoundEvent* pEvent = new cPhotoBrowserViewControllerFileFoundEvent(sFileNameNoExtension);
+      cPhotoBrowserViewControllerFileFoundEvent* pEvent = new cPhotoBrowserViewControllerFileFoundEvent(generation, sFileNameNoExtension);
       notifyMainThread.PushEventToMainThread(pEvent);
     } else {
       LOG<<"cPhotoBrowserViewController::OnFileFound On main thread \""<<sFileNameNoExtension<<"\""<<std::endl;
+
+      // Throw away anything from a folder that we have already left
+      if (generation != imageLoadThread.GetGeneration()) return;
+
       cPhotoEntry* pEntry = new cPhotoEntry;
       pEntry->sFileNameNoExtension = sFileNameNoExtension;
       pEntry->state = cPhotoEntry::STATE::LOADING;
@@ -940,15 +987,19 @@ namespace diesel
     }
   }
 
-  void cPhotoBrowserViewController::OnImageError(const string_t& sFileNameNoExtension)
+  void cPhotoBrowserViewController::OnImageError(size_t generation, const string_t& sFileNameNoExtension)
   {
     LOG<<"cPhotoBrowserViewController::OnImageError \""<<sFileNameNoExtension<<"\""<<std::endl;
 
     if (!spitfire::util::IsMainThread()) {
-      cPhotoBrowserViewControllerImageErrorEvent* pEvent = new cPhotoBrowserViewControllerImageErrorEvent(sFileNameNoExtension);
+      cPhotoBrowserViewControllerImageErrorEvent* pEvent = new cPhotoBrowserViewControllerImageErrorEvent(generation, sFileNameNoExtension);
       notifyMainThread.PushEventToMainThread(pEvent);
     } else {
       LOG<<"cPhotoBrowserViewController::OnImageError On main thread \""<<sFileNameNoExtension<<"\""<<std::endl;
+
+      // Throw away anything from a folder that we have already left
+      if (generation != imageLoadThread.GetGeneration()) return;
+
       const size_t n = photos.size();
       for (size_t i = 0; i < n; i++) {
         if (photos[i]->sFileNameNoExtension == sFileNameNoExtension) {
@@ -962,15 +1013,19 @@ namespace diesel
     }
   }
 
-  void cPhotoBrowserViewController::OnImageLoaded(const string_t& sFileNameNoExtension, IMAGE_SIZE imageSize, voodoo::cImage* pImage)
+  void cPhotoBrowserViewController::OnImageLoaded(size_t generation, const string_t& sFileNameNoExtension, IMAGE_SIZE imageSize, int orientation, voodoo::cImage* pImage)
   {
     LOG<<"cPhotoBrowserViewController::OnImageLoaded \""<<sFileNameNoExtension<<"\""<<std::endl;
 
     if (!spitfire::util::IsMainThread()) {
-      cPhotoBrowserViewControllerImageLoadedEvent* pEvent = new cPhotoBrowserViewControllerImageLoadedEvent(sFileNameNoExtension, imageSize, pImage);
+      cPhotoBrowserViewControllerImageLoadedEvent* pEvent = new cPhotoBrowserViewControllerImageLoadedEvent(generation, sFileNameNoExtension, imageSize, orientation, pImage);
       notifyMainThread.PushEventToMainThread(pEvent);
     } else {
       LOG<<"cPhotoBrowserViewController::OnImageLoaded On main thread \""<<sFileNameNoExtension<<"\""<<std::endl;
+
+      // Throw away anything from a folder that we have already left
+      if (generation != imageLoadThread.GetGeneration()) return;
+
       const size_t n = photos.size();
       for (size_t i = 0; i < n; i++) {
         if (photos[i]->sFileNameNoExtension == sFileNameNoExtension) {
@@ -978,8 +1033,15 @@ namespace diesel
           pEntry->state = cPhotoEntry::STATE::LOADED;
 
           if (imageSize == IMAGE_SIZE::THUMBNAIL) {
-            ASSERT(pEntry->pTexturePhotoThumbnail == nullptr);
-            ASSERT(pEntry->pStaticVertexBufferObjectPhotoThumbnail == nullptr);
+            // Replace the placeholder, or the thumbnail if it has been loaded again at a bigger size
+            if (pEntry->pTexturePhotoThumbnail != nullptr) {
+              pContext->DestroyTexture(pEntry->pTexturePhotoThumbnail);
+              pEntry->pTexturePhotoThumbnail = nullptr;
+            }
+            if (pEntry->pStaticVertexBufferObjectPhotoThumbnail != nullptr) {
+              pContext->DestroyStaticVertexBufferObject(pEntry->pStaticVertexBufferObjectPhotoThumbnail);
+              pEntry->pStaticVertexBufferObjectPhotoThumbnail = nullptr;
+            }
 
             // Create the texture
             pEntry->pTexturePhotoThumbnail = pContext->CreateTextureFromImage(*pImage);
@@ -987,7 +1049,7 @@ namespace diesel
 
             // Create the static vertex buffer object
             pEntry->pStaticVertexBufferObjectPhotoThumbnail = pContext->CreateStaticVertexBufferObject();
-            CreateVertexBufferObjectPhoto(pEntry->pStaticVertexBufferObjectPhotoThumbnail, pEntry->pTexturePhotoThumbnail->GetWidth(), pEntry->pTexturePhotoThumbnail->GetHeight());
+            CreateVertexBufferObjectPhoto(pEntry->pStaticVertexBufferObjectPhotoThumbnail, pEntry->pTexturePhotoThumbnail->GetWidth(), pEntry->pTexturePhotoThumbnail->GetHeight(), orientation);
             ASSERT(pEntry->pStaticVertexBufferObjectPhotoThumbnail != nullptr);
           } else {
             ASSERT(pEntry->pTexturePhotoFull == nullptr);
@@ -999,7 +1061,7 @@ namespace diesel
 
             // Create the static vertex buffer object
             pEntry->pStaticVertexBufferObjectPhotoFull = pContext->CreateStaticVertexBufferObject();
-            CreateVertexBufferObjectPhoto(pEntry->pStaticVertexBufferObjectPhotoFull, pEntry->pTexturePhotoFull->GetWidth(), pEntry->pTexturePhotoFull->GetHeight());
+            CreateVertexBufferObjectPhoto(pEntry->pStaticVertexBufferObjectPhotoFull, pEntry->pTexturePhotoFull->GetWidth(), pEntry->pTexturePhotoFull->GetHeight(), orientation);
             ASSERT(pEntry->pStaticVertexBufferObjectPhotoFull != nullptr);
           }
 
@@ -1238,5 +1300,8 @@ namespace diesel
 
     // Clamp the value to our range
     ClampScrollBarPosition();
+
+    // Load the photos that are now visible first
+    UpdateVisibleRange();
   }
 }
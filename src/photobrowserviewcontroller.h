@@ -108,12 +108,13 @@ namespace diesel
   private:
     void CreateVertexBufferObjectSelectionRectangle(opengl::cStaticVertexBufferObject* pStaticVertexBufferObject, float fWidth, float fHeight);
     void CreateVertexBufferObjectSquare(opengl::cStaticVertexBufferObject* pStaticVertexBufferObject, float fWidth, float fHeight);
-    void CreateVertexBufferObjectRect(opengl::cStaticVertexBufferObject* pStaticVertexBufferObject, float fX, float fY, float fWidth, float fHeight, size_t textureWidth, size_t textureHeight);
+    void CreateVertexBufferObjectRect(opengl::cStaticVertexBufferObject* pStaticVertexBufferObject, float fX, float fY, float fWidth, float fHeight, size_t textureWidth, size_t textureHeight, int orientation);
     void CreateVertexBufferObjectIcon();
-    void CreateVertexBufferObjectPhoto(opengl::cStaticVertexBufferObject* pStaticVertexBufferObjectPhoto, size_t textureWidth, size_t textureHeight);
+    void CreateVertexBufferObjectPhoto(opengl::cStaticVertexBufferObject* pStaticVertexBufferObjectPhoto, size_t textureWidth, size_t textureHeight, int orientation); // orientation is the EXIF orientation to turn the photo by
 
     void ClampScrollBarPosition();
     void UpdateColumnsPageHeightAndRequiredHeight();
+    void UpdateVisibleRange();
 
     bool GetPhotoAtPoint(size_t& index, const spitfire::math::cVec2& point) const;
 
@@ -130,10 +131,10 @@ namespace diesel
 
     void RenderPhoto(size_t index, const spitfire::math::cMat4& matScale);
 
-    virtual void OnFolderFound(const string_t& sFolderName) override;
-    virtual void OnFileFound(const string_t& sFileNameNoExtension) override;
-    virtual void OnImageLoaded(const string_t& sFileNameNoExtension, IMAGE_SIZE imageSize, voodoo::cImage* pImage) override;
-    virtual void OnImageError(const string_t& sFileNameNoExtension) override;
+    virtual void OnFolderFound(size_t generation, const string_t& sFolderName) override;
+    virtual void OnFileFound(size_t generation, const string_t& sFileNameNoExtension) override;
+    virtual void OnImageLoaded(size_t generation, const string_t& sFileNameNoExtension, IMAGE_SIZE imageSize, int orientation, voodoo::cImage* pImage) override;
+    virtual void OnImageError(size_t generation, const string_t& sFileNameNoExtension) override;
 
     cWin32mmOpenGLView& view;
 
@@ -0,0 +1,505 @@
+#ifndef __WIN__
+
+// Standard headers
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+// POSIX headers
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Spitfire headers
+#include <spitfire/util/log.h>
+
+// Diesel headers
+#include "processrunner.h"
+
+extern char** environ;
+
+namespace diesel
+{
+  // How often we check if the tool should be killed while we wait for it
+  const int iPollIntervalMS = 10;
+
+  // How long a tool has to exit after SIGTERM before it gets SIGKILL
+  const int iKillGracePeriodMS = 200;
+
+  // We only keep the start of the captured output, it is only for logging and version strings
+  const size_t nMaximumCapturedBytes = 16 * 1024;
+
+  void SetNonBlocking(int fd)
+  {
+    ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+  }
+
+  void ReadFromPipe(int fd, std::string& sOutput, bool& bIsOpen)
+  {
+    char buffer[4096];
+    while (true) {
+      const ssize_t nRead = ::read(fd, buffer, sizeof(buffer));
+      if (nRead > 0) {
+        if (sOutput.length() < nMaximumCapturedBytes) sOutput.append(buffer, std::min<size_t>(nRead, nMaximumCapturedBytes - sOutput.length()));
+      } else {
+        if ((nRead == 0) || ((errno != EAGAIN) && (errno != EINTR))) bIsOpen = false;
+        break;
+      }
+    }
+  }
+
+  // Starts the tool in its own process group so that we can kill it and everything that it starts
+  bool SpawnProcess(const std::vector<string_t>& arguments, const posix_spawn_file_actions_t& fileActions, pid_t& pid)
+  {
+    ASSERT(!arguments.empty());
+
+    std::vector<char*> argv;
+    const size_t n = arguments.size();
+    for (size_t i = 0; i < n; i++) argv.push_back(const_cast<char*>(arguments[i].c_str()));
+    argv.push_back(nullptr);
+
+    posix_spawnattr_t attributes;
+    ::posix_spawnattr_init(&attributes);
+    ::posix_spawnattr_setpgroup(&attributes, 0);
+    sigset_t signalMask;
+    sigemptyset(&signalMask);
+    ::posix_spawnattr_setsigmask(&attributes, &signalMask);
+    sigset_t signalDefault;
+    sigemptyset(&signalDefault);
+    sigaddset(&signalDefault, SIGPIPE);
+    ::posix_spawnattr_setsigdefault(&attributes, &signalDefault);
+    ::posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    pid = 0;
+    const int iSpawnResult = ::posix_spawnp(&pid, argv[0], &fileActions, &attributes, argv.data(), environ);
+
+    ::posix_spawnattr_destroy(&attributes);
+
+    if (iSpawnResult != 0) {
+      LOG<<"SpawnProcess posix_spawnp FAILED for "<<cProcessRunner::GetCommandLine(arguments)<<" error="<<::strerror(iSpawnResult)<<", returning false"<<std::endl;
+      return false;
+    }
+
+    return true;
+  }
+
+  // Returns true if the process exited within nTimeoutMS
+  bool WaitForProcessToExit(pid_t pid, int iTimeoutMS)
+  {
+    for (int i = 0; i < iTimeoutMS; i += iPollIntervalMS) {
+      int status = 0;
+      const pid_t result = ::waitpid(pid, &status, WNOHANG);
+      if ((result == pid) || ((result == -1) && (errno == ECHILD))) return true;
+
+      ::poll(nullptr, 0, iPollIntervalMS);
+    }
+
+    return false;
+  }
+
+  void KillProcessGroup(pid_t pid)
+  {
+    // Ask the whole process group to exit and give it a moment before we force it
+    ::kill(-pid, SIGTERM);
+    if (WaitForProcessToExit(pid, iKillGracePeriodMS)) {
+      // Make sure that any children it started are gone too
+      ::kill(-pid, SIGKILL);
+      return;
+    }
+
+    ::kill(-pid, SIGKILL);
+
+    int status = 0;
+    while ((::waitpid(pid, &status, 0) == -1) && (errno == EINTR));
+  }
+
+
+  // ** cProcessRunner
+
+  cProcessRunner::cProcessRunner() :
+    nTimeoutMS(0),
+    bIsCaptureStandardOutput(false),
+    iExitCode(0)
+  {
+  }
+
+  void cProcessRunner::SetTimeoutMS(size_t _nTimeoutMS)
+  {
+    nTimeoutMS = _nTimeoutMS;
+  }
+
+  void cProcessRunner::SetStandardOutputFilePath(const string_t& sFilePath)
+  {
+    sStandardOutputFilePath = sFilePath;
+    bIsCaptureStandardOutput = false;
+  }
+
+  void cProcessRunner::SetCaptureStandardOutput()
+  {
+    sStandardOutputFilePath.clear();
+    bIsCaptureStandardOutput = true;
+  }
+
+  string_t cProcessRunner::GetCommandLine(const std::vector<string_t>& arguments)
+  {
+    ostringstream_t o;
+
+    const size_t n = arguments.size();
+    for (size_t i = 0; i < n; i++) {
+      if (i != 0) o<<" ";
+      o<<"\""<<arguments[i]<<"\"";
+    }
+
+    return o.str();
+  }
+
+  const char* cProcessRunner::GetResultString(PROCESS_RESULT result)
+  {
+    switch (result) {
+      case PROCESS_RESULT::SUCCESS: return "success";
+      case PROCESS_RESULT::FAILED: return "failed";
+      case PROCESS_RESULT::TIMED_OUT: return "timed out";
+      case PROCESS_RESULT::CANCELLED: return "cancelled";
+      case PROCESS_RESULT::ERROR_STARTING: return "error starting";
+    }
+
+    return "unknown";
+  }
+
+  PROCESS_RESULT cProcessRunner::Run(const std::vector<string_t>& arguments, spitfire::util::cProcessInterface& processInterface)
+  {
+    ASSERT(!arguments.empty());
+
+    iExitCode = 0;
+    sStandardOutput.clear();
+    sStandardError.clear();
+
+    if (processInterface.IsToStop()) return PROCESS_RESULT::CANCELLED;
+
+    // Create the pipes for standard output and standard error
+    // NOTE: Other workers may be starting tools at the same time, so the pipes are created close on exec or those tools could inherit them, the dup2 file
+    // actions clear the flag on the child's copies
+    int pipeStandardOutput[2] = { -1, -1 };
+    int pipeStandardError[2] = { -1, -1 };
+    if ((bIsCaptureStandardOutput && (::pipe2(pipeStandardOutput, O_CLOEXEC) != 0)) || (::pipe2(pipeStandardError, O_CLOEXEC) != 0)) {
+      LOG<<"cProcessRunner::Run pipe FAILED, returning ERROR_STARTING"<<std::endl;
+      if (pipeStandardOutput[0] != -1) {
+        ::close(pipeStandardOutput[0]);
+        ::close(pipeStandardOutput[1]);
+      }
+      return PROCESS_RESULT::ERROR_STARTING;
+    }
+
+    if (pipeStandardOutput[0] != -1) SetNonBlocking(pipeStandardOutput[0]);
+    SetNonBlocking(pipeStandardError[0]);
+
+    // Standard input goes nowhere, standard output goes nowhere, to a file or to our pipe, standard error goes to our pipe
+    posix_spawn_file_actions_t fileActions;
+    ::posix_spawn_file_actions_init(&fileActions);
+    ::posix_spawn_file_actions_addopen(&fileActions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    if (bIsCaptureStandardOutput) {
+      ::posix_spawn_file_actions_adddup2(&fileActions, pipeStandardOutput[1], STDOUT_FILENO);
+      ::posix_spawn_file_actions_addclose(&fileActions, pipeStandardOutput[0]);
+      ::posix_spawn_file_actions_addclose(&fileActions, pipeStandardOutput[1]);
+    } else if (!sStandardOutputFilePath.empty()) ::posix_spawn_file_actions_addopen(&fileActions, STDOUT_FILENO, sStandardOutputFilePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    else ::posix_spawn_file_actions_addopen(&fileActions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    ::posix_spawn_file_actions_adddup2(&fileActions, pipeStandardError[1], STDERR_FILENO);
+    ::posix_spawn_file_actions_addclose(&fileActions, pipeStandardError[0]);
+    ::posix_spawn_file_actions_addclose(&fileActions, pipeStandardError[1]);
+
+    pid_t pid = 0;
+    const bool bIsStarted = SpawnProcess(arguments, fileActions, pid);
+
+    ::posix_spawn_file_actions_destroy(&fileActions);
+    if (pipeStandardOutput[1] != -1) ::close(pipeStandardOutput[1]);
+    ::close(pipeStandardError[1]);
+
+    if (!bIsStarted) {
+      if (pipeStandardOutput[0] != -1) ::close(pipeStandardOutput[0]);
+      ::close(pipeStandardError[0]);
+      return PROCESS_RESULT::ERROR_STARTING;
+    }
+
+    const std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+    PROCESS_RESULT result = PROCESS_RESULT::SUCCESS;
+    bool bIsStandardOutputOpen = (pipeStandardOutput[0] != -1);
+    bool bIsStandardErrorOpen = true;
+    int status = 0;
+
+    while (true) {
+      // Wait for some output or until it is time to check on the tool again
+      pollfd fds[2];
+      nfds_t nfds = 0;
+      if (bIsStandardOutputOpen) {
+        fds[nfds].fd = pipeStandardOutput[0];
+        fds[nfds].events = POLLIN;
+        fds[nfds].revents = 0;
+        nfds++;
+      }
+      if (bIsStandardErrorOpen) {
+        fds[nfds].fd = pipeStandardError[0];
+        fds[nfds].events = POLLIN;
+        fds[nfds].revents = 0;
+        nfds++;
+      }
+      ::poll((nfds != 0) ? fds : nullptr, nfds, iPollIntervalMS);
+
+      if (bIsStandardOutputOpen) ReadFromPipe(pipeStandardOutput[0], sStandardOutput, bIsStandardOutputOpen);
+      if (bIsStandardErrorOpen) ReadFromPipe(pipeStandardError[0], sStandardError, bIsStandardErrorOpen);
+
+      // Check if the tool has finished
+      const pid_t waitResult = ::waitpid(pid, &status, WNOHANG);
+      if (waitResult == pid) break;
+      if ((waitResult == -1) && (errno != EINTR)) {
+        result = PROCESS_RESULT::FAILED;
+        break;
+      }
+
+      // Check if we should kill the tool
+      if (processInterface.IsToStop()) {
+        result = PROCESS_RESULT::CANCELLED;
+        KillProcessGroup(pid);
+        break;
+      }
+
+      if (nTimeoutMS != 0) {
+        const size_t nElapsedMS = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count();
+        if (nElapsedMS >= nTimeoutMS) {
+          result = PROCESS_RESULT::TIMED_OUT;
+          KillProcessGroup(pid);
+          break;
+        }
+      }
+    }
+
+    // Pick up anything that was written just before the tool exited
+    if (bIsStandardOutputOpen) ReadFromPipe(pipeStandardOutput[0], sStandardOutput, bIsStandardOutputOpen);
+    if (bIsStandardErrorOpen) ReadFromPipe(pipeStandardError[0], sStandardError, bIsStandardErrorOpen);
+
+    if (pipeStandardOutput[0] != -1) ::close(pipeStandardOutput[0]);
+    ::close(pipeStandardError[0]);
+
+    if (result == PROCESS_RESULT::SUCCESS) {
+      if (WIFEXITED(status)) iExitCode = WEXITSTATUS(status);
+      else iExitCode = -1;
+
+      if (iExitCode != 0) result = PROCESS_RESULT::FAILED;
+    }
+
+    if (result != PROCESS_RESULT::SUCCESS) {
+      LOG<<"cProcessRunner::Run "<<GetCommandLine(arguments)<<" "<<GetResultString(result)<<", exit code "<<iExitCode<<", standard error \""<<sStandardError<<"\""<<std::endl;
+    }
+
+    return result;
+  }
+
+
+  // ** cPersistentProcess
+
+  cPersistentProcess::cPersistentProcess() :
+    pid(0),
+    fdStandardInput(-1),
+    fdStandardOutput(-1),
+    fdStandardError(-1)
+  {
+  }
+
+  cPersistentProcess::~cPersistentProcess()
+  {
+    Stop();
+  }
+
+  bool cPersistentProcess::Start(const std::vector<string_t>& arguments)
+  {
+    ASSERT(!IsRunning());
+
+    sCommandLine = cProcessRunner::GetCommandLine(arguments);
+    sBufferedOutput.clear();
+    sStandardError.clear();
+
+    // Standard input is a socket rather than a pipe so that we can write to it with MSG_NOSIGNAL, if the tool dies we get an error instead of a SIGPIPE
+    // NOTE: Everything is created close on exec, if another tool that is started at the same time inherited our end of standard input then closing it
+    // wouldn't tell this tool to exit
+    int socketStandardInput[2] = { -1, -1 };
+    int pipeStandardOutput[2] = { -1, -1 };
+    int pipeStandardError[2] = { -1, -1 };
+    const bool bIsStandardInputCreated = (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, socketStandardInput) == 0);
+    const bool bIsStandardOutputCreated = (::pipe2(pipeStandardOutput, O_CLOEXEC) == 0);
+    const bool bIsStandardErrorCreated = (::pipe2(pipeStandardError, O_CLOEXEC) == 0);
+    if (!bIsStandardInputCreated || !bIsStandardOutputCreated || !bIsStandardErrorCreated) {
+      LOG<<"cPersistentProcess::Start Creating the pipes FAILED, returning false"<<std::endl;
+      const int fds[] = { socketStandardInput[0], socketStandardInput[1], pipeStandardOutput[0], pipeStandardOutput[1], pipeStandardError[0], pipeStandardError[1] };
+      for (size_t i = 0; i < 6; i++) {
+        if (fds[i] != -1) ::close(fds[i]);
+      }
+      return false;
+    }
+
+    SetNonBlocking(pipeStandardOutput[0]);
+    SetNonBlocking(pipeStandardError[0]);
+
+    posix_spawn_file_actions_t fileActions;
+    ::posix_spawn_file_actions_init(&fileActions);
+    ::posix_spawn_file_actions_adddup2(&fileActions, socketStandardInput[1], STDIN_FILENO);
+    ::posix_spawn_file_actions_adddup2(&fileActions, pipeStandardOutput[1], STDOUT_FILENO);
+    ::posix_spawn_file_actions_adddup2(&fileActions, pipeStandardError[1], STDERR_FILENO);
+    ::posix_spawn_file_actions_addclose(&fileActions, socketStandardInput[0]);
+    ::posix_spawn_file_actions_addclose(&fileActions, socketStandardInput[1]);
+    ::posix_spawn_file_actions_addclose(&fileActions, pipeStandardOutput[0]);
+    ::posix_spawn_file_actions_addclose(&fileActions, pipeStandardOutput[1]);
+    ::posix_spawn_file_actions_addclose(&fileActions, pipeStandardError[0]);
+    ::posix_spawn_file_actions_addclose(&fileActions, pipeStandardError[1]);
+
+    pid_t newPid = 0;
+    const bool bIsStarted = SpawnProcess(arguments, fileActions, newPid);
+
+    ::posix_spawn_file_actions_destroy(&fileActions);
+    ::close(socketStandardInput[1]);
+    ::close(pipeStandardOutput[1]);
+    ::close(pipeStandardError[1]);
+
+    if (!bIsStarted) {
+      ::close(socketStandardInput[0]);
+      ::close(pipeStandardOutput[0]);
+      ::close(pipeStandardError[0]);
+      return false;
+    }
+
+    pid = newPid;
+    fdStandardInput = socketStandardInput[0];
+    fdStandardOutput = pipeStandardOutput[0];
+    fdStandardError = pipeStandardError[0];
+
+    return true;
+  }
+
+  void cPersistentProcess::CloseFileDescriptors()
+  {
+    if (fdStandardInput != -1) ::close(fdStandardInput);
+    if (fdStandardOutput != -1) ::close(fdStandardOutput);
+    if (fdStandardError != -1) ::close(fdStandardError);
+    fdStandardInput = -1;
+    fdStandardOutput = -1;
+    fdStandardError = -1;
+  }
+
+  void cPersistentProcess::Kill()
+  {
+    if (!IsRunning()) return;
+
+    KillProcessGroup(pid);
+    pid = 0;
+
+    CloseFileDescriptors();
+  }
+
+  void cPersistentProcess::Stop()
+  {
+    if (!IsRunning()) return;
+
+    // Closing standard input tells the tool that there are no more jobs, if it doesn't exit by itself straight away we kill it
+    ::close(fdStandardInput);
+    fdStandardInput = -1;
+
+    if (!WaitForProcessToExit(pid, iKillGracePeriodMS)) {
+      Kill();
+      return;
+    }
+
+    pid = 0;
+    CloseFileDescriptors();
+  }
+
+  bool cPersistentProcess::WriteLine(const std::string& sLine)
+  {
+    ASSERT(IsRunning());
+
+    const std::string sData = sLine + "\n";
+    size_t nWritten = 0;
+    while (nWritten < sData.length()) {
+      const ssize_t n = ::send(fdStandardInput, sData.c_str() + nWritten, sData.length() - nWritten, MSG_NOSIGNAL);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+
+        LOG<<"cPersistentProcess::WriteLine Writing to "<<sCommandLine<<" FAILED, error="<<::strerror(errno)<<", returning false"<<std::endl;
+        Kill();
+        return false;
+      }
+
+      nWritten += n;
+    }
+
+    return true;
+  }
+
+  PROCESS_RESULT cPersistentProcess::ReadLine(std::string& sLine, size_t nTimeoutMS, spitfire::util::cProcessInterface& processInterface)
+  {
+    ASSERT(IsRunning());
+
+    sLine.clear();
+
+    const std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+    bool bIsStandardOutputOpen = true;
+    bool bIsStandardErrorOpen = true;
+
+    while (true) {
+      // Return a line if we have a whole one
+      const size_t newLine = sBufferedOutput.find('\n');
+      if (newLine != std::string::npos) {
+        sLine = sBufferedOutput.substr(0, newLine);
+        if (!sLine.empty() && (sLine[sLine.length() - 1] == '\r')) sLine.erase(sLine.length() - 1);
+        sBufferedOutput.erase(0, newLine + 1);
+        return PROCESS_RESULT::SUCCESS;
+      }
+
+      if (!bIsStandardOutputOpen) {
+        LOG<<"cPersistentProcess::ReadLine "<<sCommandLine<<" exited, standard error \""<<sStandardError<<"\", returning FAILED"<<std::endl;
+        Kill();
+        return PROCESS_RESULT::FAILED;
+      }
+
+      // Check if we should kill the tool
+      if (processInterface.IsToStop()) {
+        Kill();
+        return PROCESS_RESULT::CANCELLED;
+      }
+
+      if (nTimeoutMS != 0) {
+        const size_t nElapsedMS = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count();
+        if (nElapsedMS >= nTimeoutMS) {
+          LOG<<"cPersistentProcess::ReadLine "<<sCommandLine<<" timed out, standard error \""<<sStandardError<<"\", returning TIMED_OUT"<<std::endl;
+          Kill();
+          return PROCESS_RESULT::TIMED_OUT;
+        }
+      }
+
+      // Wait for some output, standard error has to be read too or the tool could block writing to it
+      pollfd fds[2];
+      nfds_t nfds = 0;
+      fds[nfds].fd = fdStandardOutput;
+      fds[nfds].events = POLLIN;
+      fds[nfds].revents = 0;
+      nfds++;
+      if (bIsStandardErrorOpen) {
+        fds[nfds].fd = fdStandardError;
+        fds[nfds].events = POLLIN;
+        fds[nfds].revents = 0;
+        nfds++;
+      }
+      ::poll(fds, nfds, iPollIntervalMS);
+
+      ReadFromPipe(fdStandardOutput, sBufferedOutput, bIsStandardOutputOpen);
+      if (bIsStandardErrorOpen) ReadFromPipe(fdStandardError, sStandardError, bIsStandardErrorOpen);
+    }
+  }
+}
+
+#endif // !__WIN__
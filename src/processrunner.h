@@ -0,0 +1,109 @@
+#ifndef DIESEL_PROCESSRUNNER_H
+#define DIESEL_PROCESSRUNNER_H
+
+#ifndef __WIN__
+
+// Standard headers
+#include <string>
+#include <vector>
+
+// POSIX headers
+#include <sys/types.h>
+
+// Spitfire headers
+#include <spitfire/util/process.h>
+
+// Diesel headers
+#include "diesel.h"
+
+namespace diesel
+{
+  // ** cProcessRunner
+  //
+  // Runs an external tool directly with posix_spawn without going through a shell
+  // The arguments are passed as a vector so that file paths never need quoting, standard error is captured so that it can be logged when the tool fails
+  // The tool is killed if the process interface is stopped or the timeout is reached, the tool is run in its own process group so that any
+  // processes that it starts (wine for example) are killed with it
+  // Standard output is thrown away unless it is written to a file or captured
+  //
+
+  enum class PROCESS_RESULT {
+    SUCCESS,
+    FAILED, // The tool returned a non zero exit code or was killed by a signal
+    TIMED_OUT,
+    CANCELLED,
+    ERROR_STARTING
+  };
+
+  class cProcessRunner
+  {
+  public:
+    cProcessRunner();
+
+    void SetTimeoutMS(size_t nTimeoutMS); // 0 means no timeout
+    void SetStandardOutputFilePath(const string_t& sFilePath);
+    void SetCaptureStandardOutput();
+
+    PROCESS_RESULT Run(const std::vector<string_t>& arguments, spitfire::util::cProcessInterface& processInterface);
+
+    int GetExitCode() const { return iExitCode; }
+    const std::string& GetStandardOutput() const { return sStandardOutput; }
+    const std::string& GetStandardError() const { return sStandardError; }
+
+    static string_t GetCommandLine(const std::vector<string_t>& arguments);
+    static const char* GetResultString(PROCESS_RESULT result);
+
+  private:
+    size_t nTimeoutMS;
+    string_t sStandardOutputFilePath;
+    bool bIsCaptureStandardOutput;
+    int iExitCode;
+    std::string sStandardOutput;
+    std::string sStandardError;
+  };
+
+
+  // ** cPersistentProcess
+  //
+  // Keeps a tool running so that it can be sent one job after another on standard input without paying for starting the tool for each job
+  // Standard error is kept so that it can be logged when a job fails, the tool is killed if the process interface is stopped or the timeout
+  // is reached while we wait for a reply, after which it has to be started again
+  //
+
+  class cPersistentProcess
+  {
+  public:
+    cPersistentProcess();
+    ~cPersistentProcess();
+
+    bool Start(const std::vector<string_t>& arguments);
+    void Stop(); // Closes standard input and waits briefly for the tool to exit before killing it
+
+    bool IsRunning() const { return (pid != 0); }
+
+    bool WriteLine(const std::string& sLine);
+    PROCESS_RESULT ReadLine(std::string& sLine, size_t nTimeoutMS, spitfire::util::cProcessInterface& processInterface);
+
+    const std::string& GetStandardError() const { return sStandardError; }
+    void ClearStandardError() { sStandardError.clear(); }
+
+  private:
+    cPersistentProcess(const cPersistentProcess&) = delete;
+    cPersistentProcess& operator=(const cPersistentProcess&) = delete;
+
+    void Kill();
+    void CloseFileDescriptors();
+
+    pid_t pid;
+    int fdStandardInput;
+    int fdStandardOutput;
+    int fdStandardError;
+    string_t sCommandLine;
+    std::string sBufferedOutput;
+    std::string sStandardError;
+  };
+}
+
+#endif // !__WIN__
+
+#endif // DIESEL_PROCESSRUNNER_H
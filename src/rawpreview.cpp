@@ -0,0 +1,264 @@
+// Standard headers
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <vector>
+
+// Spitfire headers
+#include <spitfire/util/log.h>
+
+// Diesel headers
+#include "jpegthumbnail.h"
+#include "rawpreview.h"
+#include "tiffreader.h"
+
+namespace diesel
+{
+  // A full size image has to at least fill most of a screen, otherwise the raw file is developed instead
+  const size_t nMinimumFullPreviewSize = 1600;
+
+  // Sub IFDs can have their own sub IFDs but no raw file goes more than a couple of levels deep, this and the IFD limit stop corrupt files from looping
+  const size_t nMaximumSubIFDDepth = 4;
+  const size_t nMaximumIFDs = 64;
+
+  // Previews are never anywhere near this big, anything bigger is a corrupt tag
+  const uint32_t nMaximumPreviewSizeBytes = 64 * 1024 * 1024;
+
+  const uint32_t TIFF_COMPRESSION_OLD_JPEG = 6;
+  const uint32_t TIFF_COMPRESSION_JPEG = 7;
+
+  // ** cRawPreview
+
+  class cRawPreview
+  {
+  public:
+    cRawPreview();
+
+    size_t GetSizePixels() const { return std::max(width, height); }
+
+    uint32_t offset;
+    uint32_t nSizeBytes;
+    size_t width;
+    size_t height;
+  };
+
+  cRawPreview::cRawPreview() :
+    offset(0),
+    nSizeBytes(0),
+    width(0),
+    height(0)
+  {
+  }
+
+
+  // ** cRawPreviews
+
+  class cRawPreviews
+  {
+  public:
+    explicit cRawPreviews(cTIFFReader& reader);
+
+    void Find();
+    bool Choose(size_t nSizePixels, cRawPreview& preview) const;
+
+    int GetOrientation() const { return orientation; }
+
+  private:
+    void FindInIFDs(uint32_t ifdOffset, size_t depth);
+    void Add(uint32_t offset, uint32_t nSizeBytes);
+    bool ReadJPEGSize(cRawPreview& preview);
+
+    cTIFFReader& reader;
+    std::vector<cRawPreview> previews;
+    std::set<uint32_t> visited;
+    int orientation;
+  };
+
+  cRawPreviews::cRawPreviews(cTIFFReader& _reader) :
+    reader(_reader),
+    orientation(1)
+  {
+  }
+
+  void cRawPreviews::Find()
+  {
+    const uint32_t firstIFDOffset = reader.GetFirstIFDOffset();
+
+    // The orientation of the photo is in the first IFD, the previews are stored the way that the sensor saw them
+    cTIFFIFD ifd;
+    uint32_t value = 1;
+    if (reader.ReadIFD(firstIFDOffset, ifd) && reader.GetValue(ifd, TIFF_TAG_ORIENTATION, value) && (value >= 1) && (value <= 8)) orientation = int(value);
+
+    FindInIFDs(firstIFDOffset, 0);
+  }
+
+  void cRawPreviews::FindInIFDs(uint32_t ifdOffset, size_t depth)
+  {
+    // IFDs that point back at an IFD that we have already read would loop forever
+    while ((ifdOffset != 0) && (visited.size() < nMaximumIFDs) && visited.insert(ifdOffset).second) {
+      cTIFFIFD ifd;
+      if (!reader.ReadIFD(ifdOffset, ifd)) return;
+
+      // Exif thumbnails and nef previews
+      uint32_t offset = 0;
+      uint32_t nSizeBytes = 0;
+      if (reader.GetValue(ifd, TIFF_TAG_JPEG_INTERCHANGE_FORMAT, offset) && reader.GetValue(ifd, TIFF_TAG_JPEG_INTERCHANGE_FORMAT_LENGTH, nSizeBytes)) Add(offset, nSizeBytes);
+
+      // Dng and cr2 previews are jpeg compressed images in a single strip, tiled images are the raw data
+      uint32_t compression = 0;
+      std::vector<uint32_t> stripOffsets;
+      std::vector<uint32_t> stripByteCounts;
+      if (
+        reader.GetValue(ifd, TIFF_TAG_COMPRESSION, compression) && ((compression == TIFF_COMPRESSION_OLD_JPEG) || (compression == TIFF_COMPRESSION_JPEG)) &&
+        reader.GetValues(ifd, TIFF_TAG_STRIP_OFFSETS, stripOffsets) && reader.GetValues(ifd, TIFF_TAG_STRIP_BYTE_COUNTS, stripByteCounts) &&
+        (stripOffsets.size() == 1) && (stripByteCounts.size() == 1)
+      ) {
+        Add(stripOffsets[0], stripByteCounts[0]);
+      }
+
+      std::vector<uint32_t> subIFDs;
+      if ((depth < nMaximumSubIFDDepth) && reader.GetValues(ifd, TIFF_TAG_SUB_IFDS, subIFDs)) {
+        const size_t n = subIFDs.size();
+        for (size_t i = 0; i < n; i++) FindInIFDs(subIFDs[i], depth + 1);
+      }
+
+      ifdOffset = ifd.nextIFDOffset;
+    }
+  }
+
+  void cRawPreviews::Add(uint32_t offset, uint32_t nSizeBytes)
+  {
+    if ((nSizeBytes == 0) || (nSizeBytes > nMaximumPreviewSizeBytes)) return;
+
+    // The same jpeg can be pointed to by more than one IFD
+    std::vector<cRawPreview>::const_iterator iter = previews.begin();
+    const std::vector<cRawPreview>::const_iterator iterEnd = previews.end();
+    while (iter != iterEnd) {
+      if (iter->offset == offset) return;
+
+      iter++;
+    }
+
+    cRawPreview preview;
+    preview.offset = offset;
+    preview.nSizeBytes = nSizeBytes;
+    if (ReadJPEGSize(preview)) previews.push_back(preview);
+  }
+
+  bool cRawPreviews::ReadJPEGSize(cRawPreview& preview)
+  {
+    uint8_t start[2];
+    if (!reader.Read(preview.offset, sizeof(start), start) || (start[0] != 0xFF) || (start[1] != 0xD8)) return false;
+
+    // Jpeg markers are always big endian, we walk them until we get to the frame header
+    const uint64_t end = uint64_t(preview.offset) + preview.nSizeBytes;
+    uint64_t position = uint64_t(preview.offset) + 2;
+    while ((position + 4) <= end) {
+      uint8_t marker[4];
+      if (!reader.Read(position, sizeof(marker), marker) || (marker[0] != 0xFF)) return false;
+
+      // Fill bytes
+      if (marker[1] == 0xFF) {
+        position++;
+        continue;
+      }
+
+      // Baseline, extended and progressive jpegs are previews that libjpeg can decode
+      if ((marker[1] == 0xC0) || (marker[1] == 0xC1) || (marker[1] == 0xC2)) {
+        uint8_t frame[5];
+        if (!reader.Read(position + 4, sizeof(frame), frame)) return false;
+
+        preview.height = (size_t(frame[1]) << 8) | frame[2];
+        preview.width = (size_t(frame[3]) << 8) | frame[4];
+        return ((preview.width != 0) && (preview.height != 0));
+      }
+
+      // Any other frame type is lossless or arithmetic coded, which is how dngs and cr2s store the raw data, a scan means there was no frame header
+      if (((marker[1] >= 0xC3) && (marker[1] <= 0xCF) && (marker[1] != 0xC4) && (marker[1] != 0xC8) && (marker[1] != 0xCC)) || (marker[1] == 0xDA) || (marker[1] == 0xD9)) return false;
+
+      const size_t length = (size_t(marker[2]) << 8) | marker[3];
+      position += 2 + length;
+    }
+
+    return false;
+  }
+
+  bool cRawPreviews::Choose(size_t nSizePixels, cRawPreview& preview) const
+  {
+    bool bIsFound = false;
+
+    std::vector<cRawPreview>::const_iterator iter = previews.begin();
+    const std::vector<cRawPreview>::const_iterator iterEnd = previews.end();
+    while (iter != iterEnd) {
+      const size_t nPreviewSizePixels = iter->GetSizePixels();
+      if (nSizePixels == 0) {
+        // The largest preview for a full size image
+        if ((nPreviewSizePixels >= nMinimumFullPreviewSize) && (!bIsFound || (nPreviewSizePixels > preview.GetSizePixels()))) {
+          preview = *iter;
+          bIsFound = true;
+        }
+      } else if ((nPreviewSizePixels >= nSizePixels) && (!bIsFound || (nPreviewSizePixels < preview.GetSizePixels()))) {
+        // The smallest preview that is big enough for the thumbnail
+        preview = *iter;
+        bIsFound = true;
+      }
+
+      iter++;
+    }
+
+    return bIsFound;
+  }
+
+
+  // ** Raw previews
+
+  bool IsRawPreviewAvailable(const string_t& sFilePath, size_t nSizePixels)
+  {
+    cTIFFReader reader;
+    if (!reader.OpenFile(sFilePath)) return false;
+
+    cRawPreviews previews(reader);
+    previews.Find();
+
+    cRawPreview preview;
+    return previews.Choose(nSizePixels, preview);
+  }
+
+  CONVERSION_RESULT ExtractRawPreview(const string_t& sFilePath, size_t nSizePixels, const string_t& sFilePathJPG)
+  {
+    // NOTE: A file that isn't a TIFF file can't be read either, it is up to the other backends to convert it
+    cTIFFReader reader;
+    if (!reader.OpenFile(sFilePath)) return CONVERSION_RESULT::INVALID_FILE;
+
+    cRawPreviews previews(reader);
+    previews.Find();
+
+    cRawPreview preview;
+    if (!previews.Choose(nSizePixels, preview)) {
+      LOG<<"ExtractRawPreview No preview in \""<<sFilePath<<"\" is big enough, returning INVALID_FILE"<<std::endl;
+      return CONVERSION_RESULT::INVALID_FILE;
+    }
+
+    std::vector<uint8_t> data(preview.nSizeBytes);
+    if (!reader.Read(preview.offset, data.size(), data.data())) return CONVERSION_RESULT::INVALID_FILE;
+
+    // A full size preview that is already the right way up is copied to the cache as it is
+    const int orientation = previews.GetOrientation();
+    if ((nSizePixels != 0) || (orientation != 1)) {
+      std::vector<uint8_t> resized;
+      if (!CreateJPEGThumbnailFromMemory(data.data(), data.size(), (nSizePixels != 0) ? nSizePixels : preview.GetSizePixels(), orientation, resized)) {
+        LOG<<"ExtractRawPreview Failed to decode the preview in \""<<sFilePath<<"\", returning INVALID_FILE"<<std::endl;
+        return CONVERSION_RESULT::INVALID_FILE;
+      }
+
+      data.swap(resized);
+    }
+
+    std::ofstream file(sFilePathJPG.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!file.good()) return CONVERSION_RESULT::TEMPORARY_FAILURE;
+
+    file.write(reinterpret_cast<const char*>(data.data()), std::streamsize(data.size()));
+    return file.good() ? CONVERSION_RESULT::SUCCESS : CONVERSION_RESULT::TEMPORARY_FAILURE;
+  }
+}
@@ -0,0 +1,27 @@
+#ifndef DIESEL_RAWPREVIEW_H
+#define DIESEL_RAWPREVIEW_H
+
+// Standard headers
+#include <cstddef>
+
+// Diesel headers
+#include "diesel.h"
+
+namespace diesel
+{
+  // ** Raw previews
+  //
+  // Dngs and nef, cr2 and pef raw files are TIFF files that carry jpeg previews of the photo in their IFDs, often at full size, which are much quicker to use than
+  // converting the raw file to dng and developing it with ufraw
+  // Every IFD and sub IFD is searched for jpegs, pointed to either by the JPEGInterchangeFormat tags or by a single strip with jpeg compression, and each jpeg's
+  // frame header is read to get its size and to skip the lossless jpegs that hold the raw data itself
+  // For a thumbnail the smallest preview that is at least nSizePixels is resized to fit in nSizePixels, for a full size image (nSizePixels is 0) the largest
+  // preview is copied to the cache as it is, neither is used if they are too small, the previews are turned to match the orientation of the raw file
+  // NOTE: Previews that cameras keep in their maker notes, such as the large previews in pef files, are not found, those files are converted as before
+  //
+
+  bool IsRawPreviewAvailable(const string_t& sFilePath, size_t nSizePixels);
+  CONVERSION_RESULT ExtractRawPreview(const string_t& sFilePath, size_t nSizePixels, const string_t& sFilePathJPG);
+}
+
+#endif // DIESEL_RAWPREVIEW_H
@@ -75,6 +75,64 @@ namespace diesel
     document.SetValue(TEXT("settings"), TEXT("cache"), TEXT("maximumSizeGB"), nSizeGB);
   }
 
+  THUMBNAIL_FORMAT cSettings::GetThumbnailFormat() const
+  {
+    const string_t sFormat = document.GetValue<string_t>(TEXT("settings"), TEXT("cache"), TEXT("thumbnailFormat"), TEXT("jpeg"));
+    if (sFormat == TEXT("rgba")) return THUMBNAIL_FORMAT::RGBA;
+    else if (sFormat == TEXT("bc1")) return THUMBNAIL_FORMAT::BC1;
+
+    return THUMBNAIL_FORMAT::JPEG;
+  }
+
+  void cSettings::SetThumbnailFormat(THUMBNAIL_FORMAT format)
+  {
+    string_t sFormat = TEXT("jpeg");
+    if (format == THUMBNAIL_FORMAT::RGBA) sFormat = TEXT("rgba");
+    else if (format == THUMBNAIL_FORMAT::BC1) sFormat = TEXT("bc1");
+
+    document.SetValue(TEXT("settings"), TEXT("cache"), TEXT("thumbnailFormat"), sFormat);
+  }
+
+  size_t cSettings::GetImageLoadHashWorkerCount() const
+  {
+    return document.GetValue<size_t>(TEXT("settings"), TEXT("imageLoad"), TEXT("hashWorkers"), 0);
+  }
+
+  void cSettings::SetImageLoadHashWorkerCount(size_t nWorkers)
+  {
+    document.SetValue(TEXT("settings"), TEXT("imageLoad"), TEXT("hashWorkers"), nWorkers);
+  }
+
+  size_t cSettings::GetImageLoadRawToDNGWorkerCount() const
+  {
+    return document.GetValue<size_t>(TEXT("settings"), TEXT("imageLoad"), TEXT("rawToDNGWorkers"), 0);
+  }
+
+  void cSettings::SetImageLoadRawToDNGWorkerCount(size_t nWorkers)
+  {
+    document.SetValue(TEXT("settings"), TEXT("imageLoad"), TEXT("rawToDNGWorkers"), nWorkers);
+  }
+
+  size_t cSettings::GetImageLoadConvertWorkerCount() const
+  {
+    return document.GetValue<size_t>(TEXT("settings"), TEXT("imageLoad"), TEXT("convertWorkers"), 0);
+  }
+
+  void cSettings::SetImageLoadConvertWorkerCount(size_t nWorkers)
+  {
+    document.SetValue(TEXT("settings"), TEXT("imageLoad"), TEXT("convertWorkers"), nWorkers);
+  }
+
+  size_t cSettings::GetImageLoadDecodeWorkerCount() const
+  {
+    return document.GetValue<size_t>(TEXT("settings"), TEXT("imageLoad"), TEXT("decodeWorkers"), 0);
+  }
+
+  void cSettings::SetImageLoadDecodeWorkerCount(size_t nWorkers)
+  {
+    document.SetValue(TEXT("settings"), TEXT("imageLoad"), TEXT("decodeWorkers"), nWorkers);
+  }
+
   void cSettings::GetPreviousPhotoBrowserFolders(std::list<string_t>& folders) const
   {
     std::vector<string_t> vFolders;
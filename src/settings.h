@@ -31,6 +31,18 @@ namespace diesel
 
     size_t GetMaximumCacheSizeGB() const;
     void SetMaximumCacheSizeGB(size_t nSizeGB);
+    THUMBNAIL_FORMAT GetThumbnailFormat() const;
+    void SetThumbnailFormat(THUMBNAIL_FORMAT format);
+
+    // NOTE: A worker count of 0 means that the image loader should pick a worker count for that stage based on the number of cores
+    size_t GetImageLoadHashWorkerCount() const;
+    void SetImageLoadHashWorkerCount(size_t nWorkers);
+    size_t GetImageLoadRawToDNGWorkerCount() const;
+    void SetImageLoadRawToDNGWorkerCount(size_t nWorkers);
+    size_t GetImageLoadConvertWorkerCount() const;
+    void SetImageLoadConvertWorkerCount(size_t nWorkers);
+    size_t GetImageLoadDecodeWorkerCount() const;
+    void SetImageLoadDecodeWorkerCount(size_t nWorkers);
 
     void GetPreviousPhotoBrowserFolders(std::list<string_t>& folders) const;
     void SetPreviousPhotoBrowserFolders(const std::list<string_t>& folders);
@@ -0,0 +1,379 @@
+// Standard headers
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+// Spitfire headers
+#include <spitfire/util/log.h>
+
+// Diesel headers
+#include "imagedecoder.h"
+#include "jpegthumbnail.h"
+#include "thumbnailformat.h"
+
+namespace diesel
+{
+  const uint32_t nEncodedThumbnailMagic = 0x50445444; // "DTDP"
+
+  const size_t nEncodedThumbnailHeaderSizeBytes = 16; // Magic, format, width and height
+
+  // Thumbnails are never anywhere near this big, anything bigger is a corrupt header
+  const size_t nMaximumEncodedThumbnailDimension = 16384;
+
+  const uint32_t nThumbnailPyramidMagic = 0x59505444; // "DTPY"
+
+  const size_t nThumbnailPyramidHeaderSizeBytes = 8; // Magic and level count
+  const size_t nThumbnailPyramidLevelSizeBytes = 12; // Size in pixels, offset and size in bytes of each level
+
+  void WriteUint32(uint8_t* pOut, uint32_t value)
+  {
+    memcpy(pOut, &value, sizeof(value));
+  }
+
+  uint32_t ReadUint32(const uint8_t* pIn)
+  {
+    uint32_t value = 0;
+    memcpy(&value, pIn, sizeof(value));
+    return value;
+  }
+
+  size_t GetEncodedThumbnailSizeBytes(THUMBNAIL_FORMAT format, size_t width, size_t height)
+  {
+    if (format == THUMBNAIL_FORMAT::RGBA) return width * height * 4;
+
+    // Each 4x4 block is 8 bytes
+    return ((width + 3) / 4) * ((height + 3) / 4) * 8;
+  }
+
+
+  // ** BC1
+
+  uint16_t ToRGB565(int r, int g, int b)
+  {
+    return uint16_t(((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3));
+  }
+
+  void FromRGB565(uint16_t colour, int& r, int& g, int& b)
+  {
+    r = (colour >> 11) & 0x1F;
+    g = (colour >> 5) & 0x3F;
+    b = colour & 0x1F;
+
+    // Replicate the high bits so that 0x1F becomes 0xFF
+    r = (r << 3) | (r >> 2);
+    g = (g << 2) | (g >> 4);
+    b = (b << 3) | (b >> 2);
+  }
+
+  void GetBC1Palette(uint16_t colour0, uint16_t colour1, int palette[4][3])
+  {
+    FromRGB565(colour0, palette[0][0], palette[0][1], palette[0][2]);
+    FromRGB565(colour1, palette[1][0], palette[1][1], palette[1][2]);
+
+    for (size_t c = 0; c < 3; c++) {
+      if (colour0 > colour1) {
+        palette[2][c] = ((2 * palette[0][c]) + palette[1][c]) / 3;
+        palette[3][c] = (palette[0][c] + (2 * palette[1][c])) / 3;
+      } else {
+        // 3 colour mode, the 4th colour is transparent black which we never use
+        palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+        palette[3][c] = 0;
+      }
+    }
+  }
+
+  void EncodeBC1Block(const uint8_t* pPixels, size_t width, size_t height, size_t blockX, size_t blockY, uint8_t* pOut)
+  {
+    // Gather the block, repeating the last row and column for blocks that hang over the edge of the image
+    int block[16][3];
+    for (size_t y = 0; y < 4; y++) {
+      const size_t sourceY = std::min(blockY + y, height - 1);
+      for (size_t x = 0; x < 4; x++) {
+        const size_t sourceX = std::min(blockX + x, width - 1);
+        const uint8_t* pPixel = pPixels + (((sourceY * width) + sourceX) * 4);
+        for (size_t c = 0; c < 3; c++) block[(y * 4) + x][c] = pPixel[c];
+      }
+    }
+
+    // Use the corners of the bounding box of the colours, moved in slightly so that the interpolated colours are used more
+    int minimum[3] = { 255, 255, 255 };
+    int maximum[3] = { 0, 0, 0 };
+    for (size_t i = 0; i < 16; i++) {
+      for (size_t c = 0; c < 3; c++) {
+        minimum[c] = std::min(minimum[c], block[i][c]);
+        maximum[c] = std::max(maximum[c], block[i][c]);
+      }
+    }
+
+    for (size_t c = 0; c < 3; c++) {
+      const int inset = (maximum[c] - minimum[c]) / 16;
+      minimum[c] += inset;
+      maximum[c] -= inset;
+    }
+
+    uint16_t colour0 = ToRGB565(maximum[0], maximum[1], maximum[2]);
+    uint16_t colour1 = ToRGB565(minimum[0], minimum[1], minimum[2]);
+    if (colour0 < colour1) std::swap(colour0, colour1);
+
+    uint32_t indices = 0;
+    if (colour0 != colour1) {
+      int palette[4][3];
+      GetBC1Palette(colour0, colour1, palette);
+
+      for (size_t i = 0; i < 16; i++) {
+        uint32_t closest = 0;
+        int closestDistance = 0x7FFFFFFF;
+        for (uint32_t p = 0; p < 4; p++) {
+          int distance = 0;
+          for (size_t c = 0; c < 3; c++) {
+            const int d = block[i][c] - palette[p][c];
+            distance += d * d;
+          }
+          if (distance < closestDistance) {
+            closest = p;
+            closestDistance = distance;
+          }
+        }
+
+        indices |= (closest << (2 * i));
+      }
+    }
+
+    // The colours and indices are little endian
+    pOut[0] = uint8_t(colour0 & 0xFF);
+    pOut[1] = uint8_t(colour0 >> 8);
+    pOut[2] = uint8_t(colour1 & 0xFF);
+    pOut[3] = uint8_t(colour1 >> 8);
+    pOut[4] = uint8_t(indices & 0xFF);
+    pOut[5] = uint8_t((indices >> 8) & 0xFF);
+    pOut[6] = uint8_t((indices >> 16) & 0xFF);
+    pOut[7] = uint8_t(indices >> 24);
+  }
+
+  void DecodeBC1Block(const uint8_t* pIn, size_t width, size_t height, size_t blockX, size_t blockY, uint8_t* pPixels)
+  {
+    const uint16_t colour0 = uint16_t(pIn[0] | (pIn[1] << 8));
+    const uint16_t colour1 = uint16_t(pIn[2] | (pIn[3] << 8));
+    const uint32_t indices = uint32_t(pIn[4]) | (uint32_t(pIn[5]) << 8) | (uint32_t(pIn[6]) << 16) | (uint32_t(pIn[7]) << 24);
+
+    int palette[4][3];
+    GetBC1Palette(colour0, colour1, palette);
+
+    const size_t rows = std::min<size_t>(4, height - blockY);
+    const size_t columns = std::min<size_t>(4, width - blockX);
+    for (size_t y = 0; y < rows; y++) {
+      uint8_t* pPixel = pPixels + ((((blockY + y) * width) + blockX) * 4);
+      for (size_t x = 0; x < columns; x++) {
+        const int* pColour = palette[(indices >> (2 * ((y * 4) + x))) & 0x3];
+        pPixel[0] = uint8_t(pColour[0]);
+        pPixel[1] = uint8_t(pColour[1]);
+        pPixel[2] = uint8_t(pColour[2]);
+        pPixel[3] = 0xFF;
+        pPixel += 4;
+      }
+    }
+  }
+
+
+  bool EncodeThumbnail(THUMBNAIL_FORMAT format, const uint8_t* pPixels, size_t width, size_t height, std::vector<uint8_t>& data)
+  {
+    ASSERT(pPixels != nullptr);
+    ASSERT(format != THUMBNAIL_FORMAT::JPEG);
+
+    if ((width == 0) || (height == 0) || (width > nMaximumEncodedThumbnailDimension) || (height > nMaximumEncodedThumbnailDimension)) return false;
+
+    data.resize(nEncodedThumbnailHeaderSizeBytes + GetEncodedThumbnailSizeBytes(format, width, height));
+
+    uint8_t* pOut = data.data();
+    WriteUint32(pOut, nEncodedThumbnailMagic);
+    WriteUint32(pOut + 4, uint32_t(format));
+    WriteUint32(pOut + 8, uint32_t(width));
+    WriteUint32(pOut + 12, uint32_t(height));
+    pOut += nEncodedThumbnailHeaderSizeBytes;
+
+    if (format == THUMBNAIL_FORMAT::RGBA) {
+      memcpy(pOut, pPixels, width * height * 4);
+      return true;
+    }
+
+    for (size_t blockY = 0; blockY < height; blockY += 4) {
+      for (size_t blockX = 0; blockX < width; blockX += 4) {
+        EncodeBC1Block(pPixels, width, height, blockX, blockY, pOut);
+        pOut += 8;
+      }
+    }
+
+    return true;
+  }
+
+  bool IsEncodedThumbnail(const uint8_t* pData, size_t nSizeBytes)
+  {
+    return (nSizeBytes >= nEncodedThumbnailHeaderSizeBytes) && (ReadUint32(pData) == nEncodedThumbnailMagic);
+  }
+
+  bool DecodeThumbnail(const uint8_t* pData, size_t nSizeBytes, voodoo::cImage& image)
+  {
+    if (!IsEncodedThumbnail(pData, nSizeBytes)) return false;
+
+    const uint32_t nFormat = ReadUint32(pData + 4);
+    const size_t width = ReadUint32(pData + 8);
+    const size_t height = ReadUint32(pData + 12);
+    if (((nFormat != uint32_t(THUMBNAIL_FORMAT::RGBA)) && (nFormat != uint32_t(THUMBNAIL_FORMAT::BC1))) ||
+      (width == 0) || (height == 0) || (width > nMaximumEncodedThumbnailDimension) || (height > nMaximumEncodedThumbnailDimension)
+    ) {
+      LOG<<"DecodeThumbnail Invalid header, returning false"<<std::endl;
+      return false;
+    }
+
+    const THUMBNAIL_FORMAT format = THUMBNAIL_FORMAT(nFormat);
+    if (nSizeBytes != (nEncodedThumbnailHeaderSizeBytes + GetEncodedThumbnailSizeBytes(format, width, height))) {
+      LOG<<"DecodeThumbnail The size does not match the header, returning false"<<std::endl;
+      return false;
+    }
+
+    const uint8_t* pIn = pData + nEncodedThumbnailHeaderSizeBytes;
+
+    // RGBA is copied straight out of the thumbnail pack
+    if (format == THUMBNAIL_FORMAT::RGBA) return image.CreateFromBuffer(pIn, width, height, voodoo::PIXELFORMAT::R8G8B8A8);
+
+    std::vector<uint8_t> pixels(width * height * 4);
+    for (size_t blockY = 0; blockY < height; blockY += 4) {
+      for (size_t blockX = 0; blockX < width; blockX += 4) {
+        DecodeBC1Block(pIn, width, height, blockX, blockY, pixels.data());
+        pIn += 8;
+      }
+    }
+
+    return image.CreateFromBuffer(pixels.data(), width, height, voodoo::PIXELFORMAT::R8G8B8A8);
+  }
+
+
+  // ** Thumbnail pyramids
+
+  size_t GetThumbnailLevelForSize(size_t nSizePixels)
+  {
+    size_t level = nSmallestThumbnailLevel;
+    while ((level < nSizePixels) && (level < nLargestThumbnailLevel)) level *= 2;
+    return level;
+  }
+
+  void ResizeImage(const uint8_t* pSource, size_t sourceWidth, size_t sourceHeight, uint8_t* pDestination, size_t width, size_t height)
+  {
+    for (size_t y = 0; y < height; y++) {
+      const size_t sourceY0 = (y * sourceHeight) / height;
+      const size_t sourceY1 = std::max(sourceY0 + 1, ((y + 1) * sourceHeight) / height);
+      for (size_t x = 0; x < width; x++) {
+        const size_t sourceX0 = (x * sourceWidth) / width;
+        const size_t sourceX1 = std::max(sourceX0 + 1, ((x + 1) * sourceWidth) / width);
+
+        uint32_t total[4] = { 0, 0, 0, 0 };
+        for (size_t sourceY = sourceY0; sourceY < sourceY1; sourceY++) {
+          const uint8_t* pPixel = pSource + (((sourceY * sourceWidth) + sourceX0) * 4);
+          for (size_t sourceX = sourceX0; sourceX < sourceX1; sourceX++) {
+            for (size_t c = 0; c < 4; c++) total[c] += pPixel[c];
+            pPixel += 4;
+          }
+        }
+
+        const uint32_t count = uint32_t((sourceY1 - sourceY0) * (sourceX1 - sourceX0));
+        uint8_t* pOut = pDestination + (((y * width) + x) * 4);
+        for (size_t c = 0; c < 4; c++) pOut[c] = uint8_t(total[c] / count);
+      }
+    }
+  }
+
+  bool EncodeThumbnailPyramid(THUMBNAIL_FORMAT format, const std::vector<uint8_t>& jpeg, std::vector<uint8_t>& data)
+  {
+    std::vector<uint8_t> pixels;
+    size_t width = 0;
+    size_t height = 0;
+    if (!DecodeImageFromMemory(jpeg.data(), jpeg.size(), pixels, width, height) || (width == 0) || (height == 0)) return false;
+
+    // Work down from the biggest level, each level is made from the one above it so that a large preview is only read once
+    std::vector<size_t> levelSizes;
+    std::vector<std::vector<uint8_t>> levels;
+
+    size_t level = GetThumbnailLevelForSize(std::max(width, height));
+    while (level >= nSmallestThumbnailLevel) {
+      const size_t nSizePixels = std::max(width, height);
+      if (nSizePixels > level) {
+        // Shrink the image to fit in the level
+        const size_t levelWidth = std::max<size_t>(1, (width * level) / nSizePixels);
+        const size_t levelHeight = std::max<size_t>(1, (height * level) / nSizePixels);
+        std::vector<uint8_t> resized(levelWidth * levelHeight * 4);
+        ResizeImage(pixels.data(), width, height, resized.data(), levelWidth, levelHeight);
+        pixels.swap(resized);
+        width = levelWidth;
+        height = levelHeight;
+      }
+
+      std::vector<uint8_t> encoded;
+      if (format == THUMBNAIL_FORMAT::JPEG) {
+        if (levels.empty() && (nSizePixels <= level)) encoded = jpeg; // The jpeg already fits so we can keep it
+        else if (!EncodeJPEG(pixels.data(), width, height, 4, encoded)) return false;
+      } else if (!EncodeThumbnail(format, pixels.data(), width, height, encoded)) return false;
+
+      levelSizes.push_back(std::max(width, height));
+      levels.push_back(encoded);
+
+      level /= 2;
+    }
+
+    // The header is followed by the table of levels, smallest first, and then the levels themselves
+    const size_t nLevels = levels.size();
+    size_t nSizeBytes = nThumbnailPyramidHeaderSizeBytes + (nLevels * nThumbnailPyramidLevelSizeBytes);
+    for (size_t i = 0; i < nLevels; i++) nSizeBytes += levels[i].size();
+
+    data.resize(nSizeBytes);
+
+    uint8_t* pOut = data.data();
+    WriteUint32(pOut, nThumbnailPyramidMagic);
+    WriteUint32(pOut + 4, uint32_t(nLevels));
+
+    size_t offset = nThumbnailPyramidHeaderSizeBytes + (nLevels * nThumbnailPyramidLevelSizeBytes);
+    for (size_t i = 0; i < nLevels; i++) {
+      const size_t source = nLevels - 1 - i;
+      uint8_t* pLevel = pOut + nThumbnailPyramidHeaderSizeBytes + (i * nThumbnailPyramidLevelSizeBytes);
+      WriteUint32(pLevel, uint32_t(levelSizes[source]));
+      WriteUint32(pLevel + 4, uint32_t(offset));
+      WriteUint32(pLevel + 8, uint32_t(levels[source].size()));
+
+      memcpy(pOut + offset, levels[source].data(), levels[source].size());
+      offset += levels[source].size();
+    }
+
+    return true;
+  }
+
+  void GetThumbnailPyramidLevel(const uint8_t* pData, size_t nSizeBytes, size_t nSizePixels, const uint8_t*& pLevelData, size_t& nLevelSizeBytes)
+  {
+    pLevelData = pData;
+    nLevelSizeBytes = nSizeBytes;
+
+    if ((nSizeBytes < nThumbnailPyramidHeaderSizeBytes) || (ReadUint32(pData) != nThumbnailPyramidMagic)) return;
+
+    const size_t nLevels = ReadUint32(pData + 4);
+    if ((nLevels == 0) || (nSizeBytes < (nThumbnailPyramidHeaderSizeBytes + (nLevels * nThumbnailPyramidLevelSizeBytes)))) {
+      LOG<<"GetThumbnailPyramidLevel Invalid header"<<std::endl;
+      return;
+    }
+
+    // The levels are smallest first so the first one that is big enough is the one that we want
+    size_t i = 0;
+    while ((i + 1) < nLevels) {
+      if (ReadUint32(pData + nThumbnailPyramidHeaderSizeBytes + (i * nThumbnailPyramidLevelSizeBytes)) >= nSizePixels) break;
+      i++;
+    }
+
+    const uint8_t* pLevel = pData + nThumbnailPyramidHeaderSizeBytes + (i * nThumbnailPyramidLevelSizeBytes);
+    const size_t offset = ReadUint32(pLevel + 4);
+    const size_t nLevelBytes = ReadUint32(pLevel + 8);
+    if ((offset > nSizeBytes) || (nLevelBytes > (nSizeBytes - offset))) {
+      LOG<<"GetThumbnailPyramidLevel Invalid level "<<i<<std::endl;
+      return;
+    }
+
+    pLevelData = pData + offset;
+    nLevelSizeBytes = nLevelBytes;
+  }
+}
@@ -0,0 +1,54 @@
+#ifndef DIESEL_THUMBNAILFORMAT_H
+#define DIESEL_THUMBNAILFORMAT_H
+
+// Standard headers
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// libvoodoomm headers
+#include <libvoodoomm/cImage.h>
+
+// Diesel headers
+#include "diesel.h"
+
+namespace diesel
+{
+  // ** Thumbnail formats
+  //
+  // Thumbnails can be stored in the thumbnail pack already decoded so that loading them doesn't have to decode a jpeg
+  // RGBA is copied straight into the image, it is the fastest to load but takes 4 bytes per pixel, 160 KB for a 200x200 thumbnail instead of about 10 KB as a jpeg
+  // BC1 (DXT1) takes 8 bytes per 4x4 block, 20 KB for a 200x200 thumbnail, and is expanded to RGBA with a few shifts and adds per pixel, much quicker than a jpeg decode
+  // Each encoded thumbnail starts with a 16 byte header, which can't be mistaken for a jpeg as jpegs start with 0xFF 0xD8
+  //
+  // Thumbnail pyramids
+  //
+  // Each thumbnail is stored at 64, 128, 256 and 512 pixels so that the view can use the smallest one that covers the size that it is drawn at
+  // The levels are made from the one thumbnail that the converter creates and stored together so that the whole pyramid is added and evicted as one
+  // Levels are encoded in the thumbnail format, with the jpeg format the level that the jpeg from the converter already fits in is kept as it is and
+  // the other levels are encoded as jpegs with EncodeJPEG
+  // The levels bigger than the thumbnail from the converter are left out, thumbnails that were added before pyramids are treated as one level
+  //
+
+  const size_t nSmallestThumbnailLevel = 64;
+  const size_t nLargestThumbnailLevel = 512;
+
+  // Returns the smallest level that is at least nSizePixels, or the largest level
+  size_t GetThumbnailLevelForSize(size_t nSizePixels);
+
+  // Averages the pixels that each destination pixel covers, the destination must be smaller than the source, pixels are 8 bits per channel RGBA
+  void ResizeImage(const uint8_t* pSource, size_t sourceWidth, size_t sourceHeight, uint8_t* pDestination, size_t width, size_t height);
+
+  // Pixels are 8 bits per channel RGBA with no padding between rows
+  bool EncodeThumbnail(THUMBNAIL_FORMAT format, const uint8_t* pPixels, size_t width, size_t height, std::vector<uint8_t>& data);
+
+  bool IsEncodedThumbnail(const uint8_t* pData, size_t nSizeBytes);
+  bool DecodeThumbnail(const uint8_t* pData, size_t nSizeBytes, voodoo::cImage& image);
+
+  bool EncodeThumbnailPyramid(THUMBNAIL_FORMAT format, const std::vector<uint8_t>& jpeg, std::vector<uint8_t>& data);
+
+  // Returns the level that covers nSizePixels, or the biggest level if none of them do, a thumbnail that is not a pyramid is returned as is
+  void GetThumbnailPyramidLevel(const uint8_t* pData, size_t nSizeBytes, size_t nSizePixels, const uint8_t*& pLevelData, size_t& nLevelSizeBytes);
+}
+
+#endif // DIESEL_THUMBNAILFORMAT_H
@@ -0,0 +1,882 @@
+// Standard headers
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <map>
+
+#ifndef __WIN__
+// POSIX headers
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Spitfire headers
+#include <spitfire/storage/filesystem.h>
+#include <spitfire/util/log.h>
+
+// Diesel headers
+#include "cachefile.h"
+#include "contenthash.h"
+#include "thumbnailpack.h"
+
+namespace diesel
+{
+  const char indexMagic[8] = { 'D', 'S', 'L', 'T', 'H', 'I', 'D', 'X' };
+  const uint32_t nIndexVersion = 1;
+  const uint32_t nRecordMagic = 0x52485444; // "DTHR"
+
+  // The index starts with room for this many thumbnails and doubles whenever it is more than half full
+  const uint64_t nInitialIndexSlots = 16 * 1024;
+
+  // Compacting rewrites the whole pack so we wait until there is a reasonable amount of space to reclaim
+  const uint64_t nMinimumWastedBytesForCompact = 64 * 1024 * 1024;
+
+  enum class SLOT_STATE : uint32_t {
+    EMPTY,
+    USED,
+    REMOVED // Skipped over when probing, but can be reused when inserting
+  };
+
+  // ** The file formats
+  //
+  // thumbnails.index: cThumbnailPackIndexHeader followed by nSlots cThumbnailPackIndexSlot
+  // thumbnails_<generation>.pack: cThumbnailPackRecordHeader, cache key, thumbnail data, cThumbnailPackRecordHeader, cache key, thumbnail data, ...
+  //
+
+  class cThumbnailPackIndexHeader
+  {
+  public:
+    char magic[8];
+    uint32_t version;
+    uint32_t generation;
+    uint64_t nSlots; // Always a power of two
+    uint64_t nUsedSlots; // Includes the removed slots
+    uint64_t nEntries;
+    uint64_t nLiveBytes; // The size of the records that are still in the index
+  };
+
+  class cThumbnailPackIndexSlot
+  {
+  public:
+    uint64_t keyHash;
+    uint64_t offset;
+    uint32_t nRecordSizeBytes;
+    SLOT_STATE state;
+    int64_t createdSeconds;
+  };
+
+  class cThumbnailPackRecordHeader
+  {
+  public:
+    uint32_t magic;
+    uint32_t nKeyLength;
+    uint64_t nDataSizeBytes;
+  };
+
+  static_assert(sizeof(cThumbnailPackIndexHeader) == 48, "The index header must be the same size on every platform");
+  static_assert(sizeof(cThumbnailPackIndexSlot) == 32, "The index slots must be the same size on every platform");
+  static_assert(sizeof(cThumbnailPackRecordHeader) == 16, "The record header must be the same size on every platform");
+
+  std::string GetThumbnailPackKey(const string_t& sCacheKey)
+  {
+    // NOTE: Cache keys are always ascii
+    return std::string(sCacheKey.begin(), sCacheKey.end());
+  }
+
+  uint64_t GetThumbnailPackKeyHash(const std::string& sKey)
+  {
+    return XXH64(sKey.data(), sKey.length(), 0);
+  }
+
+  uint64_t GetThumbnailPackSlotCount(size_t nEntries)
+  {
+    uint64_t nSlots = nInitialIndexSlots;
+    while ((uint64_t(nEntries) * 2) >= nSlots) nSlots *= 2;
+
+    return nSlots;
+  }
+
+  void InsertThumbnailPackSlot(cThumbnailPackIndexSlot* pSlots, uint64_t nSlots, const cThumbnailPackIndexSlot& slot)
+  {
+    const uint64_t mask = nSlots - 1;
+    uint64_t i = slot.keyHash & mask;
+    while (pSlots[i].state == SLOT_STATE::USED) i = (i + 1) & mask;
+
+    pSlots[i] = slot;
+  }
+
+
+  // ** cThumbnailPackMapping
+  //
+  // A file mapped into memory, the whole file is mapped so a pack that has grown since it was mapped has to be mapped again to see the new records
+  //
+
+  class cThumbnailPackMapping
+  {
+  public:
+    cThumbnailPackMapping();
+    ~cThumbnailPackMapping();
+
+    bool Open(const string_t& sFilePath, bool bIsWritable);
+
+    uint8_t* GetData() const { return pData; }
+    uint64_t GetSizeBytes() const { return nSizeBytes; }
+
+  private:
+    cThumbnailPackMapping(const cThumbnailPackMapping&) = delete;
+    cThumbnailPackMapping& operator=(const cThumbnailPackMapping&) = delete;
+
+    uint8_t* pData;
+    uint64_t nSizeBytes;
+
+    #ifdef __WIN__
+    HANDLE hFile;
+    HANDLE hMapping;
+    #endif
+  };
+
+  cThumbnailPackMapping::cThumbnailPackMapping() :
+    pData(nullptr),
+    nSizeBytes(0)
+    #ifdef __WIN__
+    ,
+    hFile(INVALID_HANDLE_VALUE),
+    hMapping(NULL)
+    #endif
+  {
+  }
+
+  cThumbnailPackMapping::~cThumbnailPackMapping()
+  {
+    #ifdef __WIN__
+    if (pData != nullptr) ::UnmapViewOfFile(pData);
+    if (hMapping != NULL) ::CloseHandle(hMapping);
+    if (hFile != INVALID_HANDLE_VALUE) ::CloseHandle(hFile);
+    #else
+    if (pData != nullptr) ::munmap(pData, nSizeBytes);
+    #endif
+  }
+
+  bool cThumbnailPackMapping::Open(const string_t& sFilePath, bool bIsWritable)
+  {
+    ASSERT(pData == nullptr);
+
+    #ifdef __WIN__
+    // Other handles can still write to the file and the file can be deleted while it is mapped
+    hFile = ::CreateFileW(sFilePath.c_str(), GENERIC_READ | (bIsWritable ? GENERIC_WRITE : 0), FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER size;
+    if (!::GetFileSizeEx(hFile, &size)) return false;
+
+    nSizeBytes = uint64_t(size.QuadPart);
+
+    // An empty file can't be mapped
+    if (nSizeBytes == 0) return true;
+
+    hMapping = ::CreateFileMappingW(hFile, NULL, bIsWritable ? PAGE_READWRITE : PAGE_READONLY, 0, 0, NULL);
+    if (hMapping == NULL) return false;
+
+    pData = static_cast<uint8_t*>(::MapViewOfFile(hMapping, bIsWritable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0));
+    return (pData != nullptr);
+    #else
+    const int fd = ::open(sFilePath.c_str(), (bIsWritable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    if (fd == -1) return false;
+
+    struct ::stat s;
+    if (::fstat(fd, &s) != 0) {
+      ::close(fd);
+      return false;
+    }
+
+    nSizeBytes = uint64_t(s.st_size);
+
+    // An empty file can't be mapped
+    if (nSizeBytes == 0) {
+      ::close(fd);
+      return true;
+    }
+
+    void* pMapped = ::mmap(nullptr, nSizeBytes, PROT_READ | (bIsWritable ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+
+    // The mapping keeps its own reference to the file
+    ::close(fd);
+
+    if (pMapped == MAP_FAILED) return false;
+
+    pData = static_cast<uint8_t*>(pMapped);
+    return true;
+    #endif
+  }
+
+
+  // ** cThumbnailPackLock
+  //
+  // Holds the lock file that is shared with the other instances for a scope, unless an outer scope in this thread already holds it
+  // NOTE: Only used with cThumbnailPack::mutex held
+  //
+
+  class cThumbnailPackLock
+  {
+  public:
+    explicit cThumbnailPackLock(cFileLock& lock);
+    ~cThumbnailPackLock();
+
+  private:
+    cFileLock& lock;
+    const bool bIsOwner;
+  };
+
+  cThumbnailPackLock::cThumbnailPackLock(cFileLock& _lock) :
+    lock(_lock),
+    bIsOwner(!_lock.IsLocked())
+  {
+    if (bIsOwner) lock.Lock();
+  }
+
+  cThumbnailPackLock::~cThumbnailPackLock()
+  {
+    if (bIsOwner) lock.Unlock();
+  }
+
+
+  // ** cThumbnailPackRecord
+
+  cThumbnailPackRecord::cThumbnailPackRecord() :
+    pData(nullptr),
+    nSizeBytes(0)
+  {
+  }
+
+
+  // ** cThumbnailPackEntry
+
+  cThumbnailPackEntry::cThumbnailPackEntry() :
+    nSizeBytes(0),
+    createdSeconds(0)
+  {
+  }
+
+
+  // ** cThumbnailPack
+
+  cThumbnailPack::cThumbnailPack(const string_t& _sFolderPath) :
+    sFolderPath(_sFolderPath),
+    bIsOpen(false),
+    packLock(spitfire::filesystem::MakeFilePath(_sFolderPath, TEXT("thumbnails.lock"))),
+    nPackSizeBytes(0)
+  {
+  }
+
+  cThumbnailPack::~cThumbnailPack()
+  {
+    CloseFiles();
+  }
+
+  bool cThumbnailPack::IsPackFile(const string_t& sFileName)
+  {
+    if (sFileName == TEXT("thumbnails.index")) return true;
+
+    const string_t sPrefix = TEXT("thumbnails_");
+    const string_t sSuffix = TEXT(".pack");
+    return (
+      (sFileName.length() > (sPrefix.length() + sSuffix.length())) &&
+      (sFileName.compare(0, sPrefix.length(), sPrefix) == 0) &&
+      (sFileName.compare(sFileName.length() - sSuffix.length(), sSuffix.length(), sSuffix) == 0)
+    );
+  }
+
+  bool cThumbnailPack::IsInUse(const string_t& sFileName)
+  {
+    // NOTE: The index is replaced through the tmp folder, so the only index file that we see here is the one that is in use
+    if (sFileName == TEXT("thumbnails.index")) return true;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (!OpenIfRequired()) return false;
+
+    return (sFileName == spitfire::filesystem::GetFile(GetPackFilePath(GetIndexHeader().generation)));
+  }
+
+  string_t cThumbnailPack::GetIndexFilePath() const
+  {
+    return spitfire::filesystem::MakeFilePath(sFolderPath, TEXT("thumbnails.index"));
+  }
+
+  string_t cThumbnailPack::GetPackFilePath(uint32_t generation) const
+  {
+    ostringstream_t o;
+    o<<TEXT("thumbnails_")<<generation<<TEXT(".pack");
+    return spitfire::filesystem::MakeFilePath(sFolderPath, o.str());
+  }
+
+  cThumbnailPackIndexHeader& cThumbnailPack::GetIndexHeader() const
+  {
+    ASSERT(pIndexMapping);
+    return *reinterpret_cast<cThumbnailPackIndexHeader*>(pIndexMapping->GetData());
+  }
+
+  cThumbnailPackIndexSlot* cThumbnailPack::GetIndexSlots() const
+  {
+    ASSERT(pIndexMapping);
+    return reinterpret_cast<cThumbnailPackIndexSlot*>(pIndexMapping->GetData() + sizeof(cThumbnailPackIndexHeader));
+  }
+
+  bool cThumbnailPack::OpenIfRequired()
+  {
+    // Another instance sharing the cache may have replaced the index since we mapped it
+    if (bIsOpen && (memcmp(GetIndexHeader().magic, indexMagic, sizeof(indexMagic)) != 0)) {
+      LOG<<"cThumbnailPack::OpenIfRequired The index has been replaced, opening it again"<<std::endl;
+      CloseFiles();
+    }
+
+    if (bIsOpen) return true;
+
+    // If there is no index, or the index doesn't match its pack, then we start again with an empty index, any records in the pack are reclaimed the next time it is compacted
+    if (!OpenIndex() || !OpenPack()) {
+      CloseFiles();
+
+      // The cache folder may have been cleared
+      if (!spitfire::filesystem::DirectoryExists(sFolderPath)) spitfire::filesystem::CreateDirectory(sFolderPath);
+
+      // Another instance may be creating the index at the same time, whoever gets the lock first creates it and the others open it
+      cThumbnailPackLock lock(packLock);
+
+      if (!OpenIndex() || !OpenPack()) {
+        const uint32_t generation = pIndexMapping ? GetIndexHeader().generation + 1 : 0;
+        CloseFiles();
+
+        LOG<<"cThumbnailPack::OpenIfRequired Creating a new index for generation "<<generation<<std::endl;
+
+        const std::vector<cThumbnailPackIndexSlot> slots;
+        if (!ReplaceIndex(generation, slots) || !OpenPack()) {
+          LOG<<"cThumbnailPack::OpenIfRequired Failed to open the thumbnail pack in \""<<sFolderPath<<"\", returning false"<<std::endl;
+          CloseFiles();
+          return false;
+        }
+      }
+    }
+
+    bIsOpen = true;
+
+    // The previous generation may still have been mapped when we last compacted
+    const uint32_t generation = GetIndexHeader().generation;
+    if (generation != 0) {
+      const string_t sPreviousPackFilePath = GetPackFilePath(generation - 1);
+      if (spitfire::filesystem::FileExists(sPreviousPackFilePath)) spitfire::filesystem::DeleteFile(sPreviousPackFilePath);
+    }
+
+    LOG<<"cThumbnailPack::OpenIfRequired Opened generation "<<generation<<" with "<<GetIndexHeader().nEntries<<" thumbnails, "<<GetIndexHeader().nLiveBytes<<" of "<<nPackSizeBytes<<" bytes in use"<<std::endl;
+
+    return true;
+  }
+
+  bool cThumbnailPack::OpenIndex()
+  {
+    const string_t sIndexFilePath = GetIndexFilePath();
+    if (!spitfire::filesystem::FileExists(sIndexFilePath)) return false;
+
+    if (!MapIndex(sIndexFilePath)) return false;
+
+    const cThumbnailPackIndexHeader& header = GetIndexHeader();
+    const uint64_t nSlots = header.nSlots;
+    if (
+      (memcmp(header.magic, indexMagic, sizeof(indexMagic)) != 0) ||
+      (header.version != nIndexVersion) ||
+      (nSlots == 0) || ((nSlots & (nSlots - 1)) != 0) ||
+      (pIndexMapping->GetSizeBytes() != (sizeof(cThumbnailPackIndexHeader) + (nSlots * sizeof(cThumbnailPackIndexSlot))))
+    ) {
+      LOG<<"cThumbnailPack::OpenIndex \""<<sIndexFilePath<<"\" is not a valid index, returning false"<<std::endl;
+      pIndexMapping.reset();
+      return false;
+    }
+
+    return true;
+  }
+
+  bool cThumbnailPack::MapIndex(const string_t& sFilePath)
+  {
+    pIndexMapping.reset(new cThumbnailPackMapping);
+    if (!pIndexMapping->Open(sFilePath, true) || (pIndexMapping->GetSizeBytes() < sizeof(cThumbnailPackIndexHeader))) {
+      pIndexMapping.reset();
+      return false;
+    }
+
+    return true;
+  }
+
+  bool cThumbnailPack::OpenPack()
+  {
+    const string_t sPackFilePath = GetPackFilePath(GetIndexHeader().generation);
+
+    // Without its pack the index is no use
+    const bool bIsPackFound = spitfire::filesystem::FileExists(sPackFilePath);
+    if (!bIsPackFound && (GetIndexHeader().nEntries != 0)) return false;
+
+    packFile.open(sPackFilePath.c_str(), std::ios::out | std::ios::binary | std::ios::app);
+    if (!packFile.good()) {
+      packFile.close();
+      packFile.clear();
+      return false;
+    }
+
+    // NOTE: Anything after the last record that was added to the index is a record that we were stopped part way through writing, it is just wasted space
+    nPackSizeBytes = bIsPackFound ? spitfire::filesystem::GetFileSizeBytes(sPackFilePath) : 0;
+    pPackMapping.reset();
+
+    return true;
+  }
+
+  bool cThumbnailPack::MapPackIfRequired(uint64_t nRequiredSizeBytes)
+  {
+    if (pPackMapping && (pPackMapping->GetSizeBytes() >= nRequiredSizeBytes)) return true;
+
+    // Another instance sharing the cache may have added records since we last looked
+    if (nRequiredSizeBytes > nPackSizeBytes) nPackSizeBytes = spitfire::filesystem::GetFileSizeBytes(GetPackFilePath(GetIndexHeader().generation));
+    if (nRequiredSizeBytes > nPackSizeBytes) return false;
+
+    // The records that are still using the old mapping keep it alive until they are finished with it
+    std::shared_ptr<cThumbnailPackMapping> pMapping(new cThumbnailPackMapping);
+    if (!pMapping->Open(GetPackFilePath(GetIndexHeader().generation), false) || (pMapping->GetSizeBytes() < nRequiredSizeBytes)) {
+      LOG<<"cThumbnailPack::MapPackIfRequired Failed to map the pack, returning false"<<std::endl;
+      return false;
+    }
+
+    pPackMapping = pMapping;
+    return true;
+  }
+
+  bool cThumbnailPack::WriteIndexFile(const string_t& sFilePath, uint32_t generation, const std::vector<cThumbnailPackIndexSlot>& slots)
+  {
+    cThumbnailPackIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, indexMagic, sizeof(indexMagic));
+    header.version = nIndexVersion;
+    header.generation = generation;
+    header.nSlots = GetThumbnailPackSlotCount(slots.size());
+
+    std::vector<cThumbnailPackIndexSlot> table(size_t(header.nSlots));
+    memset(table.data(), 0, table.size() * sizeof(cThumbnailPackIndexSlot));
+
+    std::vector<cThumbnailPackIndexSlot>::const_iterator iter = slots.begin();
+    const std::vector<cThumbnailPackIndexSlot>::const_iterator iterEnd = slots.end();
+    while (iter != iterEnd) {
+      InsertThumbnailPackSlot(table.data(), header.nSlots, *iter);
+      header.nUsedSlots++;
+      header.nEntries++;
+      header.nLiveBytes += iter->nRecordSizeBytes;
+
+      iter++;
+    }
+
+    std::ofstream file(sFilePath.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(cThumbnailPackIndexSlot));
+    return file.good();
+  }
+
+  bool cThumbnailPack::ReplaceIndex(uint32_t generation, const std::vector<cThumbnailPackIndexSlot>& slots)
+  {
+    // NOTE: The caller holds the lock file so no other instance can be replacing the index at the same time
+    const string_t sIndexFilePath = GetIndexFilePath();
+    const string_t sTemporaryFilePath = GetTemporaryFilePath(sIndexFilePath);
+
+    if (!WriteIndexFile(sTemporaryFilePath, generation, slots)) {
+      LOG<<"cThumbnailPack::ReplaceIndex Failed to write \""<<sTemporaryFilePath<<"\", returning false"<<std::endl;
+      if (spitfire::filesystem::FileExists(sTemporaryFilePath)) spitfire::filesystem::DeleteFile(sTemporaryFilePath);
+      return false;
+    }
+
+    // The old index has to be unmapped before it can be replaced on Windows, which also means that no other instance can still have it mapped there
+    #ifdef __WIN__
+    pIndexMapping.reset();
+    #endif
+
+    // If this fails the old index is left where it is and is still valid
+    if (!PublishFile(sTemporaryFilePath, sIndexFilePath)) return false;
+
+    // Tell any other instance that still has the old index mapped to open the new one
+    if (pIndexMapping) {
+      memset(GetIndexHeader().magic, 0, sizeof(indexMagic));
+      pIndexMapping.reset();
+    }
+
+    return MapIndex(sIndexFilePath);
+  }
+
+  void cThumbnailPack::GetUsedSlots(std::vector<cThumbnailPackIndexSlot>& slots) const
+  {
+    slots.clear();
+
+    const cThumbnailPackIndexSlot* pSlots = GetIndexSlots();
+    const uint64_t nSlots = GetIndexHeader().nSlots;
+    for (uint64_t i = 0; i < nSlots; i++) {
+      if (pSlots[i].state == SLOT_STATE::USED) slots.push_back(pSlots[i]);
+    }
+  }
+
+  bool cThumbnailPack::GrowIndexIfRequired()
+  {
+    // Keep the table less than 70% full so that probes stay short, removed slots count too because probes have to step over them
+    const cThumbnailPackIndexHeader& header = GetIndexHeader();
+    if (((header.nUsedSlots + 1) * 10) <= (header.nSlots * 7)) return true;
+
+    std::vector<cThumbnailPackIndexSlot> slots;
+    GetUsedSlots(slots);
+
+    LOG<<"cThumbnailPack::GrowIndexIfRequired Rebuilding the index for "<<slots.size()<<" thumbnails"<<std::endl;
+
+    if (!ReplaceIndex(header.generation, slots)) {
+      CloseFiles();
+      return false;
+    }
+
+    return true;
+  }
+
+  cThumbnailPackIndexSlot* cThumbnailPack::FindSlot(uint64_t keyHash) const
+  {
+    cThumbnailPackIndexSlot* pSlots = GetIndexSlots();
+    const uint64_t nSlots = GetIndexHeader().nSlots;
+    const uint64_t mask = nSlots - 1;
+
+    uint64_t i = keyHash & mask;
+    for (uint64_t nProbes = 0; nProbes < nSlots; nProbes++) {
+      cThumbnailPackIndexSlot& slot = pSlots[i];
+      if (slot.state == SLOT_STATE::EMPTY) break;
+      if ((slot.state == SLOT_STATE::USED) && (slot.keyHash == keyHash)) return &slot;
+
+      i = (i + 1) & mask;
+    }
+
+    return nullptr;
+  }
+
+  void cThumbnailPack::InsertSlot(const cThumbnailPackIndexSlot& slot)
+  {
+    cThumbnailPackIndexHeader& header = GetIndexHeader();
+
+    // Replace the thumbnail if we already have one for this key
+    cThumbnailPackIndexSlot* pExisting = FindSlot(slot.keyHash);
+    if (pExisting != nullptr) {
+      header.nLiveBytes -= pExisting->nRecordSizeBytes;
+      header.nLiveBytes += slot.nRecordSizeBytes;
+      *pExisting = slot;
+      return;
+    }
+
+    cThumbnailPackIndexSlot* pSlots = GetIndexSlots();
+    const uint64_t mask = header.nSlots - 1;
+    uint64_t i = slot.keyHash & mask;
+    while (pSlots[i].state == SLOT_STATE::USED) i = (i + 1) & mask;
+
+    if (pSlots[i].state == SLOT_STATE::EMPTY) header.nUsedSlots++;
+    header.nEntries++;
+    header.nLiveBytes += slot.nRecordSizeBytes;
+
+    pSlots[i] = slot;
+  }
+
+  cThumbnailPackRecord cThumbnailPack::GetRecord(const cThumbnailPackIndexSlot& slot, const std::string& sKey)
+  {
+    cThumbnailPackRecord record;
+
+    if (!MapPackIfRequired(slot.offset + slot.nRecordSizeBytes)) return record;
+
+    const uint8_t* pRecord = pPackMapping->GetData() + slot.offset;
+
+    cThumbnailPackRecordHeader header;
+    memcpy(&header, pRecord, sizeof(header));
+    if ((header.magic != nRecordMagic) || ((sizeof(header) + header.nKeyLength + header.nDataSizeBytes) != slot.nRecordSizeBytes)) {
+      LOG<<"cThumbnailPack::GetRecord The record at "<<slot.offset<<" is corrupt, returning an invalid record"<<std::endl;
+      return record;
+    }
+
+    // Two keys that hash to the same value
+    if ((header.nKeyLength != sKey.length()) || (memcmp(pRecord + sizeof(header), sKey.data(), sKey.length()) != 0)) return record;
+
+    record.pMapping = pPackMapping;
+    record.pData = pRecord + sizeof(header) + header.nKeyLength;
+    record.nSizeBytes = size_t(header.nDataSizeBytes);
+    return record;
+  }
+
+  cThumbnailPackRecord cThumbnailPack::GetThumbnail(const string_t& sCacheKey)
+  {
+    const std::string sKey = GetThumbnailPackKey(sCacheKey);
+    const uint64_t keyHash = GetThumbnailPackKeyHash(sKey);
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (!OpenIfRequired()) return cThumbnailPackRecord();
+
+    const cThumbnailPackIndexSlot* pSlot = FindSlot(keyHash);
+    if (pSlot == nullptr) return cThumbnailPackRecord();
+
+    return GetRecord(*pSlot, sKey);
+  }
+
+  cThumbnailPackRecord cThumbnailPack::AddThumbnail(const string_t& sCacheKey, const std::vector<uint8_t>& data)
+  {
+    ASSERT(!sCacheKey.empty());
+    ASSERT(!data.empty());
+
+    const std::string sKey = GetThumbnailPackKey(sCacheKey);
+    const uint64_t keyHash = GetThumbnailPackKeyHash(sKey);
+
+    cThumbnailPackRecordHeader header;
+    header.magic = nRecordMagic;
+    header.nKeyLength = uint32_t(sKey.length());
+    header.nDataSizeBytes = data.size();
+
+    const uint64_t nRecordSizeBytes = sizeof(header) + sKey.length() + data.size();
+    ASSERT(nRecordSizeBytes < 0xFFFFFFFF);
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    // Other instances sharing the cache append to the same pack
+    cThumbnailPackLock lockPack(packLock);
+
+    if (!OpenIfRequired() || !GrowIndexIfRequired()) return cThumbnailPackRecord();
+
+    // The record goes at the end of the pack, wherever the other instances have got to
+    nPackSizeBytes = spitfire::filesystem::GetFileSizeBytes(GetPackFilePath(GetIndexHeader().generation));
+
+    // Append the record and flush it so that it can be read through the mapping straight away
+    packFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    packFile.write(sKey.data(), sKey.length());
+    packFile.write(reinterpret_cast<const char*>(data.data()), data.size());
+    packFile.flush();
+
+    if (!packFile.good()) {
+      LOG<<"cThumbnailPack::AddThumbnail Failed to write the thumbnail for "<<sCacheKey<<", returning an invalid record"<<std::endl;
+      CloseFiles();
+      return cThumbnailPackRecord();
+    }
+
+    cThumbnailPackIndexSlot slot;
+    slot.keyHash = keyHash;
+    slot.offset = nPackSizeBytes;
+    slot.nRecordSizeBytes = uint32_t(nRecordSizeBytes);
+    slot.state = SLOT_STATE::USED;
+    slot.createdSeconds = int64_t(std::time(nullptr));
+
+    nPackSizeBytes += nRecordSizeBytes;
+
+    InsertSlot(slot);
+
+    return GetRecord(slot, sKey);
+  }
+
+  void cThumbnailPack::GetEntries(std::vector<cThumbnailPackEntry>& entries)
+  {
+    entries.clear();
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (!OpenIfRequired() || !MapPackIfRequired(nPackSizeBytes)) return;
+
+    const cThumbnailPackIndexSlot* pSlots = GetIndexSlots();
+    const uint64_t nSlots = GetIndexHeader().nSlots;
+    for (uint64_t i = 0; i < nSlots; i++) {
+      const cThumbnailPackIndexSlot& slot = pSlots[i];
+      if (slot.state != SLOT_STATE::USED) continue;
+
+      // The cache key is only kept in the record
+      if ((slot.offset + slot.nRecordSizeBytes) > pPackMapping->GetSizeBytes()) continue;
+
+      const uint8_t* pRecord = pPackMapping->GetData() + slot.offset;
+
+      cThumbnailPackRecordHeader header;
+      memcpy(&header, pRecord, sizeof(header));
+      if ((header.magic != nRecordMagic) || ((sizeof(header) + header.nKeyLength + header.nDataSizeBytes) != slot.nRecordSizeBytes)) continue;
+
+      const char* szKey = reinterpret_cast<const char*>(pRecord + sizeof(header));
+
+      cThumbnailPackEntry entry;
+      entry.sCacheKey = string_t(szKey, szKey + header.nKeyLength);
+      entry.nSizeBytes = header.nDataSizeBytes;
+      entry.createdSeconds = slot.createdSeconds;
+      entries.push_back(entry);
+    }
+  }
+
+  bool cThumbnailPack::RemoveThumbnail(const string_t& sCacheKey)
+  {
+    const std::string sKey = GetThumbnailPackKey(sCacheKey);
+    const uint64_t keyHash = GetThumbnailPackKeyHash(sKey);
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    cThumbnailPackLock lockPack(packLock);
+
+    if (!OpenIfRequired()) return false;
+
+    // Make sure that the slot is for this key and not another key with the same hash
+    cThumbnailPackIndexSlot* pSlot = FindSlot(keyHash);
+    if ((pSlot == nullptr) || !GetRecord(*pSlot, sKey).IsValid()) return false;
+
+    cThumbnailPackIndexHeader& header = GetIndexHeader();
+    header.nEntries--;
+    header.nLiveBytes -= pSlot->nRecordSizeBytes;
+
+    pSlot->state = SLOT_STATE::REMOVED;
+
+    return true;
+  }
+
+  bool cThumbnailPack::IsCompactRequired()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (!OpenIfRequired()) return false;
+
+    // Compact once more than half of the pack is wasted
+    const uint64_t nLiveBytes = GetIndexHeader().nLiveBytes;
+    const uint64_t nWastedBytes = (nPackSizeBytes > nLiveBytes) ? (nPackSizeBytes - nLiveBytes) : 0;
+    return (nWastedBytes >= nMinimumWastedBytesForCompact) && (nWastedBytes > nLiveBytes);
+  }
+
+  bool cThumbnailPack::Compact(spitfire::util::cProcessInterface& processInterface)
+  {
+    // Only one instance compacts the pack, if another instance is already compacting it then we leave it to them
+    cFileLock compactLock(spitfire::filesystem::MakeFilePath(sFolderPath, TEXT("thumbnails.compact.lock")));
+    if (!compactLock.TryLock()) {
+      LOG<<"cThumbnailPack::Compact The pack is already being compacted, returning false"<<std::endl;
+      return false;
+    }
+
+    // Take a copy of the index and the mapping, most of the records can then be copied without holding the lock
+    std::vector<cThumbnailPackIndexSlot> slots;
+    uint32_t generation = 0;
+    std::shared_ptr<const cThumbnailPackMapping> pOldPackMapping;
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+
+      if (!OpenIfRequired()) return false;
+
+      generation = GetIndexHeader().generation;
+      GetUsedSlots(slots);
+
+      if (!slots.empty() && !MapPackIfRequired(nPackSizeBytes)) return false;
+
+      pOldPackMapping = pPackMapping;
+    }
+
+    LOG<<"cThumbnailPack::Compact Compacting generation "<<generation<<" with "<<slots.size()<<" thumbnails"<<std::endl;
+
+    // Copy the records in the order that they are in the pack so that the old pack is read sequentially
+    std::sort(slots.begin(), slots.end(), [](const cThumbnailPackIndexSlot& lhs, const cThumbnailPackIndexSlot& rhs) { return (lhs.offset < rhs.offset); });
+
+    const string_t sNewPackFilePath = GetPackFilePath(generation + 1);
+    std::ofstream newPackFile(sNewPackFilePath.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+
+    std::map<uint64_t, uint64_t> newOffsets;
+    uint64_t nNewPackSizeBytes = 0;
+
+    auto AbortCompact = [&]() {
+      newPackFile.close();
+      spitfire::filesystem::DeleteFile(sNewPackFilePath);
+      return false;
+    };
+
+    std::vector<cThumbnailPackIndexSlot>::const_iterator iter = slots.begin();
+    const std::vector<cThumbnailPackIndexSlot>::const_iterator iterEnd = slots.end();
+    while (iter != iterEnd) {
+      if (processInterface.IsToStop()) return AbortCompact();
+
+      if ((iter->offset + iter->nRecordSizeBytes) <= pOldPackMapping->GetSizeBytes()) {
+        newPackFile.write(reinterpret_cast<const char*>(pOldPackMapping->GetData() + iter->offset), iter->nRecordSizeBytes);
+        newOffsets[iter->offset] = nNewPackSizeBytes;
+        nNewPackSizeBytes += iter->nRecordSizeBytes;
+      }
+
+      iter++;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    cThumbnailPackLock lockPack(packLock);
+
+    // The pack was closed or cleared while we were copying
+    if (!bIsOpen || !OpenIfRequired() || (GetIndexHeader().generation != generation)) return AbortCompact();
+
+    // Thumbnails that were added while we were copying are copied now, thumbnails that were removed are left out
+    GetUsedSlots(slots);
+
+    std::vector<cThumbnailPackIndexSlot>::iterator iterSlot = slots.begin();
+    const std::vector<cThumbnailPackIndexSlot>::iterator iterSlotEnd = slots.end();
+    while (iterSlot != iterSlotEnd) {
+      std::map<uint64_t, uint64_t>::const_iterator iterNewOffset = newOffsets.find(iterSlot->offset);
+      if (iterNewOffset != newOffsets.end()) iterSlot->offset = iterNewOffset->second;
+      else if (MapPackIfRequired(iterSlot->offset + iterSlot->nRecordSizeBytes)) {
+        newPackFile.write(reinterpret_cast<const char*>(pPackMapping->GetData() + iterSlot->offset), iterSlot->nRecordSizeBytes);
+        iterSlot->offset = nNewPackSizeBytes;
+        nNewPackSizeBytes += iterSlot->nRecordSizeBytes;
+      } else iterSlot->state = SLOT_STATE::REMOVED;
+
+      iterSlot++;
+    }
+
+    slots.erase(std::remove_if(slots.begin(), slots.end(), [](const cThumbnailPackIndexSlot& slot) { return (slot.state != SLOT_STATE::USED); }), slots.end());
+
+    newPackFile.close();
+    if (!newPackFile.good()) {
+      LOG<<"cThumbnailPack::Compact Failed to write \""<<sNewPackFilePath<<"\", returning false"<<std::endl;
+      return AbortCompact();
+    }
+
+    // Switch over to the new generation, the old pack file stays mapped until the last record that points into it has been decoded
+    const uint64_t nOldPackSizeBytes = nPackSizeBytes;
+    const string_t sOldPackFilePath = GetPackFilePath(generation);
+
+    packFile.close();
+    packFile.clear();
+    pPackMapping.reset();
+
+    if (!ReplaceIndex(generation + 1, slots)) {
+      // Nothing points to the new pack, the old index is still in place
+      LOG<<"cThumbnailPack::Compact Failed to replace the index, returning false"<<std::endl;
+      CloseFiles();
+      spitfire::filesystem::DeleteFile(sNewPackFilePath);
+      return false;
+    }
+
+    if (!OpenPack()) {
+      LOG<<"cThumbnailPack::Compact Failed to open \""<<sNewPackFilePath<<"\", returning false"<<std::endl;
+      CloseFiles();
+      return false;
+    }
+
+    spitfire::filesystem::DeleteFile(sOldPackFilePath);
+
+    LOG<<"cThumbnailPack::Compact Compacted "<<nOldPackSizeBytes<<" bytes down to "<<nPackSizeBytes<<" bytes"<<std::endl;
+
+    return true;
+  }
+
+  void cThumbnailPack::Close()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    CloseFiles();
+
+    // The cache folder may be about to be deleted, the lock file is opened again when it is next needed
+    packLock.Close();
+  }
+
+  void cThumbnailPack::CloseFiles()
+  {
+    if (packFile.is_open()) packFile.close();
+    packFile.clear();
+
+    pPackMapping.reset();
+    pIndexMapping.reset();
+    nPackSizeBytes = 0;
+    bIsOpen = false;
+  }
+}
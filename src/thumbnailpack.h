@@ -0,0 +1,139 @@
+#ifndef DIESEL_THUMBNAILPACK_H
+#define DIESEL_THUMBNAILPACK_H
+
+// Standard headers
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Spitfire headers
+#include <spitfire/util/process.h>
+
+// Diesel headers
+#include "diesel.h"
+#include "cachefile.h"
+
+namespace diesel
+{
+  class cThumbnailPackMapping;
+  class cThumbnailPackIndexHeader;
+  class cThumbnailPackIndexSlot;
+
+  // ** cThumbnailPackRecord
+  //
+  // A thumbnail in the pack, the data points straight into the mapped pack file and stays valid for as long as the record is kept,
+  // even if the pack is compacted or closed in the mean time
+  //
+
+  class cThumbnailPackRecord
+  {
+  public:
+    friend class cThumbnailPack;
+
+    cThumbnailPackRecord();
+
+    bool IsValid() const { return (pData != nullptr); }
+
+    const uint8_t* GetData() const { return pData; }
+    size_t GetSizeBytes() const { return nSizeBytes; }
+
+  private:
+    std::shared_ptr<const cThumbnailPackMapping> pMapping;
+    const uint8_t* pData;
+    size_t nSizeBytes;
+  };
+
+
+  // ** cThumbnailPackEntry
+  //
+  // A thumbnail in the index, used to build the cache eviction index
+  //
+
+  class cThumbnailPackEntry
+  {
+  public:
+    cThumbnailPackEntry();
+
+    string_t sCacheKey;
+    uint64_t nSizeBytes; // The size of the thumbnail data
+    int64_t createdSeconds;
+  };
+
+
+  // ** cThumbnailPack
+  //
+  // Stores all of the thumbnails in one append only pack file instead of one jpeg file per thumbnail, so that the cache folder stays small enough to scan
+  // The index is an open addressing hash table of XXH64(cache key) -> record that is mapped into memory, so a lookup is a probe of the table without touching the
+  // file system, and the thumbnail is decoded straight out of the mapped pack file without reading it into a buffer first
+  // Each record in the pack also has the cache key so that a hash collision is never mistaken for a hit, and so that the index can be thought of as just a cache of the pack
+  // Removing a thumbnail only removes it from the index, the space is reclaimed by Compact which copies the live records into a new pack file, the pack and the
+  // index are named after a generation that is increased each time the pack is compacted so that records that are still being decoded from the old pack stay valid
+  // NOTE: All of the methods are thread safe
+  // NOTE: Several instances can share the pack, appending a record and changing the index is done while holding thumbnails.lock, the index is mapped shared
+  // so the other instances see new slots straight away, and an index that is replaced is marked so that the instances that still have it mapped open the new one
+  // NOTE: The pack is only ever appended to so a record can't change under a reader, unlike a source file that may be truncated while it is mapped
+  //
+
+  class cThumbnailPack
+  {
+  public:
+    explicit cThumbnailPack(const string_t& sFolderPath);
+    ~cThumbnailPack();
+
+    static bool IsPackFile(const string_t& sFileName); // Returns true if the file in the cache folder belongs to a pack
+    bool IsInUse(const string_t& sFileName); // Returns true if the file belongs to the current generation of the pack
+
+    cThumbnailPackRecord GetThumbnail(const string_t& sCacheKey);
+    cThumbnailPackRecord AddThumbnail(const string_t& sCacheKey, const std::vector<uint8_t>& data); // Returns an invalid record if the thumbnail could not be written
+
+    void GetEntries(std::vector<cThumbnailPackEntry>& entries); // Reads every record in the pack so this is only used when the cache eviction index has to be built again
+    bool RemoveThumbnail(const string_t& sCacheKey); // Returns false if the thumbnail was not in the pack
+
+    bool IsCompactRequired();
+    bool Compact(spitfire::util::cProcessInterface& processInterface); // Returns false if the pack was not compacted because processInterface was stopped or there was an error
+
+    void Close(); // Closes the files so that the cache folder can be deleted, the pack is opened again the next time that it is needed
+
+  private:
+    cThumbnailPack(const cThumbnailPack&) = delete;
+    cThumbnailPack& operator=(const cThumbnailPack&) = delete;
+
+    string_t GetIndexFilePath() const;
+    string_t GetPackFilePath(uint32_t generation) const;
+
+    bool OpenIfRequired();
+    bool OpenIndex();
+    bool MapIndex(const string_t& sFilePath);
+    bool OpenPack();
+    bool MapPackIfRequired(uint64_t nRequiredSizeBytes);
+
+    static bool WriteIndexFile(const string_t& sFilePath, uint32_t generation, const std::vector<cThumbnailPackIndexSlot>& slots);
+    bool ReplaceIndex(uint32_t generation, const std::vector<cThumbnailPackIndexSlot>& slots);
+    bool GrowIndexIfRequired();
+    void GetUsedSlots(std::vector<cThumbnailPackIndexSlot>& slots) const;
+
+    cThumbnailPackIndexHeader& GetIndexHeader() const;
+    cThumbnailPackIndexSlot* GetIndexSlots() const;
+    cThumbnailPackIndexSlot* FindSlot(uint64_t keyHash) const;
+    void InsertSlot(const cThumbnailPackIndexSlot& slot);
+    cThumbnailPackRecord GetRecord(const cThumbnailPackIndexSlot& slot, const std::string& sKey);
+
+    void CloseFiles();
+
+    std::mutex mutex;
+
+    const string_t sFolderPath;
+    bool bIsOpen;
+
+    cFileLock packLock; // Held while the pack is appended to or the index is changed, shared with the other instances
+
+    std::unique_ptr<cThumbnailPackMapping> pIndexMapping; // Only accessed with the mutex held
+    std::shared_ptr<const cThumbnailPackMapping> pPackMapping; // Shared with the records that point into it, remapped as the pack grows
+    std::ofstream packFile;
+    uint64_t nPackSizeBytes;
+  };
+}
+
+#endif // DIESEL_THUMBNAILPACK_H
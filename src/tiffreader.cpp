@@ -0,0 +1,182 @@
+// Standard headers
+#include <cstring>
+#include <iostream>
+
+// Spitfire headers
+#include <spitfire/util/log.h>
+
+// Diesel headers
+#include "tiffreader.h"
+
+namespace diesel
+{
+  // Raw files have a handful of IFDs with a few dozen entries each, anything with more entries than this is corrupt
+  const size_t nMaximumTIFFIFDEntries = 1024;
+
+  const uint16_t TIFF_TYPE_SHORT = 3;
+  const uint16_t TIFF_TYPE_LONG = 4;
+  const uint16_t TIFF_TYPE_IFD = 13;
+
+  // ** cTIFFIFD
+
+  cTIFFIFD::cTIFFIFD() :
+    nextIFDOffset(0)
+  {
+  }
+
+  const cTIFFEntry* cTIFFIFD::GetEntry(uint16_t tag) const
+  {
+    std::vector<cTIFFEntry>::const_iterator iter = entries.begin();
+    const std::vector<cTIFFEntry>::const_iterator iterEnd = entries.end();
+    while (iter != iterEnd) {
+      if (iter->tag == tag) return &(*iter);
+
+      iter++;
+    }
+
+    return nullptr;
+  }
+
+
+  // ** cTIFFReader
+
+  cTIFFReader::cTIFFReader() :
+    pData(nullptr),
+    nSizeBytes(0),
+    bIsLittleEndian(true),
+    firstIFDOffset(0)
+  {
+  }
+
+  bool cTIFFReader::OpenFile(const string_t& sFilePath)
+  {
+    file.open(sFilePath.c_str(), std::ios::in | std::ios::binary | std::ios::ate);
+    if (!file.good()) return false;
+
+    nSizeBytes = uint64_t(file.tellg());
+
+    return ReadHeader();
+  }
+
+  bool cTIFFReader::OpenMemory(const uint8_t* _pData, size_t _nSizeBytes)
+  {
+    ASSERT(_pData != nullptr);
+
+    pData = _pData;
+    nSizeBytes = _nSizeBytes;
+
+    return ReadHeader();
+  }
+
+  bool cTIFFReader::ReadHeader()
+  {
+    uint8_t header[8];
+    if (!Read(0, sizeof(header), header)) return false;
+
+    if ((header[0] == 'I') && (header[1] == 'I')) bIsLittleEndian = true;
+    else if ((header[0] == 'M') && (header[1] == 'M')) bIsLittleEndian = false;
+    else return false;
+
+    // Olympus and Panasonic raw files are TIFF files with their own magic number
+    const uint16_t magic = ToUint16(header + 2);
+    if ((magic != 42) && (magic != 0x4F52) && (magic != 0x5352) && (magic != 0x0055)) return false;
+
+    firstIFDOffset = ToUint32(header + 4);
+    return true;
+  }
+
+  uint16_t cTIFFReader::ToUint16(const uint8_t* pIn) const
+  {
+    return bIsLittleEndian ? uint16_t(pIn[0] | (pIn[1] << 8)) : uint16_t((pIn[0] << 8) | pIn[1]);
+  }
+
+  uint32_t cTIFFReader::ToUint32(const uint8_t* pIn) const
+  {
+    return bIsLittleEndian ? (uint32_t(ToUint16(pIn)) | (uint32_t(ToUint16(pIn + 2)) << 16)) : ((uint32_t(ToUint16(pIn)) << 16) | uint32_t(ToUint16(pIn + 2)));
+  }
+
+  bool cTIFFReader::Read(uint64_t offset, size_t nReadSizeBytes, uint8_t* pOut)
+  {
+    if ((offset > nSizeBytes) || (nReadSizeBytes > (nSizeBytes - offset))) return false;
+
+    if (pData != nullptr) {
+      memcpy(pOut, pData + offset, nReadSizeBytes);
+      return true;
+    }
+
+    file.seekg(std::streamoff(offset));
+    file.read(reinterpret_cast<char*>(pOut), std::streamsize(nReadSizeBytes));
+    if (!file.good() || (size_t(file.gcount()) != nReadSizeBytes)) {
+      file.clear();
+      return false;
+    }
+
+    return true;
+  }
+
+  bool cTIFFReader::ReadIFD(uint32_t offset, cTIFFIFD& ifd)
+  {
+    ifd.entries.clear();
+    ifd.nextIFDOffset = 0;
+
+    uint8_t count[2];
+    if (!Read(offset, sizeof(count), count)) return false;
+
+    const size_t nEntries = ToUint16(count);
+    if (nEntries > nMaximumTIFFIFDEntries) return false;
+
+    // Each entry is a tag, a type, a count and then the value or the offset of the values, followed by the offset of the next IFD
+    std::vector<uint8_t> data((nEntries * 12) + 4);
+    if (!Read(uint64_t(offset) + 2, data.size(), data.data())) return false;
+
+    ifd.entries.resize(nEntries);
+    for (size_t i = 0; i < nEntries; i++) {
+      const uint8_t* pEntry = data.data() + (i * 12);
+      cTIFFEntry& entry = ifd.entries[i];
+      entry.tag = ToUint16(pEntry);
+      entry.type = ToUint16(pEntry + 2);
+      entry.count = ToUint32(pEntry + 4);
+      memcpy(entry.value, pEntry + 8, sizeof(entry.value));
+    }
+
+    ifd.nextIFDOffset = ToUint32(data.data() + (nEntries * 12));
+
+    return true;
+  }
+
+  bool cTIFFReader::GetValues(const cTIFFIFD& ifd, uint16_t tag, std::vector<uint32_t>& values)
+  {
+    values.clear();
+
+    const cTIFFEntry* pEntry = ifd.GetEntry(tag);
+    if (pEntry == nullptr) return false;
+
+    size_t nValueSizeBytes = 0;
+    if (pEntry->type == TIFF_TYPE_SHORT) nValueSizeBytes = 2;
+    else if ((pEntry->type == TIFF_TYPE_LONG) || (pEntry->type == TIFF_TYPE_IFD)) nValueSizeBytes = 4;
+    else return false;
+
+    // Even a tiled raw file only has a few thousand strips or tiles, the count is checked against the size of the file before we allocate anything
+    const uint64_t nValuesSizeBytes = uint64_t(pEntry->count) * nValueSizeBytes;
+    if ((pEntry->count == 0) || (nValuesSizeBytes > nSizeBytes)) return false;
+
+    const size_t nDataSizeBytes = size_t(nValuesSizeBytes);
+    std::vector<uint8_t> data(nDataSizeBytes);
+    if (nValuesSizeBytes <= sizeof(pEntry->value)) memcpy(data.data(), pEntry->value, data.size());
+    else if (!Read(ToUint32(pEntry->value), data.size(), data.data())) return false;
+
+    values.resize(pEntry->count);
+    for (size_t i = 0; i < pEntry->count; i++) values[i] = (nValueSizeBytes == 2) ? ToUint16(data.data() + (i * 2)) : ToUint32(data.data() + (i * 4));
+
+    return true;
+  }
+
+  bool cTIFFReader::GetValue(const cTIFFIFD& ifd, uint16_t tag, uint32_t& value)
+  {
+    std::vector<uint32_t> values;
+    if (!GetValues(ifd, tag, values)) return false;
+
+    value = values[0];
+    return true;
+  }
+}
@@ -0,0 +1,97 @@
+#ifndef DIESEL_TIFFREADER_H
+#define DIESEL_TIFFREADER_H
+
+// Standard headers
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <vector>
+
+// Diesel headers
+#include "diesel.h"
+
+namespace diesel
+{
+  // ** TIFF tags
+
+  const uint16_t TIFF_TAG_COMPRESSION = 0x0103;
+  const uint16_t TIFF_TAG_STRIP_OFFSETS = 0x0111;
+  const uint16_t TIFF_TAG_ORIENTATION = 0x0112;
+  const uint16_t TIFF_TAG_STRIP_BYTE_COUNTS = 0x0117;
+  const uint16_t TIFF_TAG_SUB_IFDS = 0x014A;
+  const uint16_t TIFF_TAG_JPEG_INTERCHANGE_FORMAT = 0x0201;
+  const uint16_t TIFF_TAG_JPEG_INTERCHANGE_FORMAT_LENGTH = 0x0202;
+
+  // ** cTIFFEntry
+
+  class cTIFFEntry
+  {
+  public:
+    uint16_t tag;
+    uint16_t type;
+    uint32_t count;
+    uint8_t value[4]; // The values themselves if they fit in 4 bytes, otherwise the offset of the values, in the byte order of the file
+  };
+
+
+  // ** cTIFFIFD
+
+  class cTIFFIFD
+  {
+  public:
+    cTIFFIFD();
+
+    const cTIFFEntry* GetEntry(uint16_t tag) const; // Returns nullptr if the IFD doesn't have the tag
+
+    std::vector<cTIFFEntry> entries;
+    uint32_t nextIFDOffset; // 0 for the last IFD
+  };
+
+
+  // ** cTIFFReader
+  //
+  // Reads the IFDs of a TIFF file, dngs and the raw files from most cameras are TIFF files with the raw data, the previews and the settings in their IFDs
+  // Only the parts of the file that we ask for are read so finding the previews in a 50 MB raw file only reads a few KB, a buffer that is already in
+  // memory, such as the EXIF block of a jpeg, is read the same way
+  // Everything is checked against the size of the file, a corrupt offset or count makes the read fail rather than reading past the end
+  // NOTE: Offsets in a TIFF are 32 bits so BigTIFF files are not supported
+  //
+
+  class cTIFFReader
+  {
+  public:
+    cTIFFReader();
+
+    bool OpenFile(const string_t& sFilePath);
+    bool OpenMemory(const uint8_t* pData, size_t nSizeBytes); // The buffer has to outlive the reader
+
+    uint32_t GetFirstIFDOffset() const { return firstIFDOffset; }
+    uint64_t GetSizeBytes() const { return nSizeBytes; }
+
+    bool ReadIFD(uint32_t offset, cTIFFIFD& ifd);
+
+    // Shorts, longs and IFD offsets are returned as 32 bit values, other types return false
+    bool GetValues(const cTIFFIFD& ifd, uint16_t tag, std::vector<uint32_t>& values);
+    bool GetValue(const cTIFFIFD& ifd, uint16_t tag, uint32_t& value); // The first value
+
+    bool Read(uint64_t offset, size_t nReadSizeBytes, uint8_t* pOut);
+
+  private:
+    cTIFFReader(const cTIFFReader&) = delete;
+    cTIFFReader& operator=(const cTIFFReader&) = delete;
+
+    bool ReadHeader();
+
+    uint16_t ToUint16(const uint8_t* pIn) const;
+    uint32_t ToUint32(const uint8_t* pIn) const;
+
+    std::ifstream file;
+    const uint8_t* pData;
+    uint64_t nSizeBytes;
+
+    bool bIsLittleEndian;
+    uint32_t firstIFDOffset;
+  };
+}
+
+#endif // DIESEL_TIFFREADER_H
@@ -21,6 +21,11 @@ namespace diesel
     string_t FindFileExtensionForRawFile(const string_t& sFolderPath, const string_t& sFileNameNoExtension);
     string_t FindFileExtensionForImageFile(const string_t& sFolderPath, const string_t& sFileNameNoExtension);
 
+    // Photos that are loaded straight from a jpeg are turned to match their EXIF orientation when they are drawn
+    // u and v are a position in the photo as it is shown from 0 to 1, fTextureU and fTextureV are where to sample the image as it is stored, from 0 to 1
+    bool IsOrientationSwapWidthAndHeight(int orientation);
+    void GetTextureCoordinateForOrientation(int orientation, float u, float v, float& fTextureU, float& fTextureV);
+
 
     // Inlines
 
@@ -49,6 +54,25 @@ namespace diesel
       return IsFileTypeRaw(sExtensionLower) || (sExtensionLower == TEXT(".dng")) || IsFileTypeImage(sExtensionLower);
     }
 
+    inline bool IsOrientationSwapWidthAndHeight(int orientation)
+    {
+      return ((orientation >= 5) && (orientation <= 8));
+    }
+
+    inline void GetTextureCoordinateForOrientation(int orientation, float u, float v, float& fTextureU, float& fTextureV)
+    {
+      switch (orientation) {
+        case 2: fTextureU = 1.0f - u; fTextureV = v; break; // Flipped horizontally
+        case 3: fTextureU = 1.0f - u; fTextureV = 1.0f - v; break; // Upside down
+        case 4: fTextureU = u; fTextureV = 1.0f - v; break; // Flipped vertically
+        case 5: fTextureU = v; fTextureV = u; break; // Transposed
+        case 6: fTextureU = v; fTextureV = 1.0f - u; break; // Turned 90 degrees clockwise
+        case 7: fTextureU = 1.0f - v; fTextureV = 1.0f - u; break; // Transversed
+        case 8: fTextureU = 1.0f - v; fTextureV = u; break; // Turned 90 degrees anticlockwise
+        default: fTextureU = u; fTextureV = v; break;
+      }
+    }
+
 
 
     template <size_t N>